@@ -0,0 +1,1062 @@
+#include "Benchmark.h"
+#include "NoiseExpr.h"
+#include "HeightmapFile.h"
+#include "HeightmapPyramid.h"
+#include "Half.h"
+#include "GreyPng.h"
+#include "lodepng.h"
+#include "CpuFeatures.h"
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <thread>
+
+namespace {
+	const int BENCH_SIZE = 512;
+	const double FEATURE_SIZE = 150;
+}
+
+void BenchmarkNoiseExpr() {
+	std::cout << "NoiseExpr: " << BENCH_SIZE << "x" << BENCH_SIZE << " samples" << std::endl;
+
+	/*Composed: 0.7 * fbm + ridged warped by a low octave fbm*/
+	auto terrain = Fbm<8>(1001, FEATURE_SIZE) * 0.7
+		+ Ridged<5>(2002, FEATURE_SIZE).Warp(Fbm<3>(3003, FEATURE_SIZE) * 40.0);
+
+	Stopwatch sw;
+	double exprSum = 0;
+	for (int y = 0; y < BENCH_SIZE; ++y) {
+		for (int x = 0; x < BENCH_SIZE; ++x) {
+			exprSum += terrain(x, y);
+		}
+	}
+	double exprTime = sw.Seconds();
+
+	/*Hand fused: the same maths written as one loop over three generators*/
+	SimplexNoise fbm(FEATURE_SIZE, 0.65, 1, 1001);
+	SimplexNoise ridged(FEATURE_SIZE, 0.65, 1, 2002);
+	SimplexNoise warp(FEATURE_SIZE, 0.65, 1, 3003);
+	double frequency[8];
+	double amplitude[8];
+	frequency[0] = 1.0 / FEATURE_SIZE;
+	amplitude[0] = 0.65;
+	for (int i = 1; i < 8; ++i) {
+		frequency[i] = frequency[i-1] * 2.0;
+		amplitude[i] = amplitude[i-1] * 0.65;
+	}
+
+	sw.Restart();
+	double fusedSum = 0;
+	for (int y = 0; y < BENCH_SIZE; ++y) {
+		for (int x = 0; x < BENCH_SIZE; ++x) {
+			double f = 0;
+			for (int i = 0; i < 8; ++i) {
+				f += fbm.Noise(x * frequency[i], y * frequency[i]) * amplitude[i];
+			}
+			double dx = 0;
+			double dy = 0;
+			for (int i = 0; i < 3; ++i) {
+				dx += warp.Noise(x * frequency[i], y * frequency[i]) * amplitude[i];
+				dy += warp.Noise((x + 5.2) * frequency[i], (y + 1.3) * frequency[i]) * amplitude[i];
+			}
+			double wx = x + dx * 40.0;
+			double wy = y + dy * 40.0;
+			double r = 0;
+			double weight = 1.0;
+			for (int i = 0; i < 5; ++i) {
+				double signal = 1.0 - std::fabs(ridged.Noise(wx * frequency[i], wy * frequency[i]));
+				signal *= signal * weight;
+				weight = signal * 2.0;
+				if (weight > 1.0) weight = 1.0;
+				if (weight < 0.0) weight = 0.0;
+				r += signal * amplitude[i];
+			}
+			fusedSum += f * 0.7 + r;
+		}
+	}
+	double fusedTime = sw.Seconds();
+
+	std::cout << "  expression: " << exprTime * 1000.0 << " ms (checksum " << exprSum << ")" << std::endl;
+	std::cout << "  hand fused: " << fusedTime * 1000.0 << " ms (checksum " << fusedSum << ")" << std::endl;
+	std::cout << "  ratio:      " << exprTime / fusedTime << std::endl;
+}
+
+void BenchmarkHeightmapFile() {
+	const uint32_t size = 4096;
+	const char* names[3] = { "f32", "f16", "u16" };
+	SimplexNoise noise(FEATURE_SIZE, 0.65, 8, 5000);
+	std::cout << "HeightmapFile: " << size << "x" << size << " samples" << std::endl;
+
+	for (int type = SAMPLE_F32; type <= SAMPLE_U16; ++type) {
+		std::string filename = std::string("bench_") + names[type] + ".snhm";
+		Stopwatch sw;
+		bool written = HeightmapWriter::Write(filename, noise, 0, 0, size, size, 256, (SampleType)type);
+		double writeTime = sw.Seconds();
+
+		sw.Restart();
+		HeightmapReader reader;
+		bool opened = reader.Open(filename);
+		double openTime = sw.Seconds();
+		if (!written || !opened) {
+			std::cout << "  " << names[type] << ": failed" << std::endl;
+			continue;
+		}
+
+		/*Largest difference from NoiseAt along the diagonal*/
+		double maxError = 0;
+		for (uint32_t i = 0; i < size; i += 7) {
+			double error = std::fabs(reader.Sample(i, size - 1 - i) - noise.NoiseAt(i, size - 1 - i));
+			if (error > maxError) maxError = error;
+		}
+		sw.Restart();
+		bool verified = reader.Verify();
+		double verifyTime = sw.Seconds();
+		double mb = (double)size * size * SampleSize((SampleType)type) / (1024.0 * 1024.0);
+		std::cout << "  " << names[type] << ": write " << writeTime * 1000.0 << " ms (" << mb / writeTime
+			<< " MB/s), open " << openTime * 1000.0 << " ms, verify " << verifyTime * 1000.0 << " ms"
+			<< (verified ? "" : " (CRC MISMATCH)") << ", max error " << maxError << std::endl;
+		reader.Close();
+		std::remove(filename.c_str());
+	}
+}
+
+void BenchmarkPyramid() {
+	const uint32_t size = 4096;
+	SimplexNoise noise(FEATURE_SIZE, 0.65, 8, 5000);
+	PyramidSettings settings;
+	int levels = PyramidBuilder::FullLevelCount(size, size, settings.tileSize);
+	std::cout << "Pyramid: " << size << "x" << size << ", " << levels << " levels" << std::endl;
+
+	/*Level 0 alone, then every level. Rendering each coarser level with
+	NoiseAt instead would add another third of the level 0 render time*/
+	settings.levels = 1;
+	Stopwatch sw;
+	bool built = PyramidBuilder::Build("bench.snpy", noise, 0, 0, size, size, settings);
+	double finestTime = sw.Seconds();
+
+	settings.levels = levels;
+	sw.Restart();
+	built = PyramidBuilder::Build("bench.snpy", noise, 0, 0, size, size, settings) && built;
+	double pyramidTime = sw.Seconds();
+	std::remove("bench.snpy");
+
+	std::cout << "  level 0 only: " << finestTime * 1000.0 << " ms" << (built ? "" : " (failed)") << std::endl;
+	std::cout << "  all levels:   " << pyramidTime * 1000.0 << " ms (+"
+		<< (pyramidTime / finestTime - 1.0) * 100.0 << "%)" << std::endl;
+}
+
+void BenchmarkHalf() {
+	const int size = 1024;
+	SimplexNoise noise(FEATURE_SIZE, 0.65, 8, 5000);
+	std::cout << "Half: " << size << "x" << size << " samples, F16C " << (Cpu().f16c ? "on" : "off") << std::endl;
+
+	std::vector<double> exact((size_t)size * size);
+	RenderTile(noise, 0, 0, size, size, SAMPLE_F64, &exact[0], size * sizeof(double));
+	std::vector<half> halves(exact.size());
+	RenderTile(noise, 0, 0, size, size, SAMPLE_F16, &halves[0], size * sizeof(half));
+
+	double maxError = 0;
+	double sumSquares = 0;
+	for (size_t i = 0; i < exact.size(); ++i) {
+		double error = std::fabs(HalfToFloat(halves[i]) - exact[i]);
+		if (error > maxError) maxError = error;
+		sumSquares += error * error;
+	}
+	std::cout << "  error vs NoiseAt: max " << maxError << ", rms " << std::sqrt(sumSquares / exact.size())
+		<< ", bound " << noise.AmplitudeSum() << std::endl;
+	std::cout << "  bytes: double " << exact.size() * sizeof(double) << ", half " << halves.size() * sizeof(half) << std::endl;
+
+	std::vector<float> floats(exact.begin(), exact.end());
+	const int passes = 20;
+	Stopwatch sw;
+	for (int pass = 0; pass < passes; ++pass) {
+		for (size_t i = 0; i < floats.size(); ++i) {
+			halves[i] = FloatToHalf(floats[i]);
+		}
+	}
+	double scalarTime = sw.Seconds();
+	sw.Restart();
+	for (int pass = 0; pass < passes; ++pass) {
+		FloatToHalfRow(&floats[0], &halves[0], floats.size());
+	}
+	double rowTime = sw.Seconds();
+	double samples = (double)floats.size() * passes / 1e6;
+	std::cout << "  float to half: scalar " << samples / scalarTime << " Msamples/s, row "
+		<< samples / rowTime << " Msamples/s" << std::endl;
+}
+
+void BenchmarkGrey16Png() {
+	SimplexNoise noise(FEATURE_SIZE, 0.65, 8, 5000);
+	std::cout << "Grey16Png: " << BENCH_SIZE << "x" << BENCH_SIZE << " samples" << std::endl;
+
+	std::vector<double> heights((size_t)BENCH_SIZE * BENCH_SIZE);
+	RenderTile(noise, 0, 0, BENCH_SIZE, BENCH_SIZE, SAMPLE_F64, &heights[0], BENCH_SIZE * sizeof(double));
+	double min = heights[0];
+	double max = heights[0];
+	for (size_t i = 0; i < heights.size(); ++i) {
+		if (heights[i] < min) min = heights[i];
+		if (heights[i] > max) max = heights[i];
+	}
+
+	/*What main.cpp used to do: 8 bit grey expanded to RGBA*/
+	Stopwatch sw;
+	std::vector<unsigned char> rgba(heights.size() * 4);
+	for (size_t i = 0; i < heights.size(); ++i) {
+		unsigned char pix = (unsigned char)((heights[i] - min) / (max - min) * 255);
+		rgba[4*i] = rgba[4*i+1] = rgba[4*i+2] = pix;
+		rgba[4*i+3] = 255;
+	}
+	std::vector<unsigned char> rgbaPng;
+	lodepng::encode(rgbaPng, rgba, BENCH_SIZE, BENCH_SIZE);
+	double rgbaTime = sw.Seconds();
+
+	sw.Restart();
+	std::vector<unsigned char> greyPng;
+	EncodeGrey16Png(greyPng, &heights[0], BENCH_SIZE, BENCH_SIZE, Grey16Range(min, max));
+	double greyTime = sw.Seconds();
+
+	const int passes = 50;
+	std::vector<unsigned char> scanlines(heights.size() * 2);
+	sw.Restart();
+	for (int pass = 0; pass < passes; ++pass) {
+		QuantizeGrey16Row(&heights[0], &scanlines[0], heights.size(), Grey16Range(min, max));
+	}
+	double quantizeTime = sw.Seconds();
+	unsigned long long checksum = 0;
+	for (size_t i = 0; i < scanlines.size(); ++i) {
+		checksum = checksum * 31 + scanlines[i];
+	}
+
+	std::cout << "  rgba8:  " << rgbaTime * 1000 << " ms, " << rgba.size() << " raw bytes, " << rgbaPng.size() << " png bytes" << std::endl;
+	std::cout << "  grey16: " << greyTime * 1000 << " ms, " << scanlines.size() << " raw bytes, " << greyPng.size() << " png bytes" << std::endl;
+	std::cout << "  quantize: " << (double)heights.size() * passes / 1e6 / quantizeTime << " Msamples/s, checksum "
+		<< checksum << std::endl;
+}
+
+void BenchmarkParallelDeflate() {
+	const int size = 1024;
+	SimplexNoise noise(FEATURE_SIZE, 0.65, 8, 5000);
+	std::vector<double> heights((size_t)size * size);
+	RenderTile(noise, 0, 0, size, size, SAMPLE_F64, &heights[0], size * sizeof(double));
+	std::vector<unsigned char> scanlines(heights.size() * 2);
+	QuantizeGrey16Row(&heights[0], &scanlines[0], heights.size(), SampleRange::ForU16(noise));
+	std::cout << "ParallelDeflate: " << size << "x" << size << " grey16, "
+		<< std::thread::hardware_concurrency() << " hardware threads" << std::endl;
+
+	unsigned threads[] = { 1, 0 };
+	for (int i = 0; i < 2; ++i) {
+		std::vector<unsigned char> png;
+		Stopwatch sw;
+		unsigned error = EncodeGrey16Png(png, &scanlines[0], size, size, threads[i]);
+		double time = sw.Seconds();
+		std::vector<unsigned char> decoded;
+		unsigned w, h;
+		bool same = !error && !lodepng::decode(decoded, w, h, png, LCT_GREY, 16) && decoded == scanlines;
+		std::cout << "  threads " << threads[i] << ": " << time * 1000 << " ms, " << png.size() << " bytes, "
+			<< (same ? "round trip ok" : "ROUND TRIP FAILED") << std::endl;
+	}
+}
+
+void BenchmarkPngFilters() {
+	const int size = 1024;
+	SimplexNoise noise(FEATURE_SIZE, 0.65, 8, 5000);
+	std::vector<double> heights((size_t)size * size);
+	RenderTile(noise, 0, 0, size, size, SAMPLE_F64, &heights[0], size * sizeof(double));
+	std::vector<unsigned char> scanlines(heights.size() * 2);
+	QuantizeGrey16Row(&heights[0], &scanlines[0], heights.size(), SampleRange::ForU16(noise));
+	std::cout << "PngFilters: " << size << "x" << size << " grey16, minsum filters, stored deflate" << std::endl;
+
+	/*stored blocks leave filtering and unfiltering as most of the work*/
+	lodepng::State state;
+	state.info_raw.colortype = LCT_GREY;
+	state.info_raw.bitdepth = 16;
+	state.info_png.color.colortype = LCT_GREY;
+	state.info_png.color.bitdepth = 16;
+	state.encoder.auto_convert = LAC_NO;
+	state.encoder.zlibsettings.btype = 0;
+
+	unsigned simd = lodepng_get_simd();
+	unsigned masks[] = { 0, simd };
+	std::vector<unsigned char> png[2];
+	for (int i = 0; i < 2; ++i) {
+		lodepng_set_simd(masks[i]);
+		Stopwatch sw;
+		lodepng::encode(png[i], scanlines, size, size, state);
+		double encodeTime = sw.Seconds();
+		std::vector<unsigned char> decoded;
+		unsigned w, h;
+		sw.Restart();
+		lodepng::decode(decoded, w, h, png[i], LCT_GREY, 16);
+		double decodeTime = sw.Seconds();
+		std::cout << "  " << (i == 0 ? "scalar" : "simd  ") << ": encode " << encodeTime * 1000 << " ms, decode "
+			<< decodeTime * 1000 << " ms" << (decoded == scanlines ? "" : ", ROUND TRIP FAILED") << std::endl;
+	}
+	lodepng_set_simd(simd);
+	std::cout << "  identical output: " << (png[0] == png[1] ? "yes" : "NO") << std::endl;
+}
+
+void BenchmarkChecksums() {
+	const size_t size = 64 << 20;
+	const int passes = 4;
+	std::vector<unsigned char> data(size);
+	uint32_t state = 5000;
+	for (size_t i = 0; i < size; ++i) {
+		state = state * 1664525u + 1013904223u;
+		data[i] = (unsigned char)(state >> 24);
+	}
+	std::cout << "Checksums: " << (size >> 20) << " MB" << std::endl;
+
+	unsigned simd = lodepng_get_simd();
+	unsigned masks[] = { 0, simd };
+	unsigned crc[2], adler[2];
+	for (int i = 0; i < 2; ++i) {
+		lodepng_set_simd(masks[i]);
+		Stopwatch sw;
+		for (int pass = 0; pass < passes; ++pass) crc[i] = lodepng_crc32(&data[0], size);
+		double crcTime = sw.Seconds();
+		sw.Restart();
+		for (int pass = 0; pass < passes; ++pass) adler[i] = lodepng_adler32(&data[0], size);
+		double adlerTime = sw.Seconds();
+		double gb = (double)size * passes / (1024.0 * 1024.0 * 1024.0);
+		std::cout << "  " << (i == 0 ? "scalar" : "simd  ") << ": crc32 " << gb / crcTime << " GB/s, adler32 "
+			<< gb / adlerTime << " GB/s" << std::endl;
+	}
+	lodepng_set_simd(simd);
+	std::cout << "  identical output: " << (crc[0] == crc[1] && adler[0] == adler[1] ? "yes" : "NO") << std::endl;
+}
+
+void BenchmarkCompressionLevels() {
+	const int size = 1024;
+	/*the rough terrain LZ77 finds next to nothing in, and a smooth one where it helps a little*/
+	SimplexNoise noises[2] = { SimplexNoise(FEATURE_SIZE, 0.65, 8, 5000), SimplexNoise(FEATURE_SIZE, 0.65, 3, 5000) };
+	const char* names[2] = { "8 octaves", "3 octaves" };
+	std::cout << "CompressionLevels: " << size << "x" << size << " grey16, one thread" << std::endl;
+
+	for (int n = 0; n < 2; ++n) {
+		std::vector<double> heights((size_t)size * size);
+		RenderTile(noises[n], 0, 0, size, size, SAMPLE_F64, &heights[0], size * sizeof(double));
+		std::vector<unsigned char> scanlines(heights.size() * 2);
+		QuantizeGrey16Row(&heights[0], &scanlines[0], heights.size(), SampleRange::ForU16(noises[n]));
+		double mb = scanlines.size() / (1024.0 * 1024.0);
+		std::cout << "  " << names[n] << std::endl;
+
+		for (unsigned level = 0; level <= 10; ++level) {
+			lodepng::State state;
+			state.info_raw.colortype = LCT_GREY;
+			state.info_raw.bitdepth = 16;
+			state.info_png.color.colortype = LCT_GREY;
+			state.info_png.color.bitdepth = 16;
+			state.encoder.auto_convert = LAC_NO;
+			/*one past the last level stands for the defaults, lodepng_compress_settings_init*/
+			if (level <= 9) lodepng_compress_settings_level(&state.encoder.zlibsettings, level);
+			std::vector<unsigned char> png;
+			Stopwatch sw;
+			unsigned error = lodepng::encode(png, scanlines, size, size, state);
+			double encodeTime = sw.Seconds();
+			std::vector<unsigned char> decoded;
+			unsigned w, h;
+			bool same = !error && !lodepng::decode(decoded, w, h, png, LCT_GREY, 16) && decoded == scanlines;
+			if (level <= 9) std::cout << "    level " << level << ": ";
+			else std::cout << "    default: ";
+			std::cout << mb / encodeTime << " MB/s, ratio " << (double)scanlines.size() / png.size()
+				<< (same ? "" : ", ROUND TRIP FAILED") << std::endl;
+		}
+	}
+}
+
+void BenchmarkAdaptiveDeflate() {
+	const int size = 1024;
+	SimplexNoise noises[2] = { SimplexNoise(FEATURE_SIZE, 0.65, 8, 5000), SimplexNoise(8, 0.9, 16, 5000) };
+	const char* names[2] = { "8 octaves", "16 octaves, persistence 0.9" };
+	std::cout << "AdaptiveDeflate: " << size << "x" << size << " grey16, one thread" << std::endl;
+
+	for (int n = 0; n < 2; ++n) {
+		std::vector<double> heights((size_t)size * size);
+		RenderTile(noises[n], 0, 0, size, size, SAMPLE_F64, &heights[0], size * sizeof(double));
+		std::vector<unsigned char> scanlines(heights.size() * 2);
+		QuantizeGrey16Row(&heights[0], &scanlines[0], heights.size(), SampleRange::ForU16(noises[n]));
+		double mb = scanlines.size() / (1024.0 * 1024.0);
+		std::cout << "  " << names[n] << std::endl;
+
+		for (unsigned btype = 2; btype <= 3; ++btype) {
+			lodepng::State state;
+			state.info_raw.colortype = LCT_GREY;
+			state.info_raw.bitdepth = 16;
+			state.info_png.color.colortype = LCT_GREY;
+			state.info_png.color.bitdepth = 16;
+			state.encoder.auto_convert = LAC_NO;
+			state.encoder.zlibsettings.btype = btype;
+			LodePNGDeflateStats stats = {};
+			state.encoder.zlibsettings.stats = &stats;
+			std::vector<unsigned char> png;
+			Stopwatch sw;
+			unsigned error = lodepng::encode(png, scanlines, size, size, state);
+			double encodeTime = sw.Seconds();
+
+			/*deflate on its own, without the filtering the PNG encode also does*/
+			unsigned char* zlib = 0;
+			size_t zlibsize = 0;
+			state.encoder.zlibsettings.stats = 0;
+			sw.Restart();
+			error |= lodepng_zlib_compress(&zlib, &zlibsize, &scanlines[0], scanlines.size(), &state.encoder.zlibsettings);
+			double zlibTime = sw.Seconds();
+			free(zlib);
+
+			std::vector<unsigned char> decoded;
+			unsigned w, h;
+			bool same = !error && !lodepng::decode(decoded, w, h, png, LCT_GREY, 16) && decoded == scanlines;
+			std::cout << (btype == 2 ? "    dynamic:  " : "    adaptive: ") << mb / encodeTime << " MB/s encode, "
+				<< mb / zlibTime << " MB/s deflate, ratio " << (double)scanlines.size() / png.size()
+				<< ", blocks stored/fixed/dynamic " << stats.blocks[0] << "/" << stats.blocks[1] << "/" << stats.blocks[2]
+				<< ", " << stats.literal_bytes << " bytes without LZ77" << (same ? "" : ", ROUND TRIP FAILED") << std::endl;
+		}
+	}
+}
+
+void BenchmarkStreamingPng() {
+	const int size = 1024;
+	SimplexNoise noise(FEATURE_SIZE, 0.65, 8, 5000);
+	SampleRange range = SampleRange::ForU16(noise);
+	const char* filename = "bench_stream.png";
+	std::cout << "StreamingPng: " << size << "x" << size << " grey16, one thread" << std::endl;
+
+	Stopwatch sw;
+	std::vector<double> heights((size_t)size * size);
+	RenderTile(noise, 0, 0, size, size, SAMPLE_F64, &heights[0], size * sizeof(double));
+	std::vector<unsigned char> png;
+	unsigned error = EncodeGrey16Png(png, &heights[0], size, size, range, 1);
+	double memoryTime = sw.Seconds();
+	size_t memoryBytes = heights.size() * (sizeof(double) + 2) + png.size();
+
+	sw.Restart();
+	error |= StreamGrey16Png(filename, noise, 0, 0, size, size, range);
+	double streamTime = sw.Seconds();
+
+	std::vector<unsigned char> streamed, expected, decoded;
+	unsigned w, h;
+	lodepng::load_file(streamed, filename);
+	bool same = !error && !lodepng::decode(expected, w, h, png, LCT_GREY, 16)
+		&& !lodepng::decode(decoded, w, h, streamed, LCT_GREY, 16) && decoded == expected;
+	std::remove(filename);
+
+	std::cout << "  in memory: " << memoryTime * 1000 << " ms, " << png.size() << " bytes, "
+		<< memoryBytes / 1024 << " KB of buffers" << std::endl;
+	std::cout << "  streamed:  " << streamTime * 1000 << " ms, " << streamed.size() << " bytes, "
+		<< (same ? "same pixels" : "PIXELS DIFFER") << std::endl;
+}
+
+void BenchmarkPngScratch() {
+	const int tileSize = 128;
+	const int tiles = 256;
+	SimplexNoise noise(FEATURE_SIZE, 0.65, 8, 5000);
+	SampleRange range = SampleRange::ForU16(noise);
+	std::vector<unsigned char> scanlines((size_t)tiles * tileSize * tileSize * 2);
+	std::vector<double> heights((size_t)tileSize * tileSize);
+	for (int i = 0; i < tiles; ++i) {
+		RenderTile(noise, (i % 16) * tileSize, (i / 16) * tileSize, tileSize, tileSize, SAMPLE_F64, &heights[0],
+			tileSize * sizeof(double));
+		QuantizeGrey16Row(&heights[0], &scanlines[(size_t)i * tileSize * tileSize * 2], heights.size(), range);
+	}
+	std::cout << "PngScratch: " << tiles << " grey16 tiles of " << tileSize << "x" << tileSize << ", one thread" << std::endl;
+
+	std::vector<unsigned char> png;
+	size_t freshBytes = 0;
+	Stopwatch sw;
+	for (int i = 0; i < tiles; ++i) {
+		EncodeGrey16Png(png, &scanlines[(size_t)i * tileSize * tileSize * 2], tileSize, tileSize, 1);
+		freshBytes += png.size();
+	}
+	double freshTime = sw.Seconds();
+
+	Grey16PngEncoder encoder(1);
+	size_t reusedBytes = 0;
+	sw.Restart();
+	for (int i = 0; i < tiles; ++i) {
+		encoder.Encode(png, &scanlines[(size_t)i * tileSize * tileSize * 2], tileSize, tileSize);
+		reusedBytes += png.size();
+	}
+	double reusedTime = sw.Seconds();
+
+	std::cout << "  new state per tile: " << tiles / freshTime << " tiles/s, " << freshBytes << " bytes" << std::endl;
+	std::cout << "  reused scratch:     " << tiles / reusedTime << " tiles/s, " << reusedBytes << " bytes" << std::endl;
+}
+
+void BenchmarkPngInPlace() {
+	const int tileSize = 128;
+	const int tiles = 256;
+	SimplexNoise noise(FEATURE_SIZE, 0.65, 8, 5000);
+	SampleRange range = SampleRange::ForU16(noise);
+	std::vector<unsigned char> scanlines((size_t)tiles * tileSize * tileSize * 2);
+	std::vector<double> heights((size_t)tileSize * tileSize);
+	for (int i = 0; i < tiles; ++i) {
+		RenderTile(noise, (i % 16) * tileSize, (i / 16) * tileSize, tileSize, tileSize, SAMPLE_F64, &heights[0],
+			tileSize * sizeof(double));
+		QuantizeGrey16Row(&heights[0], &scanlines[(size_t)i * tileSize * tileSize * 2], heights.size(), range);
+	}
+	Grey16PngEncoder encoder(1);
+	size_t bound = encoder.Bound(tileSize, tileSize);
+	std::cout << "PngInPlace: " << tiles << " grey16 tiles of " << tileSize << "x" << tileSize << ", bound "
+		<< bound << " bytes of " << tileSize * tileSize * 2 << " raw" << std::endl;
+
+	/*the lodepng::encode path: the PNG is built by lodepng, then copied into the vector*/
+	lodepng::State state;
+	state.info_raw.colortype = LCT_GREY;
+	state.info_raw.bitdepth = 16;
+	state.info_png.color.colortype = LCT_GREY;
+	state.info_png.color.bitdepth = 16;
+	state.encoder.auto_convert = LAC_NO;
+	state.encoder.zlibsettings.threads = 1;
+	std::vector<unsigned char> png;
+	size_t copiedBytes = 0;
+	Stopwatch sw;
+	for (int i = 0; i < tiles; ++i) {
+		png.clear();
+		lodepng::encode(png, &scanlines[(size_t)i * tileSize * tileSize * 2], tileSize, tileSize, state);
+		copiedBytes += png.size();
+	}
+	double copiedTime = sw.Seconds();
+
+	/*packed back to back into one archive, each tile written where it ends up*/
+	std::vector<unsigned char> archive((size_t)tiles * bound);
+	size_t used = 0;
+	int failed = 0;
+	sw.Restart();
+	for (int i = 0; i < tiles; ++i) {
+		size_t size = 0;
+		if (encoder.Encode(&archive[used], archive.size() - used, size,
+			&scanlines[(size_t)i * tileSize * tileSize * 2], tileSize, tileSize)) ++failed;
+		used += size;
+	}
+	double inPlaceTime = sw.Seconds();
+
+	std::cout << "  encode to vector:   " << tiles / copiedTime << " tiles/s, " << copiedBytes << " bytes" << std::endl;
+	std::cout << "  encode in place:    " << tiles / inPlaceTime << " tiles/s, " << used << " bytes"
+		<< (failed || used != copiedBytes ? " MISMATCH" : "") << std::endl;
+}
+
+void BenchmarkInflate() {
+	const int size = 1024;
+	SimplexNoise noise(FEATURE_SIZE, 0.65, 8, 5000);
+	std::vector<double> heights((size_t)size * size);
+	RenderTile(noise, 0, 0, size, size, SAMPLE_F64, &heights[0], size * sizeof(double));
+	std::vector<unsigned char> scanlines(heights.size() * 2);
+	QuantizeGrey16Row(&heights[0], &scanlines[0], heights.size(), SampleRange::ForU16(noise));
+	double mb = scanlines.size() / (1024.0 * 1024.0);
+	const unsigned levels[3] = { 1, 6, 9 };
+	std::cout << "Inflate: " << size << "x" << size << " grey16, zlib stream and whole PNG" << std::endl;
+
+	for (int i = 0; i < 3; ++i) {
+		lodepng::State state;
+		state.info_raw.colortype = LCT_GREY;
+		state.info_raw.bitdepth = 16;
+		state.info_png.color.colortype = LCT_GREY;
+		state.info_png.color.bitdepth = 16;
+		state.encoder.auto_convert = LAC_NO;
+		lodepng_compress_settings_level(&state.encoder.zlibsettings, levels[i]);
+		std::vector<unsigned char> png;
+		unsigned error = lodepng::encode(png, scanlines, size, size, state);
+		unsigned char* zlib = 0;
+		size_t zlibsize = 0;
+		error |= lodepng_zlib_compress(&zlib, &zlibsize, &scanlines[0], scanlines.size(), &state.encoder.zlibsettings);
+
+		const int runs = 5;
+		unsigned char* inflated = 0;
+		size_t inflatedsize = 0;
+		Stopwatch sw;
+		for (int r = 0; r < runs; ++r) {
+			free(inflated);
+			inflated = 0;
+			inflatedsize = 0;
+			error |= lodepng_zlib_decompress(&inflated, &inflatedsize, zlib, zlibsize, &lodepng_default_decompress_settings);
+		}
+		double inflateTime = sw.Seconds() / runs;
+		bool same = inflatedsize == scanlines.size() && std::equal(scanlines.begin(), scanlines.end(), inflated);
+		free(inflated);
+		free(zlib);
+
+		std::vector<unsigned char> decoded;
+		unsigned w, h;
+		sw.Restart();
+		for (int r = 0; r < runs; ++r) {
+			decoded.clear(); /*lodepng::decode appends*/
+			error |= lodepng::decode(decoded, w, h, png, LCT_GREY, 16);
+		}
+		double decodeTime = sw.Seconds() / runs;
+		same = same && !error && decoded == scanlines;
+		std::cout << "  level " << levels[i] << ": inflate " << mb / inflateTime << " MB/s, PNG decode "
+			<< mb / decodeTime << " MB/s" << (same ? "" : ", ROUND TRIP FAILED") << std::endl;
+	}
+}
+
+namespace {
+	struct RowChecksum {
+		std::vector<unsigned char>* rows;
+		size_t offset;
+		unsigned y; /*the row expected next*/
+	};
+
+	/*LodePNGRowSink comparing the rows, which must come top to bottom, against the whole image decode*/
+	unsigned CompareRow(void* context, unsigned y, const unsigned char* row, size_t size) {
+		RowChecksum& check = *(RowChecksum*)context;
+		if (y != check.y || check.offset + size > check.rows->size()
+			|| !std::equal(row, row + size, check.rows->begin() + check.offset)) {
+			return 1000;
+		}
+		check.offset += size;
+		++check.y;
+		return 0;
+	}
+}
+
+void BenchmarkRowDecode() {
+	const int size = 2048;
+	SimplexNoise noise(FEATURE_SIZE, 0.65, 8, 5000);
+	SampleRange range = SampleRange::ForU16(noise);
+	const char* filename = "bench_rows.png";
+	std::vector<double> heights((size_t)size * size);
+	RenderTile(noise, 0, 0, size, size, SAMPLE_F64, &heights[0], size * sizeof(double));
+	unsigned error = SaveGrey16Png(filename, &heights[0], size, size, range);
+	std::cout << "RowDecode: " << size << "x" << size << " grey16 PNG file" << std::endl;
+
+	const int runs = 3;
+	std::vector<unsigned char> file, decoded;
+	unsigned w = 0, h = 0;
+	Stopwatch sw;
+	for (int r = 0; r < runs; ++r) {
+		file.clear();
+		decoded.clear(); /*lodepng::decode appends*/
+		lodepng::load_file(file, filename);
+		error |= lodepng::decode(decoded, w, h, file, LCT_GREY, 16);
+	}
+	double wholeTime = sw.Seconds() / runs;
+	/*the file, the inflated scanlines with their filter bytes and the image*/
+	size_t wholeBytes = file.size() + decoded.size() + h + decoded.size();
+
+	bool same = true;
+	sw.Restart();
+	for (int r = 0; r < runs; ++r) {
+		RowChecksum check = { &decoded, 0, 0 };
+		error |= LoadGrey16Png(filename, w, h, CompareRow, &check);
+		same = same && check.offset == decoded.size();
+	}
+	double rowTime = sw.Seconds() / runs;
+	/*the inflate window and three rows, the file pages belong to the OS*/
+	size_t rowBytes = 32768 + 2 * 65536 + 3 * ((size_t)w * 2 + 1);
+
+	std::vector<double> loaded;
+	error |= LoadGrey16Png(filename, loaded, w, h, range);
+	double maxError = 0;
+	for (size_t i = 0; i < loaded.size() && i < heights.size(); ++i) {
+		maxError = std::max(maxError, std::fabs(loaded[i] - heights[i]));
+	}
+	same = same && !error && loaded.size() == heights.size();
+	std::remove(filename);
+
+	std::cout << "  load_file + decode: " << wholeTime * 1000 << " ms, " << wholeBytes / 1024 << " KB" << std::endl;
+	std::cout << "  mapped row decode:  " << rowTime * 1000 << " ms, " << rowBytes / 1024 << " KB, "
+		<< (same ? "same rows" : "ROWS DIFFER") << ", heights within " << maxError << std::endl;
+}
+
+void BenchmarkConvert() {
+	const int size = 1024;
+	const int runs = 5;
+	struct Conversion {
+		const char* name;
+		LodePNGColorType inType, outType;
+		unsigned inBits, outBits;
+	};
+	const Conversion conversions[6] = {
+		{ "grey8 to RGBA8  ", LCT_GREY, LCT_RGBA, 8, 8 },
+		{ "grey16 to RGBA8 ", LCT_GREY, LCT_RGBA, 16, 8 },
+		{ "RGBA8 to grey8  ", LCT_RGBA, LCT_GREY, 8, 8 },
+		{ "RGBA16 to RGBA8 ", LCT_RGBA, LCT_RGBA, 16, 8 },
+		{ "grey16 to RGBA16", LCT_GREY, LCT_RGBA, 16, 16 },
+		{ "grey8 to grey16 ", LCT_GREY, LCT_GREY, 8, 16 }
+	};
+	std::cout << "Convert: lodepng_convert on " << size << "x" << size << " images, MB/s of output" << std::endl;
+
+	unsigned simd = lodepng_get_simd();
+	for (int c = 0; c < 6; ++c) {
+		const Conversion& conversion = conversions[c];
+		LodePNGColorMode in, out;
+		lodepng_color_mode_init(&in);
+		lodepng_color_mode_init(&out);
+		in.colortype = conversion.inType;
+		in.bitdepth = conversion.inBits;
+		out.colortype = conversion.outType;
+		out.bitdepth = conversion.outBits;
+		std::vector<unsigned char> pixels(lodepng_get_raw_size(size, size, &in));
+		for (size_t i = 0; i < pixels.size(); ++i) pixels[i] = (unsigned char)(i * 7 + (i >> 11));
+		size_t outSize = lodepng_get_raw_size(size, size, &out);
+		double mb = outSize / (1024.0 * 1024.0);
+
+		/*a grey colour key no sample can match takes the per pixel code with the
+		same result, when the key would become alpha*/
+		std::vector<unsigned char> expected(outSize), converted(outSize);
+		double pixelTime = 0;
+		if (conversion.inType == LCT_GREY && conversion.outType == LCT_RGBA) {
+			LodePNGColorMode keyed = in;
+			keyed.key_defined = 1;
+			keyed.key_r = 65536;
+			Stopwatch sw;
+			for (int r = 0; r < runs; ++r) lodepng_convert(&expected[0], &pixels[0], &out, &keyed, size, size, 0);
+			pixelTime = sw.Seconds() / runs;
+		}
+
+		double times[2];
+		bool same = true;
+		for (int pass = 0; pass < 2; ++pass) {
+			lodepng_set_simd(pass == 0 ? 0 : simd);
+			Stopwatch sw;
+			for (int r = 0; r < runs; ++r) lodepng_convert(&converted[0], &pixels[0], &out, &in, size, size, 0);
+			times[pass] = sw.Seconds() / runs;
+			if (pixelTime == 0 && pass == 0) expected = converted;
+			same = same && converted == expected;
+		}
+		lodepng_set_simd(simd);
+
+		std::cout << "  " << conversion.name << ": ";
+		if (pixelTime > 0) std::cout << "per pixel " << mb / pixelTime << ", ";
+		std::cout << "rows " << mb / times[0] << ", SIMD " << mb / times[1]
+			<< (same ? "" : ", OUTPUT DIFFERS") << std::endl;
+		lodepng_color_mode_cleanup(&in);
+		lodepng_color_mode_cleanup(&out);
+	}
+}
+
+void BenchmarkColorProfile() {
+	const int size = 2048;
+	const int runs = 5;
+	SimplexNoise noise(FEATURE_SIZE, 0.65, 8, 5000);
+	std::vector<double> heights((size_t)size * size);
+	RenderTile(noise, 0, 0, size, size, SAMPLE_F64, &heights[0], size * sizeof(double));
+	/*the grey, opaque RGBA image main.cpp used to save*/
+	std::vector<unsigned char> rgba(heights.size() * 4);
+	double amplitude = noise.AmplitudeSum();
+	for (size_t i = 0; i < heights.size(); ++i) {
+		unsigned char grey = (unsigned char)((heights[i] / amplitude + 1.0) * 127.5);
+		rgba[i*4] = rgba[i*4+1] = rgba[i*4+2] = grey;
+		rgba[i*4+3] = 255;
+	}
+	std::cout << "ColorProfile: " << size << "x" << size << " grey RGBA8 noise, LAC_AUTO" << std::endl;
+
+	LodePNGColorMode in;
+	lodepng_color_mode_init(&in);
+	unsigned simd = lodepng_get_simd();
+	for (int pass = 0; pass < 2; ++pass) {
+		lodepng_set_simd(pass == 0 ? 0 : simd);
+		LodePNGColorMode chosen;
+		lodepng_color_mode_init(&chosen);
+		Stopwatch sw;
+		for (int r = 0; r < runs; ++r) {
+			lodepng_color_mode_copy(&chosen, &in);
+			lodepng_auto_choose_color(&chosen, &rgba[0], size, size, &in, LAC_AUTO);
+		}
+		double time = sw.Seconds() / runs;
+		std::cout << "  profile " << (pass == 0 ? "scalar: " : "SIMD:   ") << time * 1000 << " ms, chose "
+			<< (chosen.colortype == LCT_GREY ? "grey" : "other") << " " << chosen.bitdepth << std::endl;
+		lodepng_color_mode_cleanup(&chosen);
+	}
+	lodepng_set_simd(simd);
+
+	/*with the output colour type given, LAC_NO skips the profile*/
+	for (int pass = 0; pass < 2; ++pass) {
+		lodepng::State state;
+		state.encoder.auto_convert = pass == 0 ? LAC_AUTO : LAC_NO;
+		state.info_png.color.colortype = LCT_GREY;
+		std::vector<unsigned char> png;
+		Stopwatch sw;
+		unsigned error = lodepng::encode(png, rgba, size, size, state);
+		double time = sw.Seconds();
+		std::cout << "  encode " << (pass == 0 ? "LAC_AUTO: " : "LAC_NO:   ") << time * 1000 << " ms, "
+			<< png.size() << " bytes" << (error ? ", ERROR" : "") << std::endl;
+	}
+	lodepng_color_mode_cleanup(&in);
+}
+
+void BenchmarkBatchEncode() {
+	const int tileSize = 256;
+	const int across = 8;
+	const int repeats = 4;
+	const int size = tileSize * across;
+	SimplexNoise noise(FEATURE_SIZE, 0.65, 8, 5000);
+	std::vector<double> heights((size_t)size * size);
+	RenderTile(noise, 0, 0, size, size, SAMPLE_F64, &heights[0], size * sizeof(double));
+	std::vector<unsigned char> grey16(heights.size() * 2);
+	QuantizeGrey16Row(&heights[0], &grey16[0], heights.size(), SampleRange::ForU16(noise));
+
+	/*the tiles of one render, cut out and encoded repeats times over*/
+	size_t tileBytes = (size_t)tileSize * tileSize * 2;
+	std::vector<unsigned char> tilePixels(tileBytes * across * across);
+	for (int t = 0; t < across * across; ++t) {
+		for (int y = 0; y < tileSize; ++y) {
+			const unsigned char* row = &grey16[(((size_t)(t / across) * tileSize + y) * size + (t % across) * tileSize) * 2];
+			std::copy(row, row + tileSize * 2, tilePixels.begin() + t * tileBytes + (size_t)y * tileSize * 2);
+		}
+	}
+	std::vector<lodepng::BatchImage> tiles(across * across * repeats);
+	for (size_t i = 0; i < tiles.size(); ++i) {
+		tiles[i].image = &tilePixels[(i % (across * across)) * tileBytes];
+		tiles[i].w = tileSize;
+		tiles[i].h = tileSize;
+	}
+	std::cout << "BatchEncode: " << tiles.size() << " grey16 tiles of " << tileSize << "x" << tileSize << std::endl;
+
+	/*what the tile loops did: a fresh state and a serial encode per tile*/
+	std::vector<std::vector<unsigned char> > serial(tiles.size());
+	Stopwatch sw;
+	for (size_t i = 0; i < tiles.size(); ++i) {
+		lodepng::State state;
+		state.info_raw.colortype = LCT_GREY;
+		state.info_raw.bitdepth = 16;
+		state.info_png.color.colortype = LCT_GREY;
+		state.info_png.color.bitdepth = 16;
+		state.encoder.auto_convert = LAC_NO;
+		state.encoder.zlibsettings.threads = 1;
+		lodepng::encode(serial[i], tiles[i].image, tileSize, tileSize, state);
+	}
+	double serialTime = sw.Seconds();
+	std::cout << "  serial, state per tile: " << tiles.size() / serialTime << " tiles/s" << std::endl;
+
+	lodepng::State state;
+	state.info_raw.colortype = LCT_GREY;
+	state.info_raw.bitdepth = 16;
+	state.info_png.color.colortype = LCT_GREY;
+	state.info_png.color.bitdepth = 16;
+	state.encoder.auto_convert = LAC_NO;
+	unsigned cores = std::thread::hardware_concurrency();
+	if (cores < 1) cores = 1;
+	for (unsigned threads = 1; ; threads = std::min(threads * 2, cores)) {
+		/*the first batch starts the threads and fills their arenas, the second reuses both*/
+		sw.Restart();
+		lodepng::BatchEncoder batch(state, threads);
+		for (int pass = 0; pass < 2; ++pass) {
+			std::vector<lodepng::BatchResult> results;
+			if (pass == 1) sw.Restart();
+			unsigned error = batch.encode(results, &tiles[0], tiles.size());
+			double time = sw.Seconds();
+
+			bool same = !error;
+			std::vector<double> seconds(results.size());
+			for (size_t i = 0; i < results.size(); ++i) {
+				same = same && results[i].png == serial[i];
+				seconds[i] = results[i].seconds;
+			}
+			std::sort(seconds.begin(), seconds.end());
+			std::cout << "  batch, " << threads << " threads, " << (pass == 0 ? "first: " : "again: ")
+				<< tiles.size() / time << " tiles/s, " << serialTime / time << "x, per tile median "
+				<< seconds[seconds.size() / 2] * 1000 << " ms, max " << seconds.back() * 1000 << " ms"
+				<< (same ? "" : ", OUTPUT DIFFERS") << std::endl;
+		}
+		if (threads == cores) break;
+	}
+}
+
+void BenchmarkHuffmanLengths() {
+	const int tileSize = 128;
+	const int runs = 20000;
+	SimplexNoise noise(FEATURE_SIZE, 0.65, 8, 5000);
+	std::vector<double> heights((size_t)tileSize * tileSize);
+	RenderTile(noise, 0, 0, tileSize, tileSize, SAMPLE_F64, &heights[0], tileSize * sizeof(double));
+	std::vector<unsigned char> grey16(heights.size() * 2);
+	QuantizeGrey16Row(&heights[0], &grey16[0], heights.size(), SampleRange::ForU16(noise));
+
+	/*a literal/length alphabet as a tile's dynamic block sees it: its bytes, a spread of
+	lengths and the end code, and the 19 symbol code length alphabet*/
+	std::vector<unsigned> litlen(286, 0), codelength(19, 0);
+	for (size_t i = 0; i < grey16.size(); ++i) litlen[grey16[i]]++;
+	for (int i = 257; i < 286; ++i) litlen[i] = (unsigned)(grey16.size() >> (i - 254));
+	for (int i = 0; i < 19; ++i) codelength[i] = (unsigned)((i * 37) % 23);
+	std::vector<unsigned> lengths(286);
+	std::cout << "HuffmanLengths: package-merge code lengths, " << runs << " trees each" << std::endl;
+
+	unsigned error = 0;
+	Stopwatch sw;
+	for (int r = 0; r < runs; ++r) error |= lodepng_huffman_code_lengths(&lengths[0], &litlen[0], 286, 15);
+	double litlenTime = sw.Seconds() / runs;
+	unsigned long long bits = 0;
+	for (int i = 0; i < 286; ++i) bits += (unsigned long long)litlen[i] * lengths[i];
+	sw.Restart();
+	for (int r = 0; r < runs; ++r) error |= lodepng_huffman_code_lengths(&lengths[0], &codelength[0], 19, 7);
+	double codelengthTime = sw.Seconds() / runs;
+
+	std::cout << "  286 symbols, 15 bits: " << litlenTime * 1e6 << " us, " << bits << " bits coded" << std::endl;
+	std::cout << "  19 symbols, 7 bits:   " << codelengthTime * 1e6 << " us" << (error ? ", ERROR" : "") << std::endl;
+}
+
+void BenchmarkNoiseBatch() {
+	SimplexNoise noise(FEATURE_SIZE, 0.65, 8, 5000);
+	std::cout << "NoiseBatch: " << BENCH_SIZE << "x" << BENCH_SIZE << " samples, SSE2 " << (Cpu().sse2 ? "on" : "off") << std::endl;
+
+	Vector2dArray points((size_t)BENCH_SIZE * BENCH_SIZE);
+	for (int y = 0; y < BENCH_SIZE; ++y) {
+		for (int x = 0; x < BENCH_SIZE; ++x) {
+			points.Set((size_t)y * BENCH_SIZE + x, Vector2d(x - BENCH_SIZE / 2, y * 3 - BENCH_SIZE));
+		}
+	}
+
+	std::vector<double> scalar(points.Size());
+	Stopwatch sw;
+	for (size_t i = 0; i < points.Size(); ++i) {
+		scalar[i] = noise.NoiseAt((int)points.X()[i], (int)points.Y()[i]);
+	}
+	double scalarTime = sw.Seconds();
+
+	std::vector<double> batch(points.Size());
+	sw.Restart();
+	noise.NoiseAt(points, &batch[0]);
+	double batchTime = sw.Seconds();
+
+	double checksum = 0;
+	size_t mismatches = 0;
+	for (size_t i = 0; i < points.Size(); ++i) {
+		checksum += batch[i];
+		if (batch[i] != scalar[i]) ++mismatches;
+	}
+	std::cout << "  point by point: " << scalarTime * 1000.0 << " ms" << std::endl;
+	std::cout << "  batch:          " << batchTime * 1000.0 << " ms (checksum " << checksum << ", "
+		<< mismatches << " mismatches)" << std::endl;
+	std::cout << "  speedup:        " << scalarTime / batchTime << std::endl;
+}
+
+void BenchmarkNoiseVsPod() {
+	const int passes = 8;
+	SimplexNoise noise(FEATURE_SIZE, 0.65, 1, 5000);
+	std::cout << "NoiseVsPod: " << BENCH_SIZE << "x" << BENCH_SIZE << " samples x " << passes << std::endl;
+
+	/*Interleave the two so that clock changes hit both alike*/
+	double vectorTime = 0;
+	double podTime = 0;
+	double vectorSum = 0;
+	double podSum = 0;
+	for (int pass = 0; pass < passes; ++pass) {
+		double offset = pass * 1000.0 - 4000.0;
+		Stopwatch sw;
+		for (int y = 0; y < BENCH_SIZE; ++y) {
+			for (int x = 0; x < BENCH_SIZE; ++x) {
+				vectorSum += noise.Noise(x * 0.0137 + offset, y * 0.0213 - offset);
+			}
+		}
+		vectorTime += sw.Seconds();
+		sw.Restart();
+		for (int y = 0; y < BENCH_SIZE; ++y) {
+			for (int x = 0; x < BENCH_SIZE; ++x) {
+				podSum += noise.NoiseReference(x * 0.0137 + offset, y * 0.0213 - offset);
+			}
+		}
+		podTime += sw.Seconds();
+	}
+	std::cout << "  Noise (Vector2): " << vectorTime * 1000.0 << " ms (checksum " << vectorSum << ")" << std::endl;
+	std::cout << "  POD reference:   " << podTime * 1000.0 << " ms (checksum " << podSum << ")" << std::endl;
+	std::cout << "  ratio:           " << vectorTime / podTime << std::endl;
+}
+
+size_t CheckFastFloor(size_t& checks) {
+	size_t mismatches = 0;
+	checks = 0;
+	for (int e = 0; e <= 31; ++e) {
+		double magnitude = std::ldexp(1.0, e);
+		double bases[4] = { magnitude - 1, magnitude, -magnitude, -magnitude + 1 };
+		for (int b = 0; b < 4; ++b) {
+			double nudge = std::ldexp(std::fabs(bases[b]) + 1.0, -52); /*about an ulp*/
+			double candidates[5] = { bases[b] - 0.5, bases[b] - nudge, bases[b], bases[b] + nudge, bases[b] + 0.5 };
+			for (int c = 0; c < 5; ++c) {
+				double x = candidates[c];
+				if (x < -2147483648.0 || x >= 2147483648.0) continue;
+				++checks;
+				if (FastFloor(x) != (int)std::floor(x)) ++mismatches;
+			}
+		}
+	}
+	return mismatches;
+}
+
+void BenchmarkNoiseFloor() {
+	SimplexNoise noise(FEATURE_SIZE, 0.65, 8, 5000);
+	std::cout << "NoiseFloor:" << std::endl;
+
+	size_t floorChecks;
+	size_t floorMismatches = CheckFastFloor(floorChecks);
+
+	/*Noise against the reference around the origin, around +-1e6 and at
+	+-1e9, near the edge of the int range once skewed (x + (x + y) * F2 must
+	fit in an int), in steps that land on and between cell edges*/
+	const double centres[5] = { 0.0, 1e6, -1e6, 1e9, -1e9 };
+	size_t noiseChecks = 0;
+	size_t noiseMismatches = 0;
+	for (int c = 0; c < 5; ++c) {
+		for (int j = -200; j < 200; ++j) {
+			for (int i = -200; i < 200; ++i) {
+				double x = centres[c] + i * 0.0625 + j * 0.0078125;
+				double y = centres[c] - j * 0.0625 + i * 0.01;
+				++noiseChecks;
+				if (noise.Noise(x, y) != noise.NoiseReference(x, y)) ++noiseMismatches;
+			}
+		}
+	}
+	std::cout << "  FastFloor: " << floorChecks << " values, " << floorMismatches << " mismatches" << std::endl;
+	std::cout << "  Noise:     " << noiseChecks << " points, " << noiseMismatches << " mismatches" << std::endl;
+
+	/*fBm over a grid, where the low octaves pick the same corner for long runs*/
+	Stopwatch sw;
+	double gridSum = 0;
+	for (int y = 0; y < BENCH_SIZE; ++y) {
+		for (int x = 0; x < BENCH_SIZE; ++x) {
+			gridSum += noise.NoiseAt(x, y);
+		}
+	}
+	double gridTime = sw.Seconds();
+
+	/*Scattered single octave samples, where neither choice can be predicted*/
+	std::vector<double> points((size_t)BENCH_SIZE * BENCH_SIZE * 2);
+	unsigned state = 12345;
+	for (size_t i = 0; i < points.size(); ++i) {
+		state = state * 1103515245u + 12345u;
+		points[i] = (state >> 8) * (2000.0 / 16777216.0) - 1000.0;
+	}
+	sw.Restart();
+	double noiseSum = 0;
+	for (size_t i = 0; i < points.size(); i += 2) {
+		noiseSum += noise.Noise(points[i], points[i + 1]);
+	}
+	double noiseTime = sw.Seconds();
+	sw.Restart();
+	double referenceSum = 0;
+	for (size_t i = 0; i < points.size(); i += 2) {
+		referenceSum += noise.NoiseReference(points[i], points[i + 1]);
+	}
+	double referenceTime = sw.Seconds();
+
+	std::cout << "  NoiseAt grid:     " << gridTime * 1000.0 << " ms (checksum " << gridSum << ")" << std::endl;
+	std::cout << "  random Noise:     " << noiseTime * 1000.0 << " ms (checksum " << noiseSum << ")" << std::endl;
+	std::cout << "  random reference: " << referenceTime * 1000.0 << " ms (checksum " << referenceSum << ")" << std::endl;
+}
+
+int RunBenchmarks() {
+	BenchmarkNoiseExpr();
+	BenchmarkHeightmapFile();
+	BenchmarkPyramid();
+	BenchmarkHalf();
+	BenchmarkGrey16Png();
+	BenchmarkParallelDeflate();
+	BenchmarkPngFilters();
+	BenchmarkChecksums();
+	BenchmarkCompressionLevels();
+	BenchmarkStreamingPng();
+	BenchmarkPngScratch();
+	BenchmarkPngInPlace();
+	BenchmarkAdaptiveDeflate();
+	BenchmarkInflate();
+	BenchmarkRowDecode();
+	BenchmarkConvert();
+	BenchmarkColorProfile();
+	BenchmarkBatchEncode();
+	BenchmarkHuffmanLengths();
+	BenchmarkNoiseBatch();
+	BenchmarkNoiseVsPod();
+	BenchmarkNoiseFloor();
+	return 0;
+}
@@ -0,0 +1,115 @@
+#pragma once
+/*
+Micro benchmarks for the noise generators and their output paths.
+Run with "SimplexNoise --bench". Each benchmark prints its timings and a
+checksum so that runs of equivalent code can be compared for both speed and
+identical output.
+*/
+
+#include <chrono>
+#include <cstddef>
+
+/*Wall clock stopwatch used by the benchmarks*/
+class Stopwatch {
+public:
+	Stopwatch() : start(std::chrono::high_resolution_clock::now()) {}
+
+	double Seconds() const {
+		return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+	}
+
+	void Restart() {
+		start = std::chrono::high_resolution_clock::now();
+	}
+
+private:
+	std::chrono::high_resolution_clock::time_point start;
+};
+
+/*FastFloor against std::floor at and either side of integers from the
+bottom to the top of the int range, also run by the regression tests.
+Returns the number of mismatches, checks is set to the values tried*/
+size_t CheckFastFloor(size_t& checks);
+
+/*Expression template composition vs the same composition written out by hand*/
+void BenchmarkNoiseExpr();
+
+/*Rendering a tiled raw heightmap into a mapped file and mapping it back*/
+void BenchmarkHeightmapFile();
+
+/*Building a pyramid from one render vs rendering every level separately*/
+void BenchmarkPyramid();
+
+/*Half precision conversion speed and accuracy against NoiseAt*/
+void BenchmarkHalf();
+
+/*Direct 16 bit grey PNG export vs the old 8 bit RGBA expansion*/
+void BenchmarkGrey16Png();
+
+/*PNG encoding with lodepng's single threaded vs parallel deflate*/
+void BenchmarkParallelDeflate();
+
+/*lodepng's scanline filters and unfilters, scalar vs SIMD*/
+void BenchmarkPngFilters();
+
+/*lodepng's CRC-32 and Adler-32, table driven vs PCLMULQDQ/SSSE3/AVX2*/
+void BenchmarkChecksums();
+
+/*lodepng's zlib style compression levels 0-9, speed against ratio, on a
+rough and a smooth heightmap*/
+void BenchmarkCompressionLevels();
+
+/*Grey16 PNG export rendered and encoded a band at a time vs all in memory*/
+void BenchmarkStreamingPng();
+
+/*Encoding many small PNG tiles with a fresh lodepng state each vs one state
+whose scratch arena is reused*/
+void BenchmarkPngScratch();
+
+/*Encoding PNG tiles into a vector each vs straight into one preallocated
+archive buffer, lodepng_encode_bound bytes per slot*/
+void BenchmarkPngInPlace();
+
+/*lodepng's adaptive block type (btype 3) against the default dynamic blocks
+on ordinary and high octave noise, with the block types it picked*/
+void BenchmarkAdaptiveDeflate();
+
+/*Decoding grey16 heightmaps: raw zlib inflate and the whole PNG decode, on
+streams from a fast, the default and the best compression level*/
+void BenchmarkInflate();
+
+/*Decoding a grey16 PNG file whole with lodepng::load_file and decode vs
+mapping it and decoding a row at a time*/
+void BenchmarkRowDecode();
+
+/*lodepng's colour conversions: the per pixel code against the row loops and
+their SIMD versions*/
+void BenchmarkConvert();
+
+/*lodepng's automatic colour type choice on a large grey RGBA image, scalar
+and SIMD, and the encode with and without it*/
+void BenchmarkColorProfile();
+
+/*Encoding many tiles serially with a state each vs two batches on a
+lodepng::BatchEncoder of 1, 2, 4 ... threads up to the core count*/
+void BenchmarkBatchEncode();
+
+/*lodepng's length limited Huffman code lengths on a tile's literal/length
+alphabet and the code length alphabet*/
+void BenchmarkHuffmanLengths();
+
+/*NoiseAt point by point vs the structure of arrays batch NoiseAt, which runs
+two points per SSE2 instruction*/
+void BenchmarkNoiseBatch();
+
+/*SimplexNoise::Noise, written with Vector2 expressions, against Gustavson's
+plain double version (NoiseReference)*/
+void BenchmarkNoiseVsPod();
+
+/*Noise's FastFloor and branchless corner choice: a sweep against std::floor
+and NoiseReference over negative and large coordinates, then timings on a
+grid (predictable corners) and on random points*/
+void BenchmarkNoiseFloor();
+
+/*Runs every benchmark in turn, returns the process exit code*/
+int RunBenchmarks();
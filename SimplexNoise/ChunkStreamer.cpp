@@ -0,0 +1,183 @@
+#include "ChunkStreamer.h"
+#include <algorithm>
+#include <cmath>
+
+ChunkStreamer::ChunkStreamer(const SimplexNoise& noise, int chunkSize, double viewRadius,
+	double prefetchSeconds, int workerCount, SampleType type)
+	: noise(noise), chunkSize(chunkSize), type(type), viewRadius(viewRadius), prefetchSeconds(prefetchSeconds),
+	stopping(false), completed(COMPLETION_CAPACITY) {
+	if (type == SAMPLE_U16) range = SampleRange::ForU16(noise);
+	if (workerCount <= 0) {
+		workerCount = (int)std::thread::hardware_concurrency() - 1;
+		if (workerCount < 1) workerCount = 1;
+	}
+	for (int i = 0; i < workerCount; ++i) {
+		workers.push_back(std::thread(&ChunkStreamer::WorkerLoop, this));
+	}
+}
+
+ChunkStreamer::~ChunkStreamer() {
+	{
+		std::lock_guard<std::mutex> lock(queueMutex);
+		stopping = true;
+		queue.clear();
+	}
+	queueSignal.notify_all();
+	for (size_t i = 0; i < workers.size(); ++i) {
+		workers[i].join();
+	}
+	Chunk* chunk;
+	while (completed.TryPop(chunk)) {
+		delete chunk;
+	}
+}
+
+void ChunkStreamer::Update(const std::vector<Viewer>& newViewers) {
+	viewers = newViewers;
+
+	/*Everything around the viewers now, and around where they are heading.
+	Priority is distance, with the predicted ring ranked as if it were half
+	the prefetch distance further away: the ground under a viewer comes
+	first, then the ground ahead of it before the ground behind it*/
+	std::map<Vector2i, double, CoordLess> wanted;
+	for (size_t i = 0; i < viewers.size(); ++i) {
+		Vector2d lead = viewers[i].velocity * prefetchSeconds;
+		AddWanted(wanted, viewers[i].position, 0.0);
+		AddWanted(wanted, viewers[i].position + lead, 0.5 * lead.Length());
+	}
+
+	/*Drop resident chunks once they are a chunk beyond the view radius, the
+	slack stops chunks on the boundary from being rebuilt over and over*/
+	std::set<Vector2i, CoordLess>::iterator it = resident.begin();
+	while (it != resident.end()) {
+		if (!Wanted(*it, viewRadius + chunkSize)) {
+			evicted.push_back(*it);
+			resident.erase(it++);
+		} else {
+			++it;
+		}
+	}
+
+	std::vector<Request> requests;
+	requests.reserve(wanted.size());
+	for (std::map<Vector2i, double, CoordLess>::const_iterator w = wanted.begin(); w != wanted.end(); ++w) {
+		if (resident.count(w->first)) continue;
+		Request r;
+		r.coord = w->first;
+		r.priority = w->second;
+		requests.push_back(r);
+	}
+	std::sort(requests.begin(), requests.end(), [](const Request& a, const Request& b) {
+		return a.priority > b.priority;
+	});
+
+	/*The old queue is simply replaced, chunks that went out of range before a
+	worker reached them are never built*/
+	{
+		std::lock_guard<std::mutex> lock(queueMutex);
+		queue.clear();
+		for (size_t i = 0; i < requests.size(); ++i) {
+			if (!inFlight.count(requests[i].coord)) {
+				queue.push_back(requests[i]);
+			}
+		}
+	}
+	queueSignal.notify_all();
+}
+
+std::unique_ptr<Chunk> ChunkStreamer::PollCompleted() {
+	Chunk* chunk;
+	while (completed.TryPop(chunk)) {
+		std::unique_ptr<Chunk> owned(chunk);
+		/*Chunks can finish after they went out of range, or be built twice if
+		they were requeued while a worker was handing them over*/
+		if (resident.count(owned->coord) || !Wanted(owned->coord, viewRadius + chunkSize)) {
+			continue;
+		}
+		resident.insert(owned->coord);
+		return owned;
+	}
+	return std::unique_ptr<Chunk>();
+}
+
+void ChunkStreamer::TakeEvicted(std::vector<Vector2i>& out) {
+	out.insert(out.end(), evicted.begin(), evicted.end());
+	evicted.clear();
+}
+
+size_t ChunkStreamer::PendingCount() const {
+	std::lock_guard<std::mutex> lock(queueMutex);
+	return queue.size() + inFlight.size();
+}
+
+void ChunkStreamer::WorkerLoop() {
+	for (;;) {
+		Request request;
+		{
+			std::unique_lock<std::mutex> lock(queueMutex);
+			queueSignal.wait(lock, [this] { return stopping || !queue.empty(); });
+			if (stopping) return;
+			request = queue.back();
+			queue.pop_back();
+			inFlight.insert(request.coord);
+		}
+
+		Chunk* chunk = new Chunk();
+		chunk->coord = request.coord;
+		chunk->size = chunkSize;
+		Generate(*chunk);
+
+		/*The completion queue only fills up if the main thread stops polling,
+		back off until it catches up*/
+		while (!completed.TryPush(chunk)) {
+			if (stopping) {
+				delete chunk;
+				break;
+			}
+			std::this_thread::yield();
+		}
+
+		std::lock_guard<std::mutex> lock(queueMutex);
+		inFlight.erase(request.coord);
+	}
+}
+
+void ChunkStreamer::Generate(Chunk& chunk) const {
+	chunk.type = type;
+	chunk.range = range;
+	chunk.samples.resize(chunk.size * chunk.size * SampleSize(type));
+	RenderTile(noise, chunk.coord.x * chunk.size, chunk.coord.y * chunk.size, chunk.size, chunk.size,
+		type, &chunk.samples[0], chunk.size * SampleSize(type), range);
+}
+
+bool ChunkStreamer::Wanted(const Vector2i& coord, double radius) const {
+	Vector2d centre = (Vector2d(coord) + 0.5) * chunkSize;
+	for (size_t i = 0; i < viewers.size(); ++i) {
+		if (centre.DistanceTo(viewers[i].position) <= radius) return true;
+		Vector2d ahead = viewers[i].position + viewers[i].velocity * prefetchSeconds;
+		if (centre.DistanceTo(ahead) <= radius) return true;
+	}
+	return false;
+}
+
+void ChunkStreamer::AddWanted(std::map<Vector2i, double, CoordLess>& wanted, const Vector2d& centre,
+	double penalty) const {
+	int minX = (int)std::floor((centre.x - viewRadius) / chunkSize);
+	int maxX = (int)std::floor((centre.x + viewRadius) / chunkSize);
+	int minY = (int)std::floor((centre.y - viewRadius) / chunkSize);
+	int maxY = (int)std::floor((centre.y + viewRadius) / chunkSize);
+	for (int cy = minY; cy <= maxY; ++cy) {
+		for (int cx = minX; cx <= maxX; ++cx) {
+			Vector2i coord(cx, cy);
+			double distance = ((Vector2d(coord) + 0.5) * chunkSize).DistanceTo(centre);
+			if (distance > viewRadius) continue;
+			distance += penalty;
+			std::map<Vector2i, double, CoordLess>::iterator it = wanted.find(coord);
+			if (it == wanted.end()) {
+				wanted.insert(std::make_pair(coord, distance));
+			} else if (distance < it->second) {
+				it->second = distance;
+			}
+		}
+	}
+}
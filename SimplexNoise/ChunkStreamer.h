@@ -0,0 +1,116 @@
+#pragma once
+/*
+Class: ChunkStreamer
+Description:
+Streams square chunks of NoiseAt samples around any number of moving
+viewers in an unbounded world. Each Update() works out which chunks should
+be resident (everything within the view radius of a viewer, plus everything
+within the view radius of where the viewer will be prefetchSeconds from now)
+and queues the missing ones for the background workers, nearest first.
+
+Finished chunks are handed back through a lock free queue, so the caller's
+main loop only ever does a short, bounded amount of bookkeeping: it never
+waits on generation. Chunks that fall out of range are reported through
+TakeEvicted() so the caller can free whatever it built from them.
+
+Update, PollCompleted and TakeEvicted must all be called from the same
+(main) thread.
+*/
+
+#include "SimplexNoise.h"
+#include "LockFreeQueue.h"
+#include "TileRenderer.h"
+#include <vector>
+#include <map>
+#include <set>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+struct Chunk {
+	Vector2i coord; /*chunk coordinates, sample origin is coord * size*/
+	int size;
+	SampleType type;
+	SampleRange range; /*for quantised types*/
+	std::vector<unsigned char> samples; /*size*size samples of type, row major*/
+
+	double Height(int x, int y) const {
+		return LoadSample(&samples[0], y * size + x, type, range);
+	}
+};
+
+struct Viewer {
+	Vector2d position; /*in samples*/
+	Vector2d velocity; /*in samples per second*/
+
+	Viewer() {}
+	Viewer(const Vector2d& position, const Vector2d& velocity) : position(position), velocity(velocity) {}
+};
+
+class ChunkStreamer {
+public:
+	/*viewRadius is in samples. workers = 0 uses one thread per core, less
+	one for the caller. Chunks are stored as type, SAMPLE_F16 keeps a quarter
+	of the memory of the default doubles*/
+	ChunkStreamer(const SimplexNoise& noise, int chunkSize, double viewRadius,
+		double prefetchSeconds = 1.0, int workers = 0, SampleType type = SAMPLE_F64);
+	~ChunkStreamer();
+
+	void Update(const std::vector<Viewer>& viewers);
+
+	/*Returns the next finished chunk (caller takes ownership), or null if
+	nothing has completed since the last call*/
+	std::unique_ptr<Chunk> PollCompleted();
+
+	/*Moves the coordinates of chunks dropped since the last call into out*/
+	void TakeEvicted(std::vector<Vector2i>& out);
+
+	int ChunkSize() const { return chunkSize; }
+	size_t PendingCount() const;
+
+private:
+	struct CoordLess {
+		bool operator()(const Vector2i& a, const Vector2i& b) const {
+			return a.x < b.x || (a.x == b.x && a.y < b.y);
+		}
+	};
+
+	struct Request {
+		Vector2i coord;
+		double priority; /*lower is sooner*/
+	};
+
+	static const size_t COMPLETION_CAPACITY = 1024;
+
+	void WorkerLoop();
+	void Generate(Chunk& chunk) const;
+	bool Wanted(const Vector2i& coord, double radius) const;
+	void AddWanted(std::map<Vector2i, double, CoordLess>& wanted, const Vector2d& centre, double penalty) const;
+
+	SimplexNoise noise;
+	int chunkSize;
+	SampleType type;
+	SampleRange range;
+	double viewRadius;
+	double prefetchSeconds;
+
+	/*Main thread only*/
+	std::set<Vector2i, CoordLess> resident;
+	std::vector<Viewer> viewers;
+	std::vector<Vector2i> evicted;
+
+	/*Shared with the workers, guarded by queueMutex*/
+	mutable std::mutex queueMutex;
+	std::condition_variable queueSignal;
+	std::vector<Request> queue; /*sorted so the highest priority is at the back*/
+	std::set<Vector2i, CoordLess> inFlight;
+	std::atomic<bool> stopping; /*also polled without the lock while backing off*/
+
+	LockFreeQueue<Chunk*> completed;
+	std::vector<std::thread> workers;
+
+	ChunkStreamer(const ChunkStreamer&);
+	ChunkStreamer& operator=(const ChunkStreamer&);
+};
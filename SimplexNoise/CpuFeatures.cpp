@@ -0,0 +1,69 @@
+#include "CpuFeatures.h"
+
+#ifdef SIMD_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+namespace {
+#ifdef SIMD_X86
+	void CpuId(int leaf, int subleaf, unsigned regs[4]) {
+#ifdef _MSC_VER
+		int r[4];
+		__cpuidex(r, leaf, subleaf);
+		for (int i = 0; i < 4; ++i) regs[i] = (unsigned)r[i];
+#else
+		__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+	}
+
+	/*XCR0, tells whether the OS saves the AVX state on context switches*/
+	unsigned long long ReadXcr0() {
+#ifdef _MSC_VER
+		return _xgetbv(0);
+#else
+		unsigned eax, edx;
+		__asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+		return ((unsigned long long)edx << 32) | eax;
+#endif
+	}
+#endif
+
+	CpuFeatures Detect() {
+		CpuFeatures f = { false, false, false, false, false, false, false };
+#ifdef SIMD_X86
+		unsigned regs[4];
+		CpuId(0, 0, regs);
+		unsigned maxLeaf = regs[0];
+		if (maxLeaf < 1) return f;
+
+		CpuId(1, 0, regs);
+		f.sse2 = (regs[3] & (1u << 26)) != 0;
+		f.ssse3 = (regs[2] & (1u << 9)) != 0;
+		f.sse41 = (regs[2] & (1u << 19)) != 0;
+		bool osxsave = (regs[2] & (1u << 27)) != 0;
+		bool avx = (regs[2] & (1u << 28)) != 0;
+		bool f16c = (regs[2] & (1u << 29)) != 0;
+		bool fma = (regs[2] & (1u << 12)) != 0;
+
+		/*XMM and YMM state both enabled by the OS*/
+		f.avx = avx && osxsave && (ReadXcr0() & 6) == 6;
+		f.f16c = f.avx && f16c;
+		f.fma = f.avx && fma;
+		if (f.avx && maxLeaf >= 7) {
+			CpuId(7, 0, regs);
+			f.avx2 = (regs[1] & (1u << 5)) != 0;
+		}
+#endif
+		return f;
+	}
+
+	const CpuFeatures features = Detect();
+}
+
+const CpuFeatures& Cpu() {
+	return features;
+}
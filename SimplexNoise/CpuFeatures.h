@@ -0,0 +1,30 @@
+#pragma once
+/*
+Runtime detection of the instruction set extensions used by the vectorised
+kernels. Kernels are compiled for their target with SIMD_TARGET (a no-op on
+MSVC, which allows any intrinsic anywhere) and only called when Cpu() says
+the running processor and OS support them.
+*/
+
+#if defined(__GNUC__) || defined(__clang__)
+#define SIMD_TARGET(isa) __attribute__((target(isa)))
+#else
+#define SIMD_TARGET(isa)
+#endif
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86 1
+#endif
+
+struct CpuFeatures {
+	bool sse2;
+	bool ssse3;
+	bool sse41;
+	bool avx;   /*includes OS support for saving the YMM registers*/
+	bool avx2;
+	bool f16c;
+	bool fma;
+};
+
+/*Detected once at startup*/
+const CpuFeatures& Cpu();
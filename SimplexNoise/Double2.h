@@ -0,0 +1,153 @@
+#pragma once
+/*
+Class: Double2
+Description:
+Two doubles packed in one SSE2 register, with the arithmetic, comparison and
+rounding functions of a double, so that the Vector2/Vector3 templates work
+on it unchanged: a Vector2<Double2> holds two points and every operator on
+it handles both at once. Each operation rounds exactly as the scalar double
+operation does, so a kernel written against the vector API gives the same
+bits whether it runs on double or on Double2.
+
+Comparisons return a lane mask, all ones where true, for Select to blend
+with. Code that has to work on both double and Double2 uses the overloads
+at the bottom of this file (LaneCount, StoreLanes, LoadLanes, Select),
+which also have trivial double versions.
+
+Only defined, as SIMD_DOUBLE2, where SSE2 can be compiled without a target
+attribute: MSVC on x86/x64 (VS2012 builds x86 with /arch:SSE2 by default)
+and GCC/Clang with SSE2 enabled, which x86-64 always is. Callers should
+still check Cpu().sse2 before taking a Double2 path.
+*/
+
+#include "CpuFeatures.h"
+
+#if defined(SIMD_X86) && (defined(_MSC_VER) || defined(__SSE2__))
+#define SIMD_DOUBLE2 1
+#include <emmintrin.h>
+
+class Double2 {
+public:
+	__m128d v;
+
+	static const int LANES = 2;
+
+	Double2() : v(_mm_setzero_pd()) {}
+	Double2(double s) : v(_mm_set1_pd(s)) {}
+	Double2(double a, double b) : v(_mm_setr_pd(a, b)) {}
+	Double2(__m128d v) : v(v) {}
+
+	/*Unaligned load/store of two consecutive doubles*/
+	static Double2 Load(const double* p) {
+		return Double2(_mm_loadu_pd(p));
+	}
+	void Store(double* p) const {
+		_mm_storeu_pd(p, v);
+	}
+
+	/*Compound arithmetic*/
+	Double2& operator+=(const Double2& b) {
+		v = _mm_add_pd(v, b.v);
+		return *this;
+	}
+	Double2& operator-=(const Double2& b) {
+		v = _mm_sub_pd(v, b.v);
+		return *this;
+	}
+	Double2& operator*=(const Double2& b) {
+		v = _mm_mul_pd(v, b.v);
+		return *this;
+	}
+	Double2& operator/=(const Double2& b) {
+		v = _mm_div_pd(v, b.v);
+		return *this;
+	}
+};
+
+/*Binary arithmetic, doubles convert to both lanes*/
+
+inline Double2 operator+(const Double2& a, const Double2& b) {
+	return Double2(_mm_add_pd(a.v, b.v));
+}
+inline Double2 operator-(const Double2& a, const Double2& b) {
+	return Double2(_mm_sub_pd(a.v, b.v));
+}
+inline Double2 operator*(const Double2& a, const Double2& b) {
+	return Double2(_mm_mul_pd(a.v, b.v));
+}
+inline Double2 operator/(const Double2& a, const Double2& b) {
+	return Double2(_mm_div_pd(a.v, b.v));
+}
+inline Double2 operator-(const Double2& a) {
+	return Double2(_mm_xor_pd(a.v, _mm_set1_pd(-0.0)));
+}
+
+/*Lane mask comparisons*/
+
+inline Double2 operator<(const Double2& a, const Double2& b) {
+	return Double2(_mm_cmplt_pd(a.v, b.v));
+}
+inline Double2 operator>(const Double2& a, const Double2& b) {
+	return Double2(_mm_cmpgt_pd(a.v, b.v));
+}
+inline Double2 operator<=(const Double2& a, const Double2& b) {
+	return Double2(_mm_cmple_pd(a.v, b.v));
+}
+inline Double2 operator>=(const Double2& a, const Double2& b) {
+	return Double2(_mm_cmpge_pd(a.v, b.v));
+}
+
+/*mask ? a : b per lane, mask being the result of a comparison*/
+inline Double2 Select(const Double2& mask, const Double2& a, const Double2& b) {
+	return Double2(_mm_or_pd(_mm_and_pd(mask.v, a.v), _mm_andnot_pd(mask.v, b.v)));
+}
+
+/*a < b ? a : b and a > b ? a : b per lane, like the SSE2 instructions*/
+inline Double2 Min(const Double2& a, const Double2& b) {
+	return Double2(_mm_min_pd(a.v, b.v));
+}
+inline Double2 Max(const Double2& a, const Double2& b) {
+	return Double2(_mm_max_pd(a.v, b.v));
+}
+
+inline Double2 sqrt(const Double2& a) {
+	return Double2(_mm_sqrt_pd(a.v));
+}
+
+inline Double2 fabs(const Double2& a) {
+	return Double2(_mm_andnot_pd(_mm_set1_pd(-0.0), a.v));
+}
+
+/*Floor by truncating to int and stepping down where that rounded up, which
+SSE2 can do without roundpd. Exact for |a| < 2^31, the range in which the
+noise kernels cast their cell coordinates to int anyway*/
+inline Double2 floor(const Double2& a) {
+	__m128d t = _mm_cvtepi32_pd(_mm_cvttpd_epi32(a.v));
+	return Double2(_mm_sub_pd(t, _mm_and_pd(_mm_cmpgt_pd(t, a.v), _mm_set1_pd(1.0))));
+}
+
+inline int LaneCount(const Double2&) {
+	return Double2::LANES;
+}
+inline void StoreLanes(const Double2& a, double* lanes) {
+	_mm_storeu_pd(lanes, a.v);
+}
+inline void LoadLanes(Double2& a, const double* lanes) {
+	a.v = _mm_loadu_pd(lanes);
+}
+#endif
+
+/*Scalar versions of the lane helpers, so one kernel compiles for both*/
+
+inline double Select(bool mask, double a, double b) {
+	return mask ? a : b;
+}
+inline int LaneCount(double) {
+	return 1;
+}
+inline void StoreLanes(double a, double* lanes) {
+	lanes[0] = a;
+}
+inline void LoadLanes(double& a, const double* lanes) {
+	a = lanes[0];
+}
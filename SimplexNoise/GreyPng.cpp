@@ -0,0 +1,287 @@
+#include "GreyPng.h"
+#include "CpuFeatures.h"
+#include "lodepng.h"
+#include "MappedFile.h"
+#include <cstdio>
+
+#ifdef SIMD_X86
+#include <emmintrin.h>
+#endif
+
+namespace {
+	template <typename T>
+	void QuantizeGrey16RowScalar(const T* in, unsigned char* out, size_t count, double offset, double inv) {
+		for (size_t i = 0; i < count; ++i) {
+			double v = (in[i] - offset) * inv + 0.5;
+			if (v < 0.0) v = 0.0;
+			if (v > 65535.0) v = 65535.0;
+			unsigned short q = (unsigned short)v;
+			out[2*i] = (unsigned char)(q >> 8);
+			out[2*i+1] = (unsigned char)(q & 255);
+		}
+	}
+
+#ifdef SIMD_X86
+	/*Two doubles to two clamped, truncated ints in the low half. Same operation
+	order as the scalar loop, so the results match bit for bit*/
+	SIMD_TARGET("sse2")
+	inline __m128i QuantizePair(__m128d v, __m128d offset, __m128d inv) {
+		v = _mm_add_pd(_mm_mul_pd(_mm_sub_pd(v, offset), inv), _mm_set1_pd(0.5));
+		v = _mm_min_pd(_mm_max_pd(v, _mm_setzero_pd()), _mm_set1_pd(65535.0));
+		return _mm_cvttpd_epi32(v);
+	}
+
+	/*Eight ints in 0..65535 to eight big endian u16. packs saturates signed,
+	so the values are biased into the signed range and back*/
+	SIMD_TARGET("sse2")
+	inline void StoreGrey16(unsigned char* out, __m128i lo, __m128i hi) {
+		const __m128i bias = _mm_set1_epi32(32768);
+		__m128i packed = _mm_packs_epi32(_mm_sub_epi32(lo, bias), _mm_sub_epi32(hi, bias));
+		packed = _mm_xor_si128(packed, _mm_set1_epi16((short)0x8000));
+		packed = _mm_or_si128(_mm_slli_epi16(packed, 8), _mm_srli_epi16(packed, 8));
+		_mm_storeu_si128((__m128i*)out, packed);
+	}
+
+	SIMD_TARGET("sse2")
+	void QuantizeGrey16RowSSE2(const double* in, unsigned char* out, size_t count, double offset, double inv) {
+		__m128d voffset = _mm_set1_pd(offset);
+		__m128d vinv = _mm_set1_pd(inv);
+		size_t i = 0;
+		for (; i + 8 <= count; i += 8) {
+			__m128i a = QuantizePair(_mm_loadu_pd(in + i), voffset, vinv);
+			__m128i b = QuantizePair(_mm_loadu_pd(in + i + 2), voffset, vinv);
+			__m128i c = QuantizePair(_mm_loadu_pd(in + i + 4), voffset, vinv);
+			__m128i d = QuantizePair(_mm_loadu_pd(in + i + 6), voffset, vinv);
+			StoreGrey16(out + 2*i, _mm_unpacklo_epi64(a, b), _mm_unpacklo_epi64(c, d));
+		}
+		QuantizeGrey16RowScalar(in + i, out + 2*i, count - i, offset, inv);
+	}
+
+	SIMD_TARGET("sse2")
+	void QuantizeGrey16RowSSE2(const float* in, unsigned char* out, size_t count, double offset, double inv) {
+		__m128d voffset = _mm_set1_pd(offset);
+		__m128d vinv = _mm_set1_pd(inv);
+		size_t i = 0;
+		for (; i + 8 <= count; i += 8) {
+			__m128 f0 = _mm_loadu_ps(in + i);
+			__m128 f1 = _mm_loadu_ps(in + i + 4);
+			__m128i a = QuantizePair(_mm_cvtps_pd(f0), voffset, vinv);
+			__m128i b = QuantizePair(_mm_cvtps_pd(_mm_movehl_ps(f0, f0)), voffset, vinv);
+			__m128i c = QuantizePair(_mm_cvtps_pd(f1), voffset, vinv);
+			__m128i d = QuantizePair(_mm_cvtps_pd(_mm_movehl_ps(f1, f1)), voffset, vinv);
+			StoreGrey16(out + 2*i, _mm_unpacklo_epi64(a, b), _mm_unpacklo_epi64(c, d));
+		}
+		QuantizeGrey16RowScalar(in + i, out + 2*i, count - i, offset, inv);
+	}
+
+	/*SAMPLE_U16 samples are in host order, PNG wants big endian*/
+	SIMD_TARGET("sse2")
+	size_t Grey16FromU16SSE2(const unsigned short* in, unsigned char* out, size_t count) {
+		size_t i = 0;
+		for (; i + 8 <= count; i += 8) {
+			__m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+			_mm_storeu_si128((__m128i*)(out + 2*i), _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+		}
+		return i;
+	}
+#endif
+
+	template <typename T>
+	void QuantizeGrey16(const T* in, unsigned char* out, size_t count, const SampleRange& range) {
+		double inv = 1.0 / range.scale;
+#ifdef SIMD_X86
+		if (Cpu().sse2) {
+			QuantizeGrey16RowSSE2(in, out, count, range.offset, inv);
+			return;
+		}
+#endif
+		QuantizeGrey16RowScalar(in, out, count, range.offset, inv);
+	}
+
+	template <typename T>
+	unsigned EncodeHeights(std::vector<unsigned char>& png, const T* heights, unsigned width, unsigned height,
+		const SampleRange& range, unsigned threads) {
+		size_t count = (size_t)width * height;
+		std::vector<unsigned char> grey16(count * 2 + 1); /*+1 keeps &grey16[0] valid for empty images*/
+		QuantizeGrey16(heights, &grey16[0], count, range);
+		return EncodeGrey16Png(png, &grey16[0], width, height, threads);
+	}
+
+	void SetGrey16Modes(lodepng::State& state) {
+		state.info_raw.colortype = LCT_GREY;
+		state.info_raw.bitdepth = 16;
+		state.info_png.color.colortype = LCT_GREY;
+		state.info_png.color.bitdepth = 16;
+		state.encoder.auto_convert = LAC_NO;
+	}
+
+	/*LodePNGSink writing to a FILE*, 79 like lodepng_save_file when it fails*/
+	unsigned WriteToFile(void* context, const unsigned char* data, size_t size) {
+		return fwrite(data, 1, size, (FILE*)context) == size ? 0 : 79;
+	}
+
+	struct HeightRows {
+		std::vector<double>* heights;
+		const SampleRange* range;
+	};
+
+	/*LodePNGRowSink turning big endian grey16 rows back into heights*/
+	unsigned DequantizeGrey16Row(void* context, unsigned y, const unsigned char* row, size_t size) {
+		HeightRows& rows = *(HeightRows*)context;
+		size_t count = size / 2;
+		double* out = &(*rows.heights)[0] + (size_t)y * count;
+		for (size_t i = 0; i < count; ++i) {
+			out[i] = ((row[2*i] << 8) | row[2*i+1]) * rows.range->scale + rows.range->offset;
+		}
+		return 0;
+	}
+}
+
+void QuantizeGrey16Row(const double* in, unsigned char* out, size_t count, const SampleRange& range) {
+	QuantizeGrey16(in, out, count, range);
+}
+
+void QuantizeGrey16Row(const float* in, unsigned char* out, size_t count, const SampleRange& range) {
+	QuantizeGrey16(in, out, count, range);
+}
+
+void Grey16FromU16Row(const unsigned short* in, unsigned char* out, size_t count) {
+	size_t i = 0;
+#ifdef SIMD_X86
+	if (Cpu().sse2) i = Grey16FromU16SSE2(in, out, count);
+#endif
+	for (; i < count; ++i) {
+		out[2*i] = (unsigned char)(in[i] >> 8);
+		out[2*i+1] = (unsigned char)(in[i] & 255);
+	}
+}
+
+SampleRange Grey16Range(double min, double max) {
+	double span = max > min ? max - min : 1.0;
+	return SampleRange(span / 65535.0, min);
+}
+
+Grey16PngEncoder::Grey16PngEncoder(unsigned threads, bool preview) {
+	SetGrey16Modes(state);
+	state.encoder.zlibsettings.threads = threads;
+	if (preview) state.encoder.zlibsettings.btype = 3;
+}
+
+unsigned Grey16PngEncoder::Encode(std::vector<unsigned char>& png, const unsigned char* grey16,
+	unsigned width, unsigned height) {
+	/*encoding into the vector itself saves copying the PNG out of lodepng*/
+	size_t size = 0;
+	png.resize(Bound(width, height));
+	unsigned error = Encode(&png[0], png.size(), size, grey16, width, height);
+	png.resize(size);
+	return error;
+}
+
+unsigned Grey16PngEncoder::Encode(unsigned char* png, size_t capacity, size_t& size, const unsigned char* grey16,
+	unsigned width, unsigned height) {
+	return lodepng_encode_to_buffer(png, capacity, &size, grey16, width, height, &state);
+}
+
+unsigned Grey16PngEncoder::Encode(LodePNGSink sink, void* context, const unsigned char* grey16,
+	unsigned width, unsigned height) {
+	return lodepng_encode_to_sink(sink, context, grey16, width, height, &state);
+}
+
+size_t Grey16PngEncoder::Bound(unsigned width, unsigned height) const {
+	return lodepng_encode_bound(width, height, &state);
+}
+
+unsigned EncodeGrey16Png(std::vector<unsigned char>& png, const unsigned char* grey16, unsigned width, unsigned height,
+	unsigned threads) {
+	Grey16PngEncoder encoder(threads);
+	return encoder.Encode(png, grey16, width, height);
+}
+
+unsigned EncodeGrey16Png(std::vector<unsigned char>& png, const double* heights, unsigned width, unsigned height,
+	const SampleRange& range, unsigned threads) {
+	return EncodeHeights(png, heights, width, height, range, threads);
+}
+
+unsigned EncodeGrey16Png(std::vector<unsigned char>& png, const float* heights, unsigned width, unsigned height,
+	const SampleRange& range, unsigned threads) {
+	return EncodeHeights(png, heights, width, height, range, threads);
+}
+
+unsigned EncodeGrey16Png(std::vector<unsigned char>& png, const unsigned short* samples, unsigned width, unsigned height,
+	unsigned threads) {
+	size_t count = (size_t)width * height;
+	std::vector<unsigned char> grey16(count * 2 + 1);
+	Grey16FromU16Row(samples, &grey16[0], count);
+	return EncodeGrey16Png(png, &grey16[0], width, height, threads);
+}
+
+unsigned SaveGrey16Png(const std::string& filename, const double* heights, unsigned width, unsigned height,
+	const SampleRange& range, unsigned threads, bool preview) {
+	size_t count = (size_t)width * height;
+	std::vector<unsigned char> grey16(count * 2 + 1);
+	QuantizeGrey16(heights, &grey16[0], count, range);
+
+	FILE* file = fopen(filename.c_str(), "wb");
+	if (!file) return 79;
+	Grey16PngEncoder encoder(threads, preview);
+	unsigned error = encoder.Encode(WriteToFile, file, &grey16[0], width, height);
+	if (fclose(file) != 0 && !error) error = 79;
+	return error;
+}
+
+unsigned StreamGrey16Png(const std::string& filename, const SimplexNoise& noise, int x0, int y0,
+	unsigned width, unsigned height, const SampleRange& range, unsigned bandRows) {
+	FILE* file = fopen(filename.c_str(), "wb");
+	if (!file) return 79;
+	if (bandRows == 0) bandRows = 1;
+
+	lodepng::State state;
+	SetGrey16Modes(state);
+	LodePNGStreamEncoder stream;
+	unsigned error = lodepng_stream_begin(&stream, width, height, &state, WriteToFile, file);
+
+	std::vector<double> heights((size_t)width * bandRows + 1);
+	std::vector<unsigned char> grey16(heights.size() * 2);
+	for (unsigned y = 0; y < height && !error; y += bandRows) {
+		unsigned rows = height - y < bandRows ? height - y : bandRows;
+		size_t count = (size_t)width * rows;
+		RenderTile(noise, x0, y0 + (int)y, width, rows, SAMPLE_F64, &heights[0], width * sizeof(double));
+		QuantizeGrey16Row(&heights[0], &grey16[0], count, range);
+		error = lodepng_stream_write_rows(&stream, &grey16[0], rows);
+	}
+	if (!error) error = lodepng_stream_finish(&stream);
+	lodepng_stream_cleanup(&stream);
+
+	if (fclose(file) != 0 && !error) error = 79;
+	return error;
+}
+
+unsigned LoadGrey16Png(const std::string& filename, unsigned& width, unsigned& height,
+	LodePNGRowSink sink, void* context) {
+	MappedFile file;
+	if (!file.Open(filename)) return 78;
+	if (file.Size() != (size_t)file.Size()) return 78; /*larger than the address space*/
+
+	lodepng::State state;
+	state.info_raw.colortype = LCT_GREY;
+	state.info_raw.bitdepth = 16;
+	return lodepng_decode_rows(sink, context, &width, &height, &state, file.Data(), (size_t)file.Size());
+}
+
+unsigned LoadGrey16Png(const std::string& filename, std::vector<double>& heights, unsigned& width, unsigned& height,
+	const SampleRange& range) {
+	MappedFile file;
+	if (!file.Open(filename)) return 78;
+	if (file.Size() != (size_t)file.Size()) return 78;
+
+	/*the header gives the size up front, so the heights are allocated once*/
+	lodepng::State state;
+	state.info_raw.colortype = LCT_GREY;
+	state.info_raw.bitdepth = 16;
+	unsigned error = lodepng_inspect(&width, &height, &state, file.Data(), (size_t)file.Size());
+	if (error) return error;
+	heights.resize((size_t)width * height);
+
+	HeightRows rows = { &heights, &range };
+	return lodepng_decode_rows(DequantizeGrey16Row, &rows, &width, &height, &state, file.Data(), (size_t)file.Size());
+}
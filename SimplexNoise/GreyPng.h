@@ -0,0 +1,107 @@
+#pragma once
+/*
+16 bit greyscale PNG export for noise buffers. Heights are quantised with a
+SampleRange straight into big endian LCT_GREY/16 scanlines (the byte order
+PNG stores) and handed to lodepng with the raw and output colour modes equal
+and auto_convert off, so the encoder neither converts nor profiles the
+pixels. Compared to the 8 bit RGBA image main.cpp used to build, this hands
+lodepng half the bytes, skips its RGBA to grey conversion pass and keeps 256
+times the height resolution.
+
+StreamGrey16Png renders and encodes a band of rows at a time through
+lodepng's streaming encoder, so images far larger than memory can be
+written: it holds one band of heights, the deflate window and one 128KB
+piece of compressed output whatever the image size.
+
+LoadGrey16Png goes the other way: it maps the file and has lodepng decode
+it a row at a time, straight from the mapping, so besides the file's pages
+it needs the 160KB inflate window and a few rows whatever the image size.
+*/
+
+#include "TileRenderer.h"
+#include "lodepng.h"
+#include <vector>
+#include <string>
+#include <cstddef>
+
+/*Quantises count heights to round((h - range.offset) / range.scale), clamped
+to 0..65535, written as big endian pairs. Uses SSE2 when available and gives
+the same bytes as the scalar loop (and as SAMPLE_U16 after a byte swap)*/
+void QuantizeGrey16Row(const double* in, unsigned char* out, size_t count, const SampleRange& range);
+void QuantizeGrey16Row(const float* in, unsigned char* out, size_t count, const SampleRange& range);
+
+/*Writes count host order samples, such as SAMPLE_U16 tiles, as big endian
+pairs. Uses SSE2 when available*/
+void Grey16FromU16Row(const unsigned short* in, unsigned char* out, size_t count);
+
+/*Range that maps [min, max] onto the full 16 bit grey scale*/
+SampleRange Grey16Range(double min, double max);
+
+/*Encodes width*height big endian grey16 samples, as made by QuantizeGrey16Row.
+threads is passed to lodepng's parallel deflate, 0 uses every hardware thread.
+Returns a lodepng error code, 0 on success*/
+unsigned EncodeGrey16Png(std::vector<unsigned char>& png, const unsigned char* grey16, unsigned width, unsigned height,
+	unsigned threads = 0);
+
+/*Encodes grey16 scanlines like EncodeGrey16Png, keeping lodepng's state, and
+with it the encoder's scratch memory, from one image to the next. Encoding
+many images of one size then makes no heap allocations after the first,
+given a png vector that is reused too. One encoder per thread.
+
+preview uses lodepng's adaptive block type, which picks stored or Huffman
+only blocks for noise that LZ77 finds nothing in, several times faster than
+the default for a fraction of a percent in size; see BenchmarkAdaptiveDeflate*/
+class Grey16PngEncoder {
+public:
+	explicit Grey16PngEncoder(unsigned threads = 0, bool preview = false);
+
+	unsigned Encode(std::vector<unsigned char>& png, const unsigned char* grey16, unsigned width, unsigned height);
+	/*Encodes straight into capacity bytes at png, such as a slot of an archive,
+	and sets size to the bytes used. Bound(width, height) bytes always suffice;
+	with less, error 94 means the PNG didn't fit*/
+	unsigned Encode(unsigned char* png, size_t capacity, size_t& size, const unsigned char* grey16,
+		unsigned width, unsigned height);
+	/*Hands the PNG to sink in one call, see LodePNGSink*/
+	unsigned Encode(LodePNGSink sink, void* context, const unsigned char* grey16, unsigned width, unsigned height);
+
+	/*Largest PNG a width*height image can encode to*/
+	size_t Bound(unsigned width, unsigned height) const;
+
+private:
+	lodepng::State state;
+};
+
+/*Quantises and encodes a row major buffer of heights*/
+unsigned EncodeGrey16Png(std::vector<unsigned char>& png, const double* heights, unsigned width, unsigned height,
+	const SampleRange& range, unsigned threads = 0);
+unsigned EncodeGrey16Png(std::vector<unsigned char>& png, const float* heights, unsigned width, unsigned height,
+	const SampleRange& range, unsigned threads = 0);
+
+/*Encodes SAMPLE_U16 samples, already quantised, as they are*/
+unsigned EncodeGrey16Png(std::vector<unsigned char>& png, const unsigned short* samples, unsigned width, unsigned height,
+	unsigned threads = 0);
+
+/*Quantises and encodes like EncodeGrey16Png, writing the PNG to the file as
+it leaves the encoder*/
+unsigned SaveGrey16Png(const std::string& filename, const double* heights, unsigned width, unsigned height,
+	const SampleRange& range, unsigned threads = 0, bool preview = false);
+
+/*Renders NoiseAt(x0 + i, y0 + j) over width*height samples bandRows rows at
+a time and streams them to filename as a grey16 PNG. The decoded pixels are
+the same as SaveGrey16Png's for the same heights; the file differs only in
+how the deflate stream is split into blocks and IDAT chunks. Deflate runs on
+the calling thread*/
+unsigned StreamGrey16Png(const std::string& filename, const SimplexNoise& noise, int x0, int y0,
+	unsigned width, unsigned height, const SampleRange& range, unsigned bandRows = 64);
+
+/*Decodes the PNG in filename as grey16, whatever its colour type, handing
+each row to sink as width big endian samples (see LodePNGRowSink). The file
+is memory mapped and read in place. The image must not be interlaced.
+Returns a lodepng error code, 78 if the file can't be mapped*/
+unsigned LoadGrey16Png(const std::string& filename, unsigned& width, unsigned& height,
+	LodePNGRowSink sink, void* context);
+
+/*Loads a grey16 PNG back into heights, h = sample * range.scale + range.offset,
+the inverse of SaveGrey16Png up to its quantisation*/
+unsigned LoadGrey16Png(const std::string& filename, std::vector<double>& heights, unsigned& width, unsigned& height,
+	const SampleRange& range);
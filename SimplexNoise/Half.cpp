@@ -0,0 +1,90 @@
+#include "Half.h"
+#include "CpuFeatures.h"
+
+#ifdef SIMD_X86
+#include <immintrin.h>
+#endif
+
+namespace {
+	void FloatToHalfRowScalar(const float* in, half* out, size_t count) {
+		for (size_t i = 0; i < count; ++i) {
+			out[i] = FloatToHalf(in[i]);
+		}
+	}
+
+	void DoubleToHalfRowScalar(const double* in, half* out, size_t count) {
+		for (size_t i = 0; i < count; ++i) {
+			out[i] = FloatToHalf((float)in[i]);
+		}
+	}
+
+	void HalfToFloatRowScalar(const half* in, float* out, size_t count) {
+		for (size_t i = 0; i < count; ++i) {
+			out[i] = HalfToFloat(in[i]);
+		}
+	}
+
+#ifdef SIMD_X86
+	SIMD_TARGET("avx,f16c")
+	void FloatToHalfRowF16C(const float* in, half* out, size_t count) {
+		size_t i = 0;
+		for (; i + 8 <= count; i += 8) {
+			__m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(in + i), _MM_FROUND_TO_NEAREST_INT);
+			_mm_storeu_si128((__m128i*)(out + i), h);
+		}
+		FloatToHalfRowScalar(in + i, out + i, count - i);
+	}
+
+	SIMD_TARGET("avx,f16c")
+	void DoubleToHalfRowF16C(const double* in, half* out, size_t count) {
+		size_t i = 0;
+		for (; i + 8 <= count; i += 8) {
+			__m128 lo = _mm256_cvtpd_ps(_mm256_loadu_pd(in + i));
+			__m128 hi = _mm256_cvtpd_ps(_mm256_loadu_pd(in + i + 4));
+			__m256 f = _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+			_mm_storeu_si128((__m128i*)(out + i), _mm256_cvtps_ph(f, _MM_FROUND_TO_NEAREST_INT));
+		}
+		DoubleToHalfRowScalar(in + i, out + i, count - i);
+	}
+
+	SIMD_TARGET("avx,f16c")
+	void HalfToFloatRowF16C(const half* in, float* out, size_t count) {
+		size_t i = 0;
+		for (; i + 8 <= count; i += 8) {
+			__m128i h = _mm_loadu_si128((const __m128i*)(in + i));
+			_mm256_storeu_ps(out + i, _mm256_cvtph_ps(h));
+		}
+		HalfToFloatRowScalar(in + i, out + i, count - i);
+	}
+#endif
+}
+
+void FloatToHalfRow(const float* in, half* out, size_t count) {
+#ifdef SIMD_X86
+	if (Cpu().f16c) {
+		FloatToHalfRowF16C(in, out, count);
+		return;
+	}
+#endif
+	FloatToHalfRowScalar(in, out, count);
+}
+
+void DoubleToHalfRow(const double* in, half* out, size_t count) {
+#ifdef SIMD_X86
+	if (Cpu().f16c) {
+		DoubleToHalfRowF16C(in, out, count);
+		return;
+	}
+#endif
+	DoubleToHalfRowScalar(in, out, count);
+}
+
+void HalfToFloatRow(const half* in, float* out, size_t count) {
+#ifdef SIMD_X86
+	if (Cpu().f16c) {
+		HalfToFloatRowF16C(in, out, count);
+		return;
+	}
+#endif
+	HalfToFloatRowScalar(in, out, count);
+}
@@ -0,0 +1,86 @@
+#pragma once
+/*
+IEEE 754 binary16 (half precision) conversion helpers. Conversions round to
+nearest even and keep infinities, NaNs and subnormals. The row functions use
+F16C (vcvtps2ph/vcvtph2ps) when the CPU has it and the scalar versions below
+otherwise; both give bit identical results apart from NaN payloads.
+
+Accuracy of half heightmaps against NoiseAt:
+A half has an 11 bit significand, so a stored height h is off by at most
+2^-11 * 2^floor(log2|h|), half an ulp. NoiseAt is bounded by AmplitudeSum()
+(1.79 for the default persistence 0.65 and 8 octaves), so:
+	|h| in [1, 2)     error <= 4.9e-4
+	|h| in [0.5, 1)   error <= 2.4e-4
+	|h| in [0.25, .5) error <= 1.2e-4, and so on down to 3e-8 near zero
+That is at worst 1/7300 of the full range, about 13 of the 16 bits a u16
+sample spends uniformly (a u16 error is a flat 2.7e-5 over the same range),
+in exchange for needing no range up front and being far more precise in the
+low lying, mostly flat areas. BenchmarkHalf measures the max and RMS error
+over a default grid. Converting from double goes through float first; near a
+rounding tie this can pick the other neighbour, which adds at most a float
+ulp (2^-24 relative) to the bounds above.
+
+Storage cost is 2 bytes per sample: a quarter of the doubles main.cpp keeps
+and half of a float.
+*/
+
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+
+typedef uint16_t half;
+
+inline half FloatToHalf(float value) {
+	uint32_t f;
+	std::memcpy(&f, &value, sizeof(f));
+	uint32_t sign = (f >> 16) & 0x8000;
+	f &= 0x7fffffff;
+
+	if (f >= 0x47800000) {
+		/*too large for a half, or inf/NaN (NaNs keep a quiet mantissa bit)*/
+		return (half)(sign | (f > 0x7f800000 ? 0x7e00 : 0x7c00));
+	}
+	if (f < 0x38800000) {
+		/*subnormal half (or zero): let the FPU do the rounding by adding 0.5,
+		which lines the half's mantissa up with the float's low bits*/
+		float magic = 0.5f;
+		float v;
+		std::memcpy(&v, &f, sizeof(v));
+		v += magic;
+		std::memcpy(&f, &v, sizeof(f));
+		return (half)(sign | (f - 0x3f000000));
+	}
+	/*normal half: rebias the exponent and round the 13 dropped bits to even*/
+	uint32_t mantOdd = (f >> 13) & 1;
+	f += 0xc8000fff + mantOdd; /*(15 - 127) << 23, plus rounding bias*/
+	return (half)(sign | (f >> 13));
+}
+
+inline float HalfToFloat(half value) {
+	uint32_t sign = (uint32_t)(value & 0x8000) << 16;
+	uint32_t exponent = (value >> 10) & 0x1f;
+	uint32_t mantissa = value & 0x3ff;
+	uint32_t f;
+
+	if (exponent == 0x1f) {
+		f = sign | 0x7f800000 | (mantissa << 13); /*inf/NaN*/
+	} else if (exponent != 0) {
+		f = sign | ((exponent + 112) << 23) | (mantissa << 13);
+	} else if (mantissa != 0) {
+		/*subnormal: value is mantissa * 2^-24*/
+		float v = (float)mantissa * (1.0f / 16777216.0f);
+		std::memcpy(&f, &v, sizeof(f));
+		f |= sign;
+	} else {
+		f = sign;
+	}
+
+	float result;
+	std::memcpy(&result, &f, sizeof(result));
+	return result;
+}
+
+/*Row conversions, runtime dispatched between F16C and the scalar code*/
+void FloatToHalfRow(const float* in, half* out, size_t count);
+void DoubleToHalfRow(const double* in, half* out, size_t count);
+void HalfToFloatRow(const half* in, float* out, size_t count);
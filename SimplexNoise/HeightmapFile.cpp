@@ -0,0 +1,178 @@
+#include "HeightmapFile.h"
+#include "lodepng.h"
+#include <cstring>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+static_assert(sizeof(HeightmapHeader) == 128, "HeightmapHeader is a fixed on disk layout");
+
+namespace {
+	const char MAGIC[4] = { 'S', 'N', 'H', 'M' };
+
+	uint64_t AlignUp(uint64_t value, uint64_t alignment) {
+		return (value + alignment - 1) / alignment * alignment;
+	}
+
+	/*Shared by the render threads, which pull tile indices from next*/
+	struct TileJob {
+		std::atomic<uint32_t> next;
+		uint32_t count;
+		uint32_t tilesX;
+		size_t tileBytes;
+		const SimplexNoise* noise;
+		const HeightmapHeader* header;
+		unsigned char* tiles;
+		uint32_t* crcs;
+	};
+
+	void RenderTiles(TileJob* job) {
+		const HeightmapHeader* header = job->header;
+		SampleType type = (SampleType)header->type;
+		SampleRange range(header->scale, header->offset);
+		size_t rowStride = header->tileSize * SampleSize(type);
+		for (;;) {
+			uint32_t index = job->next++;
+			if (index >= job->count) return;
+			int tx = (int)(index % job->tilesX);
+			int ty = (int)(index / job->tilesX);
+			unsigned char* tile = job->tiles + index * (uint64_t)job->tileBytes;
+			RenderTile(*job->noise, header->originX + tx * (int)header->tileSize, header->originY + ty * (int)header->tileSize,
+				header->tileSize, header->tileSize, type, tile, rowStride, range);
+			job->crcs[index] = lodepng_crc32(tile, job->tileBytes);
+		}
+	}
+}
+
+bool HeightmapWriter::Write(const std::string& filename, const SimplexNoise& noise,
+	int originX, int originY, uint32_t width, uint32_t height,
+	uint32_t tileSize, SampleType type, int threads) {
+	if (width == 0 || height == 0 || tileSize == 0) return false;
+
+	uint32_t tilesX = (width + tileSize - 1) / tileSize;
+	uint32_t tilesY = (height + tileSize - 1) / tileSize;
+	size_t tileBytes = (size_t)tileSize * tileSize * SampleSize(type);
+	uint64_t crcOffset = sizeof(HeightmapHeader);
+	uint64_t dataOffset = AlignUp(crcOffset + (uint64_t)tilesX * tilesY * sizeof(uint32_t), DATA_ALIGNMENT);
+	uint64_t fileSize = dataOffset + (uint64_t)tilesX * tilesY * tileBytes;
+
+	MappedFile file;
+	if (!file.Create(filename, fileSize)) return false;
+
+	HeightmapHeader* header = (HeightmapHeader*)file.Data();
+	std::memset(header, 0, sizeof(HeightmapHeader));
+	std::memcpy(header->magic, MAGIC, sizeof(MAGIC));
+	header->version = VERSION;
+	header->width = width;
+	header->height = height;
+	header->tileSize = tileSize;
+	header->type = type;
+	header->originX = originX;
+	header->originY = originY;
+	header->featureSize = noise.FeatureSize();
+	header->persistence = noise.Persistence();
+	header->octaves = noise.Octaves();
+	header->seed = noise.Seed();
+	SampleRange range = type == SAMPLE_U16 ? SampleRange::ForU16(noise) : SampleRange();
+	header->scale = range.scale;
+	header->offset = range.offset;
+	header->dataOffset = dataOffset;
+	header->crcOffset = crcOffset;
+
+	if (threads <= 0) {
+		threads = (int)std::thread::hardware_concurrency();
+		if (threads < 1) threads = 1;
+	}
+	TileJob job;
+	job.next = 0;
+	job.count = tilesX * tilesY;
+	job.tilesX = tilesX;
+	job.tileBytes = tileBytes;
+	job.noise = &noise;
+	job.header = header;
+	job.tiles = file.Data() + dataOffset;
+	job.crcs = (uint32_t*)(file.Data() + crcOffset);
+	std::vector<std::thread> workers;
+	for (int i = 1; i < threads; ++i) {
+		workers.push_back(std::thread(RenderTiles, &job));
+	}
+	RenderTiles(&job);
+	for (size_t i = 0; i < workers.size(); ++i) {
+		workers[i].join();
+	}
+	return true;
+}
+
+bool HeightmapReader::Open(const std::string& filename) {
+	Close();
+	if (!file.Open(filename)) return false;
+	if (file.Size() < sizeof(HeightmapHeader)) {
+		Close();
+		return false;
+	}
+	const HeightmapHeader* h = (const HeightmapHeader*)file.Data();
+	if (std::memcmp(h->magic, MAGIC, sizeof(MAGIC)) != 0 || h->version == 0 || h->version > HeightmapWriter::VERSION
+		|| h->tileSize == 0 || h->type > SAMPLE_F64) {
+		Close();
+		return false;
+	}
+	/*Everything in 64 bits and compared by division, so that no crafted size
+	or offset can wrap past the checks and point Tile() outside the mapping*/
+	uint64_t sampleSize = SampleSize((SampleType)h->type);
+	uint64_t tx = ((uint64_t)h->width + h->tileSize - 1) / h->tileSize;
+	uint64_t ty = ((uint64_t)h->height + h->tileSize - 1) / h->tileSize;
+	if (h->width == 0 || h->height == 0 || h->dataOffset > file.Size() || h->dataOffset % sampleSize != 0
+		|| (uint64_t)h->tileSize * h->tileSize > file.Size() / sampleSize) {
+		Close();
+		return false;
+	}
+	uint64_t bytes = (uint64_t)h->tileSize * h->tileSize * sampleSize;
+	if ((file.Size() - h->dataOffset) / bytes < tx * ty) {
+		Close();
+		return false;
+	}
+	/*version 1 left crcOffset in the zeroed reserved bytes*/
+	if (h->version >= 2 && h->crcOffset != 0
+		&& (h->crcOffset % sizeof(uint32_t) != 0 || h->crcOffset < sizeof(HeightmapHeader) || h->crcOffset > h->dataOffset
+		|| (h->dataOffset - h->crcOffset) / sizeof(uint32_t) < tx * ty)) {
+		Close();
+		return false;
+	}
+	header = h;
+	tilesX = (uint32_t)tx;
+	tilesY = (uint32_t)ty;
+	tileBytes = (size_t)bytes;
+	return true;
+}
+
+void HeightmapReader::Close() {
+	file.Close();
+	header = 0;
+	tilesX = tilesY = 0;
+	tileBytes = 0;
+}
+
+const void* HeightmapReader::Tile(uint32_t tx, uint32_t ty) const {
+	return file.Data() + header->dataOffset + ((uint64_t)ty * tilesX + tx) * tileBytes;
+}
+
+double HeightmapReader::Sample(uint32_t x, uint32_t y) const {
+	uint32_t ts = header->tileSize;
+	size_t index = (size_t)(y % ts) * ts + x % ts;
+	return LoadSample(Tile(x / ts, y / ts), index, Type(), Range());
+}
+
+bool HeightmapReader::VerifyTile(uint32_t tx, uint32_t ty) const {
+	if (!HasChecksums()) return true;
+	const uint32_t* crcs = (const uint32_t*)(file.Data() + header->crcOffset);
+	return lodepng_crc32((const unsigned char*)Tile(tx, ty), tileBytes) == crcs[(size_t)ty * tilesX + tx];
+}
+
+bool HeightmapReader::Verify() const {
+	for (uint32_t ty = 0; ty < tilesY; ++ty) {
+		for (uint32_t tx = 0; tx < tilesX; ++tx) {
+			if (!VerifyTile(tx, ty)) return false;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,103 @@
+#pragma once
+/*
+Tiled raw heightmap files.
+
+Layout (all values in the byte order of the machine that wrote the file,
+little endian on the x86 targets this project builds for; a file from a
+machine of the other byte order fails Open's version check):
+	HeightmapHeader             128 bytes, see below
+	tile CRCs                   tilesX * tilesY uint32_t at crcOffset (version 2)
+	padding                     up to dataOffset (a multiple of 4096)
+	tiles                       tilesX * tilesY tiles in row major order
+
+Every tile is tileSize*tileSize samples of the header's SampleType, row
+major, including the tiles on the right/bottom edge (their samples beyond
+width/height are rendered but not part of the map). Fixed size tiles mean
+any tile is found with one multiply and sits on a sample aligned offset, so
+a mapped file can be read in place.
+
+HeightmapWriter renders tiles straight into a read/write mapping of the new
+file, HeightmapReader maps it back read only and hands out pointers into the
+mapping: neither side copies sample data.
+
+Version 2 adds a CRC-32 (the zlib/PNG polynomial, lodepng_crc32) of every
+tile's bytes, computed by the render thread that just wrote the tile while
+it is still in cache. Opening a file doesn't check them, as that would read
+the whole file; VerifyTile and Verify do, at checksum speed (several GB/s
+with PCLMULQDQ). Version 1 files have no table and still open.
+*/
+
+#include "SimplexNoise.h"
+#include "TileRenderer.h"
+#include "MappedFile.h"
+#include <cstdint>
+#include <string>
+
+struct HeightmapHeader {
+	char magic[4];          /*"SNHM"*/
+	uint32_t version;
+	uint32_t width;
+	uint32_t height;
+	uint32_t tileSize;
+	uint32_t type;          /*SampleType*/
+	int32_t originX;        /*NoiseAt coordinates of sample (0,0)*/
+	int32_t originY;
+	double featureSize;     /*generator parameters*/
+	double persistence;
+	int32_t octaves;
+	int32_t seed;
+	double scale;           /*SampleRange for quantised types*/
+	double offset;
+	uint64_t dataOffset;    /*byte offset of the first tile*/
+	uint64_t crcOffset;     /*byte offset of the tile CRC table, 0 if there is none*/
+	uint8_t reserved[40];
+};
+
+class HeightmapWriter {
+public:
+	static const uint32_t VERSION = 2;
+	static const uint32_t DATA_ALIGNMENT = 4096;
+
+	/*Renders the width*height region starting at NoiseAt(originX, originY)
+	into filename. threads = 0 uses every core*/
+	static bool Write(const std::string& filename, const SimplexNoise& noise,
+		int originX, int originY, uint32_t width, uint32_t height,
+		uint32_t tileSize, SampleType type, int threads = 0);
+};
+
+class HeightmapReader {
+public:
+	HeightmapReader() : header(0), tilesX(0), tilesY(0), tileBytes(0) {}
+
+	bool Open(const std::string& filename);
+	void Close();
+
+	const HeightmapHeader& Header() const { return *header; }
+	uint32_t Width() const { return header->width; }
+	uint32_t Height() const { return header->height; }
+	uint32_t TileSize() const { return header->tileSize; }
+	uint32_t TilesX() const { return tilesX; }
+	uint32_t TilesY() const { return tilesY; }
+	SampleType Type() const { return (SampleType)header->type; }
+	SampleRange Range() const { return SampleRange(header->scale, header->offset); }
+
+	/*Pointer into the mapping, tileSize*tileSize samples of Type()*/
+	const void* Tile(uint32_t tx, uint32_t ty) const;
+
+	/*Decodes one sample back to a height, for spot checks and tools*/
+	double Sample(uint32_t x, uint32_t y) const;
+
+	/*Whether the file stores tile CRCs (version 2 and later)*/
+	bool HasChecksums() const { return header->version >= 2 && header->crcOffset != 0; }
+	/*Compares a tile, or every tile, against its stored CRC. Files without
+	checksums verify as true*/
+	bool VerifyTile(uint32_t tx, uint32_t ty) const;
+	bool Verify() const;
+
+private:
+	MappedFile file;
+	const HeightmapHeader* header;
+	uint32_t tilesX;
+	uint32_t tilesY;
+	size_t tileBytes;
+};
@@ -0,0 +1,382 @@
+#include "HeightmapPyramid.h"
+#include "TileRenderer.h"
+#include "Half.h"
+#include "GreyPng.h"
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+static_assert(sizeof(PyramidHeader) == 128, "PyramidHeader is a fixed on disk layout");
+static_assert(sizeof(PyramidIndexEntry) == 32, "PyramidIndexEntry is a fixed on disk layout");
+
+namespace {
+	const char MAGIC[4] = { 'S', 'N', 'P', 'Y' };
+	const int MAX_LEVELS = 32;
+
+	/*ceil(size / 2^level)*/
+	uint32_t LevelSize(uint32_t size, uint32_t level) {
+		return ((size - 1) >> level) + 1;
+	}
+
+	uint32_t TileCount(uint32_t size, uint32_t tileSize) {
+		return (uint32_t)(((uint64_t)size + tileSize - 1) / tileSize);
+	}
+
+	bool EntryLess(const PyramidIndexEntry& a, const PyramidIndexEntry& b) {
+		if (a.level != b.level) return a.level < b.level;
+		if (a.ty != b.ty) return a.ty < b.ty;
+		return a.tx < b.tx;
+	}
+
+	/*Filters a finished child tile into quadrant (qx,qy) of its parent*/
+	void Downsample(const float* child, uint32_t tileSize, PyramidFilter filter, float* parent, uint32_t qx, uint32_t qy) {
+		uint32_t halfSize = tileSize / 2;
+		for (uint32_t y = 0; y < halfSize; ++y) {
+			const float* r0 = child + 2 * y * tileSize;
+			const float* r1 = r0 + tileSize;
+			float* out = parent + (qy * halfSize + y) * tileSize + qx * halfSize;
+			switch (filter) {
+			case PYRAMID_BOX:
+				for (uint32_t x = 0; x < halfSize; ++x) {
+					out[x] = (r0[2*x] + r0[2*x+1] + r1[2*x] + r1[2*x+1]) * 0.25f;
+				}
+				break;
+			case PYRAMID_POINT:
+				for (uint32_t x = 0; x < halfSize; ++x) {
+					out[x] = r0[2*x];
+				}
+				break;
+			case PYRAMID_MIN:
+				for (uint32_t x = 0; x < halfSize; ++x) {
+					out[x] = std::min(std::min(r0[2*x], r0[2*x+1]), std::min(r1[2*x], r1[2*x+1]));
+				}
+				break;
+			case PYRAMID_MAX:
+				for (uint32_t x = 0; x < halfSize; ++x) {
+					out[x] = std::max(std::max(r0[2*x], r0[2*x+1]), std::max(r1[2*x], r1[2*x+1]));
+				}
+				break;
+			}
+		}
+	}
+
+	/*Quadrants whose child tile lies wholly outside the map only ever feed
+	parent samples that are outside the map as well, zero them*/
+	void ClearQuadrant(float* parent, uint32_t tileSize, uint32_t qx, uint32_t qy) {
+		uint32_t halfSize = tileSize / 2;
+		for (uint32_t y = 0; y < halfSize; ++y) {
+			std::fill_n(parent + (qy * halfSize + y) * tileSize + qx * halfSize, halfSize, 0.0f);
+		}
+	}
+
+	/*Appends encoded tiles to the output file. Encoding happens on the calling
+	thread, only the file write is serialised*/
+	class TileSink {
+	public:
+		TileSink(FILE* file, const PyramidHeader& header)
+			: file(file), header(header), position(sizeof(PyramidHeader)), failed(false) {}
+
+		bool Write(uint32_t level, uint32_t tx, uint32_t ty, const float* tile,
+			std::vector<unsigned char>& scratch, std::vector<unsigned char>& encoded, Grey16PngEncoder& png) {
+			size_t samples = (size_t)header.tileSize * header.tileSize;
+			const unsigned char* blob = (const unsigned char*)tile;
+			size_t size = samples * sizeof(float);
+
+			if (header.format == PYRAMID_RAW_F16) {
+				scratch.resize(samples * sizeof(half));
+				FloatToHalfRow(tile, (half*)&scratch[0], samples);
+				blob = &scratch[0];
+				size = scratch.size();
+			} else if (header.format == PYRAMID_PNG16) {
+				scratch.resize(samples * 2);
+				QuantizeGrey16Row(tile, &scratch[0], samples, SampleRange(header.scale, header.offset));
+				/*encoded keeps the worst case size, so the tile is encoded in place*/
+				encoded.resize(png.Bound(header.tileSize, header.tileSize));
+				if (png.Encode(&encoded[0], encoded.size(), size, &scratch[0], header.tileSize, header.tileSize)) {
+					failed = true;
+					return false;
+				}
+				blob = &encoded[0];
+			}
+
+			std::lock_guard<std::mutex> lock(mutex);
+			PyramidIndexEntry entry;
+			entry.level = level;
+			entry.tx = tx;
+			entry.ty = ty;
+			entry.reserved = 0;
+			entry.offset = position;
+			entry.size = size;
+			if (std::fwrite(blob, 1, size, file) != size) {
+				failed = true;
+				return false;
+			}
+			position += size;
+			index.push_back(entry);
+			return true;
+		}
+
+		bool Finish(PyramidHeader& finalHeader) {
+			if (failed) return false;
+			std::sort(index.begin(), index.end(), EntryLess);
+			finalHeader.indexOffset = position;
+			finalHeader.tileCount = (uint32_t)index.size();
+			size_t bytes = index.size() * sizeof(PyramidIndexEntry);
+			return std::fwrite(&index[0], 1, bytes, file) == bytes;
+		}
+
+		bool Failed() const { return failed; }
+
+	private:
+		FILE* file;
+		const PyramidHeader& header;
+		uint64_t position;
+		std::vector<PyramidIndexEntry> index;
+		std::mutex mutex;
+		std::atomic<bool> failed; /*set by encoders outside the lock*/
+	};
+
+	struct BuildJob {
+		const SimplexNoise* noise;
+		const PyramidHeader* header;
+		PyramidFilter filter;
+		TileSink* sink;
+		uint32_t tilesX[MAX_LEVELS];
+		uint32_t tilesY[MAX_LEVELS];
+		/*Subtrees rooted at splitLevel are built in parallel*/
+		uint32_t splitLevel;
+		std::atomic<uint32_t> next;
+		/*Finished splitLevel tiles, kept only if there are levels above it*/
+		std::vector<float>* splitTiles;
+	};
+
+	/*Per thread buffers: one tile per level below the one being built, plus
+	encoder scratch*/
+	struct BuildScratch {
+		std::vector<std::vector<float> > levels;
+		std::vector<unsigned char> samples;
+		std::vector<unsigned char> encoded;
+		/*tiles are already encoded concurrently, one deflate thread each*/
+		Grey16PngEncoder png;
+
+		BuildScratch() : png(1) {}
+	};
+
+	/*Builds tile (tx,ty) of level into out, depth first. Each child is written
+	out and filtered into the parent the moment it is complete*/
+	void BuildTile(BuildJob& job, BuildScratch& scratch, uint32_t level, uint32_t tx, uint32_t ty, float* out) {
+		const PyramidHeader& header = *job.header;
+		uint32_t ts = header.tileSize;
+		if (level == 0) {
+			RenderTile(*job.noise, header.originX + (int)(tx * ts), header.originY + (int)(ty * ts),
+				ts, ts, SAMPLE_F32, out, ts * sizeof(float));
+			return;
+		}
+		float* child = &scratch.levels[level - 1][0];
+		for (uint32_t q = 0; q < 4; ++q) {
+			uint32_t qx = q & 1;
+			uint32_t qy = q >> 1;
+			uint32_t cx = 2 * tx + qx;
+			uint32_t cy = 2 * ty + qy;
+			if (cx >= job.tilesX[level - 1] || cy >= job.tilesY[level - 1]) {
+				ClearQuadrant(out, ts, qx, qy);
+				continue;
+			}
+			BuildTile(job, scratch, level - 1, cx, cy, child);
+			job.sink->Write(level - 1, cx, cy, child, scratch.samples, scratch.encoded, scratch.png);
+			Downsample(child, ts, job.filter, out, qx, qy);
+		}
+	}
+
+	void BuildSubtrees(BuildJob* job) {
+		uint32_t ts = job->header->tileSize;
+		uint32_t level = job->splitLevel;
+		uint32_t count = job->tilesX[level] * job->tilesY[level];
+		BuildScratch scratch;
+		scratch.levels.resize(level + 1);
+		for (uint32_t i = 0; i <= level; ++i) {
+			scratch.levels[i].resize((size_t)ts * ts);
+		}
+		for (;;) {
+			uint32_t index = job->next++;
+			if (index >= count) return;
+			uint32_t tx = index % job->tilesX[level];
+			uint32_t ty = index / job->tilesX[level];
+			float* out = job->splitTiles ? &(*job->splitTiles)[(size_t)index * ts * ts] : &scratch.levels[level][0];
+			BuildTile(*job, scratch, level, tx, ty, out);
+			job->sink->Write(level, tx, ty, out, scratch.samples, scratch.encoded, scratch.png);
+		}
+	}
+}
+
+int PyramidBuilder::FullLevelCount(uint32_t width, uint32_t height, uint32_t tileSize) {
+	int levels = 1;
+	while (levels < MAX_LEVELS && (TileCount(LevelSize(width, levels - 1), tileSize) > 1
+		|| TileCount(LevelSize(height, levels - 1), tileSize) > 1)) {
+		++levels;
+	}
+	return levels;
+}
+
+bool PyramidBuilder::Build(const std::string& filename, const SimplexNoise& noise,
+	int originX, int originY, uint32_t width, uint32_t height, const PyramidSettings& settings) {
+	uint32_t ts = settings.tileSize;
+	if (width == 0 || height == 0 || ts < 2 || ts % 2 != 0 || settings.levels > MAX_LEVELS) return false;
+	int levels = settings.levels > 0 ? settings.levels : FullLevelCount(width, height, ts);
+
+	PyramidHeader header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+	header.version = VERSION;
+	header.width = width;
+	header.height = height;
+	header.tileSize = ts;
+	header.levels = levels;
+	header.format = settings.format;
+	header.filter = settings.filter;
+	header.originX = originX;
+	header.originY = originY;
+	header.featureSize = noise.FeatureSize();
+	header.persistence = noise.Persistence();
+	header.octaves = noise.Octaves();
+	header.seed = noise.Seed();
+	SampleRange range = settings.format == PYRAMID_PNG16 ? SampleRange::ForU16(noise) : SampleRange();
+	header.scale = range.scale;
+	header.offset = range.offset;
+
+	FILE* file = std::fopen(filename.c_str(), "wb");
+	if (!file) return false;
+	/*placeholder, rewritten once the index offset is known*/
+	bool ok = std::fwrite(&header, 1, sizeof(header), file) == sizeof(header);
+
+	TileSink sink(file, header);
+	BuildJob job;
+	job.noise = &noise;
+	job.header = &header;
+	job.filter = settings.filter;
+	job.sink = &sink;
+	for (int i = 0; i < levels; ++i) {
+		job.tilesX[i] = TileCount(LevelSize(width, i), ts);
+		job.tilesY[i] = TileCount(LevelSize(height, i), ts);
+	}
+
+	int threads = settings.threads;
+	if (threads <= 0) {
+		threads = (int)std::thread::hardware_concurrency();
+		if (threads < 1) threads = 1;
+	}
+
+	/*Split at the highest level that still has a couple of subtrees per
+	thread. The levels above it are tiny and get built from its tiles
+	afterwards on this thread*/
+	job.splitLevel = 0;
+	for (int i = levels - 1; i >= 0; --i) {
+		if (job.tilesX[i] * job.tilesY[i] >= (uint32_t)(2 * threads)) {
+			job.splitLevel = i;
+			break;
+		}
+	}
+	job.next = 0;
+	std::vector<float> splitTiles;
+	if ((int)job.splitLevel < levels - 1) {
+		splitTiles.resize((size_t)job.tilesX[job.splitLevel] * job.tilesY[job.splitLevel] * ts * ts);
+		job.splitTiles = &splitTiles;
+	} else {
+		job.splitTiles = 0;
+	}
+
+	if (ok) {
+		std::vector<std::thread> workers;
+		for (int i = 1; i < threads; ++i) {
+			workers.push_back(std::thread(BuildSubtrees, &job));
+		}
+		BuildSubtrees(&job);
+		for (size_t i = 0; i < workers.size(); ++i) {
+			workers[i].join();
+		}
+	}
+
+	BuildScratch scratch;
+	std::vector<float> levelTiles;
+	for (int level = job.splitLevel + 1; ok && level < levels; ++level) {
+		levelTiles.assign((size_t)job.tilesX[level] * job.tilesY[level] * ts * ts, 0.0f);
+		for (uint32_t ty = 0; ty < job.tilesY[level]; ++ty) {
+			for (uint32_t tx = 0; tx < job.tilesX[level]; ++tx) {
+				float* out = &levelTiles[((size_t)ty * job.tilesX[level] + tx) * ts * ts];
+				for (uint32_t q = 0; q < 4; ++q) {
+					uint32_t cx = 2 * tx + (q & 1);
+					uint32_t cy = 2 * ty + (q >> 1);
+					if (cx < job.tilesX[level - 1] && cy < job.tilesY[level - 1]) {
+						const float* child = &splitTiles[((size_t)cy * job.tilesX[level - 1] + cx) * ts * ts];
+						Downsample(child, ts, settings.filter, out, q & 1, q >> 1);
+					}
+				}
+				ok = sink.Write(level, tx, ty, out, scratch.samples, scratch.encoded, scratch.png);
+			}
+		}
+		splitTiles.swap(levelTiles);
+	}
+
+	ok = ok && !sink.Failed() && sink.Finish(header);
+	ok = ok && std::fseek(file, 0, SEEK_SET) == 0 && std::fwrite(&header, 1, sizeof(header), file) == sizeof(header);
+	ok = std::fclose(file) == 0 && ok;
+	return ok;
+}
+
+bool PyramidReader::Open(const std::string& filename) {
+	Close();
+	if (!file.Open(filename)) return false;
+	const PyramidHeader* h = (const PyramidHeader*)file.Data();
+	/*The same limits Build puts on its arguments, and an index that lies
+	inside the file, compared so that no crafted offset can wrap*/
+	if (file.Size() < sizeof(PyramidHeader) || std::memcmp(h->magic, MAGIC, sizeof(MAGIC)) != 0
+		|| h->version != PyramidBuilder::VERSION || h->levels == 0 || h->levels > MAX_LEVELS
+		|| h->width == 0 || h->height == 0 || h->tileSize < 2 || h->tileSize % 2 != 0
+		|| h->indexOffset > file.Size()
+		|| (file.Size() - h->indexOffset) / sizeof(PyramidIndexEntry) < h->tileCount) {
+		Close();
+		return false;
+	}
+	header = h;
+	index = (const PyramidIndexEntry*)(file.Data() + h->indexOffset);
+	return true;
+}
+
+void PyramidReader::Close() {
+	file.Close();
+	header = 0;
+	index = 0;
+}
+
+uint32_t PyramidReader::LevelWidth(uint32_t level) const {
+	return LevelSize(header->width, level);
+}
+
+uint32_t PyramidReader::LevelHeight(uint32_t level) const {
+	return LevelSize(header->height, level);
+}
+
+bool PyramidReader::Tile(uint32_t level, uint32_t tx, uint32_t ty, const unsigned char** blob, size_t* size) const {
+	if (level >= header->levels) return false;
+	/*The index is sorted by level then row, so the entry position follows
+	from the tile counts of the levels below*/
+	uint64_t base = 0;
+	for (uint32_t i = 0; i < level; ++i) {
+		base += (uint64_t)TileCount(LevelWidth(i), header->tileSize) * TileCount(LevelHeight(i), header->tileSize);
+	}
+	uint32_t tilesX = TileCount(LevelWidth(level), header->tileSize);
+	uint32_t tilesY = TileCount(LevelHeight(level), header->tileSize);
+	if (tx >= tilesX || ty >= tilesY) return false;
+	uint64_t entry = base + (uint64_t)ty * tilesX + tx;
+	if (entry >= header->tileCount) return false;
+	const PyramidIndexEntry& e = index[entry];
+	if (e.level != level || e.tx != tx || e.ty != ty
+		|| e.offset > file.Size() || e.size > file.Size() - e.offset) return false;
+	*blob = file.Data() + e.offset;
+	*size = (size_t)e.size;
+	return true;
+}
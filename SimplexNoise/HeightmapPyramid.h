@@ -0,0 +1,114 @@
+#pragma once
+/*
+Multi resolution (mipmap) pyramids of a heightmap, built from one render.
+
+Only level 0 is rendered with NoiseAt. The builder walks the level 0 tiles
+in quadtree order and, as each tile finishes, immediately filters it down
+into its quadrant of the parent tile while it is still in cache. Parent
+tiles complete as soon as their fourth child does and cascade upwards the
+same way, so every sample is generated once and read back from memory by no
+one: the coarser levels cost one filter pass over data already in L1/L2.
+
+File layout (native byte order like HeightmapFile; a file from a machine of
+the other byte order fails Open's version check):
+	PyramidHeader               128 bytes
+	tile blobs                  raw samples or a PNG per tile, in build order
+	PyramidIndexEntry[]         one per tile, at header.indexOffset
+
+Level k is ceil(width / 2^k) by ceil(height / 2^k) samples in tiles of
+tileSize*tileSize; edge tiles are full size like in HeightmapFile.
+*/
+
+#include "SimplexNoise.h"
+#include "MappedFile.h"
+#include <cstdint>
+#include <string>
+
+/*How four child samples become one parent sample*/
+enum PyramidFilter {
+	PYRAMID_BOX = 0,   /*mean of the 2x2 block*/
+	PYRAMID_POINT = 1, /*top left sample*/
+	PYRAMID_MIN = 2,   /*lowest of the block, conservative for collision*/
+	PYRAMID_MAX = 3    /*highest of the block, conservative for visibility*/
+};
+
+enum PyramidTileFormat {
+	PYRAMID_RAW_F32 = 0, /*float samples*/
+	PYRAMID_RAW_F16 = 1, /*half samples, see Half.h*/
+	PYRAMID_PNG16 = 2    /*16 bit greyscale PNG, quantised with header scale/offset*/
+};
+
+struct PyramidSettings {
+	int levels;                /*0 = keep halving until the top level is one tile*/
+	uint32_t tileSize;         /*must be even*/
+	PyramidFilter filter;
+	PyramidTileFormat format;
+	int threads;               /*0 = every core*/
+
+	PyramidSettings() : levels(0), tileSize(256), filter(PYRAMID_BOX), format(PYRAMID_RAW_F32), threads(0) {}
+};
+
+struct PyramidHeader {
+	char magic[4];          /*"SNPY"*/
+	uint32_t version;
+	uint32_t width;         /*level 0 size*/
+	uint32_t height;
+	uint32_t tileSize;
+	uint32_t levels;
+	uint32_t format;        /*PyramidTileFormat*/
+	uint32_t filter;        /*PyramidFilter*/
+	int32_t originX;
+	int32_t originY;
+	double featureSize;
+	double persistence;
+	int32_t octaves;
+	int32_t seed;
+	double scale;           /*PNG16 dequantisation: height = stored * scale + offset*/
+	double offset;
+	uint64_t indexOffset;
+	uint32_t tileCount;
+	uint8_t reserved[36];
+};
+
+struct PyramidIndexEntry {
+	uint32_t level;
+	uint32_t tx;
+	uint32_t ty;
+	uint32_t reserved;
+	uint64_t offset;        /*of the blob from the start of the file*/
+	uint64_t size;
+};
+
+class PyramidBuilder {
+public:
+	static const uint32_t VERSION = 1;
+
+	/*Renders the width*height region starting at NoiseAt(originX, originY)
+	and writes every level of it to filename*/
+	static bool Build(const std::string& filename, const SimplexNoise& noise,
+		int originX, int originY, uint32_t width, uint32_t height,
+		const PyramidSettings& settings = PyramidSettings());
+
+	/*Number of levels needed for the top level to be a single tile*/
+	static int FullLevelCount(uint32_t width, uint32_t height, uint32_t tileSize);
+};
+
+class PyramidReader {
+public:
+	PyramidReader() : header(0), index(0) {}
+
+	bool Open(const std::string& filename);
+	void Close();
+
+	const PyramidHeader& Header() const { return *header; }
+	uint32_t LevelWidth(uint32_t level) const;
+	uint32_t LevelHeight(uint32_t level) const;
+
+	/*Points blob at the tile's bytes in the mapping, false if there is no such tile*/
+	bool Tile(uint32_t level, uint32_t tx, uint32_t ty, const unsigned char** blob, size_t* size) const;
+
+private:
+	MappedFile file;
+	const PyramidHeader* header;
+	const PyramidIndexEntry* index;
+};
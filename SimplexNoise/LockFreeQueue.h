@@ -0,0 +1,92 @@
+#pragma once
+/*
+Class: LockFreeQueue
+Description:
+Bounded multi producer/multi consumer queue after Dmitry Vyukov's design.
+Each cell carries a sequence number which tells producers and consumers
+whether the cell is free or filled for their lap of the ring, so both ends
+only ever CAS their own position counter and never take a lock. TryPush and
+TryPop return false instead of waiting when the queue is full/empty.
+
+T must be cheap to copy (it is intended for pointers and small handles).
+*/
+
+#include <atomic>
+#include <memory>
+#include <cstddef>
+
+template <typename T>
+class LockFreeQueue {
+public:
+	/*capacity is rounded up to a power of two*/
+	explicit LockFreeQueue(size_t capacity) : enqueuePos(0), dequeuePos(0) {
+		size_t size = 2;
+		while (size < capacity) size <<= 1;
+		mask = size - 1;
+		cells.reset(new Cell[size]);
+		for (size_t i = 0; i < size; ++i) {
+			cells[i].sequence.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	bool TryPush(const T& value) {
+		size_t pos = enqueuePos.load(std::memory_order_relaxed);
+		for (;;) {
+			Cell& cell = cells[pos & mask];
+			size_t seq = cell.sequence.load(std::memory_order_acquire);
+			ptrdiff_t diff = (ptrdiff_t)seq - (ptrdiff_t)pos;
+			if (diff == 0) {
+				if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					cell.data = value;
+					cell.sequence.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			} else if (diff < 0) {
+				return false; /*full*/
+			} else {
+				pos = enqueuePos.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	bool TryPop(T& value) {
+		size_t pos = dequeuePos.load(std::memory_order_relaxed);
+		for (;;) {
+			Cell& cell = cells[pos & mask];
+			size_t seq = cell.sequence.load(std::memory_order_acquire);
+			ptrdiff_t diff = (ptrdiff_t)seq - (ptrdiff_t)(pos + 1);
+			if (diff == 0) {
+				if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					value = cell.data;
+					cell.sequence.store(pos + mask + 1, std::memory_order_release);
+					return true;
+				}
+			} else if (diff < 0) {
+				return false; /*empty*/
+			} else {
+				pos = dequeuePos.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+private:
+	struct Cell {
+		std::atomic<size_t> sequence;
+		T data;
+	};
+
+	/*Keep the two counters on separate cache lines so producers and the
+	consumer don't false share*/
+	static const size_t CACHE_LINE = 64;
+
+	std::unique_ptr<Cell[]> cells;
+	size_t mask;
+	char pad0[CACHE_LINE];
+	std::atomic<size_t> enqueuePos;
+	char pad1[CACHE_LINE];
+	std::atomic<size_t> dequeuePos;
+	char pad2[CACHE_LINE];
+
+	LockFreeQueue(const LockFreeQueue&);
+	LockFreeQueue& operator=(const LockFreeQueue&);
+};
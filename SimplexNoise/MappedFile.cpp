@@ -0,0 +1,146 @@
+#include "MappedFile.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+MappedFile::MappedFile() : data(0), size(0), writable(false), file(INVALID_HANDLE_VALUE), mapping(0) {}
+
+bool MappedFile::Create(const std::string& filename, uint64_t newSize) {
+	Close();
+	file = CreateFileA(filename.c_str(), GENERIC_READ | GENERIC_WRITE, 0, 0, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+	if (file == INVALID_HANDLE_VALUE) return false;
+	LARGE_INTEGER end;
+	end.QuadPart = (LONGLONG)newSize;
+	if (!SetFilePointerEx(file, end, 0, FILE_BEGIN) || !SetEndOfFile(file)) {
+		Close();
+		return false;
+	}
+	size = newSize;
+	return Map(true);
+}
+
+bool MappedFile::Open(const std::string& filename) {
+	Close();
+	file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+	if (file == INVALID_HANDLE_VALUE) return false;
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize)) {
+		Close();
+		return false;
+	}
+	size = (uint64_t)fileSize.QuadPart;
+	return Map(false);
+}
+
+bool MappedFile::Map(bool write) {
+	if (size == 0 || size > (uint64_t)(size_t)-1) {
+		Close();
+		return false;
+	}
+	mapping = CreateFileMappingA(file, 0, write ? PAGE_READWRITE : PAGE_READONLY,
+		(DWORD)(size >> 32), (DWORD)(size & 0xffffffff), 0);
+	if (!mapping) {
+		Close();
+		return false;
+	}
+	data = (unsigned char*)MapViewOfFile(mapping, write ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, (SIZE_T)size);
+	if (!data) {
+		Close();
+		return false;
+	}
+	writable = write;
+	return true;
+}
+
+void MappedFile::Flush() {
+	if (data && writable) {
+		FlushViewOfFile(data, 0);
+		FlushFileBuffers(file);
+	}
+}
+
+void MappedFile::Close() {
+	if (data) UnmapViewOfFile(data);
+	if (mapping) CloseHandle(mapping);
+	if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+	data = 0;
+	mapping = 0;
+	file = INVALID_HANDLE_VALUE;
+	size = 0;
+	writable = false;
+}
+
+#else
+
+MappedFile::MappedFile() : data(0), size(0), writable(false), file(-1) {}
+
+bool MappedFile::Create(const std::string& filename, uint64_t newSize) {
+	Close();
+	file = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (file < 0) return false;
+	if (ftruncate(file, (off_t)newSize) != 0) {
+		Close();
+		return false;
+	}
+	size = newSize;
+	return Map(true);
+}
+
+bool MappedFile::Open(const std::string& filename) {
+	Close();
+	file = open(filename.c_str(), O_RDONLY);
+	if (file < 0) return false;
+	struct stat st;
+	if (fstat(file, &st) != 0) {
+		Close();
+		return false;
+	}
+	size = (uint64_t)st.st_size;
+	return Map(false);
+}
+
+bool MappedFile::Map(bool write) {
+	if (size == 0 || size > (uint64_t)(size_t)-1) {
+		Close();
+		return false;
+	}
+	void* p = mmap(0, (size_t)size, write ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, file, 0);
+	if (p == MAP_FAILED) {
+		Close();
+		return false;
+	}
+	data = (unsigned char*)p;
+	writable = write;
+	return true;
+}
+
+void MappedFile::Flush() {
+	if (data && writable) {
+		msync(data, (size_t)size, MS_SYNC);
+	}
+}
+
+void MappedFile::Close() {
+	if (data) munmap(data, (size_t)size);
+	if (file >= 0) close(file);
+	data = 0;
+	file = -1;
+	size = 0;
+	writable = false;
+}
+
+#endif
+
+MappedFile::~MappedFile() {
+	Close();
+}
@@ -0,0 +1,49 @@
+#pragma once
+/*
+Class: MappedFile
+Description:
+Thin wrapper over a memory mapped file (CreateFileMapping on Windows, mmap
+elsewhere). Create() makes a new file of the given size mapped read/write,
+Open() maps an existing file read only. The mapping is released by Close()
+or the destructor; written pages are flushed by the OS, Flush() forces it.
+
+Note the whole file is mapped at once, so files larger than the address
+space (about 2GB in a Win32 build) need a 64 bit build.
+*/
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+class MappedFile {
+public:
+	MappedFile();
+	~MappedFile();
+
+	bool Create(const std::string& filename, uint64_t size);
+	bool Open(const std::string& filename);
+	void Flush();
+	void Close();
+
+	bool IsOpen() const { return data != 0; }
+	bool IsWritable() const { return writable; }
+	unsigned char* Data() { return data; }
+	const unsigned char* Data() const { return data; }
+	uint64_t Size() const { return size; }
+
+private:
+	bool Map(bool write);
+
+	unsigned char* data;
+	uint64_t size;
+	bool writable;
+#ifdef _WIN32
+	void* file;
+	void* mapping;
+#else
+	int file;
+#endif
+
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+};
@@ -2,6 +2,7 @@
 #include <algorithm>
 #include <random>
 #include "Vector2.h"
+#include "CpuFeatures.h"
 
 const Vector3i SimplexNoise::grad3[12] = {
 	Vector3i(1,1,0), Vector3i(-1,1,0), Vector3i(1,-1,0), Vector3i(-1,-1,0),
@@ -34,7 +35,8 @@ const double SimplexNoise::DEF_OCTAVES = 8;
 const double SimplexNoise::DEF_PERSISTENCE = 0.65;
 const double SimplexNoise::lacunarity = 2.0;
 
-SimplexNoise::SimplexNoise(double featureSize, double persistence, int octaves, int seed) {
+SimplexNoise::SimplexNoise(double featureSize, double persistence, int octaves, int seed)
+	: featureSize(featureSize), persistence(persistence) {
 	std::copy(p_supply, p_supply + 256, p);
 	
 	/*No seed provided, use hardware to create one!*/
@@ -42,6 +44,7 @@ SimplexNoise::SimplexNoise(double featureSize, double persistence, int octaves,
 		std::random_device rd;
 		seed = rd();
 	}
+	this->seed = seed;
 
 	/*Seed the mersenne prng engine*/ 
 	std::mt19937 eng(seed);
@@ -62,6 +65,16 @@ SimplexNoise::SimplexNoise(double featureSize, double persistence, int octaves,
 		p[swapTo] = temp;
 	}
 
+	Init(octaves);
+}
+
+SimplexNoise::SimplexNoise(double featureSize, double persistence, int octaves, const short permutation[256])
+	: featureSize(featureSize), persistence(persistence), seed(ZERO_SEED) {
+	std::copy(permutation, permutation + 256, p);
+	Init(octaves);
+}
+
+void SimplexNoise::Init(int octaves) {
 	for (int i = 0; i < 512; ++i) {
 		perm[i] = p[i & 255];
 		permMod12[i] = (short)(perm[i] % 12);
@@ -76,7 +89,7 @@ SimplexNoise::SimplexNoise(double featureSize, double persistence, int octaves,
 	}
 }
 
-double SimplexNoise::NoiseAt(int x, int y) {
+double SimplexNoise::NoiseAt(int x, int y) const {
 	double noise = 0;
 	for (int i = 0; i < frequency.size(); ++i) {
 		noise += Noise(x * frequency[i], y * frequency[i]) * amplitude[i];
@@ -84,40 +97,101 @@ double SimplexNoise::NoiseAt(int x, int y) {
 	return noise;
 }
 
+double SimplexNoise::AmplitudeSum() const {
+	double sum = 0;
+	for (size_t i = 0; i < amplitude.size(); ++i) {
+		sum += amplitude[i];
+	}
+	return sum;
+}
+
 /*I changed this to use a custom Vector class instead of the POD types
-used in the original. It's a tad slower, but helps me read/understand 
-it a little better. I'm still not 100% confident with this algorithm.
-TO DO: 
-	Worth declaring Vecs outside class to prevent con/des each iter?*/
+used in the original, which helps me read/understand it a little better.
+I'm still not 100% confident with this algorithm.
+The vector chains are built with Lazy() so each is evaluated in one pass
+with no temporary Vecs (see VectorExpr.h); NoiseReference below is the POD
+original it's checked and benchmarked against (BenchmarkNoiseVsPod).*/
 double SimplexNoise::Noise(double xin, double yin) const {
 	Vector2d xyin(xin, yin);
     // Skew the input space to determine which simplex cell we're in
 	double s = xyin.ComponentSum() * F2; // Hairy factor for 2D
-	Vector2d ij = (xyin + s).Floor();
+	Vector2i cell = (Lazy(xyin) + s).FloorInt();
+	Vector2d ij(cell);
 	double t = ij.ComponentSum() * G2;
-	Vector2d XY(ij - t); // Unskew the cell origin back to (x,y) space
+    // Unskew the cell origin back to (x,y) space
     // The x,y distances from the cell origin
-	Vector2d xy(xyin - XY);
+	Vector2d xy = Lazy(xyin) - (Lazy(ij) - t);
     // For the 2D case, the simplex shape is an equilateral triangle.
     // Determine which simplex we are in.
-    // Offset for second (middle) corner of simplex in (i,j) coords
-	Vector2i ij1 = xy.x > xy.y ? Vector2i(1, 0) : Vector2i(0, 1); // lower triangle, XY order: (0,0)->(1,0)->(1,1) : upper triangle, YX order: (0,0)->(0,1)->(1,1)
+    // Offset for second (middle) corner of simplex in (i,j) coords:
+    // lower triangle, XY order: (0,0)->(1,0)->(1,1), upper triangle, YX order: (0,0)->(0,1)->(1,1)
+    // Taken from the comparison as an int rather than branched on, as which
+    // triangle a point is in is a coin toss the predictor can't learn
+	int lower = xy.x > xy.y;
+	Vector2i ij1(lower, 1 - lower);
     // A step of (1,0) in (i,j) means a step of (1-c,-c) in (x,y), and
     // a step of (0,1) in (i,j) means a step of (-c,1-c) in (x,y), where
     // c = (3-sqrt(3))/6
     // Offsets for middle corner in (x,y) unskewed coords
-	Vector2d xy1(xy - ij1 + G2);
+	Vector2d xy1 = Lazy(xy) - ij1 + G2;
 	// Offsets for last corner in (x,y) unskewed coords
-	Vector2d xy2(xy - 1.0 + 2.0 * G2);
+	Vector2d xy2 = Lazy(xy) - 1.0 + 2.0 * G2;
     // Work out the hashed gradient indices of the three simplex corners
-	Vector2i ij2((int)ij.x & 255, (int)ij.y & 255);
+	Vector2i ij2(cell.x & 255, cell.y & 255);
     int gi0 = permMod12[ij2.x+perm[ij2.y]];
     int gi1 = permMod12[ij2.x+ij1.x+perm[ij2.y+ij1.y]];
     int gi2 = permMod12[ij2.x+1+perm[ij2.y+1]];
     // Calculate the contribution from the three corners
 	// Add contributions from each corner to get the final noise value.
     // The result is scaled to return values in the interval [-1,1].
-	return 70.0 * (CornerContribution(gi0, xy) + CornerContribution(gi1, xy1) + CornerContribution(gi2, xy2));;
+	return 70.0 * (CornerContribution(gi0, xy) + CornerContribution(gi1, xy1) + CornerContribution(gi2, xy2));
+}
+
+/*Gustavson's 2D simplex noise as originally written, plain doubles and
+ints throughout, with std::floor and a branch for the middle corner, except
+that each corner's falloff sums x*x + y*y before subtracting it, as Dot
+does, so that it gives the same bits as Noise*/
+double SimplexNoise::NoiseReference(double xin, double yin) const {
+	double n0, n1, n2; // Noise contributions from the three corners
+	double s = (xin + yin) * F2;
+	double fi = floor(xin + s);
+	double fj = floor(yin + s);
+	double t = (fi + fj) * G2;
+	double X0 = fi - t;
+	double Y0 = fj - t;
+	double x0 = xin - X0;
+	double y0 = yin - Y0;
+	int i1, j1;
+	if (x0 > y0) { i1 = 1; j1 = 0; }
+	else { i1 = 0; j1 = 1; }
+	double x1 = x0 - i1 + G2;
+	double y1 = y0 - j1 + G2;
+	double x2 = x0 - 1.0 + 2.0 * G2;
+	double y2 = y0 - 1.0 + 2.0 * G2;
+	int ii = (int)fi & 255;
+	int jj = (int)fj & 255;
+	int gi0 = permMod12[ii+perm[jj]];
+	int gi1 = permMod12[ii+i1+perm[jj+j1]];
+	int gi2 = permMod12[ii+1+perm[jj+1]];
+	double t0 = 0.5 - (x0*x0 + y0*y0);
+	if (t0 < 0) n0 = 0.0;
+	else {
+		t0 *= t0;
+		n0 = t0 * t0 * (grad3[gi0].x * x0 + grad3[gi0].y * y0);
+	}
+	double t1 = 0.5 - (x1*x1 + y1*y1);
+	if (t1 < 0) n1 = 0.0;
+	else {
+		t1 *= t1;
+		n1 = t1 * t1 * (grad3[gi1].x * x1 + grad3[gi1].y * y1);
+	}
+	double t2 = 0.5 - (x2*x2 + y2*y2);
+	if (t2 < 0) n2 = 0.0;
+	else {
+		t2 *= t2;
+		n2 = t2 * t2 * (grad3[gi2].x * x2 + grad3[gi2].y * y2);
+	}
+	return 70.0 * (n0 + n1 + n2);
 }
 
 /*Helper functions to cut down the main noise function size*/
@@ -130,4 +204,95 @@ double SimplexNoise::CornerContribution(int gradIndex, const Vector2d& xy) const
 /*Dot a 2d/3d vector*/
 double SimplexNoise::dot(const Vector3i& a, const Vector2d& b) const {
 	return a.x * b.x + a.y * b.y;
+}
+
+/*Same steps and roundings as Noise, on Real = double or Double2. The only
+per lane work is hashing the cell corners into gradients*/
+template <typename Real>
+Real SimplexNoise::NoiseKernel(const Vector2<Real>& xyin) const {
+	Real s = xyin.ComponentSum() * F2;
+	Vector2<Real> ij = (xyin + s).Floor();
+	Real t = ij.ComponentSum() * G2;
+	Vector2<Real> xy(xyin - (ij - t));
+	Real lower = Select(xy.x > xy.y, Real(1.0), Real(0.0));
+	Vector2<Real> ij1(lower, 1.0 - lower);
+	Vector2<Real> xy1(xy - ij1 + G2);
+	Vector2<Real> xy2(xy - 1.0 + 2.0 * G2);
+
+	double ijx[4], ijy[4], ij1x[4];
+	double grad[6][4];
+	StoreLanes(ij.x, ijx);
+	StoreLanes(ij.y, ijy);
+	StoreLanes(ij1.x, ij1x);
+	for (int k = 0; k < LaneCount(s); ++k) {
+		int i = (int)ijx[k] & 255;
+		int j = (int)ijy[k] & 255;
+		int i1 = (int)ij1x[k];
+		int j1 = 1 - i1;
+		const Vector3i& g0 = grad3[permMod12[i+perm[j]]];
+		const Vector3i& g1 = grad3[permMod12[i+i1+perm[j+j1]]];
+		const Vector3i& g2 = grad3[permMod12[i+1+perm[j+1]]];
+		grad[0][k] = g0.x;
+		grad[1][k] = g0.y;
+		grad[2][k] = g1.x;
+		grad[3][k] = g1.y;
+		grad[4][k] = g2.x;
+		grad[5][k] = g2.y;
+	}
+	Vector2<Real> g0, g1, g2;
+	LoadLanes(g0.x, grad[0]);
+	LoadLanes(g0.y, grad[1]);
+	LoadLanes(g1.x, grad[2]);
+	LoadLanes(g1.y, grad[3]);
+	LoadLanes(g2.x, grad[4]);
+	LoadLanes(g2.y, grad[5]);
+	return 70.0 * (CornerContribution(g0, xy) + CornerContribution(g1, xy1) + CornerContribution(g2, xy2));
+}
+
+template <typename Real>
+Real SimplexNoise::CornerContribution(const Vector2<Real>& grad, const Vector2<Real>& xy) {
+	Real t = 0.5 - xy.Dot(xy);
+	Real t2 = t * t;
+	return Select(t < 0.0, Real(0.0), t2 * t2 * grad.Dot(xy));
+}
+
+void SimplexNoise::Noise(const Vector2Array<double>& points, double* out) const {
+	const double* x = points.X();
+	const double* y = points.Y();
+	size_t i = 0;
+#ifdef SIMD_DOUBLE2
+	if (Cpu().sse2) {
+		for (; i + 2 <= points.Size(); i += 2) {
+			NoiseKernel(points.Load2(i)).Store(out + i);
+		}
+	}
+#endif
+	for (; i < points.Size(); ++i) {
+		out[i] = Noise(x[i], y[i]);
+	}
+}
+
+void SimplexNoise::NoiseAt(const Vector2Array<double>& points, double* out) const {
+	const double* x = points.X();
+	const double* y = points.Y();
+	size_t i = 0;
+#ifdef SIMD_DOUBLE2
+	if (Cpu().sse2) {
+		for (; i + 2 <= points.Size(); i += 2) {
+			Vector2<Double2> xy = points.Load2(i);
+			Double2 noise(0.0);
+			for (size_t o = 0; o < frequency.size(); ++o) {
+				noise += NoiseKernel(xy * frequency[o]) * amplitude[o];
+			}
+			noise.Store(out + i);
+		}
+	}
+#endif
+	for (; i < points.Size(); ++i) {
+		double noise = 0;
+		for (size_t o = 0; o < frequency.size(); ++o) {
+			noise += Noise(x[i] * frequency[o], y[i] * frequency[o]) * amplitude[o];
+		}
+		out[i] = noise;
+	}
 }
\ No newline at end of file
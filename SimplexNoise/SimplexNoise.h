@@ -1,5 +1,7 @@
+#pragma once
 #include "Vector3.h"
 #include "Vector2.h"
+#include "VectorArray.h"
 #include <vector>
 /* 
 C++ implementation that creates noisy terrain images using fractal brownian
@@ -16,8 +18,31 @@ Peter Easeman: peastman@drizzle.stanford.edu
 class SimplexNoise {
 public:
 	SimplexNoise(double featureSize, double persistence = DEF_PERSISTENCE, int octaves = DEF_OCTAVES, int seed = 0);
-	double NoiseAt(int x, int y);
+	/*Noise on the given permutation of 0-255 rather than one shuffled from a
+	seed, which depends on the standard library's distributions: the same
+	permutation gives the same noise everywhere. Seed() is 0*/
+	SimplexNoise(double featureSize, double persistence, int octaves, const short permutation[256]);
+	double NoiseAt(int x, int y) const;
 	double Noise(double xin, double yin) const;
+	/*Gustavson's original plain double implementation of Noise, kept as the
+	reference Noise is checked and benchmarked against*/
+	double NoiseReference(double xin, double yin) const;
+
+	/*Noise and NoiseAt for every point of points, written to out[i]. The
+	results are identical to calling Noise(x, y) and NoiseAt(x, y) point by
+	point (NoiseAt's points needn't be integers here); with SSE2 the points
+	go through the kernel two at a time*/
+	void Noise(const Vector2Array<double>& points, double* out) const;
+	void NoiseAt(const Vector2Array<double>& points, double* out) const;
+
+	/*Generator parameters, Seed() is the one actually used when a zero
+	(random) seed was requested*/
+	double FeatureSize() const { return featureSize; }
+	double Persistence() const { return persistence; }
+	int Octaves() const { return (int)frequency.size(); }
+	int Seed() const { return seed; }
+	/*Sum of the octave amplitudes, |NoiseAt| never exceeds this*/
+	double AmplitudeSum() const;
 
 private:
 	static const int ZERO_SEED;
@@ -32,12 +57,23 @@ private:
 	short perm[512];
 	short permMod12[512];
 
+	/*Builds the lookup tables from p and the octave frequencies/amplitudes*/
+	void Init(int octaves);
 	double dot(const Vector3i& a, const Vector2d& b) const;
 	double CornerContribution(int gradIndex, const Vector2d& xy) const;
+	/*The noise function written once against the Vector2 API, for double and
+	Double2, with the gradient hashing done lane by lane*/
+	template <typename Real>
+	Real NoiseKernel(const Vector2<Real>& xyin) const;
+	template <typename Real>
+	static Real CornerContribution(const Vector2<Real>& grad, const Vector2<Real>& xy);
 
 	static const double DEF_PERSISTENCE;
 	static const double DEF_OCTAVES;
 	static const double lacunarity; //leave fixed as 2.0
+	double featureSize;
+	double persistence;
+	int seed;
 	std::vector<double> frequency;
 	std::vector<double> amplitude;
 };
\ No newline at end of file
@@ -0,0 +1,79 @@
+#include "TileRenderer.h"
+#include "Half.h"
+#include <cmath>
+#include <cstring>
+
+namespace {
+	/*Samples generated per conversion pass, small enough to stay in L1*/
+	const int RUN_LENGTH = 64;
+
+	void StoreRun(const double* run, int count, SampleType type, unsigned char* out, const SampleRange& range) {
+		switch (type) {
+		case SAMPLE_F32: {
+			float* dst = (float*)out;
+			for (int i = 0; i < count; ++i) {
+				dst[i] = (float)run[i];
+			}
+			break;
+		}
+		case SAMPLE_F16:
+			DoubleToHalfRow(run, (half*)out, count);
+			break;
+		case SAMPLE_U16: {
+			unsigned short* dst = (unsigned short*)out;
+			double inv = 1.0 / range.scale;
+			for (int i = 0; i < count; ++i) {
+				double v = (run[i] - range.offset) * inv + 0.5;
+				if (v < 0.0) v = 0.0;
+				if (v > 65535.0) v = 65535.0;
+				dst[i] = (unsigned short)v;
+			}
+			break;
+		}
+		case SAMPLE_F64:
+			std::memcpy(out, run, count * sizeof(double));
+			break;
+		}
+	}
+}
+
+size_t SampleSize(SampleType type) {
+	switch (type) {
+	case SAMPLE_F32: return sizeof(float);
+	case SAMPLE_F16: return sizeof(half);
+	case SAMPLE_U16: return sizeof(unsigned short);
+	case SAMPLE_F64: return sizeof(double);
+	}
+	return 0;
+}
+
+double LoadSample(const void* samples, size_t index, SampleType type, const SampleRange& range) {
+	switch (type) {
+	case SAMPLE_F32: return ((const float*)samples)[index];
+	case SAMPLE_F16: return HalfToFloat(((const half*)samples)[index]);
+	case SAMPLE_U16: return ((const unsigned short*)samples)[index] * range.scale + range.offset;
+	case SAMPLE_F64: return ((const double*)samples)[index];
+	}
+	return 0.0;
+}
+
+SampleRange SampleRange::ForU16(const SimplexNoise& noise) {
+	double bound = noise.AmplitudeSum();
+	return SampleRange(2.0 * bound / 65535.0, -bound);
+}
+
+void RenderTile(const SimplexNoise& noise, int x0, int y0, int width, int height,
+	SampleType type, void* out, size_t rowStride, const SampleRange& range) {
+	double run[RUN_LENGTH];
+	size_t sampleSize = SampleSize(type);
+	for (int y = 0; y < height; ++y) {
+		unsigned char* row = (unsigned char*)out + y * rowStride;
+		for (int x = 0; x < width; x += RUN_LENGTH) {
+			int count = width - x < RUN_LENGTH ? width - x : RUN_LENGTH;
+			for (int i = 0; i < count; ++i) {
+				run[i] = noise.NoiseAt(x0 + x + i, y0 + y);
+			}
+			StoreRun(run, count, type, row + x * sampleSize, range);
+		}
+	}
+}
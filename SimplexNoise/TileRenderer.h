@@ -0,0 +1,40 @@
+#pragma once
+/*
+Renders rectangular regions of SimplexNoise::NoiseAt straight into a caller
+supplied buffer in one of the storage formats below. Samples are generated a
+short run at a time and converted while still in registers/L1, so the
+destination (a tile of a mapped file, a chunk, an image row) is written
+exactly once and no full precision copy of the region is ever built.
+*/
+
+#include "SimplexNoise.h"
+#include <cstddef>
+
+enum SampleType {
+	SAMPLE_F32 = 0, /*float*/
+	SAMPLE_F16 = 1, /*IEEE half, see Half.h for the error against NoiseAt*/
+	SAMPLE_U16 = 2, /*unsigned short, quantised with a SampleRange*/
+	SAMPLE_F64 = 3  /*double, exactly what NoiseAt returns*/
+};
+
+size_t SampleSize(SampleType type);
+
+/*Linear mapping used by quantised types: height = stored * scale + offset*/
+struct SampleRange {
+	double scale;
+	double offset;
+
+	SampleRange() : scale(1.0), offset(0.0) {}
+	SampleRange(double scale, double offset) : scale(scale), offset(offset) {}
+
+	/*Maps [-AmplitudeSum, AmplitudeSum] of the generator onto the full u16 range*/
+	static SampleRange ForU16(const SimplexNoise& noise);
+};
+
+/*Reads sample index of a buffer of type back as a height*/
+double LoadSample(const void* samples, size_t index, SampleType type, const SampleRange& range = SampleRange());
+
+/*Renders width*height samples with NoiseAt(x0 + i, y0 + j) into out. Rows
+are rowStride bytes apart. range is only used by quantised types*/
+void RenderTile(const SimplexNoise& noise, int x0, int y0, int width, int height,
+	SampleType type, void* out, size_t rowStride, const SampleRange& range = SampleRange());
@@ -21,6 +21,20 @@ of primitive types.
 */
 
 #include <iostream>
+#include <cmath>
+#include "VectorExpr.h"
+
+template <typename Op, typename L, typename R>
+class Vector2Expr;
+
+/*floor for values that fit in an int, returned as one: truncate, then step
+down where truncation rounded up (negative non-integers). Much cheaper than
+std::floor followed by a cast, and exact for -2^31 <= x < 2^31*/
+template <typename T>
+inline int FastFloor(T x) {
+	int i = static_cast<int>(x);
+	return i - (x < i);
+}
 
 template <typename T>
 class Vector2 {
@@ -37,6 +51,17 @@ public:
 		y = static_cast<T>(v.y);
 	}
 
+	/*Evaluates an expression built with Lazy(), see VectorExpr.h*/
+	template <typename Op, typename L, typename R>
+	Vector2(const Vector2Expr<Op, L, R>& e) : x(static_cast<T>(e.X())), y(static_cast<T>(e.Y())) {}
+
+	template <typename Op, typename L, typename R>
+	Vector2<T>& operator=(const Vector2Expr<Op, L, R>& e) {
+		x = static_cast<T>(e.X());
+		y = static_cast<T>(e.Y());
+		return *this;
+	}
+
 
 
 	/*Compound arithmetic for rhs=Vector2*/
@@ -153,6 +178,11 @@ public:
 	Vector2<T> Floor() const {
 		return Vector2<T>(floor(x), floor(y));
 	}
+
+	/*Floor to int with FastFloor, for components within int range*/
+	Vector2<int> FloorInt() const {
+		return Vector2<int>(FastFloor(x), FastFloor(y));
+	}
 };
 
 /*ostream operator overload*/
@@ -231,6 +261,92 @@ auto operator/(const Vector2<T>& v, const U s) -> Vector2<decltype(v.x / s)> {
 	return Vector2<decltype(v.x / s)>(v.x / s, v.y / s);
 }
 
+/*Expression mode, see VectorExpr.h*/
+
+template <typename T>
+struct ExprStore<Vector2<T> > {
+	typedef const Vector2<T>& type;
+};
+
+template <typename T>
+const T& ExprX(const Vector2<T>& v) { return v.x; }
+template <typename T>
+const T& ExprY(const Vector2<T>& v) { return v.y; }
+
+/*A node applying Op to the components of L and R*/
+template <typename Op, typename L, typename R>
+class Vector2Expr {
+public:
+	typedef decltype(Op::Apply(ExprX(std::declval<L>()), ExprX(std::declval<R>()))) value_type;
+
+	Vector2Expr(const L& l, const R& r) : l(l), r(r) {}
+
+	value_type X() const {
+		return Op::Apply(ExprX(l), ExprX(r));
+	}
+	value_type Y() const {
+		return Op::Apply(ExprY(l), ExprY(r));
+	}
+
+	value_type ComponentSum() const {
+		return X() + Y();
+	}
+
+	Vector2<value_type> Floor() const {
+		return Vector2<value_type>(floor(X()), floor(Y()));
+	}
+
+	Vector2<int> FloorInt() const {
+		return Vector2<int>(FastFloor(X()), FastFloor(Y()));
+	}
+
+private:
+	typename ExprStore<L>::type l;
+	typename ExprStore<R>::type r;
+};
+
+template <typename Op, typename L, typename R>
+auto ExprX(const Vector2Expr<Op, L, R>& e) -> decltype(e.X()) { return e.X(); }
+template <typename Op, typename L, typename R>
+auto ExprY(const Vector2Expr<Op, L, R>& e) -> decltype(e.Y()) { return e.Y(); }
+
+/*Starts an expression with v*/
+template <typename T>
+Vector2Expr<ExprLeaf, Vector2<T>, ExprNone> Lazy(const Vector2<T>& v) {
+	return Vector2Expr<ExprLeaf, Vector2<T>, ExprNone>(v, ExprNone());
+}
+
+/*Node building operators: node with node, vector or scalar, either side*/
+#define VECTOR2_EXPR_OPERATOR(op, Op) \
+template <typename O, typename L, typename R, typename O1, typename L1, typename R1> \
+Vector2Expr<Op, Vector2Expr<O, L, R>, Vector2Expr<O1, L1, R1> > operator op(const Vector2Expr<O, L, R>& a, const Vector2Expr<O1, L1, R1>& b) { \
+	return Vector2Expr<Op, Vector2Expr<O, L, R>, Vector2Expr<O1, L1, R1> >(a, b); \
+} \
+template <typename O, typename L, typename R, typename T> \
+Vector2Expr<Op, Vector2Expr<O, L, R>, Vector2<T> > operator op(const Vector2Expr<O, L, R>& a, const Vector2<T>& b) { \
+	return Vector2Expr<Op, Vector2Expr<O, L, R>, Vector2<T> >(a, b); \
+} \
+template <typename T, typename O, typename L, typename R> \
+Vector2Expr<Op, Vector2<T>, Vector2Expr<O, L, R> > operator op(const Vector2<T>& a, const Vector2Expr<O, L, R>& b) { \
+	return Vector2Expr<Op, Vector2<T>, Vector2Expr<O, L, R> >(a, b); \
+} \
+template <typename O, typename L, typename R, typename S> \
+typename std::enable_if<std::is_arithmetic<S>::value, Vector2Expr<Op, Vector2Expr<O, L, R>, S> >::type \
+operator op(const Vector2Expr<O, L, R>& a, const S s) { \
+	return Vector2Expr<Op, Vector2Expr<O, L, R>, S>(a, s); \
+} \
+template <typename S, typename O, typename L, typename R> \
+typename std::enable_if<std::is_arithmetic<S>::value, Vector2Expr<Op, S, Vector2Expr<O, L, R> > >::type \
+operator op(const S s, const Vector2Expr<O, L, R>& b) { \
+	return Vector2Expr<Op, S, Vector2Expr<O, L, R> >(s, b); \
+}
+
+VECTOR2_EXPR_OPERATOR(+, ExprAdd)
+VECTOR2_EXPR_OPERATOR(-, ExprSub)
+VECTOR2_EXPR_OPERATOR(*, ExprMul)
+VECTOR2_EXPR_OPERATOR(/, ExprDiv)
+#undef VECTOR2_EXPR_OPERATOR
+
 typedef Vector2<int> Vector2i;
 typedef Vector2<double> Vector2d;
 typedef Vector2<float> Vector2f;
@@ -19,6 +19,11 @@ of primitive types.
 */
 
 #include <iostream>
+#include <cmath>
+#include "VectorExpr.h"
+
+template <typename Op, typename L, typename R>
+class Vector3Expr;
 
 template <typename T>
 class Vector3 {
@@ -37,6 +42,18 @@ public:
 		z = static_cast<T>(v.z);
 	}
 
+	/*Evaluates an expression built with Lazy(), see VectorExpr.h*/
+	template <typename Op, typename L, typename R>
+	Vector3(const Vector3Expr<Op, L, R>& e) : x(static_cast<T>(e.X())), y(static_cast<T>(e.Y())), z(static_cast<T>(e.Z())) {}
+
+	template <typename Op, typename L, typename R>
+	Vector3<T>& operator=(const Vector3Expr<Op, L, R>& e) {
+		x = static_cast<T>(e.X());
+		y = static_cast<T>(e.Y());
+		z = static_cast<T>(e.Z());
+		return *this;
+	}
+
 
 
 	/*Compound arithmetic for rhs=Vector3*/
@@ -108,8 +125,8 @@ public:
 
 	/*Cross product with type promotion*/
 	template <typename U>
-	auto Cross(const Vector3<U>& v) const -> decltype(x * v.x) {
-		return Vector<decltype(x * v.x)>(y * v.z - z * v.y, z * v.x - x * v.z, x * v.y - y * v.x);
+	auto Cross(const Vector3<U>& v) const -> Vector3<decltype(x * v.x)> {
+		return Vector3<decltype(x * v.x)>(y * v.z - z * v.y, z * v.x - x * v.z, x * v.y - y * v.x);
 	}
 
 	void Invert() {
@@ -244,6 +261,95 @@ auto operator/(const Vector3<T>& v, const U s) -> Vector3<decltype(v.x / s)> {
 	return Vector3<decltype(v.x / s)>(v.x / s, v.y / s, v.z / s);
 }
 
+/*Expression mode, see VectorExpr.h*/
+
+template <typename T>
+struct ExprStore<Vector3<T> > {
+	typedef const Vector3<T>& type;
+};
+
+template <typename T>
+const T& ExprX(const Vector3<T>& v) { return v.x; }
+template <typename T>
+const T& ExprY(const Vector3<T>& v) { return v.y; }
+template <typename T>
+const T& ExprZ(const Vector3<T>& v) { return v.z; }
+
+/*A node applying Op to the components of L and R*/
+template <typename Op, typename L, typename R>
+class Vector3Expr {
+public:
+	typedef decltype(Op::Apply(ExprX(std::declval<L>()), ExprX(std::declval<R>()))) value_type;
+
+	Vector3Expr(const L& l, const R& r) : l(l), r(r) {}
+
+	value_type X() const {
+		return Op::Apply(ExprX(l), ExprX(r));
+	}
+	value_type Y() const {
+		return Op::Apply(ExprY(l), ExprY(r));
+	}
+	value_type Z() const {
+		return Op::Apply(ExprZ(l), ExprZ(r));
+	}
+
+	value_type ComponentSum() const {
+		return X() + Y() + Z();
+	}
+
+	Vector3<value_type> Floor() const {
+		return Vector3<value_type>(floor(X()), floor(Y()), floor(Z()));
+	}
+
+private:
+	typename ExprStore<L>::type l;
+	typename ExprStore<R>::type r;
+};
+
+template <typename Op, typename L, typename R>
+auto ExprX(const Vector3Expr<Op, L, R>& e) -> decltype(e.X()) { return e.X(); }
+template <typename Op, typename L, typename R>
+auto ExprY(const Vector3Expr<Op, L, R>& e) -> decltype(e.Y()) { return e.Y(); }
+template <typename Op, typename L, typename R>
+auto ExprZ(const Vector3Expr<Op, L, R>& e) -> decltype(e.Z()) { return e.Z(); }
+
+/*Starts an expression with v*/
+template <typename T>
+Vector3Expr<ExprLeaf, Vector3<T>, ExprNone> Lazy(const Vector3<T>& v) {
+	return Vector3Expr<ExprLeaf, Vector3<T>, ExprNone>(v, ExprNone());
+}
+
+/*Node building operators: node with node, vector or scalar, either side*/
+#define VECTOR3_EXPR_OPERATOR(op, Op) \
+template <typename O, typename L, typename R, typename O1, typename L1, typename R1> \
+Vector3Expr<Op, Vector3Expr<O, L, R>, Vector3Expr<O1, L1, R1> > operator op(const Vector3Expr<O, L, R>& a, const Vector3Expr<O1, L1, R1>& b) { \
+	return Vector3Expr<Op, Vector3Expr<O, L, R>, Vector3Expr<O1, L1, R1> >(a, b); \
+} \
+template <typename O, typename L, typename R, typename T> \
+Vector3Expr<Op, Vector3Expr<O, L, R>, Vector3<T> > operator op(const Vector3Expr<O, L, R>& a, const Vector3<T>& b) { \
+	return Vector3Expr<Op, Vector3Expr<O, L, R>, Vector3<T> >(a, b); \
+} \
+template <typename T, typename O, typename L, typename R> \
+Vector3Expr<Op, Vector3<T>, Vector3Expr<O, L, R> > operator op(const Vector3<T>& a, const Vector3Expr<O, L, R>& b) { \
+	return Vector3Expr<Op, Vector3<T>, Vector3Expr<O, L, R> >(a, b); \
+} \
+template <typename O, typename L, typename R, typename S> \
+typename std::enable_if<std::is_arithmetic<S>::value, Vector3Expr<Op, Vector3Expr<O, L, R>, S> >::type \
+operator op(const Vector3Expr<O, L, R>& a, const S s) { \
+	return Vector3Expr<Op, Vector3Expr<O, L, R>, S>(a, s); \
+} \
+template <typename S, typename O, typename L, typename R> \
+typename std::enable_if<std::is_arithmetic<S>::value, Vector3Expr<Op, S, Vector3Expr<O, L, R> > >::type \
+operator op(const S s, const Vector3Expr<O, L, R>& b) { \
+	return Vector3Expr<Op, S, Vector3Expr<O, L, R> >(s, b); \
+}
+
+VECTOR3_EXPR_OPERATOR(+, ExprAdd)
+VECTOR3_EXPR_OPERATOR(-, ExprSub)
+VECTOR3_EXPR_OPERATOR(*, ExprMul)
+VECTOR3_EXPR_OPERATOR(/, ExprDiv)
+#undef VECTOR3_EXPR_OPERATOR
+
 typedef Vector3<int> Vector3i;
 typedef Vector3<double> Vector3d;
 typedef Vector3<float> Vector3f;
@@ -0,0 +1,173 @@
+#pragma once
+/*
+Class: Vector2Array, Vector3Array
+Description:
+Structure of arrays containers for many Vector2/Vector3 values. Each
+component lives in its own contiguous array (X(), Y(), Z()), aligned to 32
+bytes and padded to a whole number of 32 byte blocks, so a loop over the
+points reads consecutive x values with whole register loads instead of
+picking them out of interleaved Vector2s, and a packed load that starts in
+the last partial block stays inside the allocation.
+
+Get/Set move one element in and out as a Vector2/Vector3; with SIMD_DOUBLE2,
+Load2/Store2 move two consecutive elements as a Vector2<Double2> or
+Vector3<Double2>, which is what the batch noise functions run on.
+*/
+
+#include "Vector2.h"
+#include "Vector3.h"
+#include "Double2.h"
+#include <vector>
+#include <algorithm>
+#include <cstddef>
+
+/*Component storage shared by both containers: components arrays of count
+elements, each starting on a 32 byte boundary*/
+template <typename T>
+class ComponentArrays {
+public:
+	ComponentArrays(int components) : components(components), count(0), stride(0) {}
+
+	ComponentArrays(const ComponentArrays<T>& other) : components(other.components), count(0), stride(0) {
+		*this = other;
+	}
+
+	ComponentArrays<T>& operator=(const ComponentArrays<T>& other) {
+		if (this != &other) {
+			components = other.components;
+			Resize(other.count);
+			for (int c = 0; c < components; ++c) {
+				std::copy(other.Component(c), other.Component(c) + count, Component(c));
+			}
+		}
+		return *this;
+	}
+
+	/*Sets the size to n, zeroing every element*/
+	void Resize(size_t n) {
+		const size_t block = ALIGNMENT / sizeof(T);
+		count = n;
+		stride = (n + block - 1) / block * block;
+		store.assign(stride * components + block, T(0));
+	}
+
+	size_t Size() const {
+		return count;
+	}
+
+	T* Component(int c) {
+		return Aligned() + c * stride;
+	}
+	const T* Component(int c) const {
+		return const_cast<ComponentArrays<T>*>(this)->Aligned() + c * stride;
+	}
+
+private:
+	static const size_t ALIGNMENT = 32;
+
+	T* Aligned() {
+		if (store.empty()) return 0;
+		size_t misalign = (size_t)&store[0] % ALIGNMENT;
+		return misalign == 0 ? &store[0] : &store[0] + (ALIGNMENT - misalign) / sizeof(T);
+	}
+
+	int components;
+	size_t count;
+	size_t stride;
+	std::vector<T> store;
+};
+
+template <typename T>
+class Vector2Array {
+public:
+	Vector2Array() : arrays(2) {}
+	explicit Vector2Array(size_t count) : arrays(2) {
+		arrays.Resize(count);
+	}
+
+	void Resize(size_t count) {
+		arrays.Resize(count);
+	}
+	size_t Size() const {
+		return arrays.Size();
+	}
+
+	T* X() { return arrays.Component(0); }
+	T* Y() { return arrays.Component(1); }
+	const T* X() const { return arrays.Component(0); }
+	const T* Y() const { return arrays.Component(1); }
+
+	Vector2<T> Get(size_t i) const {
+		return Vector2<T>(X()[i], Y()[i]);
+	}
+	void Set(size_t i, const Vector2<T>& v) {
+		X()[i] = v.x;
+		Y()[i] = v.y;
+	}
+
+#ifdef SIMD_DOUBLE2
+	/*Elements i and i + 1, double arrays only*/
+	Vector2<Double2> Load2(size_t i) const {
+		return Vector2<Double2>(Double2::Load(X() + i), Double2::Load(Y() + i));
+	}
+	void Store2(size_t i, const Vector2<Double2>& v) {
+		v.x.Store(X() + i);
+		v.y.Store(Y() + i);
+	}
+#endif
+
+private:
+	ComponentArrays<T> arrays;
+};
+
+template <typename T>
+class Vector3Array {
+public:
+	Vector3Array() : arrays(3) {}
+	explicit Vector3Array(size_t count) : arrays(3) {
+		arrays.Resize(count);
+	}
+
+	void Resize(size_t count) {
+		arrays.Resize(count);
+	}
+	size_t Size() const {
+		return arrays.Size();
+	}
+
+	T* X() { return arrays.Component(0); }
+	T* Y() { return arrays.Component(1); }
+	T* Z() { return arrays.Component(2); }
+	const T* X() const { return arrays.Component(0); }
+	const T* Y() const { return arrays.Component(1); }
+	const T* Z() const { return arrays.Component(2); }
+
+	Vector3<T> Get(size_t i) const {
+		return Vector3<T>(X()[i], Y()[i], Z()[i]);
+	}
+	void Set(size_t i, const Vector3<T>& v) {
+		X()[i] = v.x;
+		Y()[i] = v.y;
+		Z()[i] = v.z;
+	}
+
+#ifdef SIMD_DOUBLE2
+	/*Elements i and i + 1, double arrays only*/
+	Vector3<Double2> Load2(size_t i) const {
+		return Vector3<Double2>(Double2::Load(X() + i), Double2::Load(Y() + i), Double2::Load(Z() + i));
+	}
+	void Store2(size_t i, const Vector3<Double2>& v) {
+		v.x.Store(X() + i);
+		v.y.Store(Y() + i);
+		v.z.Store(Z() + i);
+	}
+#endif
+
+private:
+	ComponentArrays<T> arrays;
+};
+
+typedef Vector2Array<double> Vector2dArray;
+typedef Vector3Array<double> Vector3dArray;
+typedef Vector2Array<float> Vector2fArray;
+typedef Vector3Array<float> Vector3fArray;
@@ -0,0 +1,64 @@
+#pragma once
+/*
+Header: VectorExpr
+Description:
+Shared parts of the Vector2/Vector3 expression templates. The ordinary
+operators on Vector2/Vector3 build a new vector for every operator; wrapping
+the first operand in Lazy() switches a statement to expression mode
+instead, where each operator returns a small node recording its operands
+and nothing is computed until the whole chain is assigned to a vector:
+
+	Vector2d xy1 = Lazy(xy) - ij1 + G2;
+
+evaluates xy1.x = xy.x - ij1.x + G2 and then y the same way, with no
+intermediate Vector2s. Each node applies the same operator to the same
+component types as the eager operators, so the results, including type
+promotion and rounding, are identical.
+
+Nodes keep references to the vectors in them, so an expression must be
+evaluated in the statement that builds it: never hold one in an auto.
+*/
+
+#include <utility>
+#include <type_traits>
+
+/*Component operations applied by the nodes*/
+struct ExprAdd {
+	template <typename A, typename B>
+	static auto Apply(const A& a, const B& b) -> decltype(a + b) { return a + b; }
+};
+struct ExprSub {
+	template <typename A, typename B>
+	static auto Apply(const A& a, const B& b) -> decltype(a - b) { return a - b; }
+};
+struct ExprMul {
+	template <typename A, typename B>
+	static auto Apply(const A& a, const B& b) -> decltype(a * b) { return a * b; }
+};
+struct ExprDiv {
+	template <typename A, typename B>
+	static auto Apply(const A& a, const B& b) -> decltype(a / b) { return a / b; }
+};
+
+/*Right operand of a leaf, which just passes its vector's component on*/
+struct ExprNone {};
+struct ExprLeaf {
+	template <typename A>
+	static A Apply(const A& a, ExprNone) { return a; }
+};
+
+/*How a node stores an operand: scalars and nodes by value, vectors by
+reference (specialised in Vector2.h and Vector3.h)*/
+template <typename T>
+struct ExprStore {
+	typedef T type;
+};
+
+/*Component accessors for scalar operands: every component is the scalar.
+Vector2.h and Vector3.h add overloads for vectors and nodes*/
+template <typename S>
+const S& ExprX(const S& s) { return s; }
+template <typename S>
+const S& ExprY(const S& s) { return s; }
+template <typename S>
+const S& ExprZ(const S& s) { return s; }
@@ -30,13 +30,43 @@ Rename this file to lodepng.cpp to use it for C++, or to lodepng.c to use it for
 
 #include "lodepng.h"
 
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #ifdef LODEPNG_COMPILE_CPP
+#include <chrono>
 #include <fstream>
 #endif /*LODEPNG_COMPILE_CPP*/
 
+#ifdef LODEPNG_COMPILE_THREADS
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+#endif /*LODEPNG_COMPILE_THREADS*/
+
+#if defined(LODEPNG_COMPILE_SIMD) && \
+    (defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__))
+#define LODEPNG_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else /*_MSC_VER*/
+#include <cpuid.h>
+#endif /*_MSC_VER*/
+/*gcc and clang only allow intrinsics of instruction sets a function is compiled for,
+Visual Studio allows any intrinsic anywhere*/
+#if defined(__GNUC__) || defined(__clang__)
+#define LODEPNG_TARGET(isa) __attribute__((target(isa)))
+#else
+#define LODEPNG_TARGET(isa)
+#endif
+#endif /*LODEPNG_X86*/
+
 #define VERSION_STRING "20140624"
 
 #if (_MSC_VER >= 1310) /*Visual Studio: Kept warning-free but a few warning types are not desired here.*/
@@ -63,18 +93,44 @@ lodepng source code. Don't forget to remove "static" if you copypaste them
 from here.*/
 
 #ifdef LODEPNG_COMPILE_ALLOCATORS
+#ifdef LODEPNG_COMPILE_ENCODER
+#if defined(_MSC_VER)
+#define LODEPNG_THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__) || defined(__clang__)
+#define LODEPNG_THREAD_LOCAL __thread
+#else
+#define LODEPNG_THREAD_LOCAL /*no known way: one allocator shared by all threads*/
+#endif
+
+/*the LodePNGAllocator of the encode running on this thread, null outside of one*/
+static LODEPNG_THREAD_LOCAL const LodePNGAllocator* lodepng_allocator = 0;
+#endif /*LODEPNG_COMPILE_ENCODER*/
+
 static void* lodepng_malloc(size_t size)
 {
+#ifdef LODEPNG_COMPILE_ENCODER
+  if(lodepng_allocator) return lodepng_allocator->malloc_fn(lodepng_allocator->context, size);
+#endif /*LODEPNG_COMPILE_ENCODER*/
   return malloc(size);
 }
 
 static void* lodepng_realloc(void* ptr, size_t new_size)
 {
+#ifdef LODEPNG_COMPILE_ENCODER
+  if(lodepng_allocator) return lodepng_allocator->realloc_fn(lodepng_allocator->context, ptr, new_size);
+#endif /*LODEPNG_COMPILE_ENCODER*/
   return realloc(ptr, new_size);
 }
 
 static void lodepng_free(void* ptr)
 {
+#ifdef LODEPNG_COMPILE_ENCODER
+  if(lodepng_allocator)
+  {
+    lodepng_allocator->free_fn(lodepng_allocator->context, ptr);
+    return;
+  }
+#endif /*LODEPNG_COMPILE_ENCODER*/
   free(ptr);
 }
 #else /*LODEPNG_COMPILE_ALLOCATORS*/
@@ -186,15 +242,6 @@ static unsigned uivector_push_back(uivector* p, unsigned c)
   p->data[p->size - 1] = c;
   return 1;
 }
-
-/*copy q to p, returns 1 if success, 0 if failure ==> nothing done*/
-static unsigned uivector_copy(uivector* p, const uivector* q)
-{
-  size_t i;
-  if(!uivector_resize(p, q->size)) return 0;
-  for(i = 0; i < q->size; i++) p->data[i] = q->data[i];
-  return 1;
-}
 #endif /*LODEPNG_COMPILE_ENCODER*/
 #endif /*LODEPNG_COMPILE_ZLIB*/
 
@@ -206,6 +253,8 @@ typedef struct ucvector
   unsigned char* data;
   size_t size; /*used size*/
   size_t allocsize; /*allocated size*/
+  /*1 if data is a buffer of the caller that can't grow, set to 2 when it was too small*/
+  unsigned fixed;
 } ucvector;
 
 /*returns 1 if success, 0 if failure ==> nothing done*/
@@ -214,7 +263,13 @@ static unsigned ucvector_resize(ucvector* p, size_t size)
   if(size * sizeof(unsigned char) > p->allocsize)
   {
     size_t newsize = size * sizeof(unsigned char) * 2;
-    void* data = lodepng_realloc(p->data, newsize);
+    void* data;
+    if(p->fixed)
+    {
+      p->fixed = 2;
+      return 0;
+    }
+    data = lodepng_realloc(p->data, newsize);
     if(data)
     {
       p->allocsize = newsize;
@@ -240,6 +295,7 @@ static void ucvector_init(ucvector* p)
 {
   p->data = NULL;
   p->size = p->allocsize = 0;
+  p->fixed = 0;
 }
 
 #ifdef LODEPNG_COMPILE_DECODER
@@ -261,6 +317,7 @@ static void ucvector_init_buffer(ucvector* p, unsigned char* buffer, size_t size
 {
   p->data = buffer;
   p->allocsize = p->size = size;
+  p->fixed = 0;
 }
 #endif /*LODEPNG_COMPILE_ZLIB*/
 
@@ -391,7 +448,410 @@ unsigned lodepng_save_file(const unsigned char* buffer, size_t buffersize, const
 
 #endif /*LODEPNG_COMPILE_DISK*/
 
+#ifdef LODEPNG_COMPILE_ENCODER
+
+/*
+Makes allocator the one lodepng_malloc and co use on this thread until allocator_end.
+Null means the built in functions. Returns what to pass to allocator_end. Every PNG
+entry point uses its own state's allocator, also when called from inside another encode,
+e.g. from its sink. Without LODEPNG_COMPILE_ALLOCATORS these do nothing.
+*/
+static const LodePNGAllocator* allocator_begin(const LodePNGAllocator* allocator)
+{
+#ifdef LODEPNG_COMPILE_ALLOCATORS
+  const LodePNGAllocator* previous = lodepng_allocator;
+  lodepng_allocator = allocator;
+  return previous;
+#else /*LODEPNG_COMPILE_ALLOCATORS*/
+  (void)allocator;
+  return 0;
+#endif /*LODEPNG_COMPILE_ALLOCATORS*/
+}
+
+/*allocator_begin for the zlib entry points, which keep the allocator of a PNG encode
+they are called from (through custom_zlib or custom_deflate), whatever their settings*/
+static const LodePNGAllocator* zlib_allocator_begin(const LodePNGAllocator* allocator)
+{
+#ifdef LODEPNG_COMPILE_ALLOCATORS
+  if(lodepng_allocator) return allocator_begin(lodepng_allocator);
+#endif /*LODEPNG_COMPILE_ALLOCATORS*/
+  return allocator_begin(allocator);
+}
+
+static void allocator_end(const LodePNGAllocator* previous)
+{
+#ifdef LODEPNG_COMPILE_ALLOCATORS
+  lodepng_allocator = previous;
+#else /*LODEPNG_COMPILE_ALLOCATORS*/
+  (void)previous;
+#endif /*LODEPNG_COMPILE_ALLOCATORS*/
+}
+
+/*calls a user's sink outside the encode's allocator, the sink may encode or decode on its own*/
+static unsigned call_sink(LodePNGSink sink, void* sink_context, const unsigned char* data, size_t size)
+{
+  const LodePNGAllocator* previous = allocator_begin(0);
+  unsigned error = sink(sink_context, data, size);
+  allocator_end(previous);
+  return error;
+}
+
+#ifdef LODEPNG_COMPILE_ALLOCATORS
+/*
+The scratch arena of a LodePNGState, see keep_scratch. It is an allocator that never
+gives memory back: freed blocks go on a free list per size class and later requests of
+that class take them from there. Sizes are rounded up to 16 bytes or to a quarter of
+their power of two, so no block wastes more than a fifth. An encode asks for the same
+sizes as the one before it with the same kind of image, so from the second one on the
+lists hold every block it needs. Every operation is O(1).
+*/
+
+/*in front of every block, 16 bytes so that the data keeps malloc's alignment*/
+typedef struct ScratchBlock
+{
+  struct ScratchBlock* next; /*the next free block of the same class, while free*/
+  size_t bin; /*size class*/
+} ScratchBlock;
+
+#define SCRATCH_HEADER 16
+#define SCRATCH_BINS (1 + 4 * (sizeof(size_t) * 8 - 4))
+
+struct LodePNGScratch
+{
+  LodePNGAllocator allocator; /*the arena as a LodePNGAllocator, context points back here*/
+  LodePNGAllocator backing; /*where the blocks come from*/
+  unsigned has_backing; /*0: malloc, realloc and free*/
+  ScratchBlock* bins[SCRATCH_BINS]; /*free blocks per size class*/
+#ifdef LODEPNG_COMPILE_THREADS
+  std::mutex* mutex; /*the parallel encoder allocates from worker threads*/
+#endif /*LODEPNG_COMPILE_THREADS*/
+};
+
+/*bytes a block of class bin holds: 16, then 4 steps per power of two*/
+static size_t scratch_bin_size(size_t bin)
+{
+  size_t octave, quarter;
+  if(bin == 0) return 16;
+  octave = 4 + (bin - 1) / 4;
+  quarter = (size_t)1 << (octave - 2);
+  return ((size_t)1 << octave) + ((bin - 1) % 4 + 1) * quarter;
+}
+
+/*the smallest class holding size bytes*/
+static size_t scratch_bin(size_t size)
+{
+  size_t octave = 4, quarter;
+  if(size <= 16) return 0;
+  while(((size_t)2 << octave) < size) octave++; /*2^octave < size <= 2^(octave+1)*/
+  quarter = (size_t)1 << (octave - 2);
+  return 1 + (octave - 4) * 4 + (size - ((size_t)1 << octave) + quarter - 1) / quarter - 1;
+}
+
+static void* scratch_backing_malloc(const LodePNGScratch* scratch, size_t size)
+{
+  if(scratch->has_backing) return scratch->backing.malloc_fn(scratch->backing.context, size);
+  return malloc(size);
+}
+
+static void scratch_backing_free(const LodePNGScratch* scratch, void* ptr)
+{
+  if(scratch->has_backing) scratch->backing.free_fn(scratch->backing.context, ptr);
+  else free(ptr);
+}
+
+static void scratch_lock(LodePNGScratch* scratch)
+{
+#ifdef LODEPNG_COMPILE_THREADS
+  scratch->mutex->lock();
+#else /*LODEPNG_COMPILE_THREADS*/
+  (void)scratch;
+#endif /*LODEPNG_COMPILE_THREADS*/
+}
+
+static void scratch_unlock(LodePNGScratch* scratch)
+{
+#ifdef LODEPNG_COMPILE_THREADS
+  scratch->mutex->unlock();
+#else /*LODEPNG_COMPILE_THREADS*/
+  (void)scratch;
+#endif /*LODEPNG_COMPILE_THREADS*/
+}
+
+static ScratchBlock* scratch_block(void* ptr)
+{
+  return (ScratchBlock*)((unsigned char*)ptr - SCRATCH_HEADER);
+}
+
+static void* scratch_malloc(void* context, size_t size)
+{
+  LodePNGScratch* scratch = (LodePNGScratch*)context;
+  size_t bin = scratch_bin(size);
+  ScratchBlock* block;
+  if(size > (size_t)(-1) / 2) return 0;
+  scratch_lock(scratch);
+  block = scratch->bins[bin];
+  if(block) scratch->bins[bin] = block->next;
+  scratch_unlock(scratch);
+  if(!block)
+  {
+    block = (ScratchBlock*)scratch_backing_malloc(scratch, SCRATCH_HEADER + scratch_bin_size(bin));
+    if(!block) return 0;
+    block->bin = bin;
+  }
+  return (unsigned char*)block + SCRATCH_HEADER;
+}
+
+static void scratch_free(void* context, void* ptr)
+{
+  LodePNGScratch* scratch = (LodePNGScratch*)context;
+  ScratchBlock* block;
+  if(!ptr) return;
+  block = scratch_block(ptr);
+  scratch_lock(scratch);
+  block->next = scratch->bins[block->bin];
+  scratch->bins[block->bin] = block;
+  scratch_unlock(scratch);
+}
+
+static void* scratch_realloc(void* context, void* ptr, size_t new_size)
+{
+  void* data;
+  size_t size;
+  if(!ptr) return scratch_malloc(context, new_size);
+  size = scratch_bin_size(scratch_block(ptr)->bin);
+  if(size >= new_size) return ptr;
+  data = scratch_malloc(context, new_size);
+  if(!data) return 0;
+  memcpy(data, ptr, size);
+  scratch_free(context, ptr);
+  return data;
+}
+
+/*
+Moves size bytes at ptr, a block of the arena, into a block of the backing allocator that
+the caller owns, e.g. the PNG returned by lodepng_encode. Returns null if out of memory.
+*/
+static unsigned char* scratch_detach(LodePNGScratch* scratch, unsigned char* ptr, size_t size)
+{
+  unsigned char* data = (unsigned char*)scratch_backing_malloc(scratch, size ? size : 1);
+  if(data) memcpy(data, ptr, size);
+  scratch_free(scratch, ptr);
+  return data;
+}
+
+static LodePNGScratch* scratch_create(const LodePNGAllocator* backing)
+{
+  LodePNGScratch* scratch;
+  size_t i;
+  void* memory = backing ? backing->malloc_fn(backing->context, sizeof(LodePNGScratch))
+                         : malloc(sizeof(LodePNGScratch));
+  if(!memory) return 0;
+  scratch = (LodePNGScratch*)memory;
+  scratch->allocator.malloc_fn = scratch_malloc;
+  scratch->allocator.realloc_fn = scratch_realloc;
+  scratch->allocator.free_fn = scratch_free;
+  scratch->allocator.context = scratch;
+  scratch->has_backing = backing != 0;
+  if(backing) scratch->backing = *backing;
+  for(i = 0; i < SCRATCH_BINS; i++) scratch->bins[i] = 0;
+#ifdef LODEPNG_COMPILE_THREADS
+  scratch->mutex = new (std::nothrow) std::mutex;
+  if(!scratch->mutex)
+  {
+    scratch_backing_free(scratch, memory);
+    return 0;
+  }
+#endif /*LODEPNG_COMPILE_THREADS*/
+  return scratch;
+}
+
+/*frees the free blocks, which outside of an encode are all of them, and the arena*/
+static void scratch_destroy(LodePNGScratch* scratch)
+{
+  size_t i;
+  if(!scratch) return;
+  for(i = 0; i < SCRATCH_BINS; i++)
+  {
+    while(scratch->bins[i])
+    {
+      ScratchBlock* block = scratch->bins[i];
+      scratch->bins[i] = block->next;
+      scratch_backing_free(scratch, block);
+    }
+  }
+#ifdef LODEPNG_COMPILE_THREADS
+  delete scratch->mutex;
+#endif /*LODEPNG_COMPILE_THREADS*/
+  scratch_backing_free(scratch, scratch);
+}
+
+/*whether the arena takes its blocks from backing, which may be null for malloc*/
+static unsigned scratch_has_backing(const LodePNGScratch* scratch, const LodePNGAllocator* backing)
+{
+  if(!backing) return !scratch->has_backing;
+  return scratch->has_backing && scratch->backing.malloc_fn == backing->malloc_fn
+      && scratch->backing.realloc_fn == backing->realloc_fn
+      && scratch->backing.free_fn == backing->free_fn && scratch->backing.context == backing->context;
+}
+#endif /*LODEPNG_COMPILE_ALLOCATORS*/
+
+/*the number of threads a "threads" setting stands for, 0 means one per hardware thread*/
+static unsigned lodepng_resolve_threads(unsigned threads)
+{
+#ifdef LODEPNG_COMPILE_THREADS
+  if(threads == 0) threads = std::thread::hardware_concurrency();
+#else /*LODEPNG_COMPILE_THREADS*/
+  threads = 1;
+#endif /*LODEPNG_COMPILE_THREADS*/
+  return threads == 0 ? 1 : threads;
+}
+
+#ifdef LODEPNG_COMPILE_THREADS
+typedef struct ParallelFor
+{
+  std::atomic<size_t> next;
+  size_t count;
+  void (*func)(void*, size_t);
+  void* context;
+  const LodePNGAllocator* allocator; /*the allocator of the thread that started the loop*/
+} ParallelFor;
+
+static void parallelForWorker(ParallelFor* job)
+{
+#ifdef LODEPNG_COMPILE_ALLOCATORS
+  lodepng_allocator = job->allocator;
+#endif /*LODEPNG_COMPILE_ALLOCATORS*/
+  for(;;)
+  {
+    size_t i = job->next++;
+    if(i >= job->count) break;
+    job->func(job->context, i);
+  }
+}
+#endif /*LODEPNG_COMPILE_THREADS*/
+
+/*
+Calls func(context, i) for every i in [0, count) using up to threads threads (a
+resolved count, see lodepng_resolve_threads), the calling thread being one of them.
+Indices are handed out in increasing order. If a thread can't be started, or
+LODEPNG_COMPILE_THREADS is off, the remaining threads simply do more of the work.
+*/
+static void lodepng_parallel_for(size_t count, unsigned threads, void (*func)(void*, size_t), void* context)
+{
+  size_t i;
+#ifdef LODEPNG_COMPILE_THREADS
+  if(threads > 1 && count > 1)
+  {
+    ParallelFor job;
+    std::vector<std::thread> workers;
+    job.next = 0;
+    job.count = count;
+    job.func = func;
+    job.context = context;
+#ifdef LODEPNG_COMPILE_ALLOCATORS
+    job.allocator = lodepng_allocator;
+#else /*LODEPNG_COMPILE_ALLOCATORS*/
+    job.allocator = 0;
+#endif /*LODEPNG_COMPILE_ALLOCATORS*/
+    if(threads > count) threads = (unsigned)count;
+    try
+    {
+      for(i = 1; i < threads; i++) workers.push_back(std::thread(parallelForWorker, &job));
+    }
+    catch(...) {}
+    parallelForWorker(&job);
+    for(i = 0; i < workers.size(); i++) workers[i].join();
+    return;
+  }
+#endif /*LODEPNG_COMPILE_THREADS*/
+  for(i = 0; i < count; i++) func(context, i);
+}
+
+#endif /*LODEPNG_COMPILE_ENCODER*/
+
 /* ////////////////////////////////////////////////////////////////////////// */
+/*
+The SIMD code paths in use, LODEPNG_SIMD_* flags. Every kernel keeps its scalar
+version as the reference: the SIMD versions must give the same bytes, and setting the
+flags to 0 with lodepng_set_simd runs the scalar ones.
+*/
+static unsigned simd_detect(void)
+{
+  unsigned flags = 0;
+#ifdef LODEPNG_X86
+  unsigned regs[4], maxleaf;
+  unsigned long long xcr0 = 0;
+#ifdef _MSC_VER
+  int r[4];
+  __cpuid(r, 0);
+  maxleaf = (unsigned)r[0];
+  if(maxleaf < 1) return 0;
+  __cpuid(r, 1);
+  regs[2] = (unsigned)r[2]; regs[3] = (unsigned)r[3];
+#else /*_MSC_VER*/
+  __cpuid(0, regs[0], regs[1], regs[2], regs[3]);
+  maxleaf = regs[0];
+  if(maxleaf < 1) return 0;
+  __cpuid(1, regs[0], regs[1], regs[2], regs[3]);
+#endif /*_MSC_VER*/
+  if(regs[3] & (1u << 26)) flags |= LODEPNG_SIMD_SSE2;
+  if(regs[2] & (1u << 9)) flags |= LODEPNG_SIMD_SSSE3;
+  if(regs[2] & (1u << 1)) flags |= LODEPNG_SIMD_PCLMUL;
+  /*AVX2 also needs the OS to save the YMM registers (OSXSAVE and XCR0 bits 1 and 2)*/
+  if((regs[2] & (1u << 27)) && (regs[2] & (1u << 28)) && maxleaf >= 7)
+  {
+#ifdef _MSC_VER
+    xcr0 = _xgetbv(0);
+    __cpuidex(r, 7, 0);
+    regs[1] = (unsigned)r[1];
+#else /*_MSC_VER*/
+    unsigned eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    xcr0 = ((unsigned long long)edx << 32) | eax;
+    __cpuid_count(7, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif /*_MSC_VER*/
+    if((xcr0 & 6) == 6 && (regs[1] & (1u << 5))) flags |= LODEPNG_SIMD_AVX2;
+  }
+  /*every path builds on SSE2*/
+  if(!(flags & LODEPNG_SIMD_SSE2)) flags = 0;
+#endif /*LODEPNG_X86*/
+  return flags;
+}
+
+#ifdef LODEPNG_COMPILE_CPP
+/*detected during static initialization, before any thread of the encoder can ask*/
+static unsigned simd_flags = simd_detect();
+static unsigned simd_get(void)
+{
+  return simd_flags;
+}
+#else /*LODEPNG_COMPILE_CPP*/
+/*C has no threads in LodePNG, detected on first use*/
+static unsigned simd_flags = 0;
+static unsigned simd_ready = 0;
+static unsigned simd_get(void)
+{
+  if(!simd_ready)
+  {
+    simd_flags = simd_detect();
+    simd_ready = 1;
+  }
+  return simd_flags;
+}
+#endif /*LODEPNG_COMPILE_CPP*/
+
+unsigned lodepng_get_simd(void)
+{
+  return simd_get();
+}
+
+unsigned lodepng_set_simd(unsigned mask)
+{
+  simd_get();
+  simd_flags = simd_detect() & mask;
+  return simd_flags;
+}
+
 /* ////////////////////////////////////////////////////////////////////////// */
 /* // End of common code and tools. Begin of Zlib related code.            // */
 /* ////////////////////////////////////////////////////////////////////////// */
@@ -409,38 +869,141 @@ unsigned lodepng_save_file(const unsigned char* buffer, size_t buffersize, const
   (*bitpointer)++;\
 }
 
+/*the same bits as addBitToStream for each bit in turn, but filling up to a byte at once*/
 static void addBitsToStream(size_t* bitpointer, ucvector* bitstream, unsigned value, size_t nbits)
 {
-  size_t i;
-  for(i = 0; i < nbits; i++) addBitToStream(bitpointer, bitstream, (unsigned char)((value >> i) & 1));
+  while(nbits > 0)
+  {
+    unsigned used = (unsigned)((*bitpointer) & 7);
+    unsigned amount = 8 - used;
+    if(amount > nbits) amount = (unsigned)nbits;
+    if(used == 0) ucvector_push_back(bitstream, (unsigned char)0);
+    bitstream->data[bitstream->size - 1] |= (unsigned char)((value & ((1u << amount) - 1u)) << used);
+    value >>= amount;
+    nbits -= amount;
+    (*bitpointer) += amount;
+  }
 }
 
 static void addBitsToStreamReversed(size_t* bitpointer, ucvector* bitstream, unsigned value, size_t nbits)
 {
   size_t i;
-  for(i = 0; i < nbits; i++) addBitToStream(bitpointer, bitstream, (unsigned char)((value >> (nbits - 1 - i)) & 1));
+  unsigned reversed = 0;
+  for(i = 0; i < nbits; i++) reversed |= ((value >> (nbits - 1 - i)) & 1u) << i;
+  addBitsToStream(bitpointer, bitstream, reversed, nbits);
 }
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 #ifdef LODEPNG_COMPILE_DECODER
 
-#define READBIT(bitpointer, bitstream) ((bitstream[bitpointer >> 3] >> (bitpointer & 0x7)) & (unsigned char)1)
+/*
+Bit reader of the inflator. buffer holds the stream's bits from the current
+position on, lsb first: avail of them are valid, and any above those are zero
+or already the right bits. A refill tops it up to at least 56 bits with one
+8 byte load while 8 bytes of input remain, and a byte at a time, as zeros
+past the end of the input, after that. That is enough for a length and
+distance pair with their extra bits (15 + 5 + 15 + 13 bits) after one
+refill. Reading past the end is only detected afterwards: bitpos then
+exceeds bitsize, which the callers check.
+The input can come in pieces, such as the IDAT chunks of a PNG, read where
+they are: when data runs out, nextpiece moves it to the next piece and
+returns 1, or returns 0 after the last.
+*/
+typedef struct BitReader
+{
+  const unsigned char* data; /*the current piece*/
+  size_t size; /*size of data in bytes*/
+  size_t bitsize; /*size of the whole input in bits*/
+  size_t base; /*bytes in the pieces before data*/
+  size_t next; /*next byte of data to load into buffer, may count zero bytes past the end*/
+  unsigned long long buffer;
+  unsigned avail; /*number of valid bits in buffer*/
+  unsigned (*nextpiece)(struct BitReader* reader); /*0 for input in one piece*/
+  void* context; /*for nextpiece*/
+} BitReader;
+
+static void BitReader_init(BitReader* reader, const unsigned char* data, size_t size)
+{
+  reader->data = data;
+  reader->size = size;
+  reader->bitsize = size * 8;
+  reader->base = 0;
+  reader->next = 0;
+  reader->buffer = 0;
+  reader->avail = 0;
+  reader->nextpiece = 0;
+  reader->context = 0;
+}
 
-static unsigned char readBitFromStream(size_t* bitpointer, const unsigned char* bitstream)
+/*bit position in the input of the next bit to read*/
+static size_t BitReader_bitpos(const BitReader* reader)
 {
-  unsigned char result = (unsigned char)(READBIT(*bitpointer, bitstream));
-  (*bitpointer)++;
+  return (reader->base + reader->next) * 8 - reader->avail;
+}
+
+static unsigned long long readLE64(const unsigned char* p)
+{
+#ifdef LODEPNG_X86
+  unsigned long long result;
+  memcpy(&result, p, 8); /*x86 is little endian and allows unaligned loads*/
   return result;
+#else /*LODEPNG_X86*/
+  return (unsigned long long)p[0] | ((unsigned long long)p[1] << 8)
+      | ((unsigned long long)p[2] << 16) | ((unsigned long long)p[3] << 24)
+      | ((unsigned long long)p[4] << 32) | ((unsigned long long)p[5] << 40)
+      | ((unsigned long long)p[6] << 48) | ((unsigned long long)p[7] << 56);
+#endif /*LODEPNG_X86*/
 }
 
-static unsigned readBitsFromStream(size_t* bitpointer, const unsigned char* bitstream, size_t nbits)
+static void BitReader_refill(BitReader* reader)
 {
-  unsigned result = 0, i;
-  for(i = 0; i < nbits; i++)
+  if(reader->next + 8 <= reader->size)
+  {
+    /*bits that don't fit are loaded again by the next refill, from the same byte*/
+    reader->buffer |= readLE64(reader->data + reader->next) << reader->avail;
+    reader->next += (63 - reader->avail) >> 3;
+    reader->avail |= 56;
+  }
+  else
   {
-    result += ((unsigned)READBIT(*bitpointer, bitstream)) << i;
-    (*bitpointer)++;
+    while(reader->avail <= 56)
+    {
+      if(reader->next == reader->size && reader->nextpiece)
+      {
+        if(reader->nextpiece(reader)) continue;
+        reader->nextpiece = 0; /*that was the last piece*/
+      }
+      if(reader->next < reader->size) reader->buffer |= (unsigned long long)reader->data[reader->next] << reader->avail;
+      reader->next++;
+      reader->avail += 8;
+    }
   }
+}
+
+/*makes sure the buffer holds at least nbits bits, nbits <= 56*/
+static void ensureBits(BitReader* reader, unsigned nbits)
+{
+  if(reader->avail < nbits) BitReader_refill(reader);
+}
+
+/*the next nbits bits without consuming them, nbits < 32 and no more than the buffer holds*/
+static unsigned peekBits(const BitReader* reader, unsigned nbits)
+{
+  return (unsigned)reader->buffer & ((1u << nbits) - 1u);
+}
+
+static void advanceBits(BitReader* reader, unsigned nbits)
+{
+  reader->buffer >>= nbits;
+  reader->avail -= nbits;
+}
+
+static unsigned readBits(BitReader* reader, unsigned nbits)
+{
+  unsigned result;
+  ensureBits(reader, nbits);
+  result = peekBits(reader, nbits);
+  advanceBits(reader, nbits);
   return result;
 }
 #endif /*LODEPNG_COMPILE_DECODER*/
@@ -490,11 +1053,12 @@ Huffman tree struct, containing multiple representations of the tree
 */
 typedef struct HuffmanTree
 {
-  unsigned* tree2d;
   unsigned* tree1d;
   unsigned* lengths; /*the lengths of the codes of the 1d-tree*/
   unsigned maxbitlen; /*maximum number of bits a single code can get*/
   unsigned numcodes; /*number of symbols in the alphabet = number of codes*/
+  unsigned char* table_len; /*the decoder's lookup table, see HuffmanTree_makeTable: code lengths*/
+  unsigned short* table_value; /*symbols, or second level table starts*/
 } HuffmanTree;
 
 /*function used for debug purposes to draw the tree in ascii art with C++*/
@@ -512,77 +1076,136 @@ static void HuffmanTree_draw(HuffmanTree* tree)
 
 static void HuffmanTree_init(HuffmanTree* tree)
 {
-  tree->tree2d = 0;
   tree->tree1d = 0;
   tree->lengths = 0;
+  tree->table_len = 0;
+  tree->table_value = 0;
 }
 
 static void HuffmanTree_cleanup(HuffmanTree* tree)
 {
-  lodepng_free(tree->tree2d);
   lodepng_free(tree->tree1d);
   lodepng_free(tree->lengths);
+  lodepng_free(tree->table_len);
+  lodepng_free(tree->table_value);
+}
+
+#ifdef LODEPNG_COMPILE_DECODER
+
+/*number of bits the decoder looks up at once, in the first level of its table*/
+#define FIRSTBITS 9u
+/*table value of bit patterns that aren't a code, an incomplete tree can have them*/
+#define INVALIDSYMBOL 65535u
+
+static unsigned reverseBits(unsigned bits, unsigned num)
+{
+  unsigned i, result = 0;
+  for(i = 0; i < num; i++) result |= ((bits >> (num - i - 1)) & 1u) << i;
+  return result;
 }
 
-/*the tree representation used by the decoder. return value is error*/
-static unsigned HuffmanTree_make2DTree(HuffmanTree* tree)
+/*
+the lookup table used by the decoder. return value is error.
+Deflate sends codes msb first while the bit reader gives the stream lsb first,
+so the table is indexed by the reversed codes: the next FIRSTBITS bits of the
+stream index the first level directly. A code of at most FIRSTBITS bits fills
+every entry that starts with it, with its length and symbol. Longer codes share
+the entry of their first FIRSTBITS bits, which holds the length of the longest
+of them and the start of a second level table indexed by the bits after those.
+Oversubscribed trees, and incomplete ones with more than one code, are
+error 55. The lone code of a one code tree (or no code at all, the distance
+tree of a block without matches) leaves entries unused, which decode to
+INVALIDSYMBOL.
+*/
+static unsigned HuffmanTree_makeTable(HuffmanTree* tree)
 {
-  unsigned nodefilled = 0; /*up to which node it is filled*/
-  unsigned treepos = 0; /*position in the tree (1 of the numcodes columns)*/
-  unsigned n, i;
+  const unsigned headsize = 1u << FIRSTBITS;
+  unsigned* maxlens; /*longest code starting with each first level index*/
+  size_t i, size, start, numpresent = 0;
 
-  tree->tree2d = (unsigned*)lodepng_malloc(tree->numcodes * 2 * sizeof(unsigned));
-  if(!tree->tree2d) return 83; /*alloc fail*/
+  maxlens = (unsigned*)lodepng_malloc(headsize * sizeof(unsigned));
+  if(!maxlens) return 83; /*alloc fail*/
+  for(i = 0; i < headsize; i++) maxlens[i] = 0;
+  for(i = 0; i < tree->numcodes; i++)
+  {
+    unsigned l = tree->lengths[i], index;
+    if(l <= FIRSTBITS) continue;
+    index = reverseBits(tree->tree1d[i] >> (l - FIRSTBITS), FIRSTBITS);
+    if(maxlens[index] < l) maxlens[index] = l;
+  }
 
-  /*
-  convert tree1d[] to tree2d[][]. In the 2D array, a value of 32767 means
-  uninited, a value >= numcodes is an address to another bit, a value < numcodes
-  is a code. The 2 rows are the 2 possible bit values (0 or 1), there are as
-  many columns as codes - 1.
-  A good huffmann tree has N * 2 - 1 nodes, of which N - 1 are internal nodes.
-  Here, the internal nodes are stored (what their 0 and 1 option point to).
-  There is only memory for such good tree currently, if there are more nodes
-  (due to too long length codes), error 55 will happen
-  */
-  for(n = 0; n < tree->numcodes * 2; n++)
+  size = headsize;
+  for(i = 0; i < headsize; i++)
+  {
+    if(maxlens[i] > FIRSTBITS) size += (size_t)1 << (maxlens[i] - FIRSTBITS);
+  }
+  tree->table_len = (unsigned char*)lodepng_malloc(size);
+  tree->table_value = (unsigned short*)lodepng_malloc(size * sizeof(unsigned short));
+  if(!tree->table_len || !tree->table_value)
+  {
+    lodepng_free(maxlens);
+    return 83; /*alloc fail*/
+  }
+
+  /*16 is longer than any code, it marks entries not filled in yet*/
+  for(i = 0; i < size; i++) tree->table_len[i] = 16;
+  start = headsize;
+  for(i = 0; i < headsize; i++)
   {
-    tree->tree2d[n] = 32767; /*32767 here means the tree2d isn't filled there yet*/
+    if(maxlens[i] <= FIRSTBITS) continue;
+    tree->table_len[i] = (unsigned char)maxlens[i];
+    tree->table_value[i] = (unsigned short)start;
+    start += (size_t)1 << (maxlens[i] - FIRSTBITS);
   }
+  lodepng_free(maxlens);
 
-  for(n = 0; n < tree->numcodes; n++) /*the codes*/
+  for(i = 0; i < tree->numcodes; i++)
   {
-    for(i = 0; i < tree->lengths[n]; i++) /*the bits for this code*/
+    unsigned l = tree->lengths[i], reversed, j, num;
+    if(l == 0) continue;
+    numpresent++;
+    reversed = reverseBits(tree->tree1d[i], l);
+    if(l <= FIRSTBITS)
     {
-      unsigned char bit = (unsigned char)((tree->tree1d[n] >> (tree->lengths[n] - i - 1)) & 1);
-      if(treepos > tree->numcodes - 2) return 55; /*oversubscribed, see comment in lodepng_error_text*/
-      if(tree->tree2d[2 * treepos + bit] == 32767) /*not yet filled in*/
+      /*every index whose low l bits are this code*/
+      num = 1u << (FIRSTBITS - l);
+      for(j = 0; j < num; j++)
       {
-        if(i + 1 == tree->lengths[n]) /*last bit*/
-        {
-          tree->tree2d[2 * treepos + bit] = n; /*put the current code in it*/
-          treepos = 0;
-        }
-        else
-        {
-          /*put address of the next step in here, first that address has to be found of course
-          (it's just nodefilled + 1)...*/
-          nodefilled++;
-          /*addresses encoded with numcodes added to it*/
-          tree->tree2d[2 * treepos + bit] = nodefilled + tree->numcodes;
-          treepos = nodefilled;
-        }
+        unsigned index = reversed | (j << l);
+        if(tree->table_len[index] != 16) return 55; /*oversubscribed, see comment in lodepng_error_text*/
+        tree->table_len[index] = (unsigned char)l;
+        tree->table_value[index] = (unsigned short)i;
+      }
+    }
+    else
+    {
+      unsigned index = reversed & (headsize - 1u);
+      unsigned sublen = tree->table_len[index] - FIRSTBITS; /*bits indexing the second level table*/
+      unsigned rest = l - FIRSTBITS; /*bits of this code after the first level*/
+      if(tree->table_len[index] < l) return 55; /*a shorter code already took this index*/
+      num = 1u << (sublen - rest);
+      for(j = 0; j < num; j++)
+      {
+        size_t index2 = tree->table_value[index] + ((reversed >> FIRSTBITS) | (j << rest));
+        if(tree->table_len[index2] != 16) return 55;
+        tree->table_len[index2] = (unsigned char)l;
+        tree->table_value[index2] = (unsigned short)i;
       }
-      else treepos = tree->tree2d[2 * treepos + bit] - tree->numcodes;
     }
   }
 
-  for(n = 0; n < tree->numcodes * 2; n++)
+  for(i = 0; i < size; i++)
   {
-    if(tree->tree2d[n] == 32767) tree->tree2d[n] = 0; /*remove possible remaining 32767's*/
+    if(tree->table_len[i] != 16) continue;
+    if(numpresent >= 2) return 55; /*incomplete: some bit patterns decode to nothing*/
+    /*a length the decoder can skip: at most FIRSTBITS in the first level, more in the second*/
+    tree->table_len[i] = (unsigned char)(i < headsize ? 1 : FIRSTBITS + 1);
+    tree->table_value[i] = INVALIDSYMBOL;
   }
 
   return 0;
 }
+#endif /*LODEPNG_COMPILE_DECODER*/
 
 /*
 Second step for the ...makeFromLengths and ...makeFromFrequencies functions.
@@ -624,8 +1247,7 @@ static unsigned HuffmanTree_makeFromLengths2(HuffmanTree* tree)
   uivector_cleanup(&blcount);
   uivector_cleanup(&nextcode);
 
-  if(!error) return HuffmanTree_make2DTree(tree);
-  else return error;
+  return error;
 }
 
 /*
@@ -648,95 +1270,50 @@ static unsigned HuffmanTree_makeFromLengths(HuffmanTree* tree, const unsigned* b
 #ifdef LODEPNG_COMPILE_ENCODER
 
 /*
-A coin, this is the terminology used for the package-merge algorithm and the
-coin collector's problem. This is used to generate the huffman tree.
-A coin can be multiple coins (when they're merged)
+Length limited code lengths with the package-merge algorithm (the coin collector's problem).
+The bottom level, maxbitlen, holds the present symbols sorted by frequency. Every level above
+holds them merged with the packages, each the sum of a pair, of the level below. The first
+2 * numpresent - 2 items of the top level are the solution, and the length of a symbol is
+the number of levels it's chosen in. Only whether an item is a symbol or a package is kept
+per level, in a bit: the chosen symbols of a level are always its cheapest ones, and the
+chosen packages of a level are made of the first items of the level below, so one pass from
+the top counts how many symbols each level chooses. For deflate's alphabets all memory is on
+the stack.
 */
-typedef struct Coin
-{
-  uivector symbols;
-  float weight; /*the sum of all weights in this coin*/
-} Coin;
-
-static void coin_init(Coin* c)
-{
-  uivector_init(&c->symbols);
-}
-
-/*argument c is void* so that this dtor can be given as function pointer to the vector resize function*/
-static void coin_cleanup(void* c)
-{
-  uivector_cleanup(&((Coin*)c)->symbols);
-}
+#define HUFFMAN_STACK_SYMBOLS 288u
+#define HUFFMAN_STACK_BITLEN 15u
 
-static void coin_copy(Coin* c1, const Coin* c2)
+/*stable merge sort of the symbols by increasing frequency, temp has room for num symbols*/
+static void sortByFrequency(unsigned* symbols, unsigned* temp, size_t num, const unsigned* frequencies)
 {
-  c1->weight = c2->weight;
-  uivector_copy(&c1->symbols, &c2->symbols);
-}
-
-static void add_coins(Coin* c1, const Coin* c2)
-{
-  size_t i;
-  for(i = 0; i < c2->symbols.size; i++) uivector_push_back(&c1->symbols, c2->symbols.data[i]);
-  c1->weight += c2->weight;
-}
-
-static void init_coins(Coin* coins, size_t num)
-{
-  size_t i;
-  for(i = 0; i < num; i++) coin_init(&coins[i]);
-}
-
-static void cleanup_coins(Coin* coins, size_t num)
-{
-  size_t i;
-  for(i = 0; i < num; i++) coin_cleanup(&coins[i]);
-}
-
-static int coin_compare(const void* a, const void* b) {
-  float wa = ((const Coin*)a)->weight;
-  float wb = ((const Coin*)b)->weight;
-  return wa > wb ? 1 : wa < wb ? -1 : 0;
-}
-
-static unsigned append_symbol_coins(Coin* coins, const unsigned* frequencies, unsigned numcodes, size_t sum)
-{
-  unsigned i;
-  unsigned j = 0; /*index of present symbols*/
-  for(i = 0; i < numcodes; i++)
+  unsigned* from = symbols;
+  unsigned* to = temp;
+  size_t width, i;
+  for(width = 1; width < num; width *= 2)
   {
-    if(frequencies[i] != 0) /*only include symbols that are present*/
+    unsigned* swap;
+    for(i = 0; i < num; i += 2 * width)
     {
-      coins[j].weight = frequencies[i] / (float)sum;
-      uivector_push_back(&coins[j].symbols, i);
-      j++;
+      size_t a = i, mid = i + width < num ? i + width : num;
+      size_t b = mid, end = i + 2 * width < num ? i + 2 * width : num, k = i;
+      while(a < mid && b < end) to[k++] = frequencies[from[b]] < frequencies[from[a]] ? from[b++] : from[a++];
+      while(a < mid) to[k++] = from[a++];
+      while(b < end) to[k++] = from[b++];
     }
+    swap = from; from = to; to = swap;
   }
-  return 0;
+  if(from != symbols) memcpy(symbols, from, num * sizeof(unsigned));
 }
 
 unsigned lodepng_huffman_code_lengths(unsigned* lengths, const unsigned* frequencies,
                                       size_t numcodes, unsigned maxbitlen)
 {
-  unsigned i, j;
-  size_t sum = 0, numpresent = 0;
-  unsigned error = 0;
-  Coin* coins; /*the coins of the currently calculated row*/
-  Coin* prev_row; /*the previous row of coins*/
-  size_t numcoins;
-  size_t coinmem;
+  unsigned i;
+  size_t numpresent = 0;
 
   if(numcodes == 0) return 80; /*error: a tree of 0 symbols is not supposed to be made*/
 
-  for(i = 0; i < numcodes; i++)
-  {
-    if(frequencies[i] > 0)
-    {
-      numpresent++;
-      sum += frequencies[i];
-    }
-  }
+  for(i = 0; i < numcodes; i++) if(frequencies[i] > 0) numpresent++;
 
   for(i = 0; i < numcodes; i++) lengths[i] = 0;
 
@@ -763,76 +1340,81 @@ unsigned lodepng_huffman_code_lengths(unsigned* lengths, const unsigned* frequen
   }
   else
   {
-    /*Package-Merge algorithm represented by coin collector's problem
-    For every symbol, maxbitlen coins will be created*/
-
-    coinmem = numpresent * 2; /*max amount of coins needed with the current algo*/
-    coins = (Coin*)lodepng_malloc(sizeof(Coin) * coinmem);
-    prev_row = (Coin*)lodepng_malloc(sizeof(Coin) * coinmem);
-    if(!coins || !prev_row)
-    {
-      lodepng_free(coins);
-      lodepng_free(prev_row);
-      return 83; /*alloc fail*/
-    }
-    init_coins(coins, coinmem);
-    init_coins(prev_row, coinmem);
-
-    /*first row, lowest denominator*/
-    error = append_symbol_coins(coins, frequencies, numcodes, sum);
-    numcoins = numpresent;
-    qsort(coins, numcoins, sizeof(Coin), coin_compare);
-    if(!error)
-    {
-      unsigned numprev = 0;
-      for(j = 1; j <= maxbitlen && !error; j++) /*each of the remaining rows*/
+    /*symbols, the sort's temp space, two levels of weights and a bit per item per level*/
+    unsigned long long stackmem[HUFFMAN_STACK_SYMBOLS + 2 * 2 * HUFFMAN_STACK_SYMBOLS
+                                + (HUFFMAN_STACK_BITLEN * 2 * HUFFMAN_STACK_SYMBOLS + 63) / 64];
+    unsigned long long* mem = stackmem;
+    unsigned long long *weights, *prev, *swap; /*of the level being built and the one below it*/
+    unsigned* symbols;
+    unsigned char* items; /*bit k of level l, at l * width + k: item k is a symbol, not a package*/
+    size_t width = 2 * numpresent; /*most items a level can have*/
+    size_t size, prevsize, j, k, l;
+
+    if(maxbitlen < 64 && ((unsigned long long)1 << maxbitlen) < numpresent) return 80; /*error: can't code them all*/
+    if(maxbitlen > numpresent) maxbitlen = (unsigned)numpresent; /*no code gets longer anyway*/
+    if(numpresent > HUFFMAN_STACK_SYMBOLS || maxbitlen > HUFFMAN_STACK_BITLEN)
+    {
+      mem = (unsigned long long*)lodepng_malloc((numpresent + 2 * width + (maxbitlen * width + 63) / 64)
+                                                * sizeof(unsigned long long));
+      if(!mem) return 83; /*alloc fail*/
+    }
+    symbols = (unsigned*)mem;
+    weights = mem + numpresent;
+    prev = weights + width;
+    items = (unsigned char*)(prev + width);
+    memset(items, 0, (maxbitlen * width + 7) / 8);
+
+    for(i = 0, j = 0; i < numcodes; i++) if(frequencies[i]) symbols[j++] = i;
+    sortByFrequency(symbols, (unsigned*)weights, numpresent, frequencies);
+
+    /*the bottom level: all symbols*/
+    l = maxbitlen - 1;
+    for(j = 0; j < numpresent; j++)
+    {
+      weights[j] = frequencies[symbols[j]];
+      items[(l * width + j) >> 3] |= (unsigned char)(1u << ((l * width + j) & 7));
+    }
+    size = numpresent;
+
+    /*each level above: the symbols merged with the packages of the level below, symbols first on ties*/
+    while(l-- > 0)
+    {
+      size_t numpackages;
+      swap = prev; prev = weights; weights = swap;
+      prevsize = size;
+      numpackages = prevsize / 2;
+      j = 0; /*next symbol*/
+      k = 0; /*next package*/
+      for(size = 0; j < numpresent || k < numpackages; size++)
       {
-        unsigned tempnum;
-        Coin* tempcoins;
-        /*swap prev_row and coins, and their amounts*/
-        tempcoins = prev_row; prev_row = coins; coins = tempcoins;
-        tempnum = numprev; numprev = numcoins; numcoins = tempnum;
-
-        cleanup_coins(coins, numcoins);
-        init_coins(coins, numcoins);
-
-        numcoins = 0;
-
-        /*fill in the merged coins of the previous row*/
-        for(i = 0; i + 1 < numprev; i += 2)
+        unsigned long long package = k < numpackages ? prev[2 * k] + prev[2 * k + 1] : 0;
+        if(j < numpresent && (k >= numpackages || frequencies[symbols[j]] <= package))
         {
-          /*merge prev_row[i] and prev_row[i + 1] into new coin*/
-          Coin* coin = &coins[numcoins++];
-          coin_copy(coin, &prev_row[i]);
-          add_coins(coin, &prev_row[i + 1]);
+          weights[size] = frequencies[symbols[j++]];
+          items[(l * width + size) >> 3] |= (unsigned char)(1u << ((l * width + size) & 7));
         }
-        /*fill in all the original symbols again*/
-        if(j < maxbitlen)
+        else
         {
-          error = append_symbol_coins(coins + numcoins, frequencies, numcodes, sum);
-          numcoins += numpresent;
+          weights[size] = package;
+          k++;
         }
-        qsort(coins, numcoins, sizeof(Coin), coin_compare);
       }
     }
 
-    if(!error)
+    /*from the top, the chosen symbols of each level get a bit longer*/
+    k = 2 * numpresent - 2; /*items chosen in the level*/
+    for(l = 0; l < maxbitlen && k > 0; l++)
     {
-      /*calculate the lenghts of each symbol, as the amount of times a coin of each symbol is used*/
-      for(i = 0; i < numpresent - 1; i++)
-      {
-        Coin* coin = &coins[i];
-        for(j = 0; j < coin->symbols.size; j++) lengths[coin->symbols.data[j]]++;
-      }
+      size_t numsymbols = 0;
+      for(j = 0; j < k; j++) numsymbols += (items[(l * width + j) >> 3] >> ((l * width + j) & 7)) & 1u;
+      for(j = 0; j < numsymbols; j++) lengths[symbols[j]]++;
+      k = 2 * (k - numsymbols);
     }
 
-    cleanup_coins(coins, coinmem);
-    lodepng_free(coins);
-    cleanup_coins(prev_row, coinmem);
-    lodepng_free(prev_row);
+    if(mem != stackmem) lodepng_free(mem);
   }
 
-  return error;
+  return 0;
 }
 
 /*Create the Huffman tree given the symbol frequencies*/
@@ -901,27 +1483,24 @@ static unsigned generateFixedDistanceTree(HuffmanTree* tree)
 #ifdef LODEPNG_COMPILE_DECODER
 
 /*
-returns the code, or (unsigned)(-1) if error happened
-inbitlength is the length of the complete buffer, in bits (so its byte length times 8)
+returns the symbol, or INVALIDSYMBOL for a bit pattern that is no code of the tree.
+The reader must hold at least the 15 bits of the longest code, see ensureBits
 */
-static unsigned huffmanDecodeSymbol(const unsigned char* in, size_t* bp,
-                                    const HuffmanTree* codetree, size_t inbitlength)
+static unsigned huffmanDecodeSymbol(BitReader* reader, const HuffmanTree* codetree)
 {
-  unsigned treepos = 0, ct;
-  for(;;)
+  unsigned index = peekBits(reader, FIRSTBITS);
+  unsigned l = codetree->table_len[index];
+  unsigned value = codetree->table_value[index];
+  if(l <= FIRSTBITS)
   {
-    if(*bp >= inbitlength) return (unsigned)(-1); /*error: end of input memory reached without endcode*/
-    /*
-    decode the symbol from the tree. The "readBitFromStream" code is inlined in
-    the expression below because this is the biggest bottleneck while decoding
-    */
-    ct = codetree->tree2d[(treepos << 1) + READBIT(*bp, in)];
-    (*bp)++;
-    if(ct < codetree->numcodes) return ct; /*the symbol is decoded, return it*/
-    else treepos = ct - codetree->numcodes; /*symbol not yet decoded, instead move tree position*/
-
-    if(treepos >= codetree->numcodes) return (unsigned)(-1); /*error: it appeared outside the codetree*/
+    advanceBits(reader, l);
+    return value;
   }
+  /*a longer code, value is where the second level table of its first FIRSTBITS bits starts*/
+  advanceBits(reader, FIRSTBITS);
+  index = value + peekBits(reader, l - FIRSTBITS);
+  advanceBits(reader, codetree->table_len[index] - FIRSTBITS);
+  return codetree->table_value[index];
 }
 #endif /*LODEPNG_COMPILE_DECODER*/
 
@@ -932,21 +1511,21 @@ static unsigned huffmanDecodeSymbol(const unsigned char* in, size_t* bp,
 /* ////////////////////////////////////////////////////////////////////////// */
 
 /*get the tree of a deflated block with fixed tree, as specified in the deflate specification*/
-static void getTreeInflateFixed(HuffmanTree* tree_ll, HuffmanTree* tree_d)
+static unsigned getTreeInflateFixed(HuffmanTree* tree_ll, HuffmanTree* tree_d)
 {
-  /*TODO: check for out of memory errors*/
-  generateFixedLitLenTree(tree_ll);
-  generateFixedDistanceTree(tree_d);
+  unsigned error = generateFixedLitLenTree(tree_ll);
+  if(!error) error = HuffmanTree_makeTable(tree_ll);
+  if(!error) error = generateFixedDistanceTree(tree_d);
+  if(!error) error = HuffmanTree_makeTable(tree_d);
+  return error;
 }
 
 /*get the tree of a deflated block with dynamic tree, the tree itself is also Huffman compressed with a known tree*/
-static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
-                                      const unsigned char* in, size_t* bp, size_t inlength)
+static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d, BitReader* reader)
 {
   /*make sure that length values that aren't filled in will be 0, or a wrong tree will be generated*/
   unsigned error = 0;
   unsigned n, HLIT, HDIST, HCLEN, i;
-  size_t inbitlength = inlength * 8;
 
   /*see comments in deflateDynamic for explanation of the context and these variables, it is analogous*/
   unsigned* bitlen_ll = 0; /*lit,len code lengths*/
@@ -955,14 +1534,14 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
   unsigned* bitlen_cl = 0;
   HuffmanTree tree_cl; /*the code tree for code length codes (the huffman tree for compressed huffman trees)*/
 
-  if((*bp) >> 3 >= inlength - 2) return 49; /*error: the bit pointer is or will go past the memory*/
+  if((BitReader_bitpos(reader) >> 3) + 2 >= reader->bitsize >> 3) return 49; /*error: the bit pointer is or will go past the memory*/
 
   /*number of literal/length codes + 257. Unlike the spec, the value 257 is added to it here already*/
-  HLIT =  readBitsFromStream(bp, in, 5) + 257;
+  HLIT =  readBits(reader, 5) + 257;
   /*number of distance codes. Unlike the spec, the value 1 is added to it here already*/
-  HDIST = readBitsFromStream(bp, in, 5) + 1;
+  HDIST = readBits(reader, 5) + 1;
   /*number of code length codes. Unlike the spec, the value 4 is added to it here already*/
-  HCLEN = readBitsFromStream(bp, in, 4) + 4;
+  HCLEN = readBits(reader, 4) + 4;
 
   HuffmanTree_init(&tree_cl);
 
@@ -975,11 +1554,12 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
 
     for(i = 0; i < NUM_CODE_LENGTH_CODES; i++)
     {
-      if(i < HCLEN) bitlen_cl[CLCL_ORDER[i]] = readBitsFromStream(bp, in, 3);
+      if(i < HCLEN) bitlen_cl[CLCL_ORDER[i]] = readBits(reader, 3);
       else bitlen_cl[CLCL_ORDER[i]] = 0; /*if not, it must stay 0*/
     }
 
     error = HuffmanTree_makeFromLengths(&tree_cl, bitlen_cl, NUM_CODE_LENGTH_CODES, 7);
+    if(!error) error = HuffmanTree_makeTable(&tree_cl);
     if(error) break;
 
     /*now we can use this tree to read the lengths for the tree that this function will return*/
@@ -993,7 +1573,10 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
     i = 0;
     while(i < HLIT + HDIST)
     {
-      unsigned code = huffmanDecodeSymbol(in, bp, &tree_cl, inbitlength);
+      unsigned code;
+      ensureBits(reader, 14); /*a code length code and its extra bits*/
+      code = huffmanDecodeSymbol(reader, &tree_cl);
+      if(BitReader_bitpos(reader) > reader->bitsize) ERROR_BREAK(10); /*error: end of input memory reached*/
       if(code <= 15) /*a length code*/
       {
         if(i < HLIT) bitlen_ll[i] = code;
@@ -1005,10 +1588,11 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
         unsigned replength = 3; /*read in the 2 bits that indicate repeat length (3-6)*/
         unsigned value; /*set value to the previous code*/
 
-        if(*bp >= inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
         if (i == 0) ERROR_BREAK(54); /*can't repeat previous if i is 0*/
 
-        replength += readBitsFromStream(bp, in, 2);
+        replength += peekBits(reader, 2);
+        advanceBits(reader, 2);
+        if(BitReader_bitpos(reader) > reader->bitsize) ERROR_BREAK(50); /*error, bit pointer jumped past memory*/
 
         if(i < HLIT + 1) value = bitlen_ll[i - 1];
         else value = bitlen_d[i - HLIT - 1];
@@ -1024,9 +1608,10 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
       else if(code == 17) /*repeat "0" 3-10 times*/
       {
         unsigned replength = 3; /*read in the bits that indicate repeat length*/
-        if(*bp >= inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
 
-        replength += readBitsFromStream(bp, in, 3);
+        replength += peekBits(reader, 3);
+        advanceBits(reader, 3);
+        if(BitReader_bitpos(reader) > reader->bitsize) ERROR_BREAK(50); /*error, bit pointer jumped past memory*/
 
         /*repeat this value in the next lengths*/
         for(n = 0; n < replength; n++)
@@ -1041,9 +1626,10 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
       else if(code == 18) /*repeat "0" 11-138 times*/
       {
         unsigned replength = 11; /*read in the bits that indicate repeat length*/
-        if(*bp >= inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
 
-        replength += readBitsFromStream(bp, in, 7);
+        replength += peekBits(reader, 7);
+        advanceBits(reader, 7);
+        if(BitReader_bitpos(reader) > reader->bitsize) ERROR_BREAK(50); /*error, bit pointer jumped past memory*/
 
         /*repeat this value in the next lengths*/
         for(n = 0; n < replength; n++)
@@ -1055,14 +1641,9 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
           i++;
         }
       }
-      else /*if(code == (unsigned)(-1))*/ /*huffmanDecodeSymbol returns (unsigned)(-1) in case of error*/
+      else
       {
-        if(code == (unsigned)(-1))
-        {
-          /*return error code 10 or 11 depending on the situation that happened in huffmanDecodeSymbol
-          (10=no endcode, 11=wrong jump outside of tree)*/
-          error = (*bp) > inbitlength ? 10 : 11;
-        }
+        if(code == INVALIDSYMBOL) error = 11; /*a bit pattern that isn't a code of the tree*/
         else error = 16; /*unexisting code, this can never happen*/
         break;
       }
@@ -1073,8 +1654,9 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
 
     /*now we've finally got HLIT and HDIST, so generate the code trees, and the function is done*/
     error = HuffmanTree_makeFromLengths(tree_ll, bitlen_ll, NUM_DEFLATE_CODE_SYMBOLS, 15);
-    if(error) break;
-    error = HuffmanTree_makeFromLengths(tree_d, bitlen_d, NUM_DISTANCE_SYMBOLS, 15);
+    if(!error) error = HuffmanTree_makeTable(tree_ll);
+    if(!error) error = HuffmanTree_makeFromLengths(tree_d, bitlen_d, NUM_DISTANCE_SYMBOLS, 15);
+    if(!error) error = HuffmanTree_makeTable(tree_d);
 
     break; /*end of error-while*/
   }
@@ -1087,58 +1669,115 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
   return error;
 }
 
+/*
+copies a match of length bytes from distance bytes back to out. There must be
+room for 8 bytes past the match: the copy writes whole 8 byte words, the last
+of which may run over
+*/
+static void copyMatch(unsigned char* out, size_t distance, size_t length)
+{
+  unsigned char* end = out + length;
+  const unsigned char* src = out - distance;
+  if(distance >= 8)
+  {
+    /*the 8 bytes each word comes from are all behind it, already written*/
+    for(; out < end; out += 8, src += 8) memcpy(out, src, 8);
+  }
+  else if(distance == 1) memset(out, *src, length);
+  else
+  {
+    /*a match closer than 8 bytes repeats its first distance bytes: write them as
+    an 8 byte pattern, stepping by the whole periods in it*/
+    unsigned char pattern[8];
+    size_t i, step = 8 - 8 % distance;
+    for(i = 0; i < 8; i++) pattern[i] = src[i % distance];
+    for(; out < end; out += step) memcpy(out, pattern, 8);
+  }
+}
+
+/*
+Where the inflator writes to. Normally out grows to hold all of the output. For
+the row by row PNG decoder out has a fixed size instead, and flush is called
+when it runs full: it passes on the output it can and moves the last 32768
+bytes, as far back as deflate distances reach, to the front, changing pos. It
+must leave room for needed bytes, which is at most 65535.
+*/
+typedef struct InflateOutput
+{
+  ucvector* out;
+  size_t pos; /*bytes of output in out*/
+  unsigned (*flush)(struct InflateOutput* output, size_t needed);
+  void* context;
+} InflateOutput;
+
+/*makes room for needed more bytes at output->pos, return value is error*/
+static unsigned inflateReserve(InflateOutput* output, size_t needed)
+{
+  if(output->pos + needed <= output->out->size) return 0;
+  if(output->flush) return output->flush(output, needed);
+  /*reserve more room at once*/
+  if(!ucvector_resize(output->out, (output->pos + needed) * 2)) return 83; /*alloc fail*/
+  return 0;
+}
+
 /*inflate a block with dynamic of fixed Huffman tree*/
-static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size_t* bp,
-                                    size_t* pos, size_t inlength, unsigned btype)
+static unsigned inflateHuffmanBlock(InflateOutput* output, BitReader* reader, unsigned btype)
 {
   unsigned error = 0;
   HuffmanTree tree_ll; /*the huffman tree for literal and length codes*/
   HuffmanTree tree_d; /*the huffman tree for distance codes*/
-  size_t inbitlength = inlength * 8;
+  ucvector* out = output->out;
 
   HuffmanTree_init(&tree_ll);
   HuffmanTree_init(&tree_d);
 
-  if(btype == 1) getTreeInflateFixed(&tree_ll, &tree_d);
-  else if(btype == 2) error = getTreeInflateDynamic(&tree_ll, &tree_d, in, bp, inlength);
+  if(btype == 1) error = getTreeInflateFixed(&tree_ll, &tree_d);
+  else if(btype == 2) error = getTreeInflateDynamic(&tree_ll, &tree_d, reader);
 
   while(!error) /*decode all symbols until end reached, breaks at end code*/
   {
     /*code_ll is literal, length or end code*/
-    unsigned code_ll = huffmanDecodeSymbol(in, bp, &tree_ll, inbitlength);
+    unsigned code_ll;
+    /*one refill covers a length code, a distance code and their extra bits*/
+    ensureBits(reader, 48);
+    code_ll = huffmanDecodeSymbol(reader, &tree_ll);
+    /*only once the reader has run out of input can the code be made up of zeros past its end*/
+    if(reader->next > reader->size && BitReader_bitpos(reader) > reader->bitsize)
+    {
+      ERROR_BREAK(10); /*error: end of input memory reached without endcode*/
+    }
+
     if(code_ll <= 255) /*literal symbol*/
     {
-      if((*pos) >= out->size)
+      if(output->pos >= out->size)
       {
-        /*reserve more room at once*/
-        if(!ucvector_resize(out, ((*pos) + 1) * 2)) ERROR_BREAK(83 /*alloc fail*/);
+        error = inflateReserve(output, 1);
+        if(error) break;
       }
-      out->data[(*pos)] = (unsigned char)(code_ll);
-      (*pos)++;
+      out->data[output->pos] = (unsigned char)(code_ll);
+      output->pos++;
     }
     else if(code_ll >= FIRST_LENGTH_CODE_INDEX && code_ll <= LAST_LENGTH_CODE_INDEX) /*length code*/
     {
       unsigned code_d, distance;
       unsigned numextrabits_l, numextrabits_d; /*extra bits for length and distance*/
-      size_t start, forward, backward, length;
+      size_t length;
 
       /*part 1: get length base*/
       length = LENGTHBASE[code_ll - FIRST_LENGTH_CODE_INDEX];
 
       /*part 2: get extra bits and add the value of that to length*/
       numextrabits_l = LENGTHEXTRA[code_ll - FIRST_LENGTH_CODE_INDEX];
-      if(*bp >= inbitlength) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
-      length += readBitsFromStream(bp, in, numextrabits_l);
+      length += peekBits(reader, numextrabits_l);
+      advanceBits(reader, numextrabits_l);
 
       /*part 3: get distance code*/
-      code_d = huffmanDecodeSymbol(in, bp, &tree_d, inbitlength);
+      code_d = huffmanDecodeSymbol(reader, &tree_d);
       if(code_d > 29)
       {
-        if(code_ll == (unsigned)(-1)) /*huffmanDecodeSymbol returns (unsigned)(-1) in case of error*/
+        if(code_d == INVALIDSYMBOL) /*a bit pattern that isn't a code of the tree*/
         {
-          /*return error code 10 or 11 depending on the situation that happened in huffmanDecodeSymbol
-          (10=no endcode, 11=wrong jump outside of tree)*/
-          error = (*bp) > inlength * 8 ? 10 : 11;
+          error = BitReader_bitpos(reader) > reader->bitsize ? 10 : 11;
         }
         else error = 18; /*error: invalid distance code (30-31 are never used)*/
         break;
@@ -1147,37 +1786,35 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
 
       /*part 4: get extra bits from distance*/
       numextrabits_d = DISTANCEEXTRA[code_d];
-      if(*bp >= inbitlength) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
-
-      distance += readBitsFromStream(bp, in, numextrabits_d);
+      distance += peekBits(reader, numextrabits_d);
+      advanceBits(reader, numextrabits_d);
+      if(BitReader_bitpos(reader) > reader->bitsize) ERROR_BREAK(51); /*error, bit pointer jumped past memory*/
 
       /*part 5: fill in all the out[n] values based on the length and dist*/
-      start = (*pos);
-      if(distance > start) ERROR_BREAK(52); /*too long backward distance*/
-      backward = start - distance;
-      if((*pos) + length >= out->size)
+      if(distance > output->pos) ERROR_BREAK(52); /*too long backward distance*/
+      if(output->pos + length + 8 > out->size)
       {
-        /*reserve more room at once*/
-        if(!ucvector_resize(out, ((*pos) + length) * 2)) ERROR_BREAK(83 /*alloc fail*/);
+        error = inflateReserve(output, length);
+        if(error) break;
       }
-
-      for(forward = 0; forward < length; forward++)
+      if(output->pos + length + 8 <= out->size) copyMatch(out->data + output->pos, distance, length);
+      else
       {
-        out->data[(*pos)] = out->data[backward];
-        (*pos)++;
-        backward++;
-        if(backward >= start) backward = start - distance;
+        /*at the very end of out, without room for copyMatch to run over*/
+        unsigned char* match = out->data + output->pos;
+        size_t i;
+        for(i = 0; i < length; i++) match[i] = match[i - distance];
       }
+      output->pos += length;
     }
     else if(code_ll == 256)
     {
       break; /*end code, break the loop*/
     }
-    else /*if(code == (unsigned)(-1))*/ /*huffmanDecodeSymbol returns (unsigned)(-1) in case of error*/
+    else
     {
-      /*return error code 10 or 11 depending on the situation that happened in huffmanDecodeSymbol
-      (10=no endcode, 11=wrong jump outside of tree)*/
-      error = (*bp) > inlength * 8 ? 10 : 11;
+      /*an invalid bit pattern, or one of the unused codes 286-287*/
+      error = 11;
       break;
     }
   }
@@ -1188,66 +1825,96 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
   return error;
 }
 
-static unsigned inflateNoCompression(ucvector* out, const unsigned char* in, size_t* bp, size_t* pos, size_t inlength)
+static unsigned inflateNoCompression(InflateOutput* output, BitReader* reader)
 {
+  size_t p, inlength = reader->bitsize / 8;
+  unsigned LEN, NLEN;
+  unsigned char* data;
+
   /*go to first boundary of byte*/
-  size_t p;
-  unsigned LEN, NLEN, n, error = 0;
-  while(((*bp) & 0x7) != 0) (*bp)++;
-  p = (*bp) / 8; /*byte position*/
+  advanceBits(reader, reader->avail & 7);
+  p = BitReader_bitpos(reader) / 8; /*byte position*/
 
   /*read LEN (2 bytes) and NLEN (2 bytes)*/
-  if(p >= inlength - 4) return 52; /*error, bit pointer will jump past memory*/
-  LEN = in[p] + 256u * in[p + 1]; p += 2;
-  NLEN = in[p] + 256u * in[p + 1]; p += 2;
+  if(p + 4 >= inlength) return 52; /*error, bit pointer will jump past memory*/
+  LEN = readBits(reader, 16);
+  NLEN = readBits(reader, 16);
 
   /*check if 16-bit NLEN is really the one's complement of LEN*/
   if(LEN + NLEN != 65535) return 21; /*error: NLEN is not one's complement of LEN*/
 
-  if((*pos) + LEN >= out->size)
-  {
-    if(!ucvector_resize(out, (*pos) + LEN)) return 83; /*alloc fail*/
-  }
-
   /*read the literal data: LEN bytes are now stored in the out buffer*/
-  if(p + LEN > inlength) return 23; /*error: reading outside of in buffer*/
-  for(n = 0; n < LEN; n++) out->data[(*pos)++] = in[p++];
+  if(p + 4 + LEN > inlength) return 23; /*error: reading outside of in buffer*/
+  CERROR_TRY_RETURN(inflateReserve(output, LEN));
+  data = output->out->data + output->pos;
+  output->pos += LEN;
 
-  (*bp) = p * 8;
+  /*the first bytes can still be in the bit buffer, the rest are copied from the input*/
+  for(; LEN > 0 && reader->avail > 0; LEN--) *data++ = (unsigned char)readBits(reader, 8);
+  while(LEN > 0)
+  {
+    size_t n;
+    if(reader->next >= reader->size)
+    {
+      /*can't fail, the pieces add up to inlength*/
+      if(!reader->nextpiece || !reader->nextpiece(reader)) return 23;
+      continue;
+    }
+    n = reader->size - reader->next;
+    if(n > LEN) n = LEN;
+    memcpy(data, reader->data + reader->next, n);
+    data += n;
+    reader->next += n;
+    LEN -= (unsigned)n;
+  }
+  /*any bits left in the buffer came from before the bytes copied past it*/
+  if(reader->avail == 0) reader->buffer = 0;
 
-  return error;
+  return 0;
 }
 
-static unsigned lodepng_inflatev(ucvector* out,
-                                 const unsigned char* in, size_t insize,
-                                 const LodePNGDecompressSettings* settings)
+/*decodes the deflate blocks up to and including the final one*/
+static unsigned inflateBlocks(InflateOutput* output, BitReader* reader)
 {
-  /*bit pointer in the "in" data, current byte is bp >> 3, current bit is bp & 0x7 (from lsb to msb of the byte)*/
-  size_t bp = 0;
   unsigned BFINAL = 0;
-  size_t pos = 0; /*byte position in the out buffer*/
-
   unsigned error = 0;
 
-  (void)settings;
-
   while(!BFINAL)
   {
     unsigned BTYPE;
-    if(bp + 2 >= insize * 8) return 52; /*error, bit pointer will jump past memory*/
-    BFINAL = readBitFromStream(&bp, in);
-    BTYPE = 1u * readBitFromStream(&bp, in);
-    BTYPE += 2u * readBitFromStream(&bp, in);
+    if(BitReader_bitpos(reader) + 2 >= reader->bitsize) return 52; /*error, bit pointer will jump past memory*/
+    BFINAL = readBits(reader, 1);
+    BTYPE = readBits(reader, 2);
 
     if(BTYPE == 3) return 20; /*error: invalid BTYPE*/
-    else if(BTYPE == 0) error = inflateNoCompression(out, in, &bp, &pos, insize); /*no compression*/
-    else error = inflateHuffmanBlock(out, in, &bp, &pos, insize, BTYPE); /*compression, BTYPE 01 or 10*/
+    else if(BTYPE == 0) error = inflateNoCompression(output, reader); /*no compression*/
+    else error = inflateHuffmanBlock(output, reader, BTYPE); /*compression, BTYPE 01 or 10*/
 
     if(error) return error;
   }
+  return 0;
+}
+
+static unsigned lodepng_inflatev(ucvector* out,
+                                 const unsigned char* in, size_t insize,
+                                 const LodePNGDecompressSettings* settings)
+{
+  BitReader reader;
+  InflateOutput output;
+  unsigned error;
+
+  (void)settings;
+
+  BitReader_init(&reader, in, insize);
+  output.out = out;
+  output.pos = 0; /*byte position in the out buffer*/
+  output.flush = 0;
+  output.context = 0;
+  error = inflateBlocks(&output, &reader);
+  if(error) return error;
 
   /*Only now we know the true size of out, resize it to that*/
-  if(!ucvector_resize(out, pos)) error = 83; /*alloc fail*/
+  if(!ucvector_resize(out, output.pos)) error = 83; /*alloc fail*/
 
   return error;
 }
@@ -1438,6 +2105,122 @@ static void updateHashChain(Hash* hash, size_t wpos, unsigned hashval, unsigned
   hash->headz[numzeros] = wpos;
 }
 
+/*Feeds in[dictpos, inpos) into a fresh hash without encoding anything, so that
+encodeLZ77 starting at inpos can refer back to those bytes as if it had encoded them*/
+static void hash_prime(Hash* hash, const unsigned char* in, size_t dictpos, size_t inpos,
+                       size_t insize, unsigned windowsize)
+{
+  size_t pos;
+  unsigned numzeros = 0;
+  for(pos = dictpos; pos < inpos; pos++)
+  {
+    unsigned hashval = getHash(in, insize, pos);
+    if(hashval == 0)
+    {
+      if(numzeros == 0) numzeros = countZeros(in, insize, pos);
+      else if(pos + numzeros > insize || in[pos + numzeros - 1] != 0) numzeros--;
+    }
+    else
+    {
+      numzeros = 0;
+    }
+    updateHashChain(hash, pos & (windowsize - 1), hashval, numzeros);
+  }
+}
+
+/*
+Hash of the 4 bytes at pos for the single probe match finder: multiplicative (Knuth),
+which spreads the filtered PNG data, dominated by small values, far better than getHash
+does. Needs pos + 4 <= size.
+*/
+static unsigned getHashFast(const unsigned char* data, size_t pos)
+{
+  unsigned v = (unsigned)data[pos] | ((unsigned)data[pos + 1] << 8)
+             | ((unsigned)data[pos + 2] << 16) | ((unsigned)data[pos + 3] << 24);
+  return (v * 2654435761u) >> 16; /*HASH_NUM_VALUES == 1 << 16*/
+}
+
+/*hash_prime for encodeLZ77Fast, which only uses the hash heads*/
+static void hash_prime_fast(Hash* hash, const unsigned char* in, size_t dictpos, size_t inpos,
+                            size_t insize, unsigned windowsize)
+{
+  size_t pos;
+  for(pos = dictpos; pos < inpos && pos + 4 <= insize; pos++)
+  {
+    hash->head[getHashFast(in, pos)] = (int)(pos & (windowsize - 1));
+  }
+}
+
+/*
+The match finder for maxchain 1 (compression level 1), built for speed like zlib's
+deflate_fast: one hash table lookup of the last position with the same 4 byte hash, no
+chains, no lazy matching and no zeros chain. The head stores circular positions, so an
+entry older than the window points at some other recent position instead; the bytes are
+always compared, which makes that (and hash collisions) only a missed match, never a
+wrong one.
+*/
+static unsigned encodeLZ77Fast(uivector* out, Hash* hash,
+                               const unsigned char* in, size_t inpos, size_t insize, unsigned windowsize,
+                               unsigned minmatch, unsigned nicematch)
+{
+  size_t pos = inpos;
+  unsigned mask = windowsize - 1;
+
+  if(windowsize <= 0 || windowsize > 32768) return 60; /*error: windowsize smaller/larger than allowed*/
+  if((windowsize & (windowsize - 1)) != 0) return 90; /*error: must be power of two*/
+
+  if(nicematch > MAX_SUPPORTED_DEFLATE_LENGTH) nicematch = MAX_SUPPORTED_DEFLATE_LENGTH;
+
+  while(pos < insize)
+  {
+    unsigned length = 0, offset = 0;
+    if(pos + 4 <= insize)
+    {
+      unsigned hashval = getHashFast(in, pos);
+      int head = hash->head[hashval];
+      hash->head[hashval] = (int)(pos & mask);
+      if(head != -1)
+      {
+        offset = ((unsigned)pos - (unsigned)head) & mask;
+        if(offset > 0)
+        {
+          const unsigned char* foreptr = &in[pos];
+          const unsigned char* backptr = &in[pos - offset];
+          const unsigned char* lastptr = &in[insize < pos + MAX_SUPPORTED_DEFLATE_LENGTH
+                                             ? insize : pos + MAX_SUPPORTED_DEFLATE_LENGTH];
+          while(foreptr != lastptr && *backptr == *foreptr)
+          {
+            ++backptr;
+            ++foreptr;
+          }
+          length = (unsigned)(foreptr - &in[pos]);
+        }
+      }
+    }
+
+    if(length < 3 || length < minmatch || (length == 3 && offset > 4096))
+    {
+      if(!uivector_push_back(out, in[pos])) return 83; /*alloc fail*/
+      pos++;
+    }
+    else
+    {
+      size_t end = pos + length;
+      addLengthDistance(out, length, offset);
+      /*like zlib, only short matches have their positions added, long ones are runs
+      that a single entry at their start finds again just as well*/
+      pos++;
+      if(length < nicematch)
+      {
+        for(; pos < end && pos + 4 <= insize; pos++) hash->head[getHashFast(in, pos)] = (int)(pos & mask);
+      }
+      pos = end;
+    }
+  }
+
+  return 0;
+}
+
 /*
 LZ77-encode the data. Return value is error code. The input are raw bytes, the output
 is in the form of unsigned integers with codes representing for example literal bytes, or
@@ -1449,12 +2232,12 @@ this hash technique is one out of several ways to speed this up.
 */
 static unsigned encodeLZ77(uivector* out, Hash* hash,
                            const unsigned char* in, size_t inpos, size_t insize, unsigned windowsize,
-                           unsigned minmatch, unsigned nicematch, unsigned lazymatching)
+                           unsigned minmatch, unsigned nicematch, unsigned lazymatching, unsigned maxchain)
 {
   size_t pos;
   unsigned i, error = 0;
   /*for large window lengths, assume the user wants no compression loss. Otherwise, max hash chain length speedup.*/
-  unsigned maxchainlength = windowsize >= 8192 ? windowsize : windowsize / 8;
+  unsigned maxchainlength = maxchain ? maxchain : windowsize >= 8192 ? windowsize : windowsize / 8;
   unsigned maxlazymatch = windowsize >= 8192 ? MAX_SUPPORTED_DEFLATE_LENGTH : 64;
 
   unsigned usezeros = 1; /*not sure if setting it to false for windowsize < 8192 is better or worse*/
@@ -1621,28 +2404,43 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
   return error;
 }
 
+/*runs the match finder the settings ask for*/
+static unsigned lz77(uivector* out, Hash* hash, const unsigned char* in, size_t inpos, size_t insize,
+                     const LodePNGCompressSettings* settings)
+{
+  if(settings->maxchain == 1)
+  {
+    return encodeLZ77Fast(out, hash, in, inpos, insize, settings->windowsize,
+                          settings->minmatch, settings->nicematch);
+  }
+  return encodeLZ77(out, hash, in, inpos, insize, settings->windowsize,
+                    settings->minmatch, settings->nicematch, settings->lazymatching, settings->maxchain);
+}
+
 /* /////////////////////////////////////////////////////////////////////////// */
 
-static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, size_t datasize)
+/*the last block gets BFINAL if final is set, which also writes an empty block for empty data*/
+static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, size_t datasize, unsigned final)
 {
   /*non compressed deflate block data: 1 bit BFINAL,2 bits BTYPE,(5 bits): it jumps to start of next byte,
   2 bytes LEN, 2 bytes NLEN, LEN bytes literal DATA*/
 
   size_t i, j, numdeflateblocks = (datasize + 65534) / 65535;
-  unsigned datapos = 0;
+  size_t datapos = 0;
+  if(numdeflateblocks == 0 && final) numdeflateblocks = 1;
   for(i = 0; i < numdeflateblocks; i++)
   {
     unsigned BFINAL, BTYPE, LEN, NLEN;
     unsigned char firstbyte;
 
-    BFINAL = (i == numdeflateblocks - 1);
+    BFINAL = final && (i == numdeflateblocks - 1);
     BTYPE = 0;
 
     firstbyte = (unsigned char)(BFINAL + ((BTYPE & 1) << 1) + ((BTYPE & 2) << 1));
     ucvector_push_back(out, firstbyte);
 
     LEN = 65535;
-    if(datasize - datapos < 65535) LEN = (unsigned)datasize - datapos;
+    if(datasize - datapos < 65535) LEN = (unsigned)(datasize - datapos);
     NLEN = 65535 - LEN;
 
     ucvector_push_back(out, (unsigned char)(LEN % 256));
@@ -1694,6 +2492,46 @@ static void writeLZ77data(size_t* bp, ucvector* out, const uivector* lz77_encode
 }
 
 /*Deflate for a block of type "dynamic", that is, with freely, optimally, created huffman trees*/
+/*
+Writes data[datapos, dataend) as literals of tree_ll, frequencies being how often each byte
+occurs in it: the same bits as addHuffmanSymbol per byte, but with the codes reversed once
+up front and written a byte at a time into output sized for them in advance.
+*/
+static unsigned writeLiterals(size_t* bp, ucvector* out, const HuffmanTree* tree_ll, const unsigned* frequencies,
+                              const unsigned char* data, size_t datapos, size_t dataend)
+{
+  unsigned codes[256], lengths[256];
+  unsigned buffer = 0, bits = (unsigned)(*bp & 7);
+  size_t i, total = 0, pos = out->size;
+
+  for(i = 0; i < 256; i++)
+  {
+    unsigned code = HuffmanTree_getCode(tree_ll, (unsigned)i), j;
+    lengths[i] = HuffmanTree_getLength(tree_ll, (unsigned)i);
+    codes[i] = 0;
+    for(j = 0; j < lengths[i]; j++) codes[i] |= ((code >> (lengths[i] - 1 - j)) & 1u) << j;
+    total += (size_t)frequencies[i] * lengths[i];
+  }
+
+  /*carry on in the partly filled last byte*/
+  if(bits) buffer = out->data[--pos];
+  if(!ucvector_resize(out, pos + (bits + total + 7) / 8)) return 83; /*alloc fail*/
+  for(i = datapos; i < dataend; i++)
+  {
+    buffer |= codes[data[i]] << bits;
+    bits += lengths[data[i]];
+    while(bits >= 8)
+    {
+      out->data[pos++] = (unsigned char)buffer;
+      buffer >>= 8;
+      bits -= 8;
+    }
+  }
+  if(bits) out->data[pos] = (unsigned char)buffer;
+  *bp += total;
+  return 0;
+}
+
 static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
                                const unsigned char* data, size_t datapos, size_t dataend,
                                const LodePNGCompressSettings* settings, unsigned final)
@@ -1725,7 +2563,6 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
   (these are written as is in the file, it would be crazy to compress these using yet another huffman
   tree that needs to be represented by yet another set of code lengths)*/
   uivector bitlen_cl;
-  size_t datasize = dataend - datapos;
 
   /*
   Due to the huffman compression of huffman tree representations ("two levels"), there are some anologies:
@@ -1755,15 +2592,9 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
   {
     if(settings->use_lz77)
     {
-      error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
-                         settings->minmatch, settings->nicematch, settings->lazymatching);
+      error = lz77(&lz77_encoded, hash, data, datapos, dataend, settings);
       if(error) break;
     }
-    else
-    {
-      if(!uivector_resize(&lz77_encoded, datasize)) ERROR_BREAK(83 /*alloc fail*/);
-      for(i = datapos; i < dataend; i++) lz77_encoded.data[i] = data[i]; /*no LZ77, but still will be Huffman compressed*/
-    }
 
     if(!uivector_resizev(&frequencies_ll, 286, 0)) ERROR_BREAK(83 /*alloc fail*/);
     if(!uivector_resizev(&frequencies_d, 30, 0)) ERROR_BREAK(83 /*alloc fail*/);
@@ -1780,6 +2611,8 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
         i += 3;
       }
     }
+    /*no LZ77, but still will be Huffman compressed: all bytes are literals*/
+    if(!settings->use_lz77) for(i = datapos; i < dataend; i++) frequencies_ll.data[data[i]]++;
     frequencies_ll.data[256] = 1; /*there will be exactly 1 end code, at the end of the block*/
 
     /*Make both huffman trees, one for the lit and len codes, one for the dist codes*/
@@ -1914,7 +2747,12 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
     }
 
     /*write the compressed data symbols*/
-    writeLZ77data(bp, out, &lz77_encoded, &tree_ll, &tree_d);
+    if(settings->use_lz77) writeLZ77data(bp, out, &lz77_encoded, &tree_ll, &tree_d);
+    else
+    {
+      error = writeLiterals(bp, out, &tree_ll, frequencies_ll.data, data, datapos, dataend);
+      if(error) break;
+    }
     /*error: the length of the end code 256 must be larger than 0*/
     if(HuffmanTree_getLength(&tree_ll, 256) == 0) ERROR_BREAK(64);
 
@@ -1965,8 +2803,7 @@ static unsigned deflateFixed(ucvector* out, size_t* bp, Hash* hash,
   {
     uivector lz77_encoded;
     uivector_init(&lz77_encoded);
-    error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
-                       settings->minmatch, settings->nicematch, settings->lazymatching);
+    error = lz77(&lz77_encoded, hash, data, datapos, dataend, settings);
     if(!error) writeLZ77data(bp, out, &lz77_encoded, &tree_ll, &tree_d);
     uivector_cleanup(&lz77_encoded);
   }
@@ -1987,112 +2824,552 @@ static unsigned deflateFixed(ucvector* out, size_t* bp, Hash* hash,
   return error;
 }
 
-static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t insize,
-                                 const LodePNGCompressSettings* settings)
+/*bits that deflateStored takes for size bytes when it starts at bit pointer bp*/
+static size_t storedBits(size_t bp, size_t size)
 {
-  unsigned error = 0;
-  size_t i, blocksize, numdeflateblocks;
-  size_t bp = 0; /*the bit pointer*/
-  Hash hash;
+  size_t numblocks = size == 0 ? 1 : (size + 65534) / 65535;
+  /*the first header pads from wherever bp is, later ones start byte aligned*/
+  return 3 + ((8 - ((bp + 3) & 7)) & 7) + (numblocks - 1) * 8 + numblocks * 32 + size * 8;
+}
 
-  if(settings->btype > 2) return 61;
-  else if(settings->btype == 0) return deflateNoCompression(out, in, insize);
-  else if(settings->btype == 1) blocksize = insize;
-  else /*if(settings->btype == 2)*/
+/*like deflateNoCompression, but starting at any bit position of the stream*/
+static unsigned deflateStored(ucvector* out, size_t* bp, const unsigned char* in,
+                              size_t start, size_t end, unsigned final)
+{
+  size_t pos = start;
+  do
   {
-    blocksize = insize / 8 + 8;
-    if(blocksize < 65535) blocksize = 65535;
+    size_t len = end - pos < 65535 ? end - pos : 65535;
+    size_t size;
+    addBitsToStream(bp, out, final && pos + len == end, 1); /*BFINAL*/
+    addBitsToStream(bp, out, 0, 2); /*BTYPE 00: no compression*/
+    *bp += (8 - (*bp & 7)) & 7; /*skip to the byte boundary, the bits are 0 already*/
+    size = out->size;
+    if(!ucvector_resize(out, size + 4 + len)) return 83; /*alloc fail*/
+    out->data[size + 0] = (unsigned char)(len & 255);
+    out->data[size + 1] = (unsigned char)(len >> 8);
+    out->data[size + 2] = (unsigned char)(~len & 255);
+    out->data[size + 3] = (unsigned char)((~len >> 8) & 255);
+    if(len) memcpy(&out->data[size + 4], &in[pos], len);
+    *bp += (4 + len) * 8;
+    pos += len;
   }
+  while(pos < end);
+  return 0;
+}
 
-  numdeflateblocks = (insize + blocksize - 1) / blocksize;
-  if(numdeflateblocks == 0) numdeflateblocks = 1;
+/*the block types the adaptive btype 3 looks at this many evenly spread bytes of, at most*/
+#define PROBE_SAMPLES 8
+#define PROBE_SAMPLE_SIZE 1024
 
-  error = hash_init(&hash, settings->windowsize);
-  if(error) return error;
+/*
+Picks the block type for in[start, end) with btype 3 from a quick look at a few samples
+of it: their order 0 entropy estimates what Huffman coding of the literals gives, and the
+share of positions whose 4 bytes occurred earlier in the sample what LZ77 could add.
+Stored is chosen unless compressing is estimated to save 3%, fixed over dynamic only when
+the dynamic trees would cost more than they save. Sets *lz77 to 0 when the repeats are
+too rare for LZ77 to be worth running.
+*/
+static unsigned chooseBlockType(const unsigned char* in, size_t start, size_t end, unsigned* lz77)
+{
+  unsigned counts[256];
+  unsigned short last[1024]; /*1 + sample position of the last 4 bytes with each hash*/
+  size_t size = end - start, total = 0, matches = 0, numsamples, samplesize, i, j;
+  double entropy = 0, fixedbits = 0, repeated, dynamic, fixed, stored;
 
-  for(i = 0; i < numdeflateblocks && !error; i++)
+  if(size <= PROBE_SAMPLES * PROBE_SAMPLE_SIZE)
   {
-    unsigned final = (i == numdeflateblocks - 1);
-    size_t start = i * blocksize;
-    size_t end = start + blocksize;
-    if(end > insize) end = insize;
+    numsamples = 1;
+    samplesize = size;
+  }
+  else
+  {
+    numsamples = PROBE_SAMPLES;
+    samplesize = PROBE_SAMPLE_SIZE;
+  }
+
+  memset(counts, 0, sizeof(counts));
+  for(i = 0; i < numsamples; i++)
+  {
+    const unsigned char* sample = &in[start + (size - samplesize) / numsamples * i];
+    memset(last, 0, sizeof(last));
+    for(j = 0; j < samplesize; j++)
+    {
+      counts[sample[j]]++;
+      if(j + 4 <= samplesize)
+      {
+        unsigned hashval = getHashFast(sample, j) >> 6;
+        unsigned prev = last[hashval];
+        if(prev && memcmp(&sample[prev - 1], &sample[j], 4) == 0) matches++;
+        last[hashval] = (unsigned short)(j + 1);
+      }
+    }
+    total += samplesize;
+  }
+  if(total == 0)
+  {
+    *lz77 = 0;
+    return 1; /*an empty fixed block is the shortest*/
+  }
 
-    if(settings->btype == 1) error = deflateFixed(out, &bp, &hash, in, start, end, settings, final);
-    else if(settings->btype == 2) error = deflateDynamic(out, &bp, &hash, in, start, end, settings, final);
+  for(i = 0; i < 256; i++)
+  {
+    if(counts[i] == 0) continue;
+    entropy += counts[i] * log((double)total / counts[i]) / log(2.0);
+    fixedbits += counts[i] * (i < 144 ? 8 : 9);
   }
 
-  hash_cleanup(&hash);
+  /*in bits for the whole block: repeated bytes taken as 2 bits each, about what the
+  length and distance codes of a match cost per byte, dynamic trees as 80 bytes*/
+  repeated = (double)matches / total;
+  dynamic = size * ((1 - repeated) * entropy / total + repeated * 2) + 80 * 8;
+  fixed = size * ((1 - repeated) * fixedbits / total + repeated * 2);
+  stored = storedBits(0, size);
 
-  return error;
+  *lz77 = repeated >= 1.0 / 32;
+  if((dynamic < fixed ? dynamic : fixed) > stored * 0.97) return 0;
+  return fixed < dynamic ? 1 : 2;
 }
 
-unsigned lodepng_deflate(unsigned char** out, size_t* outsize,
-                         const unsigned char* in, size_t insize,
-                         const LodePNGCompressSettings* settings)
+/*adds a block of size bytes written with btype to stats, stored blocks are counted per 65535 bytes*/
+static void countBlock(LodePNGDeflateStats* stats, unsigned btype, size_t size)
 {
-  unsigned error;
-  ucvector v;
-  ucvector_init_buffer(&v, *out, *outsize);
-  error = lodepng_deflatev(&v, in, insize, settings);
-  *out = v.data;
-  *outsize = v.size;
-  return error;
+  if(!stats) return;
+  stats->blocks[btype] += btype == 0 && size ? (size + 65534) / 65535 : 1;
+  stats->bytes[btype] += size;
 }
 
-static unsigned deflate(unsigned char** out, size_t* outsize,
-                        const unsigned char* in, size_t insize,
-                        const LodePNGCompressSettings* settings)
+/*deflates in[start, end) as one or more blocks of settings->btype, the last of which gets
+BFINAL if final is set. A block that comes out larger than storing it is replaced by
+stored blocks, which is what bounds the output size, see lodepng_encode_bound. The blocks
+are added to stats if it isn't NULL*/
+static unsigned deflateBlocks(ucvector* out, size_t* bp, Hash* hash,
+                              const unsigned char* in, size_t start, size_t end,
+                              const LodePNGCompressSettings* settings, unsigned final,
+                              LodePNGDeflateStats* stats)
 {
-  if(settings->custom_deflate)
+  unsigned error = 0;
+  size_t i, blocksize, numdeflateblocks;
+  size_t insize = end - start;
+  LodePNGCompressSettings literal = *settings; /*for btype 3 blocks that skip LZ77*/
+  literal.use_lz77 = 0;
+
+  /*an empty range still gets one (empty) block, which may have to carry BFINAL*/
+  if(settings->btype == 1) blocksize = insize ? insize : 1;
+  else /*if(settings->btype == 2 || settings->btype == 3)*/
   {
-    return settings->custom_deflate(out, outsize, in, insize, settings);
+    blocksize = insize / 8 + 8;
+    if(blocksize < 65535) blocksize = 65535;
   }
-  else
+
+  numdeflateblocks = (insize + blocksize - 1) / blocksize;
+  if(numdeflateblocks == 0) numdeflateblocks = 1;
+
+  for(i = 0; i < numdeflateblocks && !error; i++)
   {
-    return lodepng_deflate(out, outsize, in, insize, settings);
-  }
-}
+    unsigned lastblock = final && (i == numdeflateblocks - 1);
+    size_t blockstart = start + i * blocksize;
+    size_t blockend = blockstart + blocksize;
+    size_t size0 = out->size, bp0 = *bp;
+    unsigned fixed0 = out->fixed;
+    unsigned btype = settings->btype, lz77 = settings->use_lz77;
+    const LodePNGCompressSettings* blocksettings = settings;
+    if(blockend > end) blockend = end;
 
-#endif /*LODEPNG_COMPILE_DECODER*/
+    if(btype == 3)
+    {
+      btype = chooseBlockType(in, blockstart, blockend, &lz77);
+      lz77 = lz77 && btype != 0 && settings->use_lz77;
+      if(!lz77) blocksettings = &literal;
+    }
 
-/* ////////////////////////////////////////////////////////////////////////// */
-/* / Adler32                                                                  */
-/* ////////////////////////////////////////////////////////////////////////// */
+    if(btype == 0) error = deflateStored(out, bp, in, blockstart, blockend, lastblock);
+    else if(btype == 1) error = deflateFixed(out, bp, hash, in, blockstart, blockend, blocksettings, lastblock);
+    else error = deflateDynamic(out, bp, hash, in, blockstart, blockend, blocksettings, lastblock);
 
-static unsigned update_adler32(unsigned adler, const unsigned char* data, unsigned len)
-{
-   unsigned s1 = adler & 0xffff;
-   unsigned s2 = (adler >> 16) & 0xffff;
+    if(!error && lz77 != settings->use_lz77 && settings->maxchain != 1)
+    {
+      /*LZ77 wasn't run over this block, so catch the hash chains up with its last window,
+      later blocks need them to be current. The single probe finder copes without*/
+      size_t dictpos = blockend - blockstart > settings->windowsize ? blockend - settings->windowsize : blockstart;
+      hash_prime(hash, in, dictpos, blockend, blockend, settings->windowsize);
+    }
 
-  while(len > 0)
-  {
-    /*at least 5550 sums can be done before the sums overflow, saving a lot of module divisions*/
-    unsigned amount = len > 5550 ? 5550 : len;
-    len -= amount;
-    while(amount > 0)
+    if(!error && btype != 0 && *bp - bp0 > storedBits(bp0, blockend - blockstart))
     {
-      s1 += (*data++);
-      s2 += s1;
-      amount--;
+      /*rewind to where the block began, clearing the bits it left in the last byte*/
+      out->size = size0;
+      *bp = bp0;
+      if(bp0 & 7) out->data[size0 - 1] &= (unsigned char)((1u << (bp0 & 7)) - 1u);
+      out->fixed = fixed0; /*the stored blocks may fit where the larger block didn't*/
+      error = deflateStored(out, bp, in, blockstart, blockend, lastblock);
+      btype = 0;
+    }
+    if(!error && out->fixed == 2) error = 83; /*a fixed output buffer is full, stop early*/
+    if(!error)
+    {
+      countBlock(stats, btype, blockend - blockstart);
+      if(stats && btype == 2 && !lz77) stats->literal_bytes += blockend - blockstart;
     }
-    s1 %= 65521;
-    s2 %= 65521;
   }
 
-  return (s2 << 16) | s1;
+  return error;
 }
 
-/*Return the adler32 of the bytes data[0..len-1]*/
-static unsigned adler32(const unsigned char* data, unsigned len)
+/*chunk size of the parallel deflate, the same as pigz uses*/
+#define DEFLATE_CHUNK_SIZE 131072
+
+typedef struct DeflateChunkJob
 {
-  return update_adler32(1L, data, len);
-}
+  const unsigned char* in;
+  size_t insize;
+  const LodePNGCompressSettings* settings;
+  ucvector* outs; /*one output per chunk*/
+  unsigned* errors; /*one error code per chunk*/
+  LodePNGDeflateStats* stats; /*one per chunk if the settings have stats, else NULL*/
+} DeflateChunkJob;
 
-/* ////////////////////////////////////////////////////////////////////////// */
-/* / Zlib                                                                   / */
-/* ////////////////////////////////////////////////////////////////////////// */
+/*compresses one chunk of the parallel deflate, called through lodepng_parallel_for*/
+static void deflateChunk(void* context, size_t index)
+{
+  DeflateChunkJob* job = (DeflateChunkJob*)context;
+  ucvector* out = &job->outs[index];
+  LodePNGDeflateStats* stats = job->stats ? &job->stats[index] : 0;
+  unsigned windowsize = job->settings->windowsize;
+  size_t start = index * DEFLATE_CHUNK_SIZE;
+  size_t end = start + DEFLATE_CHUNK_SIZE;
+  size_t dictpos = start > windowsize ? start - windowsize : 0;
+  unsigned final, error;
+  size_t bp = 0;
+  Hash hash;
 
-#ifdef LODEPNG_COMPILE_DECODER
+  if(end > job->insize) end = job->insize;
+  final = (end == job->insize);
+
+  error = hash_init(&hash, windowsize);
+  if(!error)
+  {
+    /*the bytes before the chunk are in memory anyway, letting the hash see them means
+    matches can cross the chunk boundary just like in the single threaded stream*/
+    if(job->settings->use_lz77 && job->settings->maxchain == 1)
+    {
+      hash_prime_fast(&hash, job->in, dictpos, start, end, windowsize);
+    }
+    else if(job->settings->use_lz77)
+    {
+      hash_prime(&hash, job->in, dictpos, start, end, windowsize);
+    }
+    error = deflateBlocks(out, &bp, &hash, job->in, start, end, job->settings, final, stats);
+  }
+  if(!error && !final)
+  {
+    /*sync flush: an empty stored block leaves the stream byte aligned, so the next
+    chunk's blocks can be appended to it as they are*/
+    addBitToStream(&bp, out, 0); /*BFINAL*/
+    addBitsToStream(&bp, out, 0, 2); /*BTYPE 00: no compression*/
+    ucvector_push_back(out, 0);
+    ucvector_push_back(out, 0);
+    ucvector_push_back(out, 255);
+    ucvector_push_back(out, 255);
+    countBlock(stats, 0, 0);
+  }
+  hash_cleanup(&hash);
+  job->errors[index] = error;
+}
+
+static unsigned deflateParallel(ucvector* out, const unsigned char* in, size_t insize,
+                                const LodePNGCompressSettings* settings, unsigned threads)
+{
+  unsigned error = 0;
+  size_t i, j;
+  size_t numchunks = (insize + DEFLATE_CHUNK_SIZE - 1) / DEFLATE_CHUNK_SIZE;
+  DeflateChunkJob job;
+
+  job.in = in;
+  job.insize = insize;
+  job.settings = settings;
+  job.outs = (ucvector*)lodepng_malloc(sizeof(ucvector) * numchunks);
+  job.errors = (unsigned*)lodepng_malloc(sizeof(unsigned) * numchunks);
+  job.stats = 0;
+  if(settings->stats) job.stats = (LodePNGDeflateStats*)lodepng_malloc(sizeof(LodePNGDeflateStats) * numchunks);
+  if(!job.outs || !job.errors || (settings->stats && !job.stats))
+  {
+    lodepng_free(job.outs);
+    lodepng_free(job.errors);
+    lodepng_free(job.stats);
+    return 83; /*alloc fail*/
+  }
+  for(i = 0; i < numchunks; i++) ucvector_init(&job.outs[i]);
+  if(job.stats) memset(job.stats, 0, sizeof(LodePNGDeflateStats) * numchunks);
+
+  lodepng_parallel_for(numchunks, threads, deflateChunk, &job);
+
+  for(i = 0; i < numchunks; i++)
+  {
+    if(!error) error = job.errors[i];
+    if(!error)
+    {
+      size_t pos = out->size;
+      if(!ucvector_resize(out, pos + job.outs[i].size)) error = 83; /*alloc fail*/
+      for(j = 0; !error && j < job.outs[i].size; j++) out->data[pos + j] = job.outs[i].data[j];
+    }
+    ucvector_cleanup(&job.outs[i]);
+    if(!error && job.stats)
+    {
+      for(j = 0; j < 3; j++)
+      {
+        settings->stats->blocks[j] += job.stats[i].blocks[j];
+        settings->stats->bytes[j] += job.stats[i].bytes[j];
+      }
+      settings->stats->literal_bytes += job.stats[i].literal_bytes;
+    }
+  }
+
+  lodepng_free(job.outs);
+  lodepng_free(job.errors);
+  lodepng_free(job.stats);
+  return error;
+}
+
+static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t insize,
+                                 const LodePNGCompressSettings* settings)
+{
+  unsigned error = 0;
+  unsigned threads;
+  size_t bp = 0; /*the bit pointer*/
+  Hash hash;
+
+  if(settings->btype > 3) return 61;
+  else if(settings->btype == 0)
+  {
+    countBlock(settings->stats, 0, insize);
+    return deflateNoCompression(out, in, insize, 1);
+  }
+
+  /*checked up front since hash_prime relies on them, encodeLZ77 would return the same*/
+  if(settings->use_lz77)
+  {
+    if(settings->windowsize == 0 || settings->windowsize > 32768) return 60;
+    if((settings->windowsize & (settings->windowsize - 1)) != 0) return 90;
+  }
+
+  threads = lodepng_resolve_threads(settings->threads);
+  if(threads > 1 && insize > DEFLATE_CHUNK_SIZE) return deflateParallel(out, in, insize, settings, threads);
+
+  error = hash_init(&hash, settings->windowsize);
+  if(!error) error = deflateBlocks(out, &bp, &hash, in, 0, insize, settings, 1, settings->stats);
+
+  hash_cleanup(&hash);
+
+  return error;
+}
+
+unsigned lodepng_deflate(unsigned char** out, size_t* outsize,
+                         const unsigned char* in, size_t insize,
+                         const LodePNGCompressSettings* settings)
+{
+  unsigned error;
+  ucvector v;
+  const LodePNGAllocator* previous = zlib_allocator_begin(settings->allocator);
+  ucvector_init_buffer(&v, *out, *outsize);
+  error = lodepng_deflatev(&v, in, insize, settings);
+  *out = v.data;
+  *outsize = v.size;
+  allocator_end(previous);
+  return error;
+}
+
+/*appends the deflated in to out, with the custom deflate function through a copy*/
+static unsigned deflate(ucvector* out, const unsigned char* in, size_t insize,
+                        const LodePNGCompressSettings* settings)
+{
+  if(settings->custom_deflate)
+  {
+    unsigned char* deflatedata = 0;
+    size_t deflatesize = 0, i;
+    unsigned error = settings->custom_deflate(&deflatedata, &deflatesize, in, insize, settings);
+    for(i = 0; !error && i < deflatesize; i++) ucvector_push_back(out, deflatedata[i]);
+    lodepng_free(deflatedata);
+    return error;
+  }
+  else
+  {
+    return lodepng_deflatev(out, in, insize, settings);
+  }
+}
+
+#endif /*LODEPNG_COMPILE_DECODER*/
+
+/* ////////////////////////////////////////////////////////////////////////// */
+/* / Adler32                                                                  */
+/* ////////////////////////////////////////////////////////////////////////// */
+
+static unsigned update_adler32_scalar(unsigned adler, const unsigned char* data, size_t len)
+{
+   unsigned s1 = adler & 0xffff;
+   unsigned s2 = (adler >> 16) & 0xffff;
+
+  while(len > 0)
+  {
+    /*at least 5550 sums can be done before the sums overflow, saving a lot of module divisions*/
+    unsigned amount = len > 5550 ? 5550 : (unsigned)len;
+    len -= amount;
+    while(amount > 0)
+    {
+      s1 += (*data++);
+      s2 += s1;
+      amount--;
+    }
+    s1 %= 65521;
+    s2 %= 65521;
+  }
+
+  return (s2 << 16) | s1;
+}
+
+#ifdef LODEPNG_X86
+/*
+Adler32 of whole blocks of 32 (SSSE3) or 64 (AVX2) bytes, the rest is left to the scalar
+code. Per block, s1 grows by the byte sum (psadbw) and s2 by 32 or 64 times the s1 at the
+start of the block plus the bytes weighted 32..1 or 64..1 (pmaddubsw then pmaddwd). The
+s1 values at block starts are summed in ps and multiplied in at the end. 5552 bytes, the
+most that can be summed before s2 can overflow, are done between reductions modulo 65521.
+*/
+#define ADLER32_NMAX 5552
+
+LODEPNG_TARGET("ssse3")
+static unsigned update_adler32_ssse3(unsigned adler, const unsigned char* data, size_t len, size_t* done)
+{
+  const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+  const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i ones = _mm_set1_epi16(1);
+  unsigned s1 = adler & 0xffff;
+  unsigned s2 = (adler >> 16) & 0xffff;
+  size_t blocks = len / 32;
+  *done = blocks * 32;
+
+  while(blocks > 0)
+  {
+    unsigned n = ADLER32_NMAX / 32;
+    __m128i v_ps, v_s1, v_s2;
+    if(n > blocks) n = (unsigned)blocks;
+    blocks -= n;
+    v_ps = _mm_cvtsi32_si128((int)(s1 * n));
+    v_s2 = _mm_cvtsi32_si128((int)s2);
+    v_s1 = zero;
+    while(n > 0)
+    {
+      const __m128i bytes1 = _mm_loadu_si128((const __m128i*)data);
+      const __m128i bytes2 = _mm_loadu_si128((const __m128i*)(data + 16));
+      v_ps = _mm_add_epi32(v_ps, v_s1);
+      v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes1, zero));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes1, tap1), ones));
+      v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes2, zero));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes2, tap2), ones));
+      data += 32;
+      n--;
+    }
+    v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+    v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(2, 3, 0, 1)));
+    v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(1, 0, 3, 2)));
+    v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(2, 3, 0, 1)));
+    v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(1, 0, 3, 2)));
+    s1 = (s1 + (unsigned)_mm_cvtsi128_si32(v_s1)) % 65521;
+    s2 = (unsigned)_mm_cvtsi128_si32(v_s2) % 65521;
+  }
+
+  return (s2 << 16) | s1;
+}
+
+LODEPNG_TARGET("avx2")
+static unsigned update_adler32_avx2(unsigned adler, const unsigned char* data, size_t len, size_t* done)
+{
+  const __m256i tap1 = _mm256_setr_epi8(64, 63, 62, 61, 60, 59, 58, 57, 56, 55, 54, 53, 52, 51, 50, 49,
+                                        48, 47, 46, 45, 44, 43, 42, 41, 40, 39, 38, 37, 36, 35, 34, 33);
+  const __m256i tap2 = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+                                        16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i ones = _mm256_set1_epi16(1);
+  unsigned s1 = adler & 0xffff;
+  unsigned s2 = (adler >> 16) & 0xffff;
+  size_t blocks = len / 64;
+  *done = blocks * 64;
+
+  while(blocks > 0)
+  {
+    unsigned n = ADLER32_NMAX / 64;
+    __m256i v_ps, v_s1, v_s2;
+    __m128i h_s1, h_s2;
+    if(n > blocks) n = (unsigned)blocks;
+    blocks -= n;
+    v_ps = _mm256_castsi128_si256(_mm_cvtsi32_si128((int)(s1 * n)));
+    v_s2 = _mm256_castsi128_si256(_mm_cvtsi32_si128((int)s2));
+    v_ps = _mm256_permute2x128_si256(v_ps, zero, 0x20); /*clear the undefined upper half*/
+    v_s2 = _mm256_permute2x128_si256(v_s2, zero, 0x20);
+    v_s1 = zero;
+    while(n > 0)
+    {
+      const __m256i bytes1 = _mm256_loadu_si256((const __m256i*)data);
+      const __m256i bytes2 = _mm256_loadu_si256((const __m256i*)(data + 32));
+      v_ps = _mm256_add_epi32(v_ps, v_s1);
+      v_s1 = _mm256_add_epi32(v_s1, _mm256_sad_epu8(bytes1, zero));
+      v_s2 = _mm256_add_epi32(v_s2, _mm256_madd_epi16(_mm256_maddubs_epi16(bytes1, tap1), ones));
+      v_s1 = _mm256_add_epi32(v_s1, _mm256_sad_epu8(bytes2, zero));
+      v_s2 = _mm256_add_epi32(v_s2, _mm256_madd_epi16(_mm256_maddubs_epi16(bytes2, tap2), ones));
+      data += 64;
+      n--;
+    }
+    v_s2 = _mm256_add_epi32(v_s2, _mm256_slli_epi32(v_ps, 6));
+    h_s1 = _mm_add_epi32(_mm256_castsi256_si128(v_s1), _mm256_extracti128_si256(v_s1, 1));
+    h_s2 = _mm_add_epi32(_mm256_castsi256_si128(v_s2), _mm256_extracti128_si256(v_s2, 1));
+    h_s1 = _mm_add_epi32(h_s1, _mm_shuffle_epi32(h_s1, _MM_SHUFFLE(2, 3, 0, 1)));
+    h_s1 = _mm_add_epi32(h_s1, _mm_shuffle_epi32(h_s1, _MM_SHUFFLE(1, 0, 3, 2)));
+    h_s2 = _mm_add_epi32(h_s2, _mm_shuffle_epi32(h_s2, _MM_SHUFFLE(2, 3, 0, 1)));
+    h_s2 = _mm_add_epi32(h_s2, _mm_shuffle_epi32(h_s2, _MM_SHUFFLE(1, 0, 3, 2)));
+    s1 = (s1 + (unsigned)_mm_cvtsi128_si32(h_s1)) % 65521;
+    s2 = (unsigned)_mm_cvtsi128_si32(h_s2) % 65521;
+  }
+
+  _mm256_zeroupper();
+  return (s2 << 16) | s1;
+}
+#endif /*LODEPNG_X86*/
+
+static unsigned update_adler32(unsigned adler, const unsigned char* data, size_t len)
+{
+#ifdef LODEPNG_X86
+  unsigned simd = simd_get();
+  size_t done = 0;
+  if(simd & LODEPNG_SIMD_AVX2) adler = update_adler32_avx2(adler, data, len, &done);
+  else if(simd & LODEPNG_SIMD_SSSE3) adler = update_adler32_ssse3(adler, data, len, &done);
+  data += done;
+  len -= done;
+#endif /*LODEPNG_X86*/
+  return update_adler32_scalar(adler, data, len);
+}
+
+/*Return the adler32 of the bytes data[0..len-1]*/
+static unsigned adler32(const unsigned char* data, unsigned len)
+{
+  return update_adler32(1L, data, len);
+}
+
+unsigned lodepng_adler32_update(unsigned adler, const unsigned char* data, size_t len)
+{
+  return update_adler32(adler, data, len);
+}
+
+unsigned lodepng_adler32(const unsigned char* data, size_t len)
+{
+  return update_adler32(1u, data, len);
+}
+
+/* ////////////////////////////////////////////////////////////////////////// */
+/* / Zlib                                                                   / */
+/* ////////////////////////////////////////////////////////////////////////// */
+
+#ifdef LODEPNG_COMPILE_DECODER
 
 unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, const unsigned char* in,
                                  size_t insize, const LodePNGDecompressSettings* settings)
@@ -2156,17 +3433,73 @@ static unsigned zlib_decompress(unsigned char** out, size_t* outsize, const unsi
 
 #ifdef LODEPNG_COMPILE_ENCODER
 
-unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in,
-                               size_t insize, const LodePNGCompressSettings* settings)
+/*
+Returns the adler32 of A followed by B, given adler1 of A, adler2 of B and the length
+of B. s1 of the whole is s1(A) + s1(B) - 1. Every byte of B adds the running s1 to s2,
+so s2 of the whole is s2(A) + s2(B) + len2 * (s1(A) - 1). Same maths as zlib's
+adler32_combine.
+*/
+static unsigned adler32_combine(unsigned adler1, unsigned adler2, size_t len2)
 {
-  /*initially, *out must be NULL and outsize 0, if you just give some random *out
-  that's pointing to a non allocated buffer, this'll crash*/
-  ucvector outv;
-  size_t i;
-  unsigned error;
-  unsigned char* deflatedata = 0;
-  size_t deflatesize = 0;
+  const unsigned BASE = 65521;
+  unsigned rem = (unsigned)(len2 % BASE);
+  unsigned sum1 = adler1 & 0xffff;
+  unsigned sum2 = (rem * sum1) % BASE;
+  sum1 += (adler2 & 0xffff) + BASE - 1;
+  sum2 += ((adler1 >> 16) & 0xffff) + ((adler2 >> 16) & 0xffff) + BASE - rem;
+  if(sum1 >= BASE) sum1 -= BASE;
+  if(sum1 >= BASE) sum1 -= BASE;
+  if(sum2 >= (BASE << 1)) sum2 -= (BASE << 1);
+  if(sum2 >= BASE) sum2 -= BASE;
+  return (sum2 << 16) | sum1;
+}
+
+typedef struct Adler32Job
+{
+  const unsigned char* in;
+  size_t insize;
+  unsigned* sums; /*adler32 of each chunk on its own*/
+} Adler32Job;
+
+static void adler32Chunk(void* context, size_t index)
+{
+  Adler32Job* job = (Adler32Job*)context;
+  size_t start = index * DEFLATE_CHUNK_SIZE;
+  size_t end = start + DEFLATE_CHUNK_SIZE;
+  if(end > job->insize) end = job->insize;
+  job->sums[index] = adler32(job->in + start, (unsigned)(end - start));
+}
+
+/*adler32 of the chunks computed concurrently, then combined in order*/
+static unsigned adler32_parallel(const unsigned char* in, size_t insize, unsigned threads)
+{
+  size_t i, numchunks = (insize + DEFLATE_CHUNK_SIZE - 1) / DEFLATE_CHUNK_SIZE;
+  unsigned result;
+  Adler32Job job;
 
+  if(threads <= 1 || numchunks <= 1) return adler32(in, (unsigned)insize);
+  job.in = in;
+  job.insize = insize;
+  job.sums = (unsigned*)lodepng_malloc(sizeof(unsigned) * numchunks);
+  if(!job.sums) return adler32(in, (unsigned)insize);
+
+  lodepng_parallel_for(numchunks, threads, adler32Chunk, &job);
+
+  result = job.sums[0];
+  for(i = 1; i < numchunks; i++)
+  {
+    size_t len = i == numchunks - 1 ? insize - i * DEFLATE_CHUNK_SIZE : DEFLATE_CHUNK_SIZE;
+    result = adler32_combine(result, job.sums[i], len);
+  }
+  lodepng_free(job.sums);
+  return result;
+}
+
+/*appends the zlib stream of in to out*/
+static unsigned zlib_compressv(ucvector* out, const unsigned char* in, size_t insize,
+                               const LodePNGCompressSettings* settings)
+{
+  unsigned error;
   unsigned ADLER32;
   /*zlib data: 1 byte CMF (CM+CINFO), 1 byte FLG, deflate data, 4 byte ADLER32 checksum of the Decompressed data*/
   unsigned CMF = 120; /*0b01111000: CM 8, CINFO 7. With CINFO 7, any window size up to 32768 can be used.*/
@@ -2176,25 +3509,37 @@ unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsig
   unsigned FCHECK = 31 - CMFFLG % 31;
   CMFFLG += FCHECK;
 
-  /*ucvector-controlled version of the output buffer, for dynamic array*/
-  ucvector_init_buffer(&outv, *out, *outsize);
-
-  ucvector_push_back(&outv, (unsigned char)(CMFFLG / 256));
-  ucvector_push_back(&outv, (unsigned char)(CMFFLG % 256));
+  ucvector_push_back(out, (unsigned char)(CMFFLG / 256));
+  ucvector_push_back(out, (unsigned char)(CMFFLG % 256));
 
-  error = deflate(&deflatedata, &deflatesize, in, insize, settings);
+  error = deflate(out, in, insize, settings);
 
   if(!error)
   {
-    ADLER32 = adler32(in, (unsigned)insize);
-    for(i = 0; i < deflatesize; i++) ucvector_push_back(&outv, deflatedata[i]);
-    lodepng_free(deflatedata);
-    lodepng_add32bitInt(&outv, ADLER32);
+    ADLER32 = adler32_parallel(in, insize, lodepng_resolve_threads(settings->threads));
+    lodepng_add32bitInt(out, ADLER32);
   }
 
+  return error;
+}
+
+unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in,
+                               size_t insize, const LodePNGCompressSettings* settings)
+{
+  /*initially, *out must be NULL and outsize 0, if you just give some random *out
+  that's pointing to a non allocated buffer, this'll crash*/
+  ucvector outv;
+  unsigned error;
+  const LodePNGAllocator* previous = zlib_allocator_begin(settings->allocator);
+
+  /*ucvector-controlled version of the output buffer, for dynamic array*/
+  ucvector_init_buffer(&outv, *out, *outsize);
+  error = zlib_compressv(&outv, in, insize, settings);
+
   *out = outv.data;
   *outsize = outv.size;
 
+  allocator_end(previous);
   return error;
 }
 
@@ -2251,13 +3596,50 @@ void lodepng_compress_settings_init(LodePNGCompressSettings* settings)
   settings->minmatch = 3;
   settings->nicematch = 128;
   settings->lazymatching = 1;
+  settings->maxchain = 0;
+
+  settings->threads = 1;
 
   settings->custom_zlib = 0;
   settings->custom_deflate = 0;
   settings->custom_context = 0;
+  settings->allocator = 0;
+  settings->stats = 0;
 }
 
-const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 0, 0};
+const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 1, 0, 0, 0, 0, 0};
+
+/*
+The settings of each compression level: btype, use_lz77, windowsize, minmatch,
+nicematch, lazymatching, maxchain. Tuned on filtered 16 bit noise heightmaps, see
+lodepng.h for the measured trade-off. Matches of 3 bytes cost about as much as the
+literals in such data, so every level asks for 4. Greedy matching on short chains lost
+to the single probe in both speed and size there, so after it come lazy chains only.
+*/
+static const unsigned COMPRESSION_LEVELS[10][7] = {
+  {0, 0,  2048, 3,   0, 0,    0}, /*0: stored*/
+  {3, 1, 32768, 4,  32, 0,    1}, /*1: adaptive, LZ77 only where the samples repeat*/
+  {2, 1, 32768, 4,  32, 0,    1}, /*2: single probe*/
+  {2, 1, 32768, 4, 128, 1,   16}, /*3: lazy, short chains*/
+  {2, 1, 32768, 4, 258, 1,   32},
+  {2, 1, 32768, 4, 258, 1,   64},
+  {2, 1, 32768, 4, 258, 1,  128},
+  {2, 1, 32768, 4, 258, 1,  256},
+  {2, 1, 32768, 4, 258, 1, 1024},
+  {2, 1, 32768, 4, 258, 1,    0}  /*9: the whole window*/
+};
+
+void lodepng_compress_settings_level(LodePNGCompressSettings* settings, unsigned level)
+{
+  const unsigned* values = COMPRESSION_LEVELS[level > 9 ? 9 : level];
+  settings->btype = values[0];
+  settings->use_lz77 = values[1];
+  settings->windowsize = values[2];
+  settings->minmatch = values[3];
+  settings->nicematch = values[4];
+  settings->lazymatching = values[5];
+  settings->maxchain = values[6];
+}
 
 
 #endif /*LODEPNG_COMPILE_ENCODER*/
@@ -2325,17 +3707,162 @@ static unsigned lodepng_crc32_table[256] = {
   3009837614u, 3294710456u, 1567103746u,  711928724u, 3020668471u, 3272380065u, 1510334235u,  755167117u
 };
 
-/*Return the CRC of the bytes buf[0..len-1].*/
-unsigned lodepng_crc32(const unsigned char* buf, size_t len)
+/*Updates the running (inverted) CRC c with buf[0..len-1], a byte at a time. The reference
+the other versions are checked against.*/
+static unsigned crc32_bytewise(unsigned c, const unsigned char* buf, size_t len)
 {
-  unsigned c = 0xffffffffL;
   size_t n;
 
   for(n = 0; n < len; n++)
   {
     c = lodepng_crc32_table[(c ^ buf[n]) & 0xff] ^ (c >> 8);
   }
-  return c ^ 0xffffffffL;
+  return c;
+}
+
+/*
+Slice-by-8 tables: crc32_slice_table[k][b] is the CRC contribution of byte b followed by k
+zero bytes, so eight bytes can be folded into the CRC with eight independent lookups
+instead of a chain of eight dependent ones. Table 0 is lodepng_crc32_table.
+*/
+static unsigned crc32_slice_table[8][256];
+
+static unsigned crc32_init_slice_table(void)
+{
+  unsigned i, k;
+  for(i = 0; i < 256; i++) crc32_slice_table[0][i] = lodepng_crc32_table[i];
+  for(k = 1; k < 8; k++)
+  {
+    for(i = 0; i < 256; i++)
+    {
+      unsigned c = crc32_slice_table[k - 1][i];
+      crc32_slice_table[k][i] = (c >> 8) ^ lodepng_crc32_table[c & 0xff];
+    }
+  }
+  return 1;
+}
+
+#ifdef LODEPNG_COMPILE_CPP
+/*filled during static initialization like simd_flags*/
+static unsigned crc32_slice_ready = crc32_init_slice_table();
+#else /*LODEPNG_COMPILE_CPP*/
+static unsigned crc32_slice_ready = 0;
+#endif /*LODEPNG_COMPILE_CPP*/
+
+static unsigned crc32_slice8(unsigned c, const unsigned char* buf, size_t len)
+{
+  if(!crc32_slice_ready) crc32_slice_ready = crc32_init_slice_table();
+  while(len >= 8)
+  {
+    unsigned one = c ^ (buf[0] | ((unsigned)buf[1] << 8) | ((unsigned)buf[2] << 16) | ((unsigned)buf[3] << 24));
+    unsigned two = buf[4] | ((unsigned)buf[5] << 8) | ((unsigned)buf[6] << 16) | ((unsigned)buf[7] << 24);
+    c = crc32_slice_table[7][one & 0xff] ^ crc32_slice_table[6][(one >> 8) & 0xff]
+      ^ crc32_slice_table[5][(one >> 16) & 0xff] ^ crc32_slice_table[4][one >> 24]
+      ^ crc32_slice_table[3][two & 0xff] ^ crc32_slice_table[2][(two >> 8) & 0xff]
+      ^ crc32_slice_table[1][(two >> 16) & 0xff] ^ crc32_slice_table[0][two >> 24];
+    buf += 8;
+    len -= 8;
+  }
+  return crc32_bytewise(c, buf, len);
+}
+
+#ifdef LODEPNG_X86
+/*
+CRC by folding with carry-less multiplication, from Intel's "Fast CRC Computation for
+Generic Polynomials Using PCLMULQDQ Instruction" (the same constants as zlib's and
+Chromium's versions for the reflected polynomial 0xedb88320). Four 128 bit accumulators
+are folded 64 bytes at a time, then into one, then reduced to 32 bits with a Barrett
+reduction. len must be a multiple of 16 and at least 64.
+*/
+LODEPNG_TARGET("sse2,pclmul")
+static unsigned crc32_pclmul(unsigned c, const unsigned char* buf, size_t len)
+{
+  const __m128i k1k2 = _mm_set_epi32(0x00000001, (int)0xc6e41596, 0x00000001, 0x54442bd4);
+  const __m128i k3k4 = _mm_set_epi32(0x00000000, (int)0xccaa009e, 0x00000001, 0x751997d0);
+  const __m128i k5k0 = _mm_set_epi32(0x00000000, 0x00000000, 0x00000001, 0x63cd6124);
+  const __m128i poly = _mm_set_epi32(0x00000001, (int)0xf7011641, 0x00000001, (int)0xdb710641);
+  const __m128i mask32 = _mm_set_epi32(0, -1, 0, -1);
+  __m128i x1, x2, x3, x4, x5, x6, x7, x8;
+
+  x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(buf + 0)), _mm_cvtsi32_si128((int)c));
+  x2 = _mm_loadu_si128((const __m128i*)(buf + 16));
+  x3 = _mm_loadu_si128((const __m128i*)(buf + 32));
+  x4 = _mm_loadu_si128((const __m128i*)(buf + 48));
+  buf += 64;
+  len -= 64;
+
+  /*fold 64 bytes at a time*/
+  while(len >= 64)
+  {
+    x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+    x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+    x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+    x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)(buf + 0)));
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(buf + 16)));
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(buf + 32)));
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(buf + 48)));
+    buf += 64;
+    len -= 64;
+  }
+
+  /*fold the four accumulators into one*/
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x2), x5);
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x3), x5);
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x4), x5);
+
+  /*then the remaining 16 byte blocks*/
+  while(len >= 16)
+  {
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)buf));
+    buf += 16;
+    len -= 16;
+  }
+
+  /*128 to 64 bits*/
+  x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k5k0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  /*Barrett reduction to 32 bits*/
+  x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), poly, 0x10);
+  x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask32), poly, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+  return (unsigned)_mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+}
+#endif /*LODEPNG_X86*/
+
+unsigned lodepng_crc32_update(unsigned crc, const unsigned char* buf, size_t len)
+{
+  unsigned c = crc ^ 0xffffffffu;
+#ifdef LODEPNG_X86
+  if(len >= 64 && (simd_get() & LODEPNG_SIMD_PCLMUL))
+  {
+    size_t blocks = len & ~(size_t)15;
+    c = crc32_pclmul(c, buf, blocks);
+    buf += blocks;
+    len -= blocks;
+  }
+#endif /*LODEPNG_X86*/
+  c = crc32_slice8(c, buf, len);
+  return c ^ 0xffffffffu;
+}
+
+/*Return the CRC of the bytes buf[0..len-1].*/
+unsigned lodepng_crc32(const unsigned char* buf, size_t len)
+{
+  return lodepng_crc32_update(0, buf, len);
 }
 
 /* ////////////////////////////////////////////////////////////////////////// */
@@ -2978,13 +4505,6 @@ static int color_tree_get(ColorTree* tree, unsigned char r, unsigned char g, uns
   return tree ? tree->index : -1;
 }
 
-#ifdef LODEPNG_COMPILE_ENCODER
-static int color_tree_has(ColorTree* tree, unsigned char r, unsigned char g, unsigned char b, unsigned char a)
-{
-  return color_tree_get(tree, r, g, b, a) >= 0;
-}
-#endif /*LODEPNG_COMPILE_ENCODER*/
-
 /*color is not allowed to already exist.
 Index should be >= 0 (it's signed to be compatible with using -1 for "doesn't exist")*/
 static void color_tree_add(ColorTree* tree,
@@ -3416,39 +4936,231 @@ converts from any color type to 24-bit or 32-bit (later maybe more supported). r
 the out buffer must have (w * h * bpp + 7) / 8 bytes, where bpp is the bits per pixel of the output color type
 (lodepng_get_bpp) for < 8 bpp images, there may _not_ be padding bits at the end of scanlines.
 */
-unsigned lodepng_convert(unsigned char* out, const unsigned char* in,
-                         LodePNGColorMode* mode_out, const LodePNGColorMode* mode_in,
-                         unsigned w, unsigned h, unsigned fix_png)
+/*
+Row conversions for the common cases that need neither a color tree nor bit packing.
+They give the same bytes as the per pixel code further down. Each SSE2 version
+converts whole blocks of pixels and returns how many, the scalar loop does the rest.
+*/
+typedef enum ConvertFast
 {
-  unsigned error = 0;
-  size_t i;
-  ColorTree tree;
-  size_t numpixels = w * h;
+  CONVERT_NONE,
+  CONVERT_GREY8_RGBA8, /*r = g = b = grey, opaque*/
+  CONVERT_GREY16_RGBA8, /*r = g = b = the high byte of grey, opaque*/
+  CONVERT_RGBA8_GREY8, /*grey = r, see rgba8ToPixel*/
+  CONVERT_HIGH_BYTES, /*16 to 8 bits of the same color type: the high byte of every sample*/
+  CONVERT_GREY16_RGBA16, /*r = g = b = grey, opaque*/
+  CONVERT_GREY8_GREY16 /*the byte twice*/
+} ConvertFast;
 
-  if(lodepng_color_mode_equal(mode_out, mode_in))
+static ConvertFast convertFastKind(const LodePNGColorMode* mode_out, const LodePNGColorMode* mode_in)
+{
+  unsigned in_bits = mode_in->bitdepth, out_bits = mode_out->bitdepth;
+  LodePNGColorType in_type = mode_in->colortype, out_type = mode_out->colortype;
+  /*a color key only matters when it turns into alpha*/
+  unsigned keyed = mode_in->key_defined && (in_type == LCT_GREY || in_type == LCT_RGB);
+
+  if(in_type == LCT_GREY && in_bits == 8 && out_type == LCT_RGBA && out_bits == 8 && !keyed)
   {
-    size_t numbytes = lodepng_get_raw_size(w, h, mode_in);
-    for(i = 0; i < numbytes; i++) out[i] = in[i];
-    return error;
+    return CONVERT_GREY8_RGBA8;
   }
-
-  if(mode_out->colortype == LCT_PALETTE)
+  if(in_type == LCT_GREY && in_bits == 16 && out_type == LCT_RGBA && out_bits == 8 && !keyed)
   {
-    size_t palsize = 1u << mode_out->bitdepth;
-    if(mode_out->palettesize < palsize) palsize = mode_out->palettesize;
-    color_tree_init(&tree);
-    for(i = 0; i < palsize; i++)
-    {
-      unsigned char* p = &mode_out->palette[i * 4];
-      color_tree_add(&tree, p[0], p[1], p[2], p[3], i);
-    }
+    return CONVERT_GREY16_RGBA8;
+  }
+  if(in_type == LCT_RGBA && in_bits == 8 && out_type == LCT_GREY && out_bits == 8) return CONVERT_RGBA8_GREY8;
+  if(in_type == out_type && in_type != LCT_PALETTE && in_bits == 16 && out_bits == 8) return CONVERT_HIGH_BYTES;
+  if(in_type == LCT_GREY && in_bits == 16 && out_type == LCT_RGBA && out_bits == 16 && !keyed)
+  {
+    return CONVERT_GREY16_RGBA16;
   }
+  if(in_type == LCT_GREY && in_bits == 8 && out_type == LCT_GREY && out_bits == 16) return CONVERT_GREY8_GREY16;
+  return CONVERT_NONE;
+}
 
-  if(mode_in->bitdepth == 16 && mode_out->bitdepth == 16)
+static void convertFastScalar(unsigned char* out, const unsigned char* in, ConvertFast kind, size_t count)
+{
+  size_t i;
+  switch(kind)
   {
-    for(i = 0; i < numpixels; i++)
-    {
-      unsigned short r = 0, g = 0, b = 0, a = 0;
+    case CONVERT_GREY8_RGBA8:
+      for(i = 0; i < count; i++, out += 4)
+      {
+        out[0] = out[1] = out[2] = in[i];
+        out[3] = 255;
+      }
+      break;
+    case CONVERT_GREY16_RGBA8:
+      for(i = 0; i < count; i++, out += 4)
+      {
+        out[0] = out[1] = out[2] = in[i * 2];
+        out[3] = 255;
+      }
+      break;
+    case CONVERT_RGBA8_GREY8:
+      for(i = 0; i < count; i++) out[i] = in[i * 4];
+      break;
+    case CONVERT_HIGH_BYTES: /*count is in samples here*/
+      for(i = 0; i < count; i++) out[i] = in[i * 2];
+      break;
+    case CONVERT_GREY16_RGBA16:
+      for(i = 0; i < count; i++, out += 8)
+      {
+        out[0] = out[2] = out[4] = in[i * 2 + 0];
+        out[1] = out[3] = out[5] = in[i * 2 + 1];
+        out[6] = out[7] = 255;
+      }
+      break;
+    case CONVERT_GREY8_GREY16:
+      for(i = 0; i < count; i++) out[i * 2 + 0] = out[i * 2 + 1] = in[i];
+      break;
+    default: break;
+  }
+}
+
+#ifdef LODEPNG_X86
+/*sixteen grey bytes to sixteen opaque RGBA pixels*/
+LODEPNG_TARGET("sse2")
+static void storeGreyRGBA8SSE2(unsigned char* out, __m128i grey)
+{
+  const __m128i alpha = _mm_set1_epi8((char)255);
+  __m128i gg_lo = _mm_unpacklo_epi8(grey, grey), gg_hi = _mm_unpackhi_epi8(grey, grey);
+  __m128i ga_lo = _mm_unpacklo_epi8(grey, alpha), ga_hi = _mm_unpackhi_epi8(grey, alpha);
+  _mm_storeu_si128((__m128i*)(out + 0), _mm_unpacklo_epi16(gg_lo, ga_lo));
+  _mm_storeu_si128((__m128i*)(out + 16), _mm_unpackhi_epi16(gg_lo, ga_lo));
+  _mm_storeu_si128((__m128i*)(out + 32), _mm_unpacklo_epi16(gg_hi, ga_hi));
+  _mm_storeu_si128((__m128i*)(out + 48), _mm_unpackhi_epi16(gg_hi, ga_hi));
+}
+
+/*the even bytes of 32 bytes, the high bytes of big endian 16 bit samples*/
+LODEPNG_TARGET("sse2")
+static __m128i highBytesSSE2(const unsigned char* in)
+{
+  const __m128i low = _mm_set1_epi16(255);
+  __m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i*)in), low);
+  __m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i*)(in + 16)), low);
+  return _mm_packus_epi16(a, b);
+}
+
+LODEPNG_TARGET("sse2")
+static size_t convertFastSSE2(unsigned char* out, const unsigned char* in, ConvertFast kind, size_t count)
+{
+  size_t i = 0;
+  switch(kind)
+  {
+    case CONVERT_GREY8_RGBA8:
+      for(; i + 16 <= count; i += 16) storeGreyRGBA8SSE2(out + i * 4, _mm_loadu_si128((const __m128i*)(in + i)));
+      break;
+    case CONVERT_GREY16_RGBA8:
+      for(; i + 16 <= count; i += 16) storeGreyRGBA8SSE2(out + i * 4, highBytesSSE2(in + i * 2));
+      break;
+    case CONVERT_RGBA8_GREY8:
+    {
+      const __m128i red = _mm_set1_epi32(255);
+      for(; i + 16 <= count; i += 16)
+      {
+        /*the red byte of each pixel is in the low byte of a 32 bit lane, values fit packs*/
+        __m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i*)(in + i * 4 + 0)), red);
+        __m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i*)(in + i * 4 + 16)), red);
+        __m128i c = _mm_and_si128(_mm_loadu_si128((const __m128i*)(in + i * 4 + 32)), red);
+        __m128i d = _mm_and_si128(_mm_loadu_si128((const __m128i*)(in + i * 4 + 48)), red);
+        _mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d)));
+      }
+      break;
+    }
+    case CONVERT_HIGH_BYTES:
+      for(; i + 16 <= count; i += 16) _mm_storeu_si128((__m128i*)(out + i), highBytesSSE2(in + i * 2));
+      break;
+    case CONVERT_GREY16_RGBA16:
+    {
+      const __m128i alpha = _mm_set1_epi16(-1);
+      for(; i + 8 <= count; i += 8)
+      {
+        /*16 bit lanes keep the bytes of each sample together in their big endian order*/
+        __m128i grey = _mm_loadu_si128((const __m128i*)(in + i * 2));
+        __m128i gg_lo = _mm_unpacklo_epi16(grey, grey), gg_hi = _mm_unpackhi_epi16(grey, grey);
+        __m128i ga_lo = _mm_unpacklo_epi16(grey, alpha), ga_hi = _mm_unpackhi_epi16(grey, alpha);
+        _mm_storeu_si128((__m128i*)(out + i * 8 + 0), _mm_unpacklo_epi32(gg_lo, ga_lo));
+        _mm_storeu_si128((__m128i*)(out + i * 8 + 16), _mm_unpackhi_epi32(gg_lo, ga_lo));
+        _mm_storeu_si128((__m128i*)(out + i * 8 + 32), _mm_unpacklo_epi32(gg_hi, ga_hi));
+        _mm_storeu_si128((__m128i*)(out + i * 8 + 48), _mm_unpackhi_epi32(gg_hi, ga_hi));
+      }
+      break;
+    }
+    case CONVERT_GREY8_GREY16:
+      for(; i + 16 <= count; i += 16)
+      {
+        __m128i grey = _mm_loadu_si128((const __m128i*)(in + i));
+        _mm_storeu_si128((__m128i*)(out + i * 2 + 0), _mm_unpacklo_epi8(grey, grey));
+        _mm_storeu_si128((__m128i*)(out + i * 2 + 16), _mm_unpackhi_epi8(grey, grey));
+      }
+      break;
+    default: break;
+  }
+  return i;
+}
+#endif /*LODEPNG_X86*/
+
+/*converts count pixels if there is a fast path for the modes, returns whether there was*/
+static unsigned convertFast(unsigned char* out, const unsigned char* in,
+                            const LodePNGColorMode* mode_out, const LodePNGColorMode* mode_in, size_t count)
+{
+  ConvertFast kind = convertFastKind(mode_out, mode_in);
+  size_t done = 0;
+  if(kind == CONVERT_NONE) return 0;
+  if(kind == CONVERT_HIGH_BYTES) count *= getNumColorChannels(mode_in->colortype);
+#ifdef LODEPNG_X86
+  if(simd_get() & LODEPNG_SIMD_SSE2) done = convertFastSSE2(out, in, kind, count);
+#endif /*LODEPNG_X86*/
+  /*the scalar loop continues at pixel (or sample) done*/
+  switch(kind)
+  {
+    case CONVERT_GREY8_RGBA8: out += done * 4; in += done; break;
+    case CONVERT_GREY16_RGBA8: out += done * 4; in += done * 2; break;
+    case CONVERT_RGBA8_GREY8: out += done; in += done * 4; break;
+    case CONVERT_HIGH_BYTES: out += done; in += done * 2; break;
+    case CONVERT_GREY16_RGBA16: out += done * 8; in += done * 2; break;
+    case CONVERT_GREY8_GREY16: out += done * 2; in += done; break;
+    default: break;
+  }
+  convertFastScalar(out, in, kind, count - done);
+  return 1;
+}
+
+unsigned lodepng_convert(unsigned char* out, const unsigned char* in,
+                         LodePNGColorMode* mode_out, const LodePNGColorMode* mode_in,
+                         unsigned w, unsigned h, unsigned fix_png)
+{
+  unsigned error = 0;
+  size_t i;
+  ColorTree tree;
+  size_t numpixels = w * h;
+
+  if(lodepng_color_mode_equal(mode_out, mode_in))
+  {
+    size_t numbytes = lodepng_get_raw_size(w, h, mode_in);
+    for(i = 0; i < numbytes; i++) out[i] = in[i];
+    return error;
+  }
+
+  if(convertFast(out, in, mode_out, mode_in, numpixels)) return error;
+
+  if(mode_out->colortype == LCT_PALETTE)
+  {
+    size_t palsize = 1u << mode_out->bitdepth;
+    if(mode_out->palettesize < palsize) palsize = mode_out->palettesize;
+    color_tree_init(&tree);
+    for(i = 0; i < palsize; i++)
+    {
+      unsigned char* p = &mode_out->palette[i * 4];
+      color_tree_add(&tree, p[0], p[1], p[2], p[3], i);
+    }
+  }
+
+  if(mode_in->bitdepth == 16 && mode_out->bitdepth == 16)
+  {
+    for(i = 0; i < numpixels; i++)
+    {
+      unsigned short r = 0, g = 0, b = 0, a = 0;
       error = getPixelColorRGBA16(&r, &g, &b, &a, in, i, mode_in);
       if(error) break;
       error = rgba16ToPixel(out, i, mode_out, r, g, b, a);
@@ -3485,6 +5197,9 @@ unsigned lodepng_convert(unsigned char* out, const unsigned char* in,
 
 #ifdef LODEPNG_COMPILE_ENCODER
 
+/*size of the hash set the color profile counts colors in, more than twice the 257 it counts up to*/
+#define COLOR_SET_SIZE 512u
+
 typedef struct ColorProfile
 {
   unsigned char sixteenbit; /*needs more than 8 bits per channel*/
@@ -3502,7 +5217,8 @@ typedef struct ColorProfile
   unsigned char alpha_done;
 
   unsigned numcolors;
-  ColorTree tree; /*for listing the counted colors, up to 256*/
+  unsigned colors[COLOR_SET_SIZE]; /*the counted colors as r | g << 8 | b << 16 | a << 24, see color_set_add*/
+  unsigned char colors_used[COLOR_SET_SIZE]; /*which entries of colors are in use*/
   unsigned char* palette; /*size 1024. Remember up to the first 256 RGBA colors*/
   unsigned maxnumcolors; /*if more than that amount counted*/
   unsigned char numcolors_done;
@@ -3525,7 +5241,7 @@ static void color_profile_init(ColorProfile* profile, const LodePNGColorMode* mo
   profile->alpha_done = lodepng_can_have_alpha(mode) ? 0 : 1;
 
   profile->numcolors = 0;
-  color_tree_init(&profile->tree);
+  memset(profile->colors_used, 0, sizeof(profile->colors_used));
   profile->palette = (unsigned char*)lodepng_malloc(1024);
   profile->maxnumcolors = 257;
   if(lodepng_get_bpp(mode) <= 8)
@@ -3541,10 +5257,93 @@ static void color_profile_init(ColorProfile* profile, const LodePNGColorMode* mo
 
 static void color_profile_cleanup(ColorProfile* profile)
 {
-  color_tree_cleanup(&profile->tree);
   lodepng_free(profile->palette);
 }
 
+/*adds the color to the profile's set of counted colors, returns 1 if it wasn't in it yet.
+Open addressing with linear probing: the set never gets more than half full*/
+static unsigned color_set_add(ColorProfile* profile,
+                              unsigned char r, unsigned char g, unsigned char b, unsigned char a)
+{
+  unsigned color = r | ((unsigned)g << 8) | ((unsigned)b << 16) | ((unsigned)a << 24);
+  unsigned i = ((color * 2654435761u) >> 23) & (COLOR_SET_SIZE - 1u); /*Fibonacci hashing*/
+  while(profile->colors_used[i])
+  {
+    if(profile->colors[i] == color) return 0;
+    i = (i + 1) & (COLOR_SET_SIZE - 1u);
+  }
+  profile->colors_used[i] = 1;
+  profile->colors[i] = color;
+  return 1;
+}
+
+/*
+Once the colors are counted and the grey bits are known, only a pixel that is colored or
+not opaque can still change the profile of an image without a color key. For 8-bit RGBA
+and grey with alpha this finds the first such pixel at or after i, or returns numpixels,
+so that get_color_profile can skip the plain ones in between.
+*/
+static size_t findProfilePixelScalar(const ColorProfile* profile, const unsigned char* in, size_t i,
+                                     size_t numpixels, const LodePNGColorMode* mode)
+{
+  if(mode->colortype == LCT_RGBA)
+  {
+    for(; i < numpixels; i++)
+    {
+      const unsigned char* p = &in[i * 4];
+      if(!profile->colored_done && (p[0] != p[1] || p[0] != p[2])) break;
+      if(!profile->alpha_done && p[3] != 255) break;
+    }
+  }
+  else /*LCT_GREY_ALPHA*/
+  {
+    for(; i < numpixels; i++) if(!profile->alpha_done && in[i * 2 + 1] != 255) break;
+  }
+  return i;
+}
+
+#ifdef LODEPNG_X86
+/*findProfilePixel on blocks of 16 pixels, returns the start of the first block that has one*/
+LODEPNG_TARGET("sse2")
+static size_t findProfilePixelSSE2(const ColorProfile* profile, const unsigned char* in, size_t i,
+                                   size_t numpixels, const LodePNGColorMode* mode)
+{
+  const __m128i ones = _mm_set1_epi8((char)255);
+  /*per pixel, the bytes comparing r with g and g with b, and the alpha byte*/
+  int rgbbits = profile->colored_done ? 0 : 0x3333;
+  int alphabits = profile->alpha_done ? 0 : (mode->colortype == LCT_RGBA ? 0x8888 : 0xaaaa);
+  size_t bytes = mode->colortype == LCT_RGBA ? 4 : 2;
+  size_t step = 64 / bytes;
+  for(; i + step <= numpixels; i += step)
+  {
+    const unsigned char* p = &in[i * bytes];
+    __m128i a = _mm_loadu_si128((const __m128i*)(p + 0));
+    __m128i b = _mm_loadu_si128((const __m128i*)(p + 16));
+    __m128i c = _mm_loadu_si128((const __m128i*)(p + 32));
+    __m128i d = _mm_loadu_si128((const __m128i*)(p + 48));
+    /*byte k of a pixel equal to byte k + 1, in all four vectors*/
+    __m128i same = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(a, _mm_srli_epi32(a, 8)),
+                                               _mm_cmpeq_epi8(b, _mm_srli_epi32(b, 8))),
+                                 _mm_and_si128(_mm_cmpeq_epi8(c, _mm_srli_epi32(c, 8)),
+                                               _mm_cmpeq_epi8(d, _mm_srli_epi32(d, 8))));
+    __m128i opaque = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(a, ones), _mm_cmpeq_epi8(b, ones)),
+                                   _mm_and_si128(_mm_cmpeq_epi8(c, ones), _mm_cmpeq_epi8(d, ones)));
+    if((_mm_movemask_epi8(same) & rgbbits) != rgbbits) break;
+    if((_mm_movemask_epi8(opaque) & alphabits) != alphabits) break;
+  }
+  return i;
+}
+#endif /*LODEPNG_X86*/
+
+static size_t findProfilePixel(const ColorProfile* profile, const unsigned char* in, size_t i,
+                               size_t numpixels, const LodePNGColorMode* mode)
+{
+#ifdef LODEPNG_X86
+  if(simd_get() & LODEPNG_SIMD_SSE2) i = findProfilePixelSSE2(profile, in, i, numpixels, mode);
+#endif /*LODEPNG_X86*/
+  return findProfilePixelScalar(profile, in, i, numpixels, mode);
+}
+
 /*function used for debug purposes with C++*/
 /*void printColorProfile(ColorProfile* p)
 {
@@ -3654,10 +5453,8 @@ static unsigned get_color_profile(ColorProfile* profile,
       if(!profile->numcolors_done)
       {
         /*assuming 8-bit rgba, this test does not care about 16-bit*/
-        if(!color_tree_has(&profile->tree, (unsigned char)r, (unsigned char)g, (unsigned char)b, (unsigned char)a))
+        if(color_set_add(profile, (unsigned char)r, (unsigned char)g, (unsigned char)b, (unsigned char)a))
         {
-          color_tree_add(&profile->tree, (unsigned char)r, (unsigned char)g, (unsigned char)b, (unsigned char)a,
-            profile->numcolors);
           if(profile->numcolors < 256)
           {
             unsigned char* p = profile->palette;
@@ -3681,11 +5478,39 @@ static unsigned get_color_profile(ColorProfile* profile,
   }
   else /* < 16-bit */
   {
+    unsigned skippable = mode->bitdepth == 8 && (mode->colortype == LCT_RGBA || mode->colortype == LCT_GREY_ALPHA);
+    unsigned lookedahead = 0;
     for(i = 0; i < numpixels; i++)
     {
       unsigned char r = 0, g = 0, b = 0, a = 0;
-      error = getPixelColorRGBA8(&r, &g, &b, &a, in, i, mode, fix_png);
-      if(error) break;
+      if(skippable && profile->greybits_done && (!profile->key || profile->alpha_done))
+      {
+        if(profile->numcolors_done)
+        {
+          i = findProfilePixel(profile, in, i, numpixels, mode);
+          if(i == numpixels) break;
+        }
+        else if(!lookedahead && profile->greybits == 8 && profile->numcolors > 16 && !profile->colored && !profile->alpha)
+        {
+          /*8-bit grey beats a palette of more than 16 colors, so the colors only matter if a
+          pixel further on is colored or not opaque. Look for one before counting any further*/
+          lookedahead = 1;
+          if(findProfilePixel(profile, in, i, numpixels, mode) == numpixels) break;
+        }
+      }
+      if(mode->colortype == LCT_RGBA && mode->bitdepth == 8)
+      {
+        /*the common case without the general function's color type checks*/
+        r = in[i * 4 + 0];
+        g = in[i * 4 + 1];
+        b = in[i * 4 + 2];
+        a = in[i * 4 + 3];
+      }
+      else
+      {
+        error = getPixelColorRGBA8(&r, &g, &b, &a, in, i, mode, fix_png);
+        if(error) break;
+      }
 
       if(!profile->colored_done && (r != g || r != b))
       {
@@ -3732,9 +5557,8 @@ static unsigned get_color_profile(ColorProfile* profile,
 
       if(!profile->numcolors_done)
       {
-        if(!color_tree_has(&profile->tree, r, g, b, a))
+        if(color_set_add(profile, r, g, b, a))
         {
-          color_tree_add(&profile->tree, r, g, b, a, profile->numcolors);
           if(profile->numcolors < 256)
           {
             unsigned char* p = profile->palette;
@@ -3802,6 +5626,8 @@ unsigned lodepng_auto_choose_color(LodePNGColorMode* mode_out,
     profile.numcolors_done = 1;
     profile.sixteenbit_done = 1;
   }
+  /*the colors are only counted for the palette*/
+  if(no_palette) profile.numcolors_done = 1;
   error = get_color_profile(&profile, image, w * h, mode_in, 0 /*fix_png*/);
   if(!error && auto_convert == LAC_ALPHA)
   {
@@ -3916,6 +5742,45 @@ static unsigned char paethPredictor(short a, short b, short c)
   else return (unsigned char)a;
 }
 
+#ifdef LODEPNG_X86
+/*SIMD building blocks shared by the filters and unfilters*/
+
+/*floor((a + b) / 2) per byte: pavgb rounds up, subtract the lost low bit*/
+LODEPNG_TARGET("sse2")
+static __m128i averageSSE2(__m128i a, __m128i b)
+{
+  return _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+}
+
+/*paethPredictor on eight 16 bit lanes holding byte values*/
+LODEPNG_TARGET("sse2")
+static __m128i paeth16SSE2(__m128i a, __m128i b, __m128i c)
+{
+  __m128i zero = _mm_setzero_si128();
+  __m128i pa = _mm_sub_epi16(b, c);
+  __m128i pb = _mm_sub_epi16(a, c);
+  __m128i pc = _mm_add_epi16(pa, pb); /*a + b - c - c*/
+  __m128i useb, usec, pred;
+  pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+  pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+  pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+  usec = _mm_and_si128(_mm_cmplt_epi16(pc, pa), _mm_cmplt_epi16(pc, pb));
+  useb = _mm_cmplt_epi16(pb, pa);
+  pred = _mm_or_si128(_mm_and_si128(useb, b), _mm_andnot_si128(useb, a));
+  return _mm_or_si128(_mm_and_si128(usec, c), _mm_andnot_si128(usec, pred));
+}
+
+/*paethPredictor on sixteen bytes*/
+LODEPNG_TARGET("sse2")
+static __m128i paethSSE2(__m128i a, __m128i b, __m128i c)
+{
+  __m128i zero = _mm_setzero_si128();
+  __m128i lo = paeth16SSE2(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero));
+  __m128i hi = paeth16SSE2(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero));
+  return _mm_packus_epi16(lo, hi);
+}
+#endif /*LODEPNG_X86*/
+
 /*shared values used by multiple Adam7 related functions*/
 
 static const unsigned ADAM7_IX[7] = { 0, 4, 0, 2, 0, 1, 0 }; /*x start values*/
@@ -3981,7 +5846,7 @@ unsigned lodepng_inspect(unsigned* w, unsigned* h, LodePNGState* state,
   {
     CERROR_RETURN_ERROR(state->error, 48); /*error: the given data is empty*/
   }
-  if(insize < 29)
+  if(insize < 33)
   {
     CERROR_RETURN_ERROR(state->error, 27); /*error: the data length is smaller than the length of a PNG header*/
   }
@@ -4030,8 +5895,8 @@ unsigned lodepng_inspect(unsigned* w, unsigned* h, LodePNGState* state,
   return state->error;
 }
 
-static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
-                                 size_t bytewidth, unsigned char filterType, size_t length)
+static unsigned unfilterScanlineScalar(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                       size_t bytewidth, unsigned char filterType, size_t length)
 {
   /*
   For PNG filter method 0
@@ -4104,6 +5969,138 @@ static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scan
   return 0;
 }
 
+#ifdef LODEPNG_X86
+/*
+SIMD versions of unfilterScanline. Up adds whole vectors. Sub is a prefix sum: within a
+vector, adding the vector to itself shifted by 1, 2, 4... pixels (with the last pixel of
+the previous vector added in first) reconstructs it in log steps, for 1, 2, 4 and 8 byte
+pixels. Average and Paeth depend on the pixel just reconstructed, so for pixels of 3 to
+8 bytes they go one pixel per step with all bytes of the pixel at once. The remaining
+cases (Average and Paeth on 1 and 2 byte pixels) stay scalar.
+Each pixel is loaded before its reconstruction is stored, so recon may be scanline.
+*/
+
+LODEPNG_TARGET("sse2")
+static __m128i loadPixelSSE2(const unsigned char* p, size_t bytewidth)
+{
+  unsigned char buffer[16] = {0};
+  memcpy(buffer, p, bytewidth);
+  return _mm_loadu_si128((const __m128i*)buffer);
+}
+
+LODEPNG_TARGET("sse2")
+static void storePixelSSE2(unsigned char* p, __m128i v, size_t bytewidth)
+{
+  unsigned char buffer[16];
+  _mm_storeu_si128((__m128i*)buffer, v);
+  memcpy(p, buffer, bytewidth);
+}
+
+/*prefix sum with an immediate pixel size, see unfilterSubSSE2*/
+#define LODEPNG_UNFILTER_SUB_LOOP(bw)\
+  for(; i + 16 <= length; i += 16)\
+  {\
+    __m128i x = _mm_add_epi8(_mm_loadu_si128((const __m128i*)(scanline + i)), carry);\
+    x = _mm_add_epi8(x, _mm_slli_si128(x, bw));\
+    if(bw < 8) x = _mm_add_epi8(x, _mm_slli_si128(x, (bw) * 2));\
+    if(bw < 4) x = _mm_add_epi8(x, _mm_slli_si128(x, (bw) * 4));\
+    if(bw < 2) x = _mm_add_epi8(x, _mm_slli_si128(x, 8));\
+    _mm_storeu_si128((__m128i*)(recon + i), x);\
+    carry = _mm_srli_si128(x, 16 - (bw));\
+  }
+
+/*Sub for 1, 2, 4 and 8 byte pixels. carry holds the last reconstructed pixel of the
+previous vector in its low bytes, 0 before the first one, which is what the first
+pixel of the scanline adds*/
+LODEPNG_TARGET("sse2")
+static void unfilterSubSSE2(unsigned char* recon, const unsigned char* scanline, size_t bytewidth, size_t length)
+{
+  __m128i carry = _mm_setzero_si128();
+  size_t i = 0;
+  switch(bytewidth)
+  {
+    case 1: LODEPNG_UNFILTER_SUB_LOOP(1) break;
+    case 2: LODEPNG_UNFILTER_SUB_LOOP(2) break;
+    case 4: LODEPNG_UNFILTER_SUB_LOOP(4) break;
+    default: LODEPNG_UNFILTER_SUB_LOOP(8) break;
+  }
+  for(; i < length; i++) recon[i] = scanline[i] + (i >= bytewidth ? recon[i - bytewidth] : 0);
+}
+
+#undef LODEPNG_UNFILTER_SUB_LOOP
+
+/*Sub, Average and Paeth one pixel of 3 to 8 bytes at a time. a is the pixel to the
+left and c the one above it, both 0 for the first pixel, which is what the scalar code
+reduces to there*/
+LODEPNG_TARGET("sse2")
+static void unfilterPixelsSSE2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                               size_t bytewidth, unsigned char filterType, size_t length)
+{
+  __m128i zero = _mm_setzero_si128();
+  __m128i a = zero, c = zero;
+  size_t i;
+  for(i = 0; i + bytewidth <= length; i += bytewidth)
+  {
+    __m128i x = loadPixelSSE2(scanline + i, bytewidth);
+    if(filterType == 1) a = _mm_add_epi8(x, a);
+    else
+    {
+      __m128i b = loadPixelSSE2(precon + i, bytewidth);
+      if(filterType == 3) a = _mm_add_epi8(x, averageSSE2(a, b));
+      else
+      {
+        __m128i pred = paeth16SSE2(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero));
+        a = _mm_add_epi8(x, _mm_packus_epi16(pred, zero));
+        c = b;
+      }
+    }
+    storePixelSSE2(recon + i, a, bytewidth);
+  }
+}
+
+/*returns 1 if the SIMD code handled the scanline, 0 if the scalar code has to*/
+LODEPNG_TARGET("sse2")
+static unsigned unfilterScanlineSSE2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                     size_t bytewidth, unsigned char filterType, size_t length)
+{
+  size_t i;
+  if(filterType == 2 && precon)
+  {
+    for(i = 0; i + 16 <= length; i += 16)
+    {
+      __m128i x = _mm_loadu_si128((const __m128i*)(scanline + i));
+      __m128i b = _mm_loadu_si128((const __m128i*)(precon + i));
+      _mm_storeu_si128((__m128i*)(recon + i), _mm_add_epi8(x, b));
+    }
+    for(; i < length; i++) recon[i] = scanline[i] + precon[i];
+    return 1;
+  }
+  if(filterType == 1 && (bytewidth == 1 || bytewidth == 2 || bytewidth == 4 || bytewidth == 8))
+  {
+    unfilterSubSSE2(recon, scanline, bytewidth, length);
+    return 1;
+  }
+  if(bytewidth >= 3 && bytewidth <= 8 && (filterType == 1 || ((filterType == 3 || filterType == 4) && precon)))
+  {
+    unfilterPixelsSSE2(recon, scanline, precon, bytewidth, filterType, length);
+    return 1;
+  }
+  return 0;
+}
+#endif /*LODEPNG_X86*/
+
+static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                 size_t bytewidth, unsigned char filterType, size_t length)
+{
+#ifdef LODEPNG_X86
+  if((simd_get() & LODEPNG_SIMD_SSE2) && unfilterScanlineSSE2(recon, scanline, precon, bytewidth, filterType, length))
+  {
+    return 0;
+  }
+#endif /*LODEPNG_X86*/
+  return unfilterScanlineScalar(recon, scanline, precon, bytewidth, filterType, length);
+}
+
 static unsigned unfilter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h, unsigned bpp)
 {
   /*
@@ -4583,15 +6580,19 @@ static unsigned readChunk_pHYs(LodePNGInfo* info, const unsigned char* data, siz
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
 /*read a PNG, the result will be in the same color type as the PNG (hence "generic")*/
-static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
-                          LodePNGState* state,
-                          const unsigned char* in, size_t insize)
+/*
+Reads the header and the chunks up to IEND into state->info_png, checking their
+lengths and CRCs. The data of the IDAT chunks is appended to idat, or without
+idat only located: *firstidat is set to the first IDAT chunk (0 if there is
+none) and *idatsize to the size of their data together.
+*/
+static void readChunks(unsigned* w, unsigned* h, LodePNGState* state,
+                       const unsigned char* in, size_t insize,
+                       ucvector* idat, const unsigned char** firstidat, size_t* idatsize)
 {
   unsigned char IEND = 0;
   const unsigned char* chunk;
   size_t i;
-  ucvector idat; /*the data from idat chunks*/
-  ucvector scanlines;
 
   /*for unknown chunk order*/
   unsigned unknown = 0;
@@ -4599,13 +6600,12 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
   unsigned critical_pos = 1; /*1 = after IHDR, 2 = after PLTE, 3 = after IDAT*/
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
-  /*provide some proper output values if error will happen*/
-  *out = 0;
+  if(firstidat) *firstidat = 0;
+  if(idatsize) *idatsize = 0;
 
   state->error = lodepng_inspect(w, h, state, in, insize); /*reads header and resets other parameters in state->info_png*/
   if(state->error) return;
 
-  ucvector_init(&idat);
   chunk = &in[33]; /*first byte of the first chunk after the header*/
 
   /*loop through the chunks, ignoring unknown chunks and stopping at IEND chunk.
@@ -4633,9 +6633,17 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
     /*IDAT chunk, containing compressed image data*/
     if(lodepng_chunk_type_equals(chunk, "IDAT"))
     {
-      size_t oldsize = idat.size;
-      if(!ucvector_resize(&idat, oldsize + chunkLength)) CERROR_BREAK(state->error, 83 /*alloc fail*/);
-      for(i = 0; i < chunkLength; i++) idat.data[oldsize + i] = data[i];
+      if(idat)
+      {
+        size_t oldsize = idat->size;
+        if(!ucvector_resize(idat, oldsize + chunkLength)) CERROR_BREAK(state->error, 83 /*alloc fail*/);
+        for(i = 0; i < chunkLength; i++) idat->data[oldsize + i] = data[i];
+      }
+      else
+      {
+        if(!*firstidat) *firstidat = chunk;
+        *idatsize += chunkLength;
+      }
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
       critical_pos = 3;
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
@@ -4728,6 +6736,20 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
 
     if(!IEND) chunk = lodepng_chunk_next_const(chunk);
   }
+}
+
+static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
+                          LodePNGState* state,
+                          const unsigned char* in, size_t insize)
+{
+  ucvector idat; /*the data from idat chunks*/
+  ucvector scanlines;
+
+  /*provide some proper output values if error will happen*/
+  *out = 0;
+
+  ucvector_init(&idat);
+  readChunks(w, h, state, in, insize, &idat, 0, 0);
 
   ucvector_init(&scanlines);
   if(!state->error)
@@ -4802,6 +6824,244 @@ unsigned lodepng_decode(unsigned char** out, unsigned* w, unsigned* h,
   return state->error;
 }
 
+#ifdef LODEPNG_COMPILE_ZLIB
+
+/*state of lodepng_decode_rows*/
+typedef struct RowDecoder
+{
+  LodePNGState* state;
+  LodePNGRowSink sink;
+  void* sink_context;
+  unsigned w;
+  unsigned h;
+  unsigned y; /*rows passed on so far*/
+  const unsigned char* chunk; /*the IDAT chunk the bit reader is in*/
+  size_t linebytes; /*PNG scanline bytes, without the filter type*/
+  size_t bytewidth; /*see unfilter*/
+  size_t rawbytes; /*bytes of a row in state->info_raw*/
+  size_t done; /*bytes of the window passed on as rows*/
+  size_t checked; /*bytes of the window added to adler*/
+  unsigned adler;
+  unsigned char* lines[2]; /*unfiltered rows, the current one and the one above it*/
+  unsigned char* converted; /*the current row in state->info_raw, 0 when no conversion is needed*/
+} RowDecoder;
+
+/*BitReader nextpiece: moves on to the data of the next IDAT chunk. readChunks has checked all chunks up to IEND*/
+static unsigned nextIDAT(BitReader* reader)
+{
+  RowDecoder* decoder = (RowDecoder*)reader->context;
+  const unsigned char* chunk = decoder->chunk;
+  do
+  {
+    if(lodepng_chunk_type_equals(chunk, "IEND")) return 0;
+    chunk = lodepng_chunk_next_const(chunk);
+  }
+  while(!lodepng_chunk_type_equals(chunk, "IDAT"));
+  decoder->chunk = chunk;
+  reader->base += reader->size;
+  reader->data = lodepng_chunk_data_const(chunk);
+  reader->size = lodepng_chunk_length(chunk);
+  reader->next = 0;
+  return 1;
+}
+
+/*unfilters and converts one scanline, filter type byte first, and hands it to the sink*/
+static unsigned decodeRow(RowDecoder* decoder, const unsigned char* scanline)
+{
+  LodePNGState* state = decoder->state;
+  unsigned char* recon = decoder->lines[decoder->y & 1];
+  const unsigned char* precon = decoder->y == 0 ? 0 : decoder->lines[(decoder->y & 1) ^ 1];
+  const unsigned char* row = recon;
+
+  if(decoder->y >= decoder->h) return 0; /*data after the last row is ignored, as by lodepng_decode*/
+  CERROR_TRY_RETURN(unfilterScanline(recon, scanline + 1, precon, decoder->bytewidth, scanline[0], decoder->linebytes));
+  if(decoder->converted)
+  {
+    CERROR_TRY_RETURN(lodepng_convert(decoder->converted, recon, &state->info_raw, &state->info_png.color,
+                                      decoder->w, 1, state->decoder.fix_png));
+    row = decoder->converted;
+  }
+  CERROR_TRY_RETURN(decoder->sink(decoder->sink_context, decoder->y, row, decoder->rawbytes));
+  decoder->y++;
+  return 0;
+}
+
+/*InflateOutput flush: passes on the complete rows in the window, then slides it*/
+static unsigned flushRows(InflateOutput* output, size_t needed)
+{
+  RowDecoder* decoder = (RowDecoder*)output->context;
+  unsigned char* data = output->out->data;
+  size_t start;
+
+  (void)needed; /*the window is large enough for any, see lodepng_decode_rows*/
+  if(!decoder->state->decoder.zlibsettings.ignore_adler32)
+  {
+    decoder->adler = update_adler32(decoder->adler, data + decoder->checked, output->pos - decoder->checked);
+  }
+  decoder->checked = output->pos;
+  while(output->pos - decoder->done >= decoder->linebytes + 1)
+  {
+    CERROR_TRY_RETURN(decodeRow(decoder, data + decoder->done));
+    decoder->done += decoder->linebytes + 1;
+  }
+
+  /*keep the last 32768 bytes for the deflate distances and the start of the next row*/
+  start = output->pos > 32768 ? output->pos - 32768 : 0;
+  if(start > decoder->done) start = decoder->done;
+  memmove(data, data + start, output->pos - start);
+  output->pos -= start;
+  decoder->done -= start;
+  decoder->checked -= start;
+  return 0;
+}
+
+unsigned lodepng_decode_rows(LodePNGRowSink sink, void* sink_context, unsigned* w, unsigned* h,
+                             LodePNGState* state, const unsigned char* in, size_t insize)
+{
+  RowDecoder decoder;
+  BitReader reader;
+  InflateOutput output;
+  ucvector window;
+  const unsigned char* firstidat;
+  size_t idatsize, windowsize;
+  unsigned error = 0;
+
+  readChunks(w, h, state, in, insize, 0, &firstidat, &idatsize);
+  if(state->error) return state->error;
+  if(state->info_png.interlace_method != 0) CERROR_RETURN_ERROR(state->error, 95);
+
+  /*the same color conversion as lodepng_decode*/
+  if(!state->decoder.color_convert)
+  {
+    state->error = lodepng_color_mode_copy(&state->info_raw, &state->info_png.color);
+    if(state->error) return state->error;
+  }
+  else if(!lodepng_color_mode_equal(&state->info_raw, &state->info_png.color)
+          && !(state->info_raw.colortype == LCT_RGB || state->info_raw.colortype == LCT_RGBA)
+          && !(state->info_raw.bitdepth == 8))
+  {
+    CERROR_RETURN_ERROR(state->error, 56); /*unsupported color mode conversion*/
+  }
+
+  decoder.state = state;
+  decoder.sink = sink;
+  decoder.sink_context = sink_context;
+  decoder.w = *w;
+  decoder.h = *h;
+  decoder.y = 0;
+  decoder.chunk = firstidat;
+  decoder.linebytes = lodepng_get_raw_size(*w, 1, &state->info_png.color);
+  decoder.bytewidth = (lodepng_get_bpp(&state->info_png.color) + 7) / 8;
+  decoder.rawbytes = lodepng_get_raw_size(*w, 1, &state->info_raw);
+  decoder.done = 0;
+  decoder.checked = 0;
+  decoder.adler = 1;
+  decoder.lines[0] = (unsigned char*)lodepng_malloc(decoder.linebytes + 1);
+  decoder.lines[1] = (unsigned char*)lodepng_malloc(decoder.linebytes + 1);
+  decoder.converted = 0;
+  if(!lodepng_color_mode_equal(&state->info_raw, &state->info_png.color))
+  {
+    decoder.converted = (unsigned char*)lodepng_malloc(decoder.rawbytes + 1);
+    if(!decoder.converted) error = 83; /*alloc fail*/
+  }
+
+  /*after a flush the window holds at most 32768 bytes and the start of a row, which
+  leaves room for a stored block of 65535 bytes, and for another 65536 so that
+  flushes don't come too often*/
+  windowsize = 32768 + decoder.linebytes + 1 + 2 * 65536;
+  ucvector_init_buffer(&window, (unsigned char*)lodepng_malloc(windowsize), windowsize);
+  if(!decoder.lines[0] || !decoder.lines[1] || !window.data) error = 83; /*alloc fail*/
+
+  /*the zlib stream is read where it is, in pieces one IDAT chunk each*/
+  if(!error && (!firstidat || idatsize < 2)) error = 53; /*error, size of zlib data too small*/
+  if(!error)
+  {
+    unsigned CMF, FLG;
+    BitReader_init(&reader, lodepng_chunk_data_const(firstidat), lodepng_chunk_length(firstidat));
+    reader.bitsize = idatsize * 8;
+    reader.nextpiece = nextIDAT;
+    reader.context = &decoder;
+
+    /*the zlib header, checked like in lodepng_zlib_decompress*/
+    CMF = readBits(&reader, 8);
+    FLG = readBits(&reader, 8);
+    if((CMF * 256 + FLG) % 31 != 0) error = 24;
+    else if((CMF & 15) != 8 || ((CMF >> 4) & 15) > 7) error = 25;
+    else if((FLG >> 5) & 1) error = 26;
+  }
+  if(!error)
+  {
+    output.out = &window;
+    output.pos = 0;
+    output.flush = flushRows;
+    output.context = &decoder;
+    error = inflateBlocks(&output, &reader);
+    if(!error) error = flushRows(&output, 0);
+    if(!error && decoder.y < decoder.h) error = 96; /*error, the image data ended early*/
+  }
+  if(!error && !state->decoder.zlibsettings.ignore_adler32)
+  {
+    /*the adler32 comes at the next byte boundary, big endian*/
+    unsigned ADLER32;
+    advanceBits(&reader, reader.avail & 7);
+    ADLER32 = readBits(&reader, 8) << 24;
+    ADLER32 |= readBits(&reader, 8) << 16;
+    ADLER32 |= readBits(&reader, 8) << 8;
+    ADLER32 |= readBits(&reader, 8);
+    if(BitReader_bitpos(&reader) > reader.bitsize || ADLER32 != decoder.adler) error = 58; /*error, adler checksum not correct*/
+  }
+
+  lodepng_free(decoder.lines[0]);
+  lodepng_free(decoder.lines[1]);
+  lodepng_free(decoder.converted);
+  ucvector_cleanup(&window);
+  state->error = error;
+  return error;
+}
+
+/*LodePNGRowSink of lodepng_decode_to_buffer*/
+typedef struct RowBuffer
+{
+  unsigned char* out;
+  size_t capacity;
+  const LodePNGState* state;
+  const unsigned* w;
+  const unsigned* h;
+} RowBuffer;
+
+static unsigned copyRow(void* context, unsigned y, const unsigned char* row, size_t size)
+{
+  RowBuffer* buffer = (RowBuffer*)context;
+  size_t linebits = (size_t)(*buffer->w) * lodepng_get_bpp(&buffer->state->info_raw);
+  if(y == 0 && lodepng_get_raw_size(*buffer->w, *buffer->h, &buffer->state->info_raw) > buffer->capacity)
+  {
+    return 97; /*error: the buffer is too small*/
+  }
+  if(linebits % 8 == 0) memcpy(buffer->out + y * (linebits / 8), row, size);
+  else
+  {
+    /*rows of less than a whole number of bytes are packed without padding, like lodepng_decode's output*/
+    size_t x, ibp = 0, obp = y * linebits;
+    for(x = 0; x < linebits; x++) setBitOfReversedStream(&obp, buffer->out, readBitFromReversedStream(&ibp, row));
+    /*the bits after the last pixel are zero*/
+    if(y + 1 == *buffer->h) while(obp & 7) setBitOfReversedStream(&obp, buffer->out, 0);
+  }
+  return 0;
+}
+
+unsigned lodepng_decode_to_buffer(unsigned char* out, size_t capacity, unsigned* w, unsigned* h,
+                                  LodePNGState* state, const unsigned char* in, size_t insize)
+{
+  RowBuffer buffer;
+  buffer.out = out;
+  buffer.capacity = capacity;
+  buffer.state = state;
+  buffer.w = w;
+  buffer.h = h;
+  return lodepng_decode_rows(copyRow, &buffer, w, h, state, in, insize);
+}
+#endif /*LODEPNG_COMPILE_ZLIB*/
+
 unsigned lodepng_decode_memory(unsigned char** out, unsigned* w, unsigned* h, const unsigned char* in,
                                size_t insize, LodePNGColorType colortype, unsigned bitdepth)
 {
@@ -4872,6 +7132,7 @@ void lodepng_state_init(LodePNGState* state)
 #endif /*LODEPNG_COMPILE_DECODER*/
 #ifdef LODEPNG_COMPILE_ENCODER
   lodepng_encoder_settings_init(&state->encoder);
+  state->scratch = 0;
 #endif /*LODEPNG_COMPILE_ENCODER*/
   lodepng_color_mode_init(&state->info_raw);
   lodepng_info_init(&state->info_png);
@@ -4882,12 +7143,21 @@ void lodepng_state_cleanup(LodePNGState* state)
 {
   lodepng_color_mode_cleanup(&state->info_raw);
   lodepng_info_cleanup(&state->info_png);
+#if defined(LODEPNG_COMPILE_ENCODER) && defined(LODEPNG_COMPILE_ALLOCATORS)
+  scratch_destroy(state->scratch);
+#endif /*defined(LODEPNG_COMPILE_ENCODER) && defined(LODEPNG_COMPILE_ALLOCATORS)*/
+#ifdef LODEPNG_COMPILE_ENCODER
+  state->scratch = 0;
+#endif /*LODEPNG_COMPILE_ENCODER*/
 }
 
 void lodepng_state_copy(LodePNGState* dest, const LodePNGState* source)
 {
   lodepng_state_cleanup(dest);
   *dest = *source;
+#ifdef LODEPNG_COMPILE_ENCODER
+  dest->scratch = 0;
+#endif /*LODEPNG_COMPILE_ENCODER*/
   lodepng_color_mode_init(&dest->info_raw);
   lodepng_info_init(&dest->info_png);
   dest->error = lodepng_color_mode_copy(&dest->info_raw, &source->info_raw); if(dest->error) return;
@@ -4902,11 +7172,27 @@ void lodepng_state_copy(LodePNGState* dest, const LodePNGState* source)
 /* / PNG Encoder                                                            / */
 /* ////////////////////////////////////////////////////////////////////////// */
 
+/*appends a chunk to out with ucvector_resize, so it can fill a fixed output buffer*/
+static unsigned appendChunk(ucvector* out, const unsigned char* chunk)
+{
+  size_t length = lodepng_chunk_length(chunk) + 12, pos = out->size;
+  if(pos + length < length) return 77; /*integer overflow happened*/
+  if(!ucvector_resize(out, pos + length)) return 83; /*alloc fail*/
+  memcpy(&out->data[pos], chunk, length);
+  return 0;
+}
+
 /*chunkName must be string of 4 characters*/
 static unsigned addChunk(ucvector* out, const char* chunkName, const unsigned char* data, size_t length)
 {
-  CERROR_TRY_RETURN(lodepng_chunk_create(&out->data, &out->size, (unsigned)length, chunkName, data));
-  out->allocsize = out->size; /*fix the allocsize again*/
+  size_t pos = out->size;
+  if(length > 2147483647) return 63; /*chunk too long*/
+  if(pos + length + 12 < length) return 77; /*integer overflow happened*/
+  if(!ucvector_resize(out, pos + length + 12)) return 83; /*alloc fail*/
+  lodepng_set32bitInt(&out->data[pos], (unsigned)length);
+  memcpy(&out->data[pos + 4], chunkName, 4);
+  if(length) memcpy(&out->data[pos + 8], data, length);
+  lodepng_chunk_generate_crc(&out->data[pos]);
   return 0;
 }
 
@@ -5007,10 +7293,28 @@ static unsigned addChunk_tRNS(ucvector* out, const LodePNGColorMode* info)
 }
 
 static unsigned addChunk_IDAT(ucvector* out, const unsigned char* data, size_t datasize,
-                              LodePNGCompressSettings* zlibsettings)
+                              const LodePNGCompressSettings* zlibsettings)
 {
   ucvector zlibdata;
   unsigned error = 0;
+#ifdef LODEPNG_COMPILE_ZLIB
+  size_t pos = out->size, length;
+
+  if(!zlibsettings->custom_zlib)
+  {
+    /*compress straight into out, behind room for the chunk length and name*/
+    if(!ucvector_resize(out, pos + 8)) return 83; /*alloc fail*/
+    error = zlib_compressv(out, data, datasize, zlibsettings);
+    if(error) return error;
+    length = out->size - pos - 8;
+    if(length > 2147483647) return 63; /*chunk too long*/
+    if(!ucvector_resize(out, out->size + 4)) return 83; /*alloc fail*/
+    lodepng_set32bitInt(&out->data[pos], (unsigned)length);
+    memcpy(&out->data[pos + 4], "IDAT", 4);
+    lodepng_chunk_generate_crc(&out->data[pos]);
+    return 0;
+  }
+#endif /*LODEPNG_COMPILE_ZLIB*/
 
   /*compress with the Zlib compressor*/
   ucvector_init(&zlibdata);
@@ -5047,7 +7351,7 @@ static unsigned addChunk_tEXt(ucvector* out, const char* keyword, const char* te
 }
 
 static unsigned addChunk_zTXt(ucvector* out, const char* keyword, const char* textstring,
-                              LodePNGCompressSettings* zlibsettings)
+                              const LodePNGCompressSettings* zlibsettings)
 {
   unsigned error = 0;
   ucvector data, compressed;
@@ -5074,7 +7378,7 @@ static unsigned addChunk_zTXt(ucvector* out, const char* keyword, const char* te
 }
 
 static unsigned addChunk_iTXt(ucvector* out, unsigned compressed, const char* keyword, const char* langtag,
-                              const char* transkey, const char* textstring, LodePNGCompressSettings* zlibsettings)
+                              const char* transkey, const char* textstring, const LodePNGCompressSettings* zlibsettings)
 {
   unsigned error = 0;
   ucvector data;
@@ -5179,8 +7483,8 @@ static unsigned addChunk_pHYs(ucvector* out, const LodePNGInfo* info)
 
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
-static void filterScanline(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
-                           size_t length, size_t bytewidth, unsigned char filterType)
+static void filterScanlineScalar(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                                 size_t length, size_t bytewidth, unsigned char filterType)
 {
   size_t i;
   switch(filterType)
@@ -5243,6 +7547,236 @@ static void filterScanline(unsigned char* out, const unsigned char* scanline, co
   }
 }
 
+#ifdef LODEPNG_X86
+/*
+SIMD versions of filterScanline for filter types 1 to 4 (with a prevline for 2 to 4).
+Filtering reads only the raw scanlines, so every vector of output is independent. The
+filters are byte arithmetic modulo 256, Average rounds pavgb's result down again and
+Paeth is evaluated on 16 bit lanes, which gives exactly the scalar bytes.
+*/
+
+/*the first bytewidth bytes, where the pixel to the left is 0*/
+static void filterHead(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                       size_t bytewidth, unsigned char filterType)
+{
+  size_t i;
+  for(i = 0; i < bytewidth; i++)
+  {
+    if(filterType == 1) out[i] = scanline[i];
+    else if(filterType == 3) out[i] = scanline[i] - prevline[i] / 2;
+    else out[i] = scanline[i] - prevline[i]; /*Up, and Paeth which predicts prevline[i] here*/
+  }
+}
+
+/*the bytes from start on that don't fill a whole vector, start >= bytewidth*/
+static void filterTail(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                       size_t start, size_t length, size_t bytewidth, unsigned char filterType)
+{
+  size_t i;
+  for(i = start; i < length; i++)
+  {
+    if(filterType == 1) out[i] = scanline[i] - scanline[i - bytewidth];
+    else if(filterType == 2) out[i] = scanline[i] - prevline[i];
+    else if(filterType == 3) out[i] = scanline[i] - ((scanline[i - bytewidth] + prevline[i]) / 2);
+    else out[i] = scanline[i] - paethPredictor(scanline[i - bytewidth], prevline[i], prevline[i - bytewidth]);
+  }
+}
+
+LODEPNG_TARGET("sse2")
+static void filterScanlineSSE2(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                               size_t length, size_t bytewidth, unsigned char filterType)
+{
+  size_t i = bytewidth < length ? bytewidth : length;
+  filterHead(out, scanline, prevline, i, filterType);
+  for(; i + 16 <= length; i += 16)
+  {
+    __m128i x = _mm_loadu_si128((const __m128i*)(scanline + i));
+    __m128i a = _mm_loadu_si128((const __m128i*)(scanline + i - bytewidth));
+    __m128i pred;
+    if(filterType == 1) pred = a;
+    else
+    {
+      __m128i b = _mm_loadu_si128((const __m128i*)(prevline + i));
+      if(filterType == 2) pred = b;
+      else if(filterType == 3) pred = averageSSE2(a, b);
+      else pred = paethSSE2(a, b, _mm_loadu_si128((const __m128i*)(prevline + i - bytewidth)));
+    }
+    _mm_storeu_si128((__m128i*)(out + i), _mm_sub_epi8(x, pred));
+  }
+  filterTail(out, scanline, prevline, i, length, bytewidth, filterType);
+}
+
+LODEPNG_TARGET("avx2")
+static __m256i paeth16AVX2(__m256i a, __m256i b, __m256i c)
+{
+  __m256i pa = _mm256_sub_epi16(b, c);
+  __m256i pb = _mm256_sub_epi16(a, c);
+  __m256i pc = _mm256_abs_epi16(_mm256_add_epi16(pa, pb));
+  __m256i useb, usec;
+  pa = _mm256_abs_epi16(pa);
+  pb = _mm256_abs_epi16(pb);
+  usec = _mm256_and_si256(_mm256_cmpgt_epi16(pa, pc), _mm256_cmpgt_epi16(pb, pc));
+  useb = _mm256_cmpgt_epi16(pa, pb);
+  return _mm256_blendv_epi8(_mm256_blendv_epi8(a, b, useb), c, usec);
+}
+
+/*paethPredictor on 32 bytes given as two halves*/
+LODEPNG_TARGET("avx2")
+static __m256i paethAVX2(const unsigned char* a, const unsigned char* b, const unsigned char* c)
+{
+  __m256i lo = paeth16AVX2(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)a)),
+                           _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)b)),
+                           _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)c)));
+  __m256i hi = paeth16AVX2(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(a + 16))),
+                           _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(b + 16))),
+                           _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(c + 16))));
+  /*packus works within 128 bit lanes, put the quarters back in order*/
+  return _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xd8);
+}
+
+LODEPNG_TARGET("avx2")
+static void filterScanlineAVX2(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                               size_t length, size_t bytewidth, unsigned char filterType)
+{
+  size_t i = bytewidth < length ? bytewidth : length;
+  filterHead(out, scanline, prevline, i, filterType);
+  for(; i + 32 <= length; i += 32)
+  {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(scanline + i));
+    __m256i a = _mm256_loadu_si256((const __m256i*)(scanline + i - bytewidth));
+    __m256i pred;
+    if(filterType == 1) pred = a;
+    else if(filterType == 2) pred = _mm256_loadu_si256((const __m256i*)(prevline + i));
+    else if(filterType == 3)
+    {
+      __m256i b = _mm256_loadu_si256((const __m256i*)(prevline + i));
+      pred = _mm256_sub_epi8(_mm256_avg_epu8(a, b),
+                             _mm256_and_si256(_mm256_xor_si256(a, b), _mm256_set1_epi8(1)));
+    }
+    else pred = paethAVX2(scanline + i - bytewidth, prevline + i, prevline + i - bytewidth);
+    _mm256_storeu_si256((__m256i*)(out + i), _mm256_sub_epi8(x, pred));
+  }
+  filterTail(out, scanline, prevline, i, length, bytewidth, filterType);
+}
+#endif /*LODEPNG_X86*/
+
+static void filterScanline(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                           size_t length, size_t bytewidth, unsigned char filterType)
+{
+#ifdef LODEPNG_X86
+  /*the first scanline has no prevline, there Up, Average and Paeth degenerate to
+  simpler forms that the scalar code handles*/
+  if(filterType >= 1 && filterType <= 4 && (prevline || filterType == 1))
+  {
+    unsigned simd = simd_get();
+    if(simd & LODEPNG_SIMD_AVX2)
+    {
+      filterScanlineAVX2(out, scanline, prevline, length, bytewidth, filterType);
+      return;
+    }
+    if(simd & LODEPNG_SIMD_SSE2)
+    {
+      filterScanlineSSE2(out, scanline, prevline, length, bytewidth, filterType);
+      return;
+    }
+  }
+#endif /*LODEPNG_X86*/
+  filterScanlineScalar(out, scanline, prevline, length, bytewidth, filterType);
+}
+
+/*
+Score of the minimum sum heuristic for a filtered scanline: the sum of its bytes, for
+the difference filters (type 1 to 4) taken as signed values and made absolute. Filter
+type 0 isn't a difference, so it's summed unsigned, which means type 0 is almost never
+chosen, but that is justified.
+*/
+static size_t filterScoreMinsumScalar(const unsigned char* data, size_t length, unsigned char type)
+{
+  size_t x, sum = 0;
+  if(type == 0)
+  {
+    for(x = 0; x < length; x++) sum += data[x];
+  }
+  else
+  {
+    for(x = 0; x < length; x++)
+    {
+      unsigned char s = data[x];
+      sum += s < 128 ? s : (255U - s);
+    }
+  }
+  return sum;
+}
+
+#ifdef LODEPNG_X86
+/*psadbw against zero sums bytes; for the difference filters, bytes >= 128 are first
+flipped to 255 - s by xoring them with their sign mask. The 64 bit lane sums are read
+as 32 bits, enough for any scanline below 16MB*/
+LODEPNG_TARGET("sse2")
+static size_t filterScoreMinsumSSE2(const unsigned char* data, size_t length, unsigned char type)
+{
+  __m128i zero = _mm_setzero_si128();
+  __m128i sums = zero;
+  size_t i;
+  for(i = 0; i + 16 <= length; i += 16)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+    if(type != 0) v = _mm_xor_si128(v, _mm_cmpgt_epi8(zero, v));
+    sums = _mm_add_epi64(sums, _mm_sad_epu8(v, zero));
+  }
+  return (size_t)(unsigned)_mm_cvtsi128_si32(sums) + (unsigned)_mm_cvtsi128_si32(_mm_srli_si128(sums, 8))
+       + filterScoreMinsumScalar(data + i, length - i, type);
+}
+
+LODEPNG_TARGET("avx2")
+static size_t filterScoreMinsumAVX2(const unsigned char* data, size_t length, unsigned char type)
+{
+  __m256i zero = _mm256_setzero_si256();
+  __m256i sums = zero;
+  __m128i sum128;
+  size_t i;
+  for(i = 0; i + 32 <= length; i += 32)
+  {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(data + i));
+    if(type != 0) v = _mm256_xor_si256(v, _mm256_cmpgt_epi8(zero, v));
+    sums = _mm256_add_epi64(sums, _mm256_sad_epu8(v, zero));
+  }
+  sum128 = _mm_add_epi64(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+  return (size_t)(unsigned)_mm_cvtsi128_si32(sum128) + (unsigned)_mm_cvtsi128_si32(_mm_srli_si128(sum128, 8))
+       + filterScoreMinsumScalar(data + i, length - i, type);
+}
+#endif /*LODEPNG_X86*/
+
+static size_t filterScoreMinsum(const unsigned char* data, size_t length, unsigned char type)
+{
+#ifdef LODEPNG_X86
+  unsigned simd = simd_get();
+  if(simd & LODEPNG_SIMD_AVX2) return filterScoreMinsumAVX2(data, length, type);
+  if(simd & LODEPNG_SIMD_SSE2) return filterScoreMinsumSSE2(data, length, type);
+#endif /*LODEPNG_X86*/
+  return filterScoreMinsumScalar(data, length, type);
+}
+
+/*Byte histogram of a filtered scanline for the entropy heuristic. Counting into four
+tables and adding them up avoids stalling on the same counter for runs of equal bytes,
+which filtered scanlines are full of. Histograms don't map onto SSE2/AVX2, this is the
+fast scalar form.*/
+static void filterCountBytes(unsigned count[256], const unsigned char* data, size_t length)
+{
+  unsigned part[3][256];
+  size_t i;
+  for(i = 0; i < 256; i++) count[i] = part[0][i] = part[1][i] = part[2][i] = 0;
+  for(i = 0; i + 4 <= length; i += 4)
+  {
+    count[data[i]]++;
+    part[0][data[i + 1]]++;
+    part[1][data[i + 2]]++;
+    part[2][data[i + 3]]++;
+  }
+  for(; i < length; i++) count[data[i]]++;
+  for(i = 0; i < 256; i++) count[i] += part[0][i] + part[1][i] + part[2][i];
+}
+
 /* log2 approximation. A slight bit faster than std::log. */
 static float flog2(float f)
 {
@@ -5252,46 +7786,23 @@ static float flog2(float f)
   return result + 1.442695f * (f * f * f / 3 - 3 * f * f / 2 + 3 * f - 1.83333f);
 }
 
-static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
-                       const LodePNGColorMode* info, const LodePNGEncoderSettings* settings)
+/*
+Filters rows [y0, y1) of the image with the given strategy. The choice for a row only
+depends on that row and the one above it (the raw rows, not the filtered ones), so any
+range of rows can be filtered independently of the others, which is what lets filter()
+hand out bands of rows to threads.
+*/
+static unsigned filterRows(unsigned char* out, const unsigned char* in, unsigned y0, unsigned y1,
+                           size_t linebytes, size_t bytewidth, LodePNGFilterStrategy strategy,
+                           const LodePNGEncoderSettings* settings)
 {
-  /*
-  For PNG filter method 0
-  out must be a buffer with as size: h + (w * h * bpp + 7) / 8, because there are
-  the scanlines with 1 extra byte per scanline
-  */
-
-  unsigned bpp = lodepng_get_bpp(info);
-  /*the width of a scanline in bytes, not including the filter type*/
-  size_t linebytes = (w * bpp + 7) / 8;
-  /*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise*/
-  size_t bytewidth = (bpp + 7) / 8;
-  const unsigned char* prevline = 0;
+  const unsigned char* prevline = y0 > 0 ? &in[(y0 - 1) * linebytes] : 0;
   unsigned x, y;
   unsigned error = 0;
-  LodePNGFilterStrategy strategy = settings->filter_strategy;
-
-  /*
-  There is a heuristic called the minimum sum of absolute differences heuristic, suggested by the PNG standard:
-   *  If the image type is Palette, or the bit depth is smaller than 8, then do not filter the image (i.e.
-      use fixed filtering, with the filter None).
-   * (The other case) If the image type is Grayscale or RGB (with or without Alpha), and the bit depth is
-     not smaller than 8, then use adaptive filtering heuristic as follows: independently for each row, apply
-     all five filters and select the filter that produces the smallest sum of absolute values per row.
-  This heuristic is used if filter strategy is LFS_MINSUM and filter_palette_zero is true.
-
-  If filter_palette_zero is true and filter_strategy is not LFS_MINSUM, the above heuristic is followed,
-  but for "the other case", whatever strategy filter_strategy is set to instead of the minimum sum
-  heuristic is used.
-  */
-  if(settings->filter_palette_zero &&
-     (info->colortype == LCT_PALETTE || info->bitdepth < 8)) strategy = LFS_ZERO;
-
-  if(bpp == 0) return 31; /*error: invalid color type*/
 
   if(strategy == LFS_ZERO)
   {
-    for(y = 0; y < h; y++)
+    for(y = y0; y < y1; y++)
     {
       size_t outindex = (1 + linebytes) * y; /*the extra filterbyte added to each row*/
       size_t inindex = linebytes * y;
@@ -5316,7 +7827,7 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
 
     if(!error)
     {
-      for(y = 0; y < h; y++)
+      for(y = y0; y < y1; y++)
       {
         /*try the 5 filter types*/
         for(type = 0; type < 5; type++)
@@ -5324,22 +7835,7 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
           filterScanline(attempt[type].data, &in[y * linebytes], prevline, linebytes, bytewidth, type);
 
           /*calculate the sum of the result*/
-          sum[type] = 0;
-          if(type == 0)
-          {
-            for(x = 0; x < linebytes; x++) sum[type] += (unsigned char)(attempt[type].data[x]);
-          }
-          else
-          {
-            for(x = 0; x < linebytes; x++)
-            {
-              /*For differences, each byte should be treated as signed, values above 127 are negative
-              (converted to signed char). Filtertype 0 isn't a difference though, so use unsigned there.
-              This means filtertype 0 is almost never chosen, but that is justified.*/
-              unsigned char s = attempt[type].data[x];
-              sum[type] += s < 128 ? s : (255U - s);
-            }
-          }
+          sum[type] = filterScoreMinsum(attempt[type].data, linebytes, type);
 
           /*check if this is smallest sum (or if type == 0 it's the first case so always store the values)*/
           if(type == 0 || sum[type] < smallest)
@@ -5373,14 +7869,13 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
       if(!ucvector_resize(&attempt[type], linebytes)) return 83; /*alloc fail*/
     }
 
-    for(y = 0; y < h; y++)
+    for(y = y0; y < y1; y++)
     {
       /*try the 5 filter types*/
       for(type = 0; type < 5; type++)
       {
         filterScanline(attempt[type].data, &in[y * linebytes], prevline, linebytes, bytewidth, type);
-        for(x = 0; x < 256; x++) count[x] = 0;
-        for(x = 0; x < linebytes; x++) count[attempt[type].data[x]]++;
+        filterCountBytes(count, attempt[type].data, linebytes);
         count[type]++; /*the filter type itself is part of the scanline*/
         sum[type] = 0;
         for(x = 0; x < 256; x++)
@@ -5407,7 +7902,7 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
   }
   else if(strategy == LFS_PREDEFINED)
   {
-    for(y = 0; y < h; y++)
+    for(y = y0; y < y1; y++)
     {
       size_t outindex = (1 + linebytes) * y; /*the extra filterbyte added to each row*/
       size_t inindex = linebytes * y;
@@ -5437,12 +7932,14 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
     images only, so disable it*/
     zlibsettings.custom_zlib = 0;
     zlibsettings.custom_deflate = 0;
+    /*the attempts are a single row, parallelism comes from filtering bands of rows at once*/
+    zlibsettings.threads = 1;
     for(type = 0; type < 5; type++)
     {
       ucvector_init(&attempt[type]);
       ucvector_resize(&attempt[type], linebytes); /*todo: give error if resize failed*/
     }
-    for(y = 0; y < h; y++) /*try the 5 filter types*/
+    for(y = y0; y < y1; y++) /*try the 5 filter types*/
     {
       for(type = 0; type < 5; type++)
       {
@@ -5472,6 +7969,107 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
   return error;
 }
 
+typedef struct FilterJob
+{
+  unsigned char* out;
+  const unsigned char* in;
+  unsigned h;
+  unsigned bandrows; /*rows per band, the last band may have less*/
+  size_t linebytes;
+  size_t bytewidth;
+  LodePNGFilterStrategy strategy;
+  const LodePNGEncoderSettings* settings;
+  unsigned* errors; /*one error code per band*/
+} FilterJob;
+
+/*filters one band of rows, called through lodepng_parallel_for*/
+static void filterBand(void* context, size_t band)
+{
+  FilterJob* job = (FilterJob*)context;
+  unsigned y0 = (unsigned)band * job->bandrows;
+  unsigned y1 = y0 + job->bandrows;
+  if(y1 > job->h) y1 = job->h;
+  job->errors[band] = filterRows(job->out, job->in, y0, y1, job->linebytes, job->bytewidth,
+                                 job->strategy, job->settings);
+}
+
+/*rows per band is chosen so that a band is at least this many bytes of input*/
+#define FILTER_BAND_BYTES 65536
+
+static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
+                       const LodePNGColorMode* info, const LodePNGEncoderSettings* settings)
+{
+  /*
+  For PNG filter method 0
+  out must be a buffer with as size: h + (w * h * bpp + 7) / 8, because there are
+  the scanlines with 1 extra byte per scanline
+  */
+
+  unsigned bpp = lodepng_get_bpp(info);
+  /*the width of a scanline in bytes, not including the filter type*/
+  size_t linebytes = (w * bpp + 7) / 8;
+  /*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise*/
+  size_t bytewidth = (bpp + 7) / 8;
+  unsigned error = 0;
+  unsigned threads;
+  LodePNGFilterStrategy strategy = settings->filter_strategy;
+
+  /*
+  There is a heuristic called the minimum sum of absolute differences heuristic, suggested by the PNG standard:
+   *  If the image type is Palette, or the bit depth is smaller than 8, then do not filter the image (i.e.
+      use fixed filtering, with the filter None).
+   * (The other case) If the image type is Grayscale or RGB (with or without Alpha), and the bit depth is
+     not smaller than 8, then use adaptive filtering heuristic as follows: independently for each row, apply
+     all five filters and select the filter that produces the smallest sum of absolute values per row.
+  This heuristic is used if filter strategy is LFS_MINSUM and filter_palette_zero is true.
+
+  If filter_palette_zero is true and filter_strategy is not LFS_MINSUM, the above heuristic is followed,
+  but for "the other case", whatever strategy filter_strategy is set to instead of the minimum sum
+  heuristic is used.
+  */
+  if(settings->filter_palette_zero &&
+     (info->colortype == LCT_PALETTE || info->bitdepth < 8)) strategy = LFS_ZERO;
+
+  if(bpp == 0) return 31; /*error: invalid color type*/
+
+  /*Bands of rows are filtered concurrently when zlibsettings.threads allows more than
+  one thread. The result is the same as filtering them in order. Brute force spends a
+  whole deflate per filter attempt, so there every row is worth a band of its own.*/
+  threads = lodepng_resolve_threads(settings->zlibsettings.threads);
+  if(threads > 1 && h > 1 && strategy != LFS_ZERO && strategy != LFS_PREDEFINED)
+  {
+    FilterJob job;
+    size_t minrows = strategy == LFS_BRUTE_FORCE ? 1 : FILTER_BAND_BYTES / (linebytes + 1) + 1;
+    size_t bandrows = (h + threads * 4 - 1) / (threads * 4); /*a few bands per thread to even out the load*/
+    size_t numbands, i;
+    if(bandrows < minrows) bandrows = minrows;
+    if(bandrows > h) bandrows = h;
+    numbands = (h + bandrows - 1) / bandrows;
+
+    if(numbands > 1)
+    {
+      job.out = out;
+      job.in = in;
+      job.h = h;
+      job.bandrows = (unsigned)bandrows;
+      job.linebytes = linebytes;
+      job.bytewidth = bytewidth;
+      job.strategy = strategy;
+      job.settings = settings;
+      job.errors = (unsigned*)lodepng_malloc(sizeof(unsigned) * numbands);
+      if(!job.errors) return 83; /*alloc fail*/
+
+      lodepng_parallel_for(numbands, threads, filterBand, &job);
+
+      for(i = 0; i < numbands && !error; i++) error = job.errors[i];
+      lodepng_free(job.errors);
+      return error;
+    }
+  }
+
+  return filterRows(out, in, 0, h, linebytes, bytewidth, strategy, settings);
+}
+
 static void addPaddingBits(unsigned char* out, const unsigned char* in,
                            size_t olinebits, size_t ilinebits, unsigned h)
 {
@@ -5675,208 +8273,662 @@ static unsigned addUnknownChunks(ucvector* out, unsigned char* data, size_t data
   unsigned char* inchunk = data;
   while((size_t)(inchunk - data) < datasize)
   {
-    CERROR_TRY_RETURN(lodepng_chunk_append(&out->data, &out->size, inchunk));
-    out->allocsize = out->size; /*fix the allocsize again*/
+    CERROR_TRY_RETURN(appendChunk(out, inchunk));
     inchunk = lodepng_chunk_next(inchunk);
   }
   return 0;
 }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
-unsigned lodepng_encode(unsigned char** out, size_t* outsize,
-                        const unsigned char* image, unsigned w, unsigned h,
-                        LodePNGState* state)
+/*writes the signature and the chunks that come before IDAT*/
+static unsigned addChunksBeforeIDAT(ucvector* out, unsigned w, unsigned h,
+                                    const LodePNGInfo* info, const LodePNGEncoderSettings* settings)
 {
-  LodePNGInfo info;
-  ucvector outv;
-  unsigned char* data = 0; /*uncompressed version of the IDAT chunk data*/
-  size_t datasize = 0;
-
-  /*provide some proper output values if error will happen*/
-  *out = 0;
-  *outsize = 0;
-  state->error = 0;
-
-  lodepng_info_init(&info);
-  lodepng_info_copy(&info, &state->info_png);
-
-  if((info.color.colortype == LCT_PALETTE || state->encoder.force_palette)
-      && (info.color.palettesize == 0 || info.color.palettesize > 256))
+  unsigned error = 0;
+  writeSignature(out);
+  /*IHDR*/
+  addChunk_IHDR(out, w, h, info->color.colortype, info->color.bitdepth, info->interlace_method);
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+  /*unknown chunks between IHDR and PLTE*/
+  if(info->unknown_chunks_data[0])
   {
-    state->error = 68; /*invalid palette size, it is only allowed to be 1-256*/
-    return state->error;
+    error = addUnknownChunks(out, info->unknown_chunks_data[0], info->unknown_chunks_size[0]);
+    if(error) return error;
   }
-
-  if(state->encoder.auto_convert != LAC_NO)
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  /*PLTE*/
+  if(info->color.colortype == LCT_PALETTE)
   {
-    state->error = lodepng_auto_choose_color(&info.color, image, w, h, &state->info_raw,
-                                             state->encoder.auto_convert);
+    addChunk_PLTE(out, &info->color);
   }
-  if(state->error) return state->error;
-
-  if(state->encoder.zlibsettings.btype > 2)
+  if(settings->force_palette && (info->color.colortype == LCT_RGB || info->color.colortype == LCT_RGBA))
   {
-    CERROR_RETURN_ERROR(state->error, 61); /*error: unexisting btype*/
+    addChunk_PLTE(out, &info->color);
   }
-  if(state->info_png.interlace_method > 1)
+  /*tRNS*/
+  if(info->color.colortype == LCT_PALETTE && getPaletteTranslucency(info->color.palette, info->color.palettesize) != 0)
   {
-    CERROR_RETURN_ERROR(state->error, 71); /*error: unexisting interlace mode*/
+    addChunk_tRNS(out, &info->color);
   }
-
-  state->error = checkColorValidity(info.color.colortype, info.color.bitdepth);
-  if(state->error) return state->error; /*error: unexisting color type given*/
-  state->error = checkColorValidity(state->info_raw.colortype, state->info_raw.bitdepth);
-  if(state->error) return state->error; /*error: unexisting color type given*/
-
-  if(!lodepng_color_mode_equal(&state->info_raw, &info.color))
+  if((info->color.colortype == LCT_GREY || info->color.colortype == LCT_RGB) && info->color.key_defined)
   {
-    unsigned char* converted;
-    size_t size = (w * h * lodepng_get_bpp(&info.color) + 7) / 8;
-
-    converted = (unsigned char*)lodepng_malloc(size);
-    if(!converted && size) state->error = 83; /*alloc fail*/
-    if(!state->error)
-    {
-      state->error = lodepng_convert(converted, image, &info.color, &state->info_raw, w, h, 0 /*fix_png*/);
-    }
-    if(!state->error) preProcessScanlines(&data, &datasize, converted, w, h, &info, &state->encoder);
-    lodepng_free(converted);
+    addChunk_tRNS(out, &info->color);
   }
-  else preProcessScanlines(&data, &datasize, image, w, h, &info, &state->encoder);
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+  /*bKGD (must come between PLTE and the IDAt chunks*/
+  if(info->background_defined) addChunk_bKGD(out, info);
+  /*pHYs (must come before the IDAT chunks)*/
+  if(info->phys_defined) addChunk_pHYs(out, info);
 
-  ucvector_init(&outv);
-  while(!state->error) /*while only executed once, to break on error*/
+  /*unknown chunks between PLTE and IDAT*/
+  if(info->unknown_chunks_data[1])
   {
+    error = addUnknownChunks(out, info->unknown_chunks_data[1], info->unknown_chunks_size[1]);
+    if(error) return error;
+  }
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  return error;
+}
+
+/*writes the chunks that come after IDAT, ending with IEND*/
+static unsigned addChunksAfterIDAT(ucvector* out, const LodePNGInfo* info, const LodePNGEncoderSettings* settings)
+{
+  unsigned error = 0;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-    size_t i;
+  size_t i;
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    /*write signature and chunks*/
-    writeSignature(&outv);
-    /*IHDR*/
-    addChunk_IHDR(&outv, w, h, info.color.colortype, info.color.bitdepth, info.interlace_method);
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-    /*unknown chunks between IHDR and PLTE*/
-    if(info.unknown_chunks_data[0])
+  /*tIME*/
+  if(info->time_defined) addChunk_tIME(out, &info->time);
+  /*tEXt and/or zTXt*/
+  for(i = 0; i < info->text_num; i++)
+  {
+    if(strlen(info->text_keys[i]) > 79)
     {
-      state->error = addUnknownChunks(&outv, info.unknown_chunks_data[0], info.unknown_chunks_size[0]);
-      if(state->error) break;
+      error = 66; /*text chunk too large*/
+      break;
     }
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    /*PLTE*/
-    if(info.color.colortype == LCT_PALETTE)
+    if(strlen(info->text_keys[i]) < 1)
     {
-      addChunk_PLTE(&outv, &info.color);
+      error = 67; /*text chunk too small*/
+      break;
     }
-    if(state->encoder.force_palette && (info.color.colortype == LCT_RGB || info.color.colortype == LCT_RGBA))
+    if(settings->text_compression)
     {
-      addChunk_PLTE(&outv, &info.color);
+      addChunk_zTXt(out, info->text_keys[i], info->text_strings[i], &settings->zlibsettings);
     }
-    /*tRNS*/
-    if(info.color.colortype == LCT_PALETTE && getPaletteTranslucency(info.color.palette, info.color.palettesize) != 0)
+    else
     {
-      addChunk_tRNS(&outv, &info.color);
+      addChunk_tEXt(out, info->text_keys[i], info->text_strings[i]);
     }
-    if((info.color.colortype == LCT_GREY || info.color.colortype == LCT_RGB) && info.color.key_defined)
+  }
+  /*LodePNG version id in text chunk*/
+  if(settings->add_id)
+  {
+    unsigned alread_added_id_text = 0;
+    for(i = 0; i < info->text_num; i++)
     {
-      addChunk_tRNS(&outv, &info.color);
+      if(!strcmp(info->text_keys[i], "LodePNG"))
+      {
+        alread_added_id_text = 1;
+        break;
+      }
     }
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-    /*bKGD (must come between PLTE and the IDAt chunks*/
-    if(info.background_defined) addChunk_bKGD(&outv, &info);
-    /*pHYs (must come before the IDAT chunks)*/
-    if(info.phys_defined) addChunk_pHYs(&outv, &info);
-
-    /*unknown chunks between PLTE and IDAT*/
-    if(info.unknown_chunks_data[1])
+    if(alread_added_id_text == 0)
     {
-      state->error = addUnknownChunks(&outv, info.unknown_chunks_data[1], info.unknown_chunks_size[1]);
-      if(state->error) break;
+      addChunk_tEXt(out, "LodePNG", VERSION_STRING); /*it's shorter as tEXt than as zTXt chunk*/
     }
+  }
+  /*iTXt*/
+  for(i = 0; i < info->itext_num; i++)
+  {
+    if(strlen(info->itext_keys[i]) > 79)
+    {
+      error = 66; /*text chunk too large*/
+      break;
+    }
+    if(strlen(info->itext_keys[i]) < 1)
+    {
+      error = 67; /*text chunk too small*/
+      break;
+    }
+    addChunk_iTXt(out, settings->text_compression,
+                  info->itext_keys[i], info->itext_langtags[i], info->itext_transkeys[i], info->itext_strings[i],
+                  &settings->zlibsettings);
+  }
+
+  /*unknown chunks between IDAT and IEND*/
+  if(info->unknown_chunks_data[2])
+  {
+    error = addUnknownChunks(out, info->unknown_chunks_data[2], info->unknown_chunks_size[2]);
+    if(error) return error;
+  }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  addChunk_IEND(out);
+  return error;
+}
+
+/*appends the PNG to out*/
+static unsigned encodePNG(ucvector* out, const unsigned char* image, unsigned w, unsigned h,
+                          LodePNGState* state)
+{
+  LodePNGInfo info;
+  unsigned char* data = 0; /*uncompressed version of the IDAT chunk data*/
+  size_t datasize = 0;
+
+  state->error = 0;
+
+  lodepng_info_init(&info);
+  lodepng_info_copy(&info, &state->info_png);
+
+  if((info.color.colortype == LCT_PALETTE || state->encoder.force_palette)
+      && (info.color.palettesize == 0 || info.color.palettesize > 256))
+  {
+    state->error = 68; /*invalid palette size, it is only allowed to be 1-256*/
+    return state->error;
+  }
+
+  if(state->encoder.auto_convert != LAC_NO)
+  {
+    state->error = lodepng_auto_choose_color(&info.color, image, w, h, &state->info_raw,
+                                             state->encoder.auto_convert);
+  }
+  if(state->error) return state->error;
+
+  if(state->encoder.zlibsettings.btype > 3)
+  {
+    CERROR_RETURN_ERROR(state->error, 61); /*error: unexisting btype*/
+  }
+  if(state->info_png.interlace_method > 1)
+  {
+    CERROR_RETURN_ERROR(state->error, 71); /*error: unexisting interlace mode*/
+  }
+
+  state->error = checkColorValidity(info.color.colortype, info.color.bitdepth);
+  if(state->error) return state->error; /*error: unexisting color type given*/
+  state->error = checkColorValidity(state->info_raw.colortype, state->info_raw.bitdepth);
+  if(state->error) return state->error; /*error: unexisting color type given*/
+
+  if(!lodepng_color_mode_equal(&state->info_raw, &info.color))
+  {
+    unsigned char* converted;
+    size_t size = (w * h * lodepng_get_bpp(&info.color) + 7) / 8;
+
+    converted = (unsigned char*)lodepng_malloc(size);
+    if(!converted && size) state->error = 83; /*alloc fail*/
+    if(!state->error)
+    {
+      state->error = lodepng_convert(converted, image, &info.color, &state->info_raw, w, h, 0 /*fix_png*/);
+    }
+    if(!state->error) preProcessScanlines(&data, &datasize, converted, w, h, &info, &state->encoder);
+    lodepng_free(converted);
+  }
+  else preProcessScanlines(&data, &datasize, image, w, h, &info, &state->encoder);
+
+  while(!state->error) /*while only executed once, to break on error*/
+  {
+    state->error = addChunksBeforeIDAT(out, w, h, &info, &state->encoder);
+    if(state->error) break;
     /*IDAT (multiple IDAT chunks must be consecutive)*/
-    state->error = addChunk_IDAT(&outv, data, datasize, &state->encoder.zlibsettings);
+    state->error = addChunk_IDAT(out, data, datasize, &state->encoder.zlibsettings);
     if(state->error) break;
+    state->error = addChunksAfterIDAT(out, &info, &state->encoder);
+
+    break; /*this isn't really a while loop; no error happened so break out now!*/
+  }
+  /*a fixed buffer that was too small makes the writes after it fail, whatever error they gave*/
+  if(out->fixed == 2) state->error = 94;
+
+  lodepng_info_cleanup(&info);
+  lodepng_free(data);
+
+  return state->error;
+}
+
+/*
+The allocator of an encode with state: its scratch arena with keep_scratch, creating it
+on first use (again if the allocator it takes its blocks from changed), or else the
+allocator of the zlib settings. Pass it to allocator_begin.
+*/
+static const LodePNGAllocator* encoder_allocator(LodePNGState* state)
+{
+  const LodePNGAllocator* allocator = state->encoder.zlibsettings.allocator;
+#ifdef LODEPNG_COMPILE_ALLOCATORS
+  /*a custom zlib or deflate may hand out memory of its own for lodepng_free*/
+  if(state->encoder.keep_scratch && !state->encoder.zlibsettings.custom_zlib
+     && !state->encoder.zlibsettings.custom_deflate)
+  {
+    if(state->scratch && !scratch_has_backing(state->scratch, allocator))
+    {
+      scratch_destroy(state->scratch);
+      state->scratch = 0;
+    }
+    if(!state->scratch) state->scratch = scratch_create(allocator);
+    if(state->scratch) allocator = &state->scratch->allocator;
+  }
+#endif /*LODEPNG_COMPILE_ALLOCATORS*/
+  return allocator;
+}
+
+unsigned lodepng_encode(unsigned char** out, size_t* outsize,
+                        const unsigned char* image, unsigned w, unsigned h,
+                        LodePNGState* state)
+{
+  const LodePNGAllocator* previous = allocator_begin(encoder_allocator(state));
+  ucvector outv;
+  unsigned error;
+  ucvector_init(&outv);
+  error = encodePNG(&outv, image, w, h, state);
+  /*instead of cleaning the vector up, give it to the output*/
+  *out = outv.data;
+  *outsize = outv.size;
+#ifdef LODEPNG_COMPILE_ALLOCATORS
+  /*the PNG is the caller's to free, not the arena's*/
+  if(*out && state->scratch && lodepng_allocator == &state->scratch->allocator)
+  {
+    *out = scratch_detach(state->scratch, *out, *outsize);
+    if(!*out)
+    {
+      *outsize = 0;
+      error = state->error = 83;
+    }
+  }
+#endif /*LODEPNG_COMPILE_ALLOCATORS*/
+  allocator_end(previous);
+  return error;
+}
+
+unsigned lodepng_encode_to_buffer(unsigned char* out, size_t capacity, size_t* outsize,
+                                  const unsigned char* image, unsigned w, unsigned h,
+                                  LodePNGState* state)
+{
+  const LodePNGAllocator* previous = allocator_begin(encoder_allocator(state));
+  ucvector outv;
+  unsigned error;
+  outv.data = out;
+  outv.size = 0;
+  outv.allocsize = capacity;
+  outv.fixed = 1;
+  error = encodePNG(&outv, image, w, h, state);
+  *outsize = error ? 0 : outv.size;
+  allocator_end(previous);
+  return error;
+}
+
+unsigned lodepng_encode_to_sink(LodePNGSink sink, void* sink_context,
+                                const unsigned char* image, unsigned w, unsigned h,
+                                LodePNGState* state)
+{
+  const LodePNGAllocator* previous = allocator_begin(encoder_allocator(state));
+  ucvector outv;
+  unsigned error;
+  ucvector_init(&outv);
+  error = encodePNG(&outv, image, w, h, state);
+  if(!error) error = state->error = call_sink(sink, sink_context, outv.data, outv.size);
+  /*with keep_scratch the PNG was built in, and goes back to, the scratch arena*/
+  ucvector_cleanup(&outv);
+  allocator_end(previous);
+  return error;
+}
+
+/*bound on the deflate stream of size bytes: deflateBlocks stores any block that would come
+out larger, which costs 5 bytes per 65535 of it plus a byte to align its header, and the
+parallel deflate adds a 5 byte sync flush per 131072 byte chunk*/
+static size_t deflate_bound(size_t size)
+{
+  return size + 10 * (size / 65535) + 11 * (size / 131072 + 1) + 1;
+}
+
+/*bound on a tEXt, zTXt or iTXt chunk's text, compressed or not*/
+static size_t text_bound(const char* text, unsigned compressed)
+{
+  size_t size = strlen(text);
+  return compressed ? deflate_bound(size) + 6 : size;
+}
+
+size_t lodepng_encode_bound(unsigned w, unsigned h, const LodePNGState* state)
+{
+  const LodePNGInfo* info = &state->info_png;
+  unsigned bpp = lodepng_get_bpp(&info->color);
+  unsigned palette = info->color.colortype == LCT_PALETTE || state->encoder.force_palette;
+  size_t datasize, bound;
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+  unsigned compressed = state->encoder.text_compression;
+  size_t i;
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+
+  if(state->encoder.auto_convert != LAC_NO)
+  {
+    /*the largest mode lodepng_auto_choose_color can pick*/
+    unsigned rawbpp = lodepng_get_bpp(&state->info_raw);
+    unsigned autobpp = state->info_raw.bitdepth == 16 ? 64 : 32;
+    if(rawbpp > bpp) bpp = rawbpp;
+    if(autobpp > bpp) bpp = autobpp;
+    palette = 1;
+  }
+
+  if(info->interlace_method == 0) datasize = (size_t)h * (1 + ((size_t)w * bpp + 7) / 8);
+  else
+  {
+    unsigned passw[7], passh[7];
+    size_t filter_passstart[8], padded_passstart[8], passstart[8];
+    Adam7_getpassvalues(passw, passh, filter_passstart, padded_passstart, passstart, w, h, bpp);
+    datasize = filter_passstart[7];
+  }
+
+  bound = 8 + 25; /*signature and IHDR*/
+  bound += 12 + deflate_bound(datasize) + 6; /*one IDAT chunk holding the zlib stream*/
+  bound += 12; /*IEND*/
+  if(palette) bound += 12 + 3 * 256 + 12 + 256; /*PLTE and tRNS*/
+  else bound += 12 + 6; /*tRNS with a color key*/
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-    /*tIME*/
-    if(info.time_defined) addChunk_tIME(&outv, &info.time);
-    /*tEXt and/or zTXt*/
-    for(i = 0; i < info.text_num; i++)
+  bound += 12 + 6 + 12 + 9 + 12 + 7; /*bKGD, pHYs and tIME*/
+  for(i = 0; i < 3; i++) bound += info->unknown_chunks_size[i];
+  for(i = 0; i < info->text_num; i++)
+  {
+    bound += 12 + strlen(info->text_keys[i]) + 2 + text_bound(info->text_strings[i], compressed);
+  }
+  bound += 12 + 8 + strlen(VERSION_STRING); /*add_id*/
+  for(i = 0; i < info->itext_num; i++)
+  {
+    bound += 12 + strlen(info->itext_keys[i]) + 3 + strlen(info->itext_langtags[i]) + 1
+           + strlen(info->itext_transkeys[i]) + 1 + text_bound(info->itext_strings[i], compressed);
+  }
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  return bound;
+}
+
+#ifdef LODEPNG_COMPILE_ZLIB
+/*writes data[0..size-1] to the sink as one IDAT chunk, without copying it*/
+static unsigned streamIDAT(LodePNGStreamEncoder* stream, const unsigned char* data, size_t size)
+{
+  unsigned char header[8], footer[4];
+  unsigned error;
+  if(size == 0) return 0;
+  if(size > 2147483647) return 63; /*chunk too long*/
+  lodepng_set32bitInt(&header[0], (unsigned)size);
+  header[4] = 'I'; header[5] = 'D'; header[6] = 'A'; header[7] = 'T';
+  lodepng_set32bitInt(footer, lodepng_crc32_update(lodepng_crc32(&header[4], 4), data, size));
+  error = call_sink(stream->sink, stream->sink_context, header, 8);
+  if(!error) error = call_sink(stream->sink, stream->sink_context, data, size);
+  if(!error) error = call_sink(stream->sink, stream->sink_context, footer, 4);
+  return error;
+}
+
+/*
+Deflates the pending filtered bytes as blocks continuing the zlib stream, with the
+dictionary in front of them primed into the hash so matches reach back over the previous
+pieces, and writes the finished bytes as an IDAT chunk. A partly filled last byte stays
+in zdata for the next blocks. With final the stream gets its last block and the Adler32.
+*/
+static unsigned streamDeflate(LodePNGStreamEncoder* stream, unsigned final)
+{
+  const LodePNGCompressSettings* settings = &stream->state->encoder.zlibsettings;
+  size_t start = stream->dictsize;
+  size_t end = stream->dictsize + stream->pendingsize;
+  size_t keep, done;
+  unsigned error = 0;
+  ucvector zdata;
+
+  zdata.data = stream->zdata;
+  zdata.size = stream->zsize;
+  zdata.allocsize = stream->zallocsize;
+  zdata.fixed = 0;
+
+  if(settings->btype == 0)
+  {
+    /*stored blocks keep the stream byte aligned*/
+    error = deflateNoCompression(&zdata, &stream->window[start], end - start, final);
+    if(end > start || final) countBlock(settings->stats, 0, end - start);
+    stream->zbits = zdata.size * 8;
+  }
+  else if(end > start || final)
+  {
+    Hash hash;
+    error = hash_init(&hash, settings->windowsize);
+    if(!error && settings->use_lz77 && settings->maxchain == 1)
     {
-      if(strlen(info.text_keys[i]) > 79)
-      {
-        state->error = 66; /*text chunk too large*/
-        break;
-      }
-      if(strlen(info.text_keys[i]) < 1)
-      {
-        state->error = 67; /*text chunk too small*/
-        break;
-      }
-      if(state->encoder.text_compression)
-      {
-        addChunk_zTXt(&outv, info.text_keys[i], info.text_strings[i], &state->encoder.zlibsettings);
-      }
-      else
-      {
-        addChunk_tEXt(&outv, info.text_keys[i], info.text_strings[i]);
-      }
+      hash_prime_fast(&hash, stream->window, 0, start, end, settings->windowsize);
     }
-    /*LodePNG version id in text chunk*/
-    if(state->encoder.add_id)
+    else if(!error && settings->use_lz77)
     {
-      unsigned alread_added_id_text = 0;
-      for(i = 0; i < info.text_num; i++)
-      {
-        if(!strcmp(info.text_keys[i], "LodePNG"))
-        {
-          alread_added_id_text = 1;
-          break;
-        }
-      }
-      if(alread_added_id_text == 0)
-      {
-        addChunk_tEXt(&outv, "LodePNG", VERSION_STRING); /*it's shorter as tEXt than as zTXt chunk*/
-      }
+      hash_prime(&hash, stream->window, 0, start, end, settings->windowsize);
     }
-    /*iTXt*/
-    for(i = 0; i < info.itext_num; i++)
+    if(!error) error = deflateBlocks(&zdata, &stream->zbits, &hash, stream->window, start, end, settings, final,
+                                     settings->stats);
+    hash_cleanup(&hash);
+  }
+
+  if(!error && final)
+  {
+    lodepng_add32bitInt(&zdata, stream->adler);
+    stream->zbits = zdata.size * 8;
+  }
+  if(!error)
+  {
+    done = stream->zbits / 8;
+    error = streamIDAT(stream, zdata.data, done);
+    if(done < zdata.size) zdata.data[0] = zdata.data[done];
+    zdata.size -= done;
+    stream->zbits -= done * 8;
+  }
+
+  stream->zdata = zdata.data;
+  stream->zsize = zdata.size;
+  stream->zallocsize = zdata.allocsize;
+
+  /*the end of what was deflated becomes the dictionary of the next piece*/
+  keep = settings->use_lz77 && settings->btype != 0 ? settings->windowsize : 0;
+  if(keep > end) keep = end;
+  memmove(stream->window, &stream->window[end - keep], keep);
+  stream->dictsize = keep;
+  stream->pendingsize = 0;
+  return error;
+}
+
+static unsigned streamBegin(LodePNGStreamEncoder* stream, unsigned w, unsigned h,
+                            LodePNGState* state, LodePNGSink sink, void* sink_context)
+{
+  const LodePNGInfo* info = &state->info_png;
+  const LodePNGCompressSettings* zlibsettings = &state->encoder.zlibsettings;
+  unsigned bpp, error = 0;
+  size_t windowsize;
+  ucvector header;
+  /*zlib header, see lodepng_zlib_compress*/
+  unsigned CMFFLG = 256 * 120;
+  CMFFLG += 31 - CMFFLG % 31;
+
+  stream->state = state;
+  stream->sink = sink;
+  stream->sink_context = sink_context;
+  stream->w = w;
+  stream->h = h;
+  stream->y = 0;
+  stream->lines = 0;
+  stream->filtered = 0;
+  stream->rawline = 0;
+  stream->window = 0;
+  stream->dictsize = 0;
+  stream->pendingsize = 0;
+  stream->zdata = 0;
+  stream->zsize = 0;
+  stream->zallocsize = 0;
+  stream->zbits = 0;
+  stream->adler = 1;
+
+  if((info->color.colortype == LCT_PALETTE || state->encoder.force_palette)
+      && (info->color.palettesize == 0 || info->color.palettesize > 256)) error = 68;
+  else if(zlibsettings->btype > 3) error = 61;
+  else if(info->interlace_method > 1) error = 71;
+  else if(info->interlace_method == 1) error = 93;
+  else if(zlibsettings->btype != 0 && zlibsettings->use_lz77
+          && (zlibsettings->windowsize == 0 || zlibsettings->windowsize > 32768)) error = 60;
+  else if(zlibsettings->btype != 0 && zlibsettings->use_lz77
+          && (zlibsettings->windowsize & (zlibsettings->windowsize - 1)) != 0) error = 90;
+  if(!error) error = checkColorValidity(info->color.colortype, info->color.bitdepth);
+  if(!error) error = checkColorValidity(state->info_raw.colortype, state->info_raw.bitdepth);
+  if(error) return stream->error = error;
+
+  bpp = lodepng_get_bpp(&info->color);
+  stream->linebytes = ((size_t)w * bpp + 7) / 8;
+  stream->rawlinebits = (size_t)w * lodepng_get_bpp(&state->info_raw);
+  /*the same strategy choice as filter()*/
+  stream->strategy = state->encoder.filter_strategy;
+  if(state->encoder.filter_palette_zero &&
+     (info->color.colortype == LCT_PALETTE || info->color.bitdepth < 8)) stream->strategy = LFS_ZERO;
+  stream->batchrows = (unsigned)(FILTER_BAND_BYTES / (stream->linebytes + 1) + 1);
+  if(stream->batchrows > h) stream->batchrows = h ? h : 1;
+  windowsize = zlibsettings->btype != 0 && zlibsettings->use_lz77 ? zlibsettings->windowsize : 0;
+
+  stream->lines = (unsigned char*)lodepng_malloc((stream->batchrows + 1) * stream->linebytes + 1);
+  stream->filtered = (unsigned char*)lodepng_malloc((stream->batchrows + 1) * (stream->linebytes + 1));
+  stream->rawline = (unsigned char*)lodepng_malloc((stream->rawlinebits + 7) / 8 + 1);
+  stream->window = (unsigned char*)lodepng_malloc(windowsize + DEFLATE_CHUNK_SIZE
+                                                  + stream->batchrows * (stream->linebytes + 1));
+  if(!stream->lines || !stream->filtered || !stream->rawline || !stream->window) return stream->error = 83;
+
+  stream->zdata = (unsigned char*)lodepng_malloc(2);
+  if(!stream->zdata) return stream->error = 83;
+  stream->zdata[0] = (unsigned char)(CMFFLG / 256);
+  stream->zdata[1] = (unsigned char)(CMFFLG % 256);
+  stream->zsize = stream->zallocsize = 2;
+  stream->zbits = 16;
+
+  ucvector_init(&header);
+  error = addChunksBeforeIDAT(&header, w, h, info, &state->encoder);
+  if(!error) error = call_sink(sink, sink_context, header.data, header.size);
+  ucvector_cleanup(&header);
+  return stream->error = error;
+}
+
+static unsigned streamWriteRows(LodePNGStreamEncoder* stream, const unsigned char* rows, unsigned count)
+{
+  const LodePNGColorMode* mode_raw = &stream->state->info_raw;
+  LodePNGColorMode* mode_png = &stream->state->info_png.color;
+  unsigned convert = !lodepng_color_mode_equal(mode_raw, mode_png);
+  size_t linebytes = stream->linebytes;
+  size_t bytewidth = (lodepng_get_bpp(mode_png) + 7) / 8;
+  LodePNGEncoderSettings settings = stream->state->encoder;
+  unsigned i = 0, error = 0;
+
+  if(stream->error) return stream->error;
+  if(count > stream->h - stream->y) return stream->error = 91;
+
+  while(i < count && !error)
+  {
+    /*filterRows sees the batch as rows [first, first + n) of an image whose row first - 1,
+    if any, is the last row of the previous batch*/
+    unsigned first = stream->y > 0 ? 1 : 0;
+    unsigned n = count - i, k;
+    size_t bytes;
+    if(n > stream->batchrows) n = stream->batchrows;
+
+    for(k = 0; k < n && !error; k++)
     {
-      if(strlen(info.itext_keys[i]) > 79)
-      {
-        state->error = 66; /*text chunk too large*/
-        break;
-      }
-      if(strlen(info.itext_keys[i]) < 1)
+      unsigned char* line = &stream->lines[(first + k) * linebytes];
+      const unsigned char* rawline;
+      size_t bit = (size_t)(i + k) * stream->rawlinebits;
+      if(stream->rawlinebits % 8 == 0) rawline = &rows[bit / 8];
+      else
       {
-        state->error = 67; /*text chunk too small*/
-        break;
+        /*rows of less than whole bytes are packed without padding, like lodepng_encode wants them*/
+        size_t obp = 0, x;
+        for(x = 0; x < stream->rawlinebits; x++)
+        {
+          setBitOfReversedStream(&obp, stream->rawline, readBitFromReversedStream(&bit, rows));
+        }
+        for(; obp % 8 != 0; ) setBitOfReversedStream(&obp, stream->rawline, 0);
+        rawline = stream->rawline;
       }
-      addChunk_iTXt(&outv, state->encoder.text_compression,
-                    info.itext_keys[i], info.itext_langtags[i], info.itext_transkeys[i], info.itext_strings[i],
-                    &state->encoder.zlibsettings);
+      if(convert) error = lodepng_convert(line, rawline, mode_png, mode_raw, stream->w, 1, 0);
+      else memcpy(line, rawline, linebytes);
     }
+    if(error) break;
 
-    /*unknown chunks between IDAT and IEND*/
-    if(info.unknown_chunks_data[2])
+    /*predefined filters are indexed by row in the image*/
+    if(stream->state->encoder.predefined_filters)
     {
-      state->error = addUnknownChunks(&outv, info.unknown_chunks_data[2], info.unknown_chunks_size[2]);
-      if(state->error) break;
+      settings.predefined_filters = stream->state->encoder.predefined_filters + stream->y - first;
     }
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    addChunk_IEND(&outv);
+    error = filterRows(stream->filtered, stream->lines, first, first + n, linebytes, bytewidth,
+                       stream->strategy, &settings);
+    if(error) break;
 
-    break; /*this isn't really a while loop; no error happened so break out now!*/
+    bytes = n * (linebytes + 1);
+    memcpy(&stream->window[stream->dictsize + stream->pendingsize], &stream->filtered[first * (linebytes + 1)], bytes);
+    stream->adler = update_adler32(stream->adler, &stream->filtered[first * (linebytes + 1)], bytes);
+    stream->pendingsize += bytes;
+    memmove(stream->lines, &stream->lines[(first + n - 1) * linebytes], linebytes);
+    stream->y += n;
+    i += n;
+
+    if(stream->pendingsize >= DEFLATE_CHUNK_SIZE) error = streamDeflate(stream, 0);
   }
 
-  lodepng_info_cleanup(&info);
-  lodepng_free(data);
-  /*instead of cleaning the vector up, give it to the output*/
-  *out = outv.data;
-  *outsize = outv.size;
+  return stream->error = error;
+}
 
-  return state->error;
+static unsigned streamFinish(LodePNGStreamEncoder* stream)
+{
+  unsigned error;
+  ucvector tail;
+  if(stream->error) return stream->error;
+  if(stream->y != stream->h) return stream->error = 92;
+
+  error = streamDeflate(stream, 1);
+  if(error) return stream->error = error;
+
+  ucvector_init(&tail);
+  error = addChunksAfterIDAT(&tail, &stream->state->info_png, &stream->state->encoder);
+  if(!error) error = call_sink(stream->sink, stream->sink_context, tail.data, tail.size);
+  ucvector_cleanup(&tail);
+  return stream->error = error;
 }
 
+/*the stream's memory comes from the allocator of the zlib settings, never the scratch arena*/
+unsigned lodepng_stream_begin(LodePNGStreamEncoder* stream, unsigned w, unsigned h,
+                              LodePNGState* state, LodePNGSink sink, void* sink_context)
+{
+  const LodePNGAllocator* previous = allocator_begin(state->encoder.zlibsettings.allocator);
+  unsigned error = streamBegin(stream, w, h, state, sink, sink_context);
+  allocator_end(previous);
+  return error;
+}
+
+unsigned lodepng_stream_write_rows(LodePNGStreamEncoder* stream, const unsigned char* rows, unsigned count)
+{
+  const LodePNGAllocator* previous = allocator_begin(stream->state->encoder.zlibsettings.allocator);
+  unsigned error = streamWriteRows(stream, rows, count);
+  allocator_end(previous);
+  return error;
+}
+
+unsigned lodepng_stream_finish(LodePNGStreamEncoder* stream)
+{
+  const LodePNGAllocator* previous = allocator_begin(stream->state->encoder.zlibsettings.allocator);
+  unsigned error = streamFinish(stream);
+  allocator_end(previous);
+  return error;
+}
+
+void lodepng_stream_cleanup(LodePNGStreamEncoder* stream)
+{
+  const LodePNGAllocator* previous = allocator_begin(stream->state->encoder.zlibsettings.allocator);
+  lodepng_free(stream->lines);
+  lodepng_free(stream->filtered);
+  lodepng_free(stream->rawline);
+  lodepng_free(stream->window);
+  lodepng_free(stream->zdata);
+  stream->lines = 0;
+  stream->filtered = 0;
+  stream->rawline = 0;
+  stream->window = 0;
+  stream->zdata = 0;
+  stream->zsize = stream->zallocsize = 0;
+  allocator_end(previous);
+}
+#endif /*LODEPNG_COMPILE_ZLIB*/
+
 unsigned lodepng_encode_memory(unsigned char** out, size_t* outsize, const unsigned char* image,
                                unsigned w, unsigned h, LodePNGColorType colortype, unsigned bitdepth)
 {
@@ -5887,6 +8939,7 @@ unsigned lodepng_encode_memory(unsigned char** out, size_t* outsize, const unsig
   state.info_raw.bitdepth = bitdepth;
   state.info_png.color.colortype = colortype;
   state.info_png.color.bitdepth = bitdepth;
+  state.encoder.keep_scratch = 0; /*the state ends with this encode*/
   lodepng_encode(out, outsize, image, w, h, &state);
   error = state.error;
   lodepng_state_cleanup(&state);
@@ -5904,14 +8957,28 @@ unsigned lodepng_encode24(unsigned char** out, size_t* outsize, const unsigned c
 }
 
 #ifdef LODEPNG_COMPILE_DISK
+/*LodePNGSink writing to a FILE*, 79 like lodepng_save_file when it fails*/
+static unsigned fileSink(void* context, const unsigned char* data, size_t size)
+{
+  return fwrite(data, 1, size, (FILE*)context) == size ? 0 : 79;
+}
+
 unsigned lodepng_encode_file(const char* filename, const unsigned char* image, unsigned w, unsigned h,
                              LodePNGColorType colortype, unsigned bitdepth)
 {
-  unsigned char* buffer;
-  size_t buffersize;
-  unsigned error = lodepng_encode_memory(&buffer, &buffersize, image, w, h, colortype, bitdepth);
-  if(!error) error = lodepng_save_file(buffer, buffersize, filename);
-  lodepng_free(buffer);
+  unsigned error;
+  LodePNGState state;
+  FILE* file = fopen(filename, "wb");
+  if(!file) return 79;
+  lodepng_state_init(&state);
+  state.info_raw.colortype = colortype;
+  state.info_raw.bitdepth = bitdepth;
+  state.info_png.color.colortype = colortype;
+  state.info_png.color.bitdepth = bitdepth;
+  state.encoder.keep_scratch = 0; /*the state ends with this encode*/
+  error = lodepng_encode_to_sink(fileSink, file, image, w, h, &state);
+  lodepng_state_cleanup(&state);
+  if(fclose(file) != 0 && !error) error = 79;
   return error;
 }
 
@@ -5938,6 +9005,7 @@ void lodepng_encoder_settings_init(LodePNGEncoderSettings* settings)
   settings->add_id = 0;
   settings->text_compression = 1;
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  settings->keep_scratch = 1;
 }
 
 #endif /*LODEPNG_COMPILE_ENCODER*/
@@ -5955,7 +9023,7 @@ const char* lodepng_error_text(unsigned code)
     case 0: return "no error, everything went ok";
     case 1: return "nothing done yet"; /*the Encoder/Decoder has done nothing yet, error checking makes no sense yet*/
     case 10: return "end of input memory reached without huffman end code"; /*while huffman decoding*/
-    case 11: return "error in code tree made it jump outside of huffman tree"; /*while huffman decoding*/
+    case 11: return "invalid huffman code in the compressed data, it is no code of its tree"; /*while huffman decoding*/
     case 13: return "problem while processing dynamic deflate block";
     case 14: return "problem while processing dynamic deflate block";
     case 15: return "problem while processing dynamic deflate block";
@@ -6009,13 +9077,13 @@ const char* lodepng_error_text(unsigned code)
     /*jumped past tree while generating huffman tree, this could be when the
     tree will have more leaves than symbols after generating it out of the
     given lenghts. They call this an oversubscribed dynamic bit lengths tree in zlib.*/
-    case 55: return "jumped past tree while generating huffman tree";
+    case 55: return "invalid huffman tree: its code lengths are oversubscribed or incomplete";
     case 56: return "given output image colortype or bitdepth not supported for color conversion";
     case 57: return "invalid CRC encountered (checking CRC can be disabled)";
     case 58: return "invalid ADLER32 encountered (checking ADLER32 can be disabled)";
     case 59: return "requested color conversion not supported";
     case 60: return "invalid window size given in the settings of the encoder (must be 0-32768)";
-    case 61: return "invalid BTYPE given in the settings of the encoder (only 0, 1 and 2 are allowed)";
+    case 61: return "invalid BTYPE given in the settings of the encoder (only 0, 1, 2 and 3 are allowed)";
     /*LodePNG leaves the choice of RGB to greyscale conversion formula to the user.*/
     case 62: return "conversion from color to greyscale not supported";
     case 63: return "length of a chunk too long, max allowed for PNG is 2147483647 bytes per chunk"; /*(2^31-1)*/
@@ -6047,6 +9115,13 @@ const char* lodepng_error_text(unsigned code)
     case 89: return "text chunk keyword too short or long: must have size 1-79";
     /*the windowsize in the LodePNGCompressSettings. Requiring POT(==> & instead of %) makes encoding 12% faster.*/
     case 90: return "windowsize must be a power of two";
+    case 91: return "the streaming encoder was given more rows than the image height";
+    case 92: return "the streaming encoder was finished before all rows were written";
+    case 93: return "the streaming encoder does not support Adam7 interlacing";
+    case 94: return "the output buffer is too small for the PNG, see lodepng_encode_bound";
+    case 95: return "the row by row decoder does not support Adam7 interlacing";
+    case 96: return "the decompressed image data ends before the last scanline";
+    case 97: return "the output buffer is too small for the decoded image";
   }
   return "unknown error code";
 }
@@ -6241,14 +9316,23 @@ unsigned encode(std::vector<unsigned char>& out,
                 const unsigned char* in, unsigned w, unsigned h,
                 State& state)
 {
-  unsigned char* buffer;
-  size_t buffersize;
-  unsigned error = lodepng_encode(&buffer, &buffersize, in, w, h, &state);
-  if(buffer)
+  /*lodepng_encode, except that the PNG goes back to the scratch arena once copied*/
+  const LodePNGAllocator* previous = allocator_begin(encoder_allocator(&state));
+  ucvector buffer;
+  unsigned error;
+  ucvector_init(&buffer);
+  error = encodePNG(&buffer, in, w, h, &state);
+  /*out's allocation may throw, the scope and the buffer must still end*/
+  try
   {
-    out.insert(out.end(), &buffer[0], &buffer[buffersize]);
-    lodepng_free(buffer);
+    if(buffer.data) out.insert(out.end(), &buffer.data[0], &buffer.data[buffer.size]);
   }
+  catch(...)
+  {
+    if(!error) error = state.error = 83; /*alloc fail*/
+  }
+  ucvector_cleanup(&buffer);
+  allocator_end(previous);
   return error;
 }
 
@@ -6260,15 +9344,164 @@ unsigned encode(std::vector<unsigned char>& out,
   return encode(out, in.empty() ? 0 : &in[0], w, h, state);
 }
 
+struct BatchJob
+{
+  const BatchImage* images;
+  BatchResult* results;
+  size_t count;
+#ifdef LODEPNG_COMPILE_THREADS
+  std::atomic<size_t> next;
+#else /*LODEPNG_COMPILE_THREADS*/
+  size_t next;
+#endif /*LODEPNG_COMPILE_THREADS*/
+};
+
+/*the workers of a BatchEncoder, each with its own copy of the state*/
+struct BatchPool
+{
+  std::vector<State> states; /*states[0] is the calling thread's*/
+#ifdef LODEPNG_COMPILE_THREADS
+  std::vector<std::thread> threads; /*threads[k] works with states[k + 1]*/
+  std::mutex mutex;
+  std::condition_variable start; /*a batch was started, or stopping was set*/
+  std::condition_variable done; /*the last thread finished the batch*/
+  BatchJob* job;
+  unsigned batches; /*batches started so far*/
+  size_t running; /*threads not done with the current batch*/
+  bool stopping;
+#endif /*LODEPNG_COMPILE_THREADS*/
+};
+
+/*one worker of a batch: encodes images until none are left with its state, whose scratch
+arena keeps the hash tables from image to image and from batch to batch. An exception,
+such as std::bad_alloc, fails the image it came from with error 83 instead of ending the
+thread and the program*/
+static void encodeBatchWorker(BatchJob* job, State& state)
+{
+  for(;;)
+  {
+    size_t i = job->next++;
+    if(i >= job->count) break;
+    const BatchImage& image = job->images[i];
+    BatchResult& result = job->results[i];
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+    try
+    {
+      result.png.clear();
+      result.error = encode(result.png, image.image, image.w, image.h, state);
+    }
+    catch(...)
+    {
+      result.png.clear();
+      result.error = 83; /*alloc fail*/
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+  }
+}
+
+#ifdef LODEPNG_COMPILE_THREADS
+/*a pool thread: waits for a batch, works on it with states[k], and waits for the next*/
+static void batchPoolThread(BatchPool* pool, size_t k)
+{
+  unsigned batches = 0;
+  for(;;)
+  {
+    BatchJob* job;
+    {
+      std::unique_lock<std::mutex> lock(pool->mutex);
+      while(!pool->stopping && pool->batches == batches) pool->start.wait(lock);
+      if(pool->stopping) return;
+      batches = pool->batches;
+      job = pool->job;
+    }
+    encodeBatchWorker(job, pool->states[k]);
+    {
+      std::lock_guard<std::mutex> lock(pool->mutex);
+      if(--pool->running == 0) pool->done.notify_one();
+    }
+  }
+}
+#endif /*LODEPNG_COMPILE_THREADS*/
+
+BatchEncoder::BatchEncoder(const State& state, unsigned threads)
+  : pool(new BatchPool)
+{
+  size_t i;
+  unsigned workers = lodepng_resolve_threads(threads);
+  pool->states.resize(workers, state);
+  /*the images are encoded in parallel already*/
+  for(i = 0; i < workers; i++) pool->states[i].encoder.zlibsettings.threads = 1;
+#ifdef LODEPNG_COMPILE_THREADS
+  pool->job = 0;
+  pool->batches = 0;
+  pool->running = 0;
+  pool->stopping = false;
+  try
+  {
+    for(i = 1; i < workers; i++) pool->threads.push_back(std::thread(batchPoolThread, pool, i));
+  }
+  catch(...) {} /*the threads that did start do more of the work*/
+#endif /*LODEPNG_COMPILE_THREADS*/
+}
+
+BatchEncoder::~BatchEncoder()
+{
+#ifdef LODEPNG_COMPILE_THREADS
+  size_t i;
+  {
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    pool->stopping = true;
+  }
+  pool->start.notify_all();
+  for(i = 0; i < pool->threads.size(); i++) pool->threads[i].join();
+#endif /*LODEPNG_COMPILE_THREADS*/
+  delete pool;
+}
+
+unsigned BatchEncoder::encode(std::vector<BatchResult>& results, const BatchImage* images, size_t count)
+{
+  BatchJob job;
+  size_t i;
+  results.resize(count);
+  job.images = images;
+  job.results = results.empty() ? 0 : &results[0];
+  job.count = count;
+  job.next = 0;
+#ifdef LODEPNG_COMPILE_THREADS
+  if(count > 1 && !pool->threads.empty())
+  {
+    std::unique_lock<std::mutex> lock(pool->mutex);
+    pool->job = &job;
+    pool->running = pool->threads.size();
+    pool->batches++;
+    lock.unlock();
+    pool->start.notify_all();
+    encodeBatchWorker(&job, pool->states[0]);
+    lock.lock();
+    while(pool->running) pool->done.wait(lock);
+  }
+  else
+#endif /*LODEPNG_COMPILE_THREADS*/
+  encodeBatchWorker(&job, pool->states[0]);
+  for(i = 0; i < count; i++) if(results[i].error) return results[i].error;
+  return 0;
+}
+
+unsigned encode_batch(std::vector<BatchResult>& results, const BatchImage* images, size_t count,
+                      const State& state, unsigned threads)
+{
+  unsigned workers = lodepng_resolve_threads(threads);
+  if(workers > count) workers = count == 0 ? 1 : (unsigned)count;
+  BatchEncoder batch(state, workers);
+  return batch.encode(results, images, count);
+}
+
 #ifdef LODEPNG_COMPILE_DISK
 unsigned encode(const std::string& filename,
                 const unsigned char* in, unsigned w, unsigned h,
                 LodePNGColorType colortype, unsigned bitdepth)
 {
-  std::vector<unsigned char> buffer;
-  unsigned error = encode(buffer, in, w, h, colortype, bitdepth);
-  if(!error) save_file(buffer, filename);
-  return error;
+  return lodepng_encode_file(filename.c_str(), in, w, h, colortype, bitdepth);
 }
 
 unsigned encode(const std::string& filename,
@@ -81,6 +81,19 @@ source files with custom allocators.*/
 #define LODEPNG_COMPILE_CPP
 #endif
 #endif
+/*run the parallel parts of the encoder (see "threads" in LodePNGCompressSettings)
+on C++11 std::thread. Without this they run one after another on the calling thread.*/
+#ifdef LODEPNG_COMPILE_CPP
+#ifndef LODEPNG_NO_COMPILE_THREADS
+#define LODEPNG_COMPILE_THREADS
+#endif
+#endif
+/*SSE2/SSSE3/AVX2/PCLMULQDQ versions of the inner loops (filters, checksums) on x86,
+chosen at runtime from what the CPU supports. The scalar versions are always
+compiled too and give identical results.*/
+#ifndef LODEPNG_NO_COMPILE_SIMD
+#define LODEPNG_COMPILE_SIMD
+#endif
 
 #ifdef LODEPNG_COMPILE_PNG
 /*The PNG color types (also used for raw).*/
@@ -244,6 +257,20 @@ unsigned encode(const std::string& filename,
 const char* lodepng_error_text(unsigned code);
 #endif /*LODEPNG_COMPILE_ERROR_TEXT*/
 
+/*SIMD code paths, as bit flags for lodepng_get_simd and lodepng_set_simd*/
+#define LODEPNG_SIMD_SSE2 1u
+#define LODEPNG_SIMD_SSSE3 2u
+#define LODEPNG_SIMD_AVX2 4u
+#define LODEPNG_SIMD_PCLMUL 8u
+
+/*Returns the SIMD code paths LodePNG uses: those the CPU and OS support, unless
+restricted with lodepng_set_simd. Always 0 without LODEPNG_COMPILE_SIMD or off x86.*/
+unsigned lodepng_get_simd(void);
+/*Restricts the SIMD code paths to mask (and what the CPU supports), for example 0 to
+run the scalar reference code. Returns the new set. Don't call this while other
+threads are encoding or decoding.*/
+unsigned lodepng_set_simd(unsigned mask);
+
 #ifdef LODEPNG_COMPILE_DECODER
 /*Settings for zlib decompression*/
 typedef struct LodePNGDecompressSettings LodePNGDecompressSettings;
@@ -270,6 +297,29 @@ void lodepng_decompress_settings_init(LodePNGDecompressSettings* settings);
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 #ifdef LODEPNG_COMPILE_ENCODER
+/*
+Memory functions for the encoder, see "allocator" in LodePNGCompressSettings. Each gets
+context as its first parameter and works like the C function of the same name.
+*/
+typedef struct LodePNGAllocator
+{
+  void* (*malloc_fn)(void* context, size_t size);
+  void* (*realloc_fn)(void* context, void* ptr, size_t new_size);
+  void (*free_fn)(void* context, void* ptr); /*must accept null*/
+  void* context;
+} LodePNGAllocator;
+
+/*
+What the deflate blocks of an encode turned out as, see stats in LodePNGCompressSettings.
+Stored data is counted as the blocks of at most 65535 bytes it's split in.
+*/
+typedef struct LodePNGDeflateStats
+{
+  size_t blocks[3]; /*blocks written per BTYPE: 0 stored, 1 fixed, 2 dynamic Huffman*/
+  size_t bytes[3]; /*uncompressed bytes that went into them*/
+  size_t literal_bytes; /*bytes of dynamic blocks btype 3 Huffman coded without LZ77*/
+} LodePNGDeflateStats;
+
 /*
 Settings for zlib compression. Tweaking these settings tweaks the balance
 between speed and compression ratio.
@@ -278,12 +328,30 @@ typedef struct LodePNGCompressSettings LodePNGCompressSettings;
 struct LodePNGCompressSettings /*deflate = compress*/
 {
   /*LZ77 related settings*/
-  unsigned btype; /*the block type for LZ (0, 1, 2 or 3, see zlib standard). Should be 2 for proper compression.*/
+  /*the block type for LZ (0, 1 or 2, see zlib standard). Should be 2 for proper compression. 3 picks
+  one per block: a quick probe of samples of the block estimates its entropy and how much LZ77
+  would find, and chooses stored, fixed or dynamic, the latter without LZ77 if there are
+  hardly any repeats. Much faster on data that barely compresses, such as noise heightmaps, at
+  a slightly larger size. Set stats to see what was chosen.*/
+  unsigned btype;
   unsigned use_lz77; /*whether or not to use LZ77. Should be 1 for proper compression.*/
   unsigned windowsize; /*must be a power of two <= 32768. higher compresses more but is slower. Default value: 2048.*/
   unsigned minmatch; /*mininum lz77 length. 3 is normally best, 6 can be better for some PNGs. Default: 0*/
   unsigned nicematch; /*stop searching if >= this length found. Set to 258 for best compression. Default: 128*/
   unsigned lazymatching; /*use lazy matching: better compression but a bit slower. Default: true*/
+  /*most hash chain entries tried per position. 0: automatic, all of them for windowsize >=
+  8192, windowsize / 8 otherwise. 1: a single probe, greedy match finder without chains,
+  several times faster than any chain. Default: 0*/
+  unsigned maxchain;
+
+  /*Multithreading. 1: compress on the calling thread (default). 0: one thread per hardware
+  thread. n: up to n threads. With more than one thread, deflate works like pigz: the input
+  is cut into 128KB chunks that are compressed concurrently, each with its own hash primed
+  with the window before it, and joined with sync flushes (empty stored blocks). The result
+  is an ordinary zlib stream, a few bytes per chunk larger than the single threaded one.
+  The PNG encoder also uses this for filter selection, which it runs on bands of rows
+  concurrently with the same result as in order.*/
+  unsigned threads;
 
   /*use custom zlib encoder instead of built in one (default: null)*/
   unsigned (*custom_zlib)(unsigned char**, size_t*,
@@ -297,10 +365,42 @@ struct LodePNGCompressSettings /*deflate = compress*/
                              const LodePNGCompressSettings*);
 
   const void* custom_context; /*optional custom settings for custom functions*/
+
+  /*Allocator for all memory the encoder uses (default: null, lodepng_malloc and co). It is
+  used for the whole call, on the worker threads too and also by the zlib functions called
+  from a PNG encode, whatever their settings. Buffers the encoder returns, such as the PNG
+  or zlib data, come from it, so free them with its free_fn. Only works with the built in
+  allocators (LODEPNG_COMPILE_ALLOCATORS). The decoder doesn't use it.*/
+  const LodePNGAllocator* allocator;
+
+  /*if not NULL, the blocks every deflate with these settings writes are added to it, which
+  includes zTXt and iTXt chunks (default: null). Zero it first. The threads of a parallel
+  deflate count separately and are added up at the end, but two encodes at once must not
+  share one.*/
+  LodePNGDeflateStats* stats;
 };
 
 extern const LodePNGCompressSettings lodepng_default_compress_settings;
 void lodepng_compress_settings_init(LodePNGCompressSettings* settings);
+/*
+Sets the LZ77 and block type settings like zlib's compression levels 0 (stored) to 9
+(smallest), leaving threads and the custom functions as they are. Above 9 is 9.
+Level 1 is the adaptive btype 3, which runs the single probe match finder only on blocks
+whose samples repeat, 2 the single probe on every block, 3 and up lazy matching on ever
+longer chains. Measured with BenchmarkCompressionLevels on a 1024x1024 16 bit noise
+heightmap with 8 octaves (3 octaves in brackets), one thread:
+  level 0:    500 MB/s (540), ratio 1.000 (1.000)
+  level 1:    290 MB/s (305), ratio 1.173 (1.326)
+  level 2:     69 MB/s  (72), ratio 1.173 (1.331)
+  level 3:     31 MB/s  (20), ratio 1.173 (1.331)
+  level 4:     31 MB/s  (18), ratio 1.173 (1.333)
+  level 5-9:   31 MB/s  (18), ratio 1.173 (1.333)
+  defaults:    55 MB/s  (41), ratio 1.171 (1.317)
+LZ77 finds next to nothing in the rough 8 octave terrain, so there levels 2 to 9 cost
+time for no gain and level 1 is the one to use; on smoother terrain the higher levels
+gain up to 0.5%. Levels 5 to 9 only differ on data with longer repeats.
+*/
+void lodepng_compress_settings_level(LodePNGCompressSettings* settings, unsigned level);
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 #ifdef LODEPNG_COMPILE_PNG
@@ -620,6 +720,17 @@ typedef struct LodePNGEncoderSettings
   /*encode text chunks as zTXt chunks instead of tEXt chunks, and use compression in iTXt chunks*/
   unsigned text_compression;
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+
+  /*Keep the encoder's working memory in the state between encodes (default: true). The
+  blocks the encoder frees, such as the filtered scanlines, the hash tables, the LZ77
+  symbols and the Huffman trees, go to a scratch arena owned by the state and are handed
+  out again by the next encode. After a few images of the same size and kind, encoding
+  with the same state makes no heap allocations: lodepng::encode gives the PNG buffer back
+  to the arena too, lodepng_encode copies it into one allocation the caller owns. Starting
+  threads (zlibsettings.threads) allocates in the C++ library regardless. The arena takes
+  its blocks from zlibsettings' allocator and keeps them until lodepng_state_cleanup.
+  Not used with custom_zlib or custom_deflate, or without the built in allocators.*/
+  unsigned keep_scratch;
 } LodePNGEncoderSettings;
 
 void lodepng_encoder_settings_init(LodePNGEncoderSettings* settings);
@@ -627,6 +738,10 @@ void lodepng_encoder_settings_init(LodePNGEncoderSettings* settings);
 
 
 #if defined(LODEPNG_COMPILE_DECODER) || defined(LODEPNG_COMPILE_ENCODER)
+#ifdef LODEPNG_COMPILE_ENCODER
+typedef struct LodePNGScratch LodePNGScratch; /*see keep_scratch in LodePNGEncoderSettings*/
+#endif /*LODEPNG_COMPILE_ENCODER*/
+
 /*The settings, state and information for extended encoding and decoding.*/
 typedef struct LodePNGState
 {
@@ -635,6 +750,7 @@ typedef struct LodePNGState
 #endif /*LODEPNG_COMPILE_DECODER*/
 #ifdef LODEPNG_COMPILE_ENCODER
   LodePNGEncoderSettings encoder; /*the encoding settings*/
+  LodePNGScratch* scratch; /*the encoder's scratch arena, owned by the state and not copied*/
 #endif /*LODEPNG_COMPILE_ENCODER*/
   LodePNGColorMode info_raw; /*specifies the format in which you would like to get the raw pixel buffer*/
   LodePNGInfo info_png; /*info of the PNG image obtained after decoding*/
@@ -668,14 +784,128 @@ information is placed in the info_png field of the LodePNGState.
 unsigned lodepng_inspect(unsigned* w, unsigned* h,
                          LodePNGState* state,
                          const unsigned char* in, size_t insize);
+
+#ifdef LODEPNG_COMPILE_ZLIB
+/*
+Receives decoded row y, in order from the top, as size bytes at row in the color mode
+state->info_raw. The bytes are only valid during the call. Returns 0 to continue or an
+error code of its own (preferably not one of LodePNG's) to abort the decode, which then
+returns that code.
+*/
+typedef unsigned (*LodePNGRowSink)(void* context, unsigned y, const unsigned char* row, size_t size);
+
+/*
+Decoding row by row: lodepng_decode_rows inflates the IDAT data where it lies in the
+PNG, unfilters each scanline as soon as it is complete, converts it to state->info_raw
+like lodepng_decode and hands it to the sink. Besides the input it needs a window of
+32KB plus 128KB and two or three rows, whatever the image size, so with a memory mapped
+file the whole image never needs to be in memory. Rows of less than a whole number of
+bytes are padded to one. The image must not be interlaced (error 95), and the zlib
+settings custom_zlib and custom_inflate are not used. Rows may have been passed on
+before an error later in the data is found.
+
+lodepng_decode_to_buffer writes the image into capacity bytes at out, with the same
+bytes as lodepng_decode, returning error 97 if lodepng_get_raw_size bytes don't fit.
+*/
+unsigned lodepng_decode_rows(LodePNGRowSink sink, void* sink_context, unsigned* w, unsigned* h,
+                             LodePNGState* state, const unsigned char* in, size_t insize);
+unsigned lodepng_decode_to_buffer(unsigned char* out, size_t capacity, unsigned* w, unsigned* h,
+                                  LodePNGState* state, const unsigned char* in, size_t insize);
+#endif /*LODEPNG_COMPILE_ZLIB*/
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 
 #ifdef LODEPNG_COMPILE_ENCODER
-/*This function allocates the out buffer with standard malloc and stores the size in *outsize.*/
+/*This function allocates the out buffer with standard malloc, or the allocator in
+state->encoder.zlibsettings, and stores the size in *outsize.*/
 unsigned lodepng_encode(unsigned char** out, size_t* outsize,
                         const unsigned char* image, unsigned w, unsigned h,
                         LodePNGState* state);
+
+/*
+Receives encoded PNG bytes in order, size bytes at data, which are only valid during the
+call. Returns 0 to continue or an error code of its own (preferably not one of LodePNG's)
+to abort the encode, which then returns that code. The sink may call LodePNG itself,
+an encode in it uses its own state's allocator, not the one of the encode calling it.
+*/
+typedef unsigned (*LodePNGSink)(void* context, const unsigned char* data, size_t size);
+
+/*
+Encoding without a copy of the PNG: lodepng_encode_to_buffer writes it straight into
+out, capacity bytes the caller owns, such as a slot of an archive, and sets *outsize to
+the bytes used. If it doesn't fit, it returns error 94 and the contents of out are
+undefined. lodepng_encode_to_sink builds the PNG in the state's scratch arena (see
+keep_scratch) and hands it to the sink in one call.
+
+lodepng_encode_bound returns a size the PNG of a w*h image with the settings and info
+in state never exceeds, for preallocating the buffer. It holds without custom_zlib and
+custom_deflate: deflate stores any block that would not get smaller, so the bound is
+the filtered scanlines plus a few bytes per 64KB and the chunks around them. With
+auto_convert it assumes the largest color mode the encoder can choose.
+*/
+unsigned lodepng_encode_to_buffer(unsigned char* out, size_t capacity, size_t* outsize,
+                                  const unsigned char* image, unsigned w, unsigned h,
+                                  LodePNGState* state);
+unsigned lodepng_encode_to_sink(LodePNGSink sink, void* sink_context,
+                                const unsigned char* image, unsigned w, unsigned h,
+                                LodePNGState* state);
+size_t lodepng_encode_bound(unsigned w, unsigned h, const LodePNGState* state);
+
+#ifdef LODEPNG_COMPILE_ZLIB
+/*
+Push style encoder for images too large to hold in memory: lodepng_stream_begin writes
+the signature and the chunks before IDAT to the sink, lodepng_stream_write_rows takes
+the scanlines top to bottom in any number of calls, filters them and deflates them in
+128KB pieces, each of which goes to the sink as an IDAT chunk, and lodepng_stream_finish
+ends the zlib stream and writes the chunks after IDAT. The encoder holds on to a few
+scanlines, the LZ77 window and one piece, whatever the height of the image.
+
+The rows are in state->info_raw and converted to state->info_png.color like with
+lodepng_encode, except that auto_convert can't look at the whole image first and is
+ignored, and that Adam7 interlacing is not supported. The deflate settings are used but
+not custom_zlib or custom_deflate, and deflate runs on the calling thread. Memory comes
+from the allocator in the zlib settings; the state's scratch arena is not used. The output
+differs from lodepng_encode's in where the deflate blocks start and end only.
+
+Every function returns an error code. After an error, later calls return the same
+error. Always call lodepng_stream_cleanup, also after an error.
+*/
+typedef struct LodePNGStreamEncoder
+{
+  LodePNGState* state; /*not copied, must stay unchanged until the encode is finished*/
+  LodePNGSink sink;
+  void* sink_context;
+  unsigned w;
+  unsigned h;
+  unsigned y; /*rows written so far*/
+  unsigned error;
+
+  /*internal state*/
+  LodePNGFilterStrategy strategy;
+  size_t linebytes; /*PNG scanline bytes, without the filter type*/
+  size_t rawlinebits; /*bits per row of the raw input*/
+  unsigned batchrows; /*rows filtered at once*/
+  unsigned char* lines; /*the last row of the previous batch, then the batch in the PNG color mode*/
+  unsigned char* filtered; /*the filtered batch*/
+  unsigned char* rawline; /*a raw row copied to a byte boundary*/
+  unsigned char* window; /*LZ77 dictionary, then the filtered bytes not yet deflated*/
+  size_t dictsize;
+  size_t pendingsize;
+  unsigned char* zdata; /*zlib bytes not yet written, the last one possibly partial*/
+  size_t zsize;
+  size_t zallocsize;
+  size_t zbits; /*bit position in zdata*/
+  unsigned adler;
+} LodePNGStreamEncoder;
+
+unsigned lodepng_stream_begin(LodePNGStreamEncoder* stream, unsigned w, unsigned h,
+                              LodePNGState* state, LodePNGSink sink, void* sink_context);
+/*rows: count rows in the state->info_raw color mode, packed like lodepng_encode's input*/
+unsigned lodepng_stream_write_rows(LodePNGStreamEncoder* stream, const unsigned char* rows, unsigned count);
+/*call after all h rows have been written*/
+unsigned lodepng_stream_finish(LodePNGStreamEncoder* stream);
+void lodepng_stream_cleanup(LodePNGStreamEncoder* stream);
+#endif /*LODEPNG_COMPILE_ZLIB*/
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 /*
@@ -741,6 +971,10 @@ unsigned lodepng_chunk_create(unsigned char** out, size_t* outlength, unsigned l
 
 /*Calculate CRC32 of buffer*/
 unsigned lodepng_crc32(const unsigned char* buf, size_t len);
+/*Continues the CRC32 crc of earlier data with buf, starting from crc 0:
+lodepng_crc32_update(lodepng_crc32(a, na), b, nb) is the CRC32 of a followed by b.
+Like lodepng_crc32, uses PCLMULQDQ folding when available and slice-by-8 tables otherwise.*/
+unsigned lodepng_crc32_update(unsigned crc, const unsigned char* buf, size_t len);
 #endif /*LODEPNG_COMPILE_PNG*/
 
 
@@ -751,6 +985,11 @@ buffer. It cannot be used to create gzip files however, and it only supports the
 part of zlib that is required for PNG, it does not support dictionaries.
 */
 
+/*Adler32 checksum of a buffer, as stored in the zlib trailer. Uses SSSE3 or AVX2 when available.*/
+unsigned lodepng_adler32(const unsigned char* data, size_t len);
+/*Continues the Adler32 adler of earlier data (start from 1) with data[0..len-1]*/
+unsigned lodepng_adler32_update(unsigned adler, const unsigned char* data, size_t len);
+
 #ifdef LODEPNG_COMPILE_DECODER
 /*Inflate a buffer. Inflate is the decompression step of deflate. Out buffer must be freed after use.*/
 unsigned lodepng_inflate(unsigned char** out, size_t* outsize,
@@ -849,6 +1088,51 @@ unsigned encode(std::vector<unsigned char>& out,
 unsigned encode(std::vector<unsigned char>& out,
                 const std::vector<unsigned char>& in, unsigned w, unsigned h,
                 State& state);
+
+//An image of a batch, in the color mode state.info_raw of the batch
+struct BatchImage
+{
+  const unsigned char* image;
+  unsigned w;
+  unsigned h;
+};
+
+struct BatchResult
+{
+  std::vector<unsigned char> png;
+  unsigned error;
+  double seconds; //wall clock time the encode of this image took
+};
+
+struct BatchPool;
+
+/*
+Encodes batches of images with the same settings, such as the tiles of a render, on up
+to threads threads (0 means one per hardware thread), the calling thread being one of
+them. Each thread works with its own copy of state, whose scratch arena it keeps from
+image to image, and takes the next image when done with one, so uneven images balance
+out. Deflate runs single threaded within an image. The threads and their states live as
+long as the BatchEncoder, so later batches start on warm arenas without starting threads.
+encode puts the PNG of images[i] in results[i], in order, and returns 0, or the error of
+the first image that failed (83 also when encoding it threw, e.g. std::bad_alloc). Only
+one thread at a time may call encode.
+*/
+class BatchEncoder
+{
+  public:
+    BatchEncoder(const State& state, unsigned threads = 0);
+    ~BatchEncoder();
+    unsigned encode(std::vector<BatchResult>& results, const BatchImage* images, size_t count);
+
+  private:
+    BatchPool* pool;
+    BatchEncoder(const BatchEncoder&);
+    BatchEncoder& operator=(const BatchEncoder&);
+};
+
+//A single batch, on a BatchEncoder of at most count threads that ends with it
+unsigned encode_batch(std::vector<BatchResult>& results, const BatchImage* images, size_t count,
+                      const State& state, unsigned threads = 0);
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 #ifdef LODEPNG_COMPILE_DISK
@@ -897,7 +1181,7 @@ TODO:
 [X] converting color to 16-bit per channel types
 [ ] read all public PNG chunk types (but never let the color profile and gamma ones touch RGB values)
 [ ] make sure encoder generates no chunks with size > (2^31)-1
-[ ] partial decoding (stream processing)
+[X] partial decoding (stream processing)
 [X] let the "isFullyOpaque" function check color keys and transparent palettes too
 [X] better name for the variables "codes", "codesD", "codelengthcodes", "clcl" and "lldl"
 [ ] don't stop decoding on errors like 69, 57, 58 (make warnings)
@@ -1016,7 +1300,8 @@ The following features are supported by the decoder:
 The following features are _not_ supported:
 
 *) some features needed to make a conformant PNG-Editor might be still missing.
-*) partial loading/stream processing. All data must be available and is processed in one call.
+*) partial loading of the PNG file. All data must be available, though lodepng_decode_rows
+   decodes it row by row.
 *) The following public chunks are not supported but treated as unknown chunks by LodePNG
     cHRM, gAMA, iCCP, sRGB, sBIT, hIST, sPLT
    Some of these are not supported on purpose: LodePNG wants to provide the RGB values
@@ -1167,13 +1452,23 @@ The following settings are supported (some are in sub-structs):
 *) auto_convert: when this option is enabled, the encoder will
 automatically choose the smallest possible color mode (including color key) that
 can encode the colors of all pixels without information loss.
+   Choosing means profiling the pixels. The profile stops as soon as the outcome is
+   settled, e.g. at the first colored, translucent pixel once over 256 colors are
+   counted, and skips plain grey opaque pixels with SIMD, but it can still read the
+   whole image. A caller that knows the color type it wants sets LAC_NO and the
+   type in info_png.color, which skips the profile. LAC_AUTO_NO_PALETTE doesn't
+   count colors.
 *) btype: the block type for LZ77. 0 = uncompressed, 1 = fixed huffman tree,
    2 = dynamic huffman tree (best compression). Should be 2 for proper
-   compression.
+   compression. 3 = adaptive, chosen per block from an entropy probe, for fast
+   previews of data that hardly compresses.
 *) use_lz77: whether or not to use LZ77 for compressed block types. Should be
    true for proper compression.
 *) windowsize: the window size used by the LZ77 encoder (1 - 32768). Has value
    2048 by default, but can be set to 32768 for better, but slow, compression.
+*) maxchain: how many earlier positions LZ77 tries per byte, 0 for automatic and 1
+   for the fast single probe match finder.
+*) lodepng_compress_settings_level sets all of the above like zlib's levels 0-9.
 *) force_palette: if colortype is 2 or 6, you can make the encoder write a PLTE
    chunk if force_palette is true. This can used as suggested palette to convert
    to by viewers that don't support more than 256 colors (if those still exist)
@@ -1182,6 +1477,9 @@ can encode the colors of all pixels without information loss.
   zTXt chunks use zlib compression on the text. This gives a smaller result on
   large texts but a larger result on small texts (such as a single program name).
   It's all tEXt or all zTXt though, there's no separate setting per text yet.
+*) keep_scratch: default 1. Reuse the encoder's memory between encodes with the same
+  state, so that a loop encoding many small images stops allocating.
+*) allocator (in zlibsettings): your own malloc, realloc and free for the encoder.
 
 
 6. color conversions
@@ -0,0 +1,914 @@
+/*
+Regression tests for the noise generators and the PNG path. Built by the
+SimplexNoiseTests project from every SimplexNoise source but main.cpp.
+
+Golden:      hashes of the exact bits of NoiseAt/Noise over fixed grids, for
+             fixed seeds and parameters at several feature sizes, around the
+             origin and at negative and large coordinates. Any change to the
+             maths, however small, changes a hash. The permutations come from
+             TestRandom rather than from SimplexNoise's seeding, which goes
+             through the standard library's uniform_int_distribution, so one
+             table holds with every library. --golden prints the table.
+Equivalence: the SSE2 batch, expression template and reduced precision
+             variants against the scalar functions, exactly or within the
+             rounding of each storage format, and lodepng's SIMD paths against
+             its scalar reference code, byte for byte.
+Malformed:   heightmap and pyramid files with corrupted headers or index
+             entries, which must fail to open or to hand out the tile.
+Performance: throughput of the hot paths against perf_baseline.txt from an
+             earlier run on the same machine. A test fails when it falls more
+             than --threshold (default 0.25, i.e. 25%) below its baseline.
+             The first run, or one with --record, writes the baseline.
+             Skipped in Debug builds, where the numbers mean nothing.
+
+The exit code is the number of failed tests.
+*/
+
+#include "SimplexNoise.h"
+#include "NoiseExpr.h"
+#include "TileRenderer.h"
+#include "Half.h"
+#include "GreyPng.h"
+#include "Benchmark.h"
+#include "lodepng.h"
+#include "HeightmapFile.h"
+#include "HeightmapPyramid.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <cstddef>
+#include <cstdio>
+#include <iterator>
+
+namespace {
+	int failures = 0;
+
+	void Report(const std::string& name, bool pass, const std::string& detail = "") {
+		std::cout << (pass ? "PASS " : "FAIL ") << name;
+		if (!detail.empty()) std::cout << ": " << detail;
+		std::cout << std::endl;
+		if (!pass) ++failures;
+	}
+
+	template <typename T>
+	std::string Str(const T& value) {
+		std::ostringstream s;
+		s << value;
+		return s.str();
+	}
+
+	/*64 bit FNV-1a over the bytes of each double*/
+	unsigned long long HashDoubles(const double* values, size_t count) {
+		unsigned long long hash = 14695981039346656037ull;
+		const unsigned char* bytes = (const unsigned char*)values;
+		for (size_t i = 0; i < count * sizeof(double); ++i) {
+			hash ^= bytes[i];
+			hash *= 1099511628211ull;
+		}
+		return hash;
+	}
+
+	bool SameBits(double a, double b) {
+		return std::memcmp(&a, &b, sizeof(double)) == 0;
+	}
+
+	/*Deterministic pseudo random doubles in [lo, hi), the same on every
+	compiler (unlike the <random> distributions)*/
+	class TestRandom {
+	public:
+		explicit TestRandom(unsigned seed) : state(seed) {}
+
+		unsigned Next() {
+			state = state * 1103515245u + 12345u;
+			return state >> 8;
+		}
+
+		double Uniform(double lo, double hi) {
+			return lo + (hi - lo) * (Next() / 16777216.0);
+		}
+
+	private:
+		unsigned state;
+	};
+
+	/*-- Golden outputs --*/
+
+	struct GoldenCase {
+		const char* name;
+		double featureSize;
+		double persistence;
+		int octaves;
+		int seed; /*of the permutation, see MakePermutation*/
+		int x0;
+		int y0;
+		int size;
+		double step; /*0: NoiseAt on integers, else Noise at x0 + i * step*/
+	};
+
+	const GoldenCase GOLDEN_CASES[] = {
+		{ "fbm150_origin",    150.0, 0.65, 8,  5000,  0,           0,           96, 0.0 },
+		{ "fbm150_negative",  150.0, 0.65, 8,  5000,  -100000,     -250000,     96, 0.0 },
+		{ "fbm150_large",     150.0, 0.65, 8,  5000,  1000000000,  1000000000,  96, 0.0 },
+		{ "fbm150_large_neg", 150.0, 0.65, 8,  5000,  -1000000000, -1000000000, 96, 0.0 },
+		{ "fbm10_origin",     10.0,  0.5,  6,  42,    -48,         -48,         96, 0.0 },
+		{ "fbm1000_mixed",    1000.0, 0.7, 10, -7,    -5000000,    7000000,     96, 0.0 },
+		{ "noise_fraction",   1.0,   0.65, 1,  5000,  -333,        -777,        96, 0.37 },
+		{ "noise_large",      1.0,   0.65, 1,  99,    600000000,   -600000000,  96, 0.59 }
+	};
+	const int GOLDEN_COUNT = sizeof(GOLDEN_CASES) / sizeof(GOLDEN_CASES[0]);
+
+	/*Hashes of GOLDEN_CASES in order. The table was made with the code as it
+	stood before any of the optimised paths, given the same permutations*/
+	const unsigned long long GOLDEN_HASHES[GOLDEN_COUNT] = {
+		0xe3203e582e480ab1ull, /*fbm150_origin*/
+		0x976baabf5ce8bf98ull, /*fbm150_negative*/
+		0xb2395bdf6ae2edfbull, /*fbm150_large*/
+		0x010780279dad07a6ull, /*fbm150_large_neg*/
+		0x8e21414a69525d00ull, /*fbm10_origin*/
+		0x7bfd5fa6387c2afcull, /*fbm1000_mixed*/
+		0xc8ca4456e37d0b44ull, /*noise_fraction*/
+		0x3b447bdd44414518ull  /*noise_large*/
+	};
+
+	/*A shuffle of 0-255 by TestRandom, the same with every standard library*/
+	void MakePermutation(unsigned seed, short permutation[256]) {
+		for (int i = 0; i < 256; ++i) permutation[i] = (short)i;
+		TestRandom random(seed);
+		for (int i = 255; i > 0; --i) {
+			std::swap(permutation[i], permutation[random.Next() % (i + 1)]);
+		}
+	}
+
+	unsigned long long GoldenHash(const GoldenCase& c) {
+		short permutation[256];
+		MakePermutation((unsigned)c.seed, permutation);
+		SimplexNoise noise(c.featureSize, c.persistence, c.octaves, permutation);
+		std::vector<double> grid((size_t)c.size * c.size);
+		for (int j = 0; j < c.size; ++j) {
+			for (int i = 0; i < c.size; ++i) {
+				grid[(size_t)j * c.size + i] = c.step == 0.0
+					? noise.NoiseAt(c.x0 + i, c.y0 + j)
+					: noise.Noise(c.x0 + i * c.step, c.y0 + j * c.step);
+			}
+		}
+		return HashDoubles(&grid[0], grid.size());
+	}
+
+	void PrintGoldenTable() {
+		std::cout << "\tconst unsigned long long GOLDEN_HASHES[GOLDEN_COUNT] = {" << std::endl;
+		for (int i = 0; i < GOLDEN_COUNT; ++i) {
+			std::cout << "\t\t0x" << std::hex << std::setfill('0') << std::setw(16) << GoldenHash(GOLDEN_CASES[i])
+				<< std::dec << "ull"
+				<< (i + 1 < GOLDEN_COUNT ? "," : "") << " /*" << GOLDEN_CASES[i].name << "*/" << std::endl;
+		}
+		std::cout << "\t};" << std::endl;
+	}
+
+	void TestGolden() {
+		for (int i = 0; i < GOLDEN_COUNT; ++i) {
+			unsigned long long hash = GoldenHash(GOLDEN_CASES[i]);
+			std::ostringstream detail;
+			detail << std::hex << std::setfill('0') << "0x" << std::setw(16) << hash;
+			if (hash != GOLDEN_HASHES[i]) detail << ", expected 0x" << std::setw(16) << GOLDEN_HASHES[i];
+			Report(std::string("golden ") + GOLDEN_CASES[i].name, hash == GOLDEN_HASHES[i], detail.str());
+		}
+	}
+
+	/*-- Equivalence and tolerance --*/
+
+	/*Noise against Gustavson's plain version, which uses std::floor and
+	branches, around zero and near the int range limits of the cell maths*/
+	void TestNoiseMatchesReference() {
+		SimplexNoise noise(1.0, 0.65, 1, 5000);
+		TestRandom random(1);
+		const double centres[5] = { 0.0, 1e6, -1e6, 1e9, -1e9 };
+		size_t mismatches = 0;
+		for (int c = 0; c < 5; ++c) {
+			for (int i = 0; i < 40000; ++i) {
+				double x = centres[c] + random.Uniform(-50.0, 50.0);
+				double y = centres[c] + random.Uniform(-50.0, 50.0);
+				if (!SameBits(noise.Noise(x, y), noise.NoiseReference(x, y))) ++mismatches;
+			}
+		}
+		Report("Noise matches NoiseReference", mismatches == 0, Str(mismatches) + " of 200000 differ");
+	}
+
+	void TestFastFloor() {
+		size_t checks;
+		size_t mismatches = CheckFastFloor(checks);
+		Report("FastFloor matches floor", mismatches == 0, Str(mismatches) + " of " + Str(checks) + " differ");
+	}
+
+	/*The SSE2 batch functions must give the scalar functions' bits*/
+	void TestBatchMatchesScalar() {
+		SimplexNoise noise(150.0, 0.65, 8, 5000);
+		TestRandom random(2);
+		const size_t count = 20001;
+		Vector2dArray fractional(count);
+		Vector2dArray integer(count);
+		for (size_t i = 0; i < count; ++i) {
+			double scale = i % 3 == 0 ? 1e3 : (i % 3 == 1 ? 1e6 : 1e9);
+			fractional.Set(i, Vector2d(random.Uniform(-scale, scale), random.Uniform(-scale, scale)));
+			integer.Set(i, Vector2d(std::floor(random.Uniform(-scale, scale)), std::floor(random.Uniform(-scale, scale))));
+		}
+		std::vector<double> batch(count);
+		size_t mismatches = 0;
+		noise.Noise(fractional, &batch[0]);
+		for (size_t i = 0; i < count; ++i) {
+			if (!SameBits(batch[i], noise.Noise(fractional.X()[i], fractional.Y()[i]))) ++mismatches;
+		}
+		Report("batch Noise matches Noise", mismatches == 0, Str(mismatches) + " of " + Str(count) + " differ");
+
+		mismatches = 0;
+		noise.NoiseAt(integer, &batch[0]);
+		for (size_t i = 0; i < count; ++i) {
+			if (!SameBits(batch[i], noise.NoiseAt((int)integer.X()[i], (int)integer.Y()[i]))) ++mismatches;
+		}
+		Report("batch NoiseAt matches NoiseAt", mismatches == 0, Str(mismatches) + " of " + Str(count) + " differ");
+	}
+
+	void TestFbmMatchesNoiseAt() {
+		SimplexNoise noise(150.0, 0.65, 8, 5000);
+		Fbm<8> fbm(5000, 150.0, 0.65);
+		size_t mismatches = 0;
+		for (int y = -64; y < 64; ++y) {
+			for (int x = -64; x < 64; ++x) {
+				if (!SameBits(fbm(x * 7, y * 5), noise.NoiseAt(x * 7, y * 5))) ++mismatches;
+			}
+		}
+		Report("Fbm<8> matches NoiseAt", mismatches == 0, Str(mismatches) + " of 16384 differ");
+	}
+
+	void TestVectorExpressions() {
+		const double G2 = (3.0 - std::sqrt(3.0)) / 6.0;
+		Vector2d xy(0.3, -1.7);
+		Vector2d a(2.5, 3.25);
+		Vector2i ij1(1, 0);
+		Vector2d eager1(xy - ij1 + G2);
+		Vector2d lazy1 = Lazy(xy) - ij1 + G2;
+		Vector2d eager2 = (xy + a) * (xy - a) / 3.0;
+		Vector2d lazy2 = (Lazy(xy) + a) * (Lazy(xy) - a) / 3.0;
+		Vector2d eager3 = (xy + 0.5).Floor();
+		Vector2d lazy3 = (Lazy(xy) + 0.5).Floor();
+		Vector3d p(1, 2, 3);
+		Vector3d q(0.5, 0.25, -1);
+		Vector3d eager4 = p * q - 1.0;
+		Vector3d lazy4 = Lazy(p) * q - 1.0;
+		Vector3d cross = Vector3d(1, 0, 0).Cross(Vector3d(0, 1, 0));
+		bool pass = eager1 == lazy1 && eager2 == lazy2 && eager3 == lazy3 && eager4 == lazy4
+			&& cross == Vector3d(0, 0, 1);
+		Report("vector expressions match eager operators", pass);
+	}
+
+	/*RenderTile's storage formats against NoiseAt, each within its rounding*/
+	void TestRenderTileTolerances() {
+		SimplexNoise noise(150.0, 0.65, 8, 5000);
+		const int size = 128;
+		const int x0 = -1000;
+		const int y0 = 3000;
+		std::vector<double> exact((size_t)size * size);
+		for (int y = 0; y < size; ++y) {
+			for (int x = 0; x < size; ++x) {
+				exact[(size_t)y * size + x] = noise.NoiseAt(x0 + x, y0 + y);
+			}
+		}
+
+		std::vector<double> f64(exact.size());
+		RenderTile(noise, x0, y0, size, size, SAMPLE_F64, &f64[0], size * sizeof(double));
+		Report("RenderTile F64 exact", HashDoubles(&f64[0], f64.size()) == HashDoubles(&exact[0], exact.size()));
+
+		SampleRange range = SampleRange::ForU16(noise);
+		const SampleType types[3] = { SAMPLE_F32, SAMPLE_F16, SAMPLE_U16 };
+		const char* names[3] = { "F32", "F16", "U16" };
+		for (int t = 0; t < 3; ++t) {
+			std::vector<unsigned char> tile(exact.size() * SampleSize(types[t]));
+			RenderTile(noise, x0, y0, size, size, types[t], &tile[0], size * SampleSize(types[t]), range);
+			double worst = 0;
+			bool pass = true;
+			for (size_t i = 0; i < exact.size(); ++i) {
+				double error = std::fabs(LoadSample(&tile[0], i, types[t], range) - exact[i]);
+				double tolerance;
+				switch (types[t]) {
+				case SAMPLE_F32: tolerance = std::fabs(exact[i]) * std::ldexp(1.0, -24) + std::ldexp(1.0, -149); break;
+				case SAMPLE_F16: tolerance = std::fabs(exact[i]) * std::ldexp(1.0, -11) + std::ldexp(1.0, -25); break;
+				default: tolerance = range.scale * 0.5 * (1.0 + 1e-9); break;
+				}
+				if (error > tolerance) pass = false;
+				if (error > worst) worst = error;
+			}
+			Report(std::string("RenderTile ") + names[t] + " within rounding", pass, "max error " + Str(worst));
+		}
+	}
+
+	/*lodepng's checksums, scalar and SIMD, against known values and each other
+	over every alignment and a spread of lengths*/
+	void TestChecksums() {
+		const unsigned char* check = (const unsigned char*)"123456789";
+		bool known = lodepng_crc32(check, 9) == 0xCBF43926u
+			&& lodepng_adler32((const unsigned char*)"Wikipedia", 9) == 0x11E60398u;
+
+		TestRandom random(3);
+		std::vector<unsigned char> data(70000);
+		for (size_t i = 0; i < data.size(); ++i) data[i] = (unsigned char)random.Next();
+		const size_t lengths[8] = { 0, 1, 15, 16, 63, 64, 5553, 65536 };
+		unsigned simd = lodepng_get_simd();
+		size_t mismatches = 0;
+		for (int l = 0; l < 8; ++l) {
+			for (size_t offset = 0; offset < 32; ++offset) {
+				const unsigned char* p = &data[offset];
+				unsigned crc = lodepng_crc32(p, lengths[l]);
+				unsigned adler = lodepng_adler32(p, lengths[l]);
+				lodepng_set_simd(0);
+				if (crc != lodepng_crc32(p, lengths[l])) ++mismatches;
+				if (adler != lodepng_adler32(p, lengths[l])) ++mismatches;
+				lodepng_set_simd(simd);
+			}
+		}
+		Report("checksums match known values", known);
+		Report("checksums SIMD match scalar", mismatches == 0, Str(mismatches) + " differ, SIMD mask " + Str(simd));
+	}
+
+	/*Whole PNGs encoded and decoded with and without SIMD, which covers the
+	filters, unfilters, colour conversion and checksums*/
+	void TestPngSimdMatchesScalar() {
+		SimplexNoise noise(150.0, 0.65, 8, 5000);
+		const unsigned size = 256;
+		std::vector<double> heights((size_t)size * size);
+		RenderTile(noise, 0, 0, size, size, SAMPLE_F64, &heights[0], size * sizeof(double));
+		SampleRange range = Grey16Range(-noise.AmplitudeSum(), noise.AmplitudeSum());
+
+		TestRandom random(4);
+		std::vector<unsigned char> rgba((size_t)size * size * 4);
+		for (size_t i = 0; i < rgba.size(); ++i) {
+			/*Smooth ramps with some noise, so every filter type gets picked*/
+			rgba[i] = (unsigned char)((i / 4 % size) + (i / 4 / size) * (i % 4) + (random.Next() & 7));
+		}
+
+		unsigned simd = lodepng_get_simd();
+		std::vector<unsigned char> grey16Png[2];
+		std::vector<unsigned char> rgbaPng[2];
+		std::vector<unsigned char> decoded[2];
+		unsigned error = 0;
+		for (int pass = 0; pass < 2; ++pass) {
+			lodepng_set_simd(pass == 0 ? simd : 0);
+			error |= EncodeGrey16Png(grey16Png[pass], &heights[0], size, size, range, 1);
+			error |= lodepng::encode(rgbaPng[pass], rgba, size, size);
+			unsigned w, h;
+			error |= lodepng::decode(decoded[pass], w, h, rgbaPng[pass], LCT_RGB, 8);
+		}
+		lodepng_set_simd(simd);
+
+		std::vector<unsigned char> roundTrip;
+		unsigned w, h;
+		error |= lodepng::decode(roundTrip, w, h, rgbaPng[0]);
+
+		Report("PNG encode SIMD matches scalar", error == 0 && grey16Png[0] == grey16Png[1] && rgbaPng[0] == rgbaPng[1],
+			error ? std::string("lodepng error ") + Str(error) : "");
+		Report("PNG decode SIMD matches scalar", error == 0 && decoded[0] == decoded[1]);
+		Report("PNG round trip", error == 0 && roundTrip == rgba);
+	}
+
+	/*Every colour type and bit depth at widths 1 to 70, so each SIMD filter
+	sees every tail length after its vector loop, with each filter type forced
+	through LFS_PREDEFINED, then minsum, entropy and Adam7. The PNG must come
+	out byte for byte the same with and without SIMD, and decode back to the
+	input with both*/
+	void TestPngFilterSweep() {
+		struct Format {
+			LodePNGColorType type;
+			unsigned depth;
+		};
+		const Format formats[] = {
+			{ LCT_GREY, 1 }, { LCT_GREY, 2 }, { LCT_GREY, 4 }, { LCT_GREY, 8 }, { LCT_GREY, 16 },
+			{ LCT_RGB, 8 }, { LCT_RGB, 16 },
+			{ LCT_PALETTE, 1 }, { LCT_PALETTE, 2 }, { LCT_PALETTE, 4 }, { LCT_PALETTE, 8 },
+			{ LCT_GREY_ALPHA, 8 }, { LCT_GREY_ALPHA, 16 },
+			{ LCT_RGBA, 8 }, { LCT_RGBA, 16 }
+		};
+		const int formatCount = sizeof(formats) / sizeof(formats[0]);
+		const unsigned height = 7;
+		/*0-4: that filter on every row, 5: minsum, 6: entropy, 7: Adam7 with minsum*/
+		const int strategies = 8;
+
+		unsigned simd = lodepng_get_simd();
+		TestRandom random(5);
+		size_t cases = 0;
+		size_t mismatches = 0;
+		size_t badRoundTrips = 0;
+		unsigned error = 0;
+		for (int f = 0; f < formatCount; ++f) {
+			for (unsigned width = 1; width <= 70; ++width) {
+				LodePNGColorMode mode;
+				lodepng_color_mode_init(&mode);
+				mode.colortype = formats[f].type;
+				mode.bitdepth = formats[f].depth;
+				if (mode.colortype == LCT_PALETTE) {
+					for (unsigned i = 0; i < (1u << mode.bitdepth); ++i) {
+						lodepng_palette_add(&mode, (unsigned char)i, (unsigned char)(i * 3), (unsigned char)(255 - i), 255);
+					}
+				}
+				std::vector<unsigned char> image(lodepng_get_raw_size(width, height, &mode));
+				for (size_t i = 0; i < image.size(); ++i) {
+					/*Ramps with noise so the predictors have something to predict*/
+					image[i] = (unsigned char)(i * 7 / 3 + (random.Next() & 3));
+					if (i % 5 == 0) image[i] = (unsigned char)random.Next();
+				}
+				/*Packed rows run on without padding, the decoder leaves the bits after the last pixel zero*/
+				size_t bits = (size_t)width * height * lodepng_get_bpp(&mode);
+				if (bits % 8) image.back() &= (unsigned char)(0xff00 >> (bits % 8));
+				std::vector<unsigned char> filters(height);
+
+				for (int strategy = 0; strategy < strategies; ++strategy) {
+					std::vector<unsigned char> png[2];
+					for (int pass = 0; pass < 2; ++pass) {
+						lodepng_set_simd(pass == 0 ? simd : 0);
+						lodepng::State state;
+						lodepng_color_mode_copy(&state.info_raw, &mode);
+						lodepng_color_mode_copy(&state.info_png.color, &mode);
+						state.encoder.auto_convert = LAC_NO;
+						state.encoder.filter_palette_zero = 0;
+						if (strategy < 5) {
+							std::fill(filters.begin(), filters.end(), (unsigned char)strategy);
+							state.encoder.filter_strategy = LFS_PREDEFINED;
+							state.encoder.predefined_filters = &filters[0];
+						} else {
+							state.encoder.filter_strategy = strategy == 6 ? LFS_ENTROPY : LFS_MINSUM;
+						}
+						state.info_png.interlace_method = strategy == 7 ? 1 : 0;
+						error |= lodepng::encode(png[pass], image, width, height, state);
+
+						/*The decode runs on the same SIMD setting as the encode*/
+						std::vector<unsigned char> decoded;
+						lodepng::State decoder;
+						lodepng_color_mode_copy(&decoder.info_raw, &mode);
+						unsigned w, h;
+						error |= lodepng::decode(decoded, w, h, decoder, png[pass]);
+						if (decoded != image) ++badRoundTrips;
+					}
+					++cases;
+					if (png[0] != png[1]) ++mismatches;
+				}
+				lodepng_color_mode_cleanup(&mode);
+			}
+		}
+		lodepng_set_simd(simd);
+
+		Report("PNG filter sweep SIMD matches scalar", error == 0 && mismatches == 0,
+			Str(mismatches) + " of " + Str(cases) + " differ" + (error ? ", lodepng error " + Str(error) : ""));
+		Report("PNG filter sweep round trip", error == 0 && badRoundTrips == 0, Str(badRoundTrips) + " decoded wrong");
+	}
+
+	unsigned AppendToVector(void* context, const unsigned char* data, size_t size) {
+		std::vector<unsigned char>* out = (std::vector<unsigned char>*)context;
+		out->insert(out->end(), data, data + size);
+		return 0;
+	}
+
+	/*The stream encoder with each block type, one row per call, on an image
+	whose filtered rows fill the last 128KB piece exactly, so finish deflates
+	an empty range. Fixed blocks used to divide by zero there*/
+	void TestPngStreamEndsOnPiece() {
+		const unsigned width = 1023; /*1024 bytes a row with the filter type*/
+		const unsigned height = 128;
+		std::vector<unsigned char> image((size_t)width * height);
+		TestRandom random(6);
+		for (size_t i = 0; i < image.size(); ++i) image[i] = (unsigned char)(i / 3 + (random.Next() & 15));
+
+		bool pass = true;
+		std::string detail;
+		for (unsigned btype = 0; btype <= 3; ++btype) {
+			lodepng::State state;
+			state.info_raw.colortype = LCT_GREY;
+			state.info_raw.bitdepth = 8;
+			state.info_png.color.colortype = LCT_GREY;
+			state.info_png.color.bitdepth = 8;
+			state.encoder.zlibsettings.btype = btype;
+
+			std::vector<unsigned char> png;
+			LodePNGStreamEncoder stream;
+			unsigned error = lodepng_stream_begin(&stream, width, height, &state, AppendToVector, &png);
+			for (unsigned y = 0; y < height && !error; ++y) {
+				error = lodepng_stream_write_rows(&stream, &image[(size_t)y * width], 1);
+			}
+			if (!error) error = lodepng_stream_finish(&stream);
+			lodepng_stream_cleanup(&stream);
+
+			std::vector<unsigned char> decoded;
+			unsigned w, h;
+			if (!error) error = lodepng::decode(decoded, w, h, png, LCT_GREY, 8);
+			if (error || decoded != image) {
+				pass = false;
+				detail += "btype " + Str(btype) + (error ? ": lodepng error " + Str(error) + " " : ": decoded wrong ");
+			}
+		}
+		Report("PNG stream ending on a piece boundary", pass, detail);
+	}
+
+	/*A sink that encodes and decodes a PNG of its own, with lodepng's C API and
+	its own state, and frees the results with free*/
+	unsigned ReencodeSink(void* context, const unsigned char* data, size_t size) {
+		unsigned* calls = (unsigned*)context;
+		unsigned char* image = 0;
+		unsigned w, h;
+		/*the stream encoder's pieces don't decode on their own, whole PNGs do*/
+		lodepng_decode_memory(&image, &w, &h, data, size, LCT_RGBA, 8);
+		std::free(image);
+
+		unsigned char pixels[4 * 4 * 4];
+		for (int i = 0; i < 4 * 4 * 4; ++i) pixels[i] = (unsigned char)(i * 5);
+		LodePNGState state;
+		lodepng_state_init(&state);
+		unsigned char* png = 0;
+		size_t pngSize = 0;
+		unsigned error = lodepng_encode(&png, &pngSize, pixels, 4, 4, &state);
+		lodepng_state_cleanup(&state);
+		std::free(png);
+		++*calls;
+		return error;
+	}
+
+	/*The encode's allocator (its state's scratch arena) must not leak into its
+	sinks: memory a nested encode or decode returns has to be the sink's own*/
+	void TestPngNestedInSink() {
+		std::vector<unsigned char> image(64 * 64 * 4);
+		for (size_t i = 0; i < image.size(); ++i) image[i] = (unsigned char)(i * 3 + i / 256);
+
+		unsigned calls = 0;
+		LodePNGState state;
+		lodepng_state_init(&state);
+		unsigned error = lodepng_encode_to_sink(ReencodeSink, &calls, &image[0], 64, 64, &state);
+		/*twice, the second encode reuses the arena*/
+		if (!error) error = lodepng_encode_to_sink(ReencodeSink, &calls, &image[0], 64, 64, &state);
+
+		LodePNGStreamEncoder stream;
+		if (!error) error = lodepng_stream_begin(&stream, 64, 64, &state, ReencodeSink, &calls);
+		if (!error) error = lodepng_stream_write_rows(&stream, &image[0], 64);
+		if (!error) error = lodepng_stream_finish(&stream);
+		lodepng_stream_cleanup(&stream);
+		lodepng_state_cleanup(&state);
+		Report("PNG encode and decode inside a sink", error == 0 && calls > 2,
+			error ? "lodepng error " + Str(error) : "");
+	}
+
+	/*Batches of different sizes on one BatchEncoder, whose threads and arenas
+	carry over, against encoding each image on its own*/
+	void TestPngBatchEncoder() {
+		TestRandom random(7);
+		std::vector<std::vector<unsigned char> > pixels(40);
+		std::vector<lodepng::BatchImage> images(40);
+		for (size_t i = 0; i < images.size(); ++i) {
+			images[i].w = 1 + random.Next() % 80;
+			images[i].h = 1 + random.Next() % 80;
+			pixels[i].resize((size_t)images[i].w * images[i].h * 4);
+			for (size_t k = 0; k < pixels[i].size(); ++k) pixels[i][k] = (unsigned char)(random.Next() % (i + 1));
+			images[i].image = &pixels[i][0];
+		}
+
+		lodepng::State state;
+		size_t mismatches = 0;
+		unsigned error = 0;
+		lodepng::BatchEncoder batch(state, 4);
+		for (size_t count = images.size(); count > 0; count = count > 9 ? count - 9 : 0) {
+			std::vector<lodepng::BatchResult> results;
+			error |= batch.encode(results, &images[0], count);
+			for (size_t i = 0; i < count; ++i) {
+				lodepng::State single;
+				std::vector<unsigned char> png;
+				error |= lodepng::encode(png, images[i].image, images[i].w, images[i].h, single);
+				if (results[i].png != png) ++mismatches;
+			}
+		}
+		Report("PNG BatchEncoder matches encode", error == 0 && mismatches == 0,
+			Str(mismatches) + " differ" + (error ? ", lodepng error " + Str(error) : ""));
+	}
+
+	/*-- Malformed files --*/
+
+	std::vector<unsigned char> ReadFile(const std::string& filename) {
+		std::ifstream in(filename.c_str(), std::ios::binary);
+		return std::vector<unsigned char>((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+	}
+
+	void WriteFile(const std::string& filename, const std::vector<unsigned char>& bytes) {
+		std::ofstream out(filename.c_str(), std::ios::binary);
+		out.write((const char*)&bytes[0], bytes.size());
+	}
+
+	/*Copies bytes with value written over the field at offset*/
+	template <typename T>
+	std::vector<unsigned char> Patched(std::vector<unsigned char> bytes, size_t offset, T value) {
+		std::memcpy(&bytes[offset], &value, sizeof(T));
+		return bytes;
+	}
+
+	/*Headers whose sizes or offsets would wrap or point outside the file
+	must fail to open rather than hand out pointers past the mapping*/
+	void TestHeightmapRejectsMalformed() {
+		const std::string filename = "test_heightmap.snhm";
+		const std::string patchedName = "test_heightmap_patched.snhm";
+		SimplexNoise noise(150.0, 0.65, 4, 5000);
+		bool written = HeightmapWriter::Write(filename, noise, 0, 0, 100, 70, 32, SAMPLE_F32, 1);
+		std::vector<unsigned char> bytes = ReadFile(filename);
+		HeightmapReader reader;
+		bool validOpens = written && reader.Open(filename);
+		reader.Close();
+
+		const size_t width = offsetof(HeightmapHeader, width);
+		const size_t height = offsetof(HeightmapHeader, height);
+		const size_t tileSize = offsetof(HeightmapHeader, tileSize);
+		const size_t dataOffset = offsetof(HeightmapHeader, dataOffset);
+		const size_t crcOffset = offsetof(HeightmapHeader, crcOffset);
+		uint64_t size = bytes.size();
+		std::vector<std::vector<unsigned char> > bad;
+		bad.push_back(Patched(Patched(bytes, width, (uint32_t)0xFFFFFFFF), tileSize, (uint32_t)2));
+		bad.push_back(Patched(bytes, width, (uint32_t)0));
+		bad.push_back(Patched(bytes, height, (uint32_t)0));
+		bad.push_back(Patched(bytes, tileSize, (uint32_t)0xFFFFFFFF));
+		bad.push_back(Patched(bytes, dataOffset, (uint64_t)0 - 4096));
+		bad.push_back(Patched(bytes, dataOffset, size + 4096));
+		bad.push_back(Patched(bytes, dataOffset, (uint64_t)4098));
+		bad.push_back(Patched(bytes, crcOffset, (uint64_t)0 - 4));
+		bad.push_back(Patched(bytes, crcOffset, (uint64_t)4));
+
+		size_t opened = 0;
+		for (size_t i = 0; i < bad.size(); ++i) {
+			WriteFile(patchedName, bad[i]);
+			if (reader.Open(patchedName)) ++opened;
+			reader.Close();
+		}
+		std::remove(filename.c_str());
+		std::remove(patchedName.c_str());
+		Report("heightmap file rejects malformed headers", validOpens && opened == 0,
+			validOpens ? Str(opened) + " of " + Str(bad.size()) + " opened" : "the valid file doesn't open");
+	}
+
+	/*The pyramid reader under the same kind of corruption, including an
+	index entry whose offset plus size wraps around*/
+	void TestPyramidRejectsMalformed() {
+		const std::string filename = "test_pyramid.snpy";
+		const std::string patchedName = "test_pyramid_patched.snpy";
+		SimplexNoise noise(150.0, 0.65, 4, 5000);
+		PyramidSettings settings;
+		settings.tileSize = 32;
+		settings.threads = 1;
+		bool written = PyramidBuilder::Build(filename, noise, 0, 0, 100, 70, settings);
+		std::vector<unsigned char> bytes = ReadFile(filename);
+		PyramidReader reader;
+		const unsigned char* blob = 0;
+		size_t size = 0;
+		bool validOpens = written && reader.Open(filename) && reader.Tile(0, 0, 0, &blob, &size);
+		uint64_t indexOffset = validOpens ? reader.Header().indexOffset : 0;
+		reader.Close();
+		if (!validOpens) {
+			std::remove(filename.c_str());
+			Report("pyramid file rejects malformed headers", false, "the valid file doesn't open");
+			return;
+		}
+
+		const size_t width = offsetof(PyramidHeader, width);
+		const size_t height = offsetof(PyramidHeader, height);
+		const size_t tileSize = offsetof(PyramidHeader, tileSize);
+		const size_t indexField = offsetof(PyramidHeader, indexOffset);
+		/*the first entry is tile (0,0) of level 0*/
+		const size_t entryOffset = (size_t)indexOffset + offsetof(PyramidIndexEntry, offset);
+		const size_t entrySize = (size_t)indexOffset + offsetof(PyramidIndexEntry, size);
+		uint64_t fileSize = bytes.size();
+		std::vector<std::vector<unsigned char> > bad;
+		bad.push_back(Patched(bytes, width, (uint32_t)0));
+		bad.push_back(Patched(bytes, height, (uint32_t)0));
+		bad.push_back(Patched(bytes, tileSize, (uint32_t)0));
+		bad.push_back(Patched(bytes, tileSize, (uint32_t)33));
+		bad.push_back(Patched(bytes, indexField, (uint64_t)0 - 16));
+		bad.push_back(Patched(bytes, indexField, fileSize + 16));
+		bad.push_back(Patched(Patched(bytes, entryOffset, (uint64_t)0 - 16), entrySize, (uint64_t)32));
+		bad.push_back(Patched(bytes, entryOffset, fileSize + 16));
+		bad.push_back(Patched(bytes, entrySize, fileSize));
+
+		size_t accepted = 0;
+		for (size_t i = 0; i < bad.size(); ++i) {
+			WriteFile(patchedName, bad[i]);
+			if (reader.Open(patchedName) && reader.Tile(0, 0, 0, &blob, &size)) ++accepted;
+			reader.Close();
+		}
+		std::remove(filename.c_str());
+		std::remove(patchedName.c_str());
+		Report("pyramid file rejects malformed headers", accepted == 0, Str(accepted) + " of " + Str(bad.size()) + " accepted");
+	}
+
+	/*-- Performance --*/
+
+	struct PerfResult {
+		std::string name;
+		double throughput;
+		const char* unit;
+	};
+
+	/*Best of three, in units per second*/
+	template <typename F>
+	double BestRate(F run, double units) {
+		double best = 0;
+		for (int i = 0; i < 3; ++i) {
+			Stopwatch sw;
+			run();
+			double rate = units / sw.Seconds();
+			if (rate > best) best = rate;
+		}
+		return best;
+	}
+
+	volatile double perfSink;
+
+	struct NoiseAtGrid {
+		const SimplexNoise* noise;
+		void operator()() const {
+			double sum = 0;
+			for (int y = 0; y < 256; ++y) {
+				for (int x = 0; x < 256; ++x) {
+					sum += noise->NoiseAt(x, y);
+				}
+			}
+			perfSink = sum;
+		}
+	};
+
+	struct NoiseScattered {
+		const SimplexNoise* noise;
+		const std::vector<double>* points;
+		void operator()() const {
+			double sum = 0;
+			for (size_t i = 0; i + 1 < points->size(); i += 2) {
+				sum += noise->Noise((*points)[i], (*points)[i + 1]);
+			}
+			perfSink = sum;
+		}
+	};
+
+	struct BatchNoiseAt {
+		const SimplexNoise* noise;
+		const Vector2dArray* points;
+		std::vector<double>* out;
+		void operator()() const {
+			noise->NoiseAt(*points, &(*out)[0]);
+		}
+	};
+
+	struct EncodeGrey16 {
+		const std::vector<double>* heights;
+		unsigned size;
+		SampleRange range;
+		void operator()() const {
+			std::vector<unsigned char> png;
+			EncodeGrey16Png(png, &(*heights)[0], size, size, range, 1);
+			perfSink = (double)png.size();
+		}
+	};
+
+	struct DecodeGrey16 {
+		const std::vector<unsigned char>* png;
+		void operator()() const {
+			std::vector<unsigned char> image;
+			unsigned w, h;
+			lodepng::decode(image, w, h, *png, LCT_GREY, 16);
+			perfSink = (double)image.size();
+		}
+	};
+
+	struct Checksums {
+		const std::vector<unsigned char>* data;
+		void operator()() const {
+			perfSink = (double)(lodepng_crc32(&(*data)[0], data->size()) ^ lodepng_adler32(&(*data)[0], data->size()));
+		}
+	};
+
+	std::vector<PerfResult> MeasurePerformance() {
+		std::vector<PerfResult> results;
+		SimplexNoise noise(150.0, 0.65, 8, 5000);
+
+		NoiseAtGrid grid = { &noise };
+		PerfResult r1 = { "noiseat_grid", BestRate(grid, 256.0 * 256.0), "samples/s" };
+		results.push_back(r1);
+
+		TestRandom random(5);
+		std::vector<double> scattered(1 << 19);
+		for (size_t i = 0; i < scattered.size(); ++i) scattered[i] = random.Uniform(-1000.0, 1000.0);
+		NoiseScattered scatter = { &noise, &scattered };
+		PerfResult r2 = { "noise_scattered", BestRate(scatter, scattered.size() / 2.0), "samples/s" };
+		results.push_back(r2);
+
+		Vector2dArray points(256 * 256);
+		for (int i = 0; i < 256 * 256; ++i) points.Set(i, Vector2d(i % 256, i / 256));
+		std::vector<double> out(points.Size());
+		BatchNoiseAt batch = { &noise, &points, &out };
+		PerfResult r3 = { "batch_noiseat", BestRate(batch, (double)points.Size()), "samples/s" };
+		results.push_back(r3);
+
+		const unsigned size = 512;
+		std::vector<double> heights((size_t)size * size);
+		RenderTile(noise, 0, 0, size, size, SAMPLE_F64, &heights[0], size * sizeof(double));
+		SampleRange range = Grey16Range(-noise.AmplitudeSum(), noise.AmplitudeSum());
+		EncodeGrey16 encode = { &heights, size, range };
+		PerfResult r4 = { "grey16_encode", BestRate(encode, size * size * 2.0 / 1e6), "MB/s" };
+		results.push_back(r4);
+
+		std::vector<unsigned char> png;
+		EncodeGrey16Png(png, &heights[0], size, size, range, 1);
+		DecodeGrey16 decode = { &png };
+		PerfResult r5 = { "grey16_decode", BestRate(decode, size * size * 2.0 / 1e6), "MB/s" };
+		results.push_back(r5);
+
+		std::vector<unsigned char> data(1 << 24);
+		for (size_t i = 0; i < data.size(); ++i) data[i] = (unsigned char)random.Next();
+		Checksums checksums = { &data };
+		PerfResult r6 = { "crc32_adler32", BestRate(checksums, data.size() / 1e6), "MB/s" };
+		results.push_back(r6);
+		return results;
+	}
+
+	void TestPerformance(const std::string& baselineFile, double threshold, bool record) {
+#ifdef _DEBUG
+		std::cout << "SKIP performance budgets in Debug builds" << std::endl;
+#else
+		std::map<std::string, double> baseline;
+		std::ifstream in(baselineFile.c_str());
+		std::string name;
+		double value;
+		while (in >> name >> value) baseline[name] = value;
+		in.close();
+
+		std::vector<PerfResult> results = MeasurePerformance();
+		bool write = record || baseline.empty();
+		for (size_t i = 0; i < results.size(); ++i) {
+			const PerfResult& r = results[i];
+			std::string detail = Str(r.throughput) + " " + r.unit;
+			if (write || baseline.find(r.name) == baseline.end()) {
+				Report("perf " + r.name, true, detail + ", recorded as baseline");
+				baseline[r.name] = r.throughput;
+				write = true;
+				continue;
+			}
+			double ratio = r.throughput / baseline[r.name];
+			Report("perf " + r.name, ratio >= 1.0 - threshold,
+				detail + ", " + Str(ratio * 100.0) + "% of baseline " + Str(baseline[r.name]));
+		}
+		if (write) {
+			std::ofstream out(baselineFile.c_str());
+			for (std::map<std::string, double>::const_iterator it = baseline.begin(); it != baseline.end(); ++it) {
+				out << it->first << " " << it->second << std::endl;
+			}
+		}
+#endif
+	}
+}
+
+int main(int argc, char* argv[]) {
+	std::string baselineFile = "perf_baseline.txt";
+	double threshold = 0.25;
+	bool record = false;
+	bool perf = true;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--golden") {
+			PrintGoldenTable();
+			return 0;
+		} else if (arg == "--record") {
+			record = true;
+		} else if (arg == "--no-perf") {
+			perf = false;
+		} else if (arg == "--threshold" && i + 1 < argc) {
+			threshold = std::atof(argv[++i]);
+		} else if (arg == "--baseline" && i + 1 < argc) {
+			baselineFile = argv[++i];
+		} else {
+			std::cout << "usage: SimplexNoiseTests [--golden] [--record] [--no-perf] [--threshold f] [--baseline file]" << std::endl;
+			return -1;
+		}
+	}
+
+	TestGolden();
+	TestNoiseMatchesReference();
+	TestFastFloor();
+	TestBatchMatchesScalar();
+	TestFbmMatchesNoiseAt();
+	TestVectorExpressions();
+	TestRenderTileTolerances();
+	TestChecksums();
+	TestPngSimdMatchesScalar();
+	TestPngFilterSweep();
+	TestPngStreamEndsOnPiece();
+	TestPngNestedInSink();
+	TestPngBatchEncoder();
+	TestHeightmapRejectsMalformed();
+	TestPyramidRejectsMalformed();
+	if (perf) TestPerformance(baselineFile, threshold, record);
+
+	std::cout << (failures ? "FAILED: " : "All tests passed") << (failures ? Str(failures) + " test(s)" : "") << std::endl;
+	return failures;
+}